@@ -0,0 +1,625 @@
+#ifndef _ASYNC_IO_H_
+#define _ASYNC_IO_H_
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define ASYNC_IO_URING 1
+#endif
+#endif
+
+#include "thread_pool.hpp"
+
+/*
+ * asynchronous file I/O for bitstreams and raw volumes, so that reading and
+ * writing overlap with encoding and decoding: a file is moved in blocks
+ * (1 MiB by default, 4 KiB aligned), queue_depth of which are in flight at
+ * once. Writers copy into the current block and hand it over when it is
+ * full, readers prefetch the blocks ahead of the one being consumed.
+ *
+ * Two backends:
+ *   uring  io_uring through the raw system calls (no liburing), with the
+ *          blocks registered as fixed buffers when the kernel allows it
+ *   pread  blocking pread/pwrite on a small thread pool, wherever io_uring
+ *          is not available (old kernels, seccomp filters)
+ *
+ * O_DIRECT bypasses the page cache for large sequential archives; the last
+ * block is padded to the alignment and the file truncated afterwards. The
+ * environment picks the defaults: H26X_IO=uring|pread, H26X_IO_DEPTH=<n>,
+ * H26X_IO_BLOCK=<KiB>, H26X_IO_DIRECT=1.
+ */
+
+static const size_t async_io_alignment = 4096;
+
+struct async_io_options {
+  unsigned queue_depth;  ///< blocks in flight
+  size_t block_size;     ///< bytes per request, a multiple of async_io_alignment
+  bool direct;           ///< open with O_DIRECT
+  bool uring;            ///< try io_uring first
+};
+
+inline async_io_options default_async_io_options()
+{
+  async_io_options value;
+  value.queue_depth = 8;
+  value.block_size = 1 << 20;
+  value.direct = false;
+  value.uring = true;
+
+  const char* backend = std::getenv("H26X_IO");
+  if (backend && std::strcmp(backend, "pread") == 0)
+    value.uring = false;
+  const char* depth = std::getenv("H26X_IO_DEPTH");
+  if (depth && std::atoi(depth) > 0)
+    value.queue_depth = std::atoi(depth);
+  const char* block = std::getenv("H26X_IO_BLOCK");
+  if (block && std::atoi(block) > 0)
+    value.block_size = (size_t)std::atoi(block) << 10;
+  const char* direct = std::getenv("H26X_IO_DIRECT");
+  value.direct = direct && std::strcmp(direct, "0") != 0 && *direct;
+  return value;
+}
+
+struct async_block {
+  uint8_t* data;
+  size_t size;         ///< bytes to transfer; after a read, the bytes read
+  size_t done;         ///< bytes transferred so far
+  uint64_t offset;     ///< in the file
+  bool write;
+  bool busy;           ///< submitted and not completed yet
+  struct iovec iov;
+};
+
+/*
+ * the block ring and the backend; submit() starts the transfer of a block,
+ * wait() returns the next one that completed (short transfers are
+ * resubmitted until the block is done, end of file, or an error)
+ */
+class async_io {
+
+public:
+  async_io() : uring_(false), registered_(false), options_(), error_(0) {}
+
+  ~async_io() { release(); }
+
+  int setup(const async_io_options& _options)
+  {
+    release();
+    options_ = _options;
+    if (options_.queue_depth < 1)
+      options_.queue_depth = 1;
+    options_.block_size = (options_.block_size + async_io_alignment - 1) / async_io_alignment * async_io_alignment;
+
+    blocks_.assign(options_.queue_depth, async_block());
+    for (async_block& block : blocks_) {
+      void* data = NULL;
+      if (posix_memalign(&data, async_io_alignment, options_.block_size) != 0) {
+        release();
+        return 1;
+      }
+      block.data = (uint8_t*)data;
+    }
+
+    if (options_.uring && uring_setup() == 0)
+      return 0;
+    pool_.reset(new work_stealing_pool(std::min(options_.queue_depth, 4u)));
+    return 0;
+  }
+
+  const char* backend() const { return uring_ ? (registered_ ? "io_uring, fixed buffers" : "io_uring") : "pread"; }
+  const async_io_options& options() const { return options_; }
+  async_block& block(int _block) { return blocks_[_block]; }
+  int blocks() const { return (int)blocks_.size(); }
+  int error() const { return error_; }
+
+  int submit(int _fd, int _block)
+  {
+    async_block& block = blocks_[_block];
+    block.busy = true;
+    uint8_t* data = block.data + block.done;
+    const size_t size = block.size - block.done;
+    const uint64_t offset = block.offset + block.done;
+
+#ifdef ASYNC_IO_URING
+    if (uring_) {
+      const unsigned tail = *ring_.sq_tail;
+      const unsigned index = tail & *ring_.sq_mask;
+      struct io_uring_sqe* sqe = &ring_.sqes[index];
+      memset(sqe, 0, sizeof(*sqe));
+      if (registered_) {
+        sqe->opcode = block.write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->addr = (uint64_t)(uintptr_t)data;
+        sqe->len = size;
+        sqe->buf_index = _block;
+      }
+      else {
+        block.iov.iov_base = data;
+        block.iov.iov_len = size;
+        sqe->opcode = block.write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->addr = (uint64_t)(uintptr_t)&block.iov;
+        sqe->len = 1;
+      }
+      sqe->fd = _fd;
+      sqe->off = offset;
+      sqe->user_data = _block;
+      ring_.sq_array[index] = index;
+      __atomic_store_n(ring_.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+      while (syscall(__NR_io_uring_enter, ring_.fd, 1, 0, 0, NULL, 0) < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+          block.busy = false;
+          return error_ = errno;
+        }
+      }
+      return 0;
+    }
+#endif
+
+    const bool write = block.write;
+    pool_->submit([this, _fd, _block, data, size, offset, write]() {
+        ssize_t result = write ? pwrite(_fd, data, size, offset) : pread(_fd, data, size, offset);
+        if (result < 0)
+          result = -errno;
+        std::lock_guard<std::mutex> lock(completed_mutex_);
+        completed_.push_back(std::make_pair(_block, result));
+        completed_ready_.notify_one();
+      });
+    return 0;
+  }
+
+  //waits for a block to complete and returns its index, -1 on an error (see error())
+  int wait(int _fd)
+  {
+    while (true) {
+      int index = -1;
+      int64_t result = 0;
+      if (next_completion(index, result) != 0)
+        return -1;
+
+      async_block& block = blocks_[index];
+      if (result < 0) {
+        block.busy = false;
+        error_ = (int)-result;
+        return -1;
+      }
+      block.done += result;
+      //short transfer: go on with the rest, a read that returns nothing is at the end of the file
+      if (result > 0 && block.done < block.size) {
+        if (submit(_fd, index) != 0)
+          return -1;
+        continue;
+      }
+      if (!block.write)
+        block.size = block.done;
+      block.busy = false;
+      return index;
+    }
+  }
+
+  //waits for every block in flight
+  int drain(int _fd)
+  {
+    int rcode = 0;
+    for (size_t b = 0; b < blocks_.size(); ++b)
+      while (blocks_[b].busy)
+        rcode |= wait(_fd) < 0;
+    return rcode;
+  }
+
+private:
+
+  int next_completion(int& _block, int64_t& _result)
+  {
+#ifdef ASYNC_IO_URING
+    if (uring_) {
+      while (true) {
+        const unsigned head = *ring_.cq_head;
+        if (head != __atomic_load_n(ring_.cq_tail, __ATOMIC_ACQUIRE)) {
+          const struct io_uring_cqe* cqe = &ring_.cqes[head & *ring_.cq_mask];
+          _block = (int)cqe->user_data;
+          _result = cqe->res;
+          __atomic_store_n(ring_.cq_head, head + 1, __ATOMIC_RELEASE);
+          return 0;
+        }
+        if (syscall(__NR_io_uring_enter, ring_.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+          return error_ = errno;
+      }
+    }
+#endif
+    std::unique_lock<std::mutex> lock(completed_mutex_);
+    completed_ready_.wait(lock, [this]() { return !completed_.empty(); });
+    _block = completed_.front().first;
+    _result = completed_.front().second;
+    completed_.pop_front();
+    return 0;
+  }
+
+#ifdef ASYNC_IO_URING
+  struct uring {
+    int fd;
+    void* sq_map;
+    size_t sq_map_size;
+    void* cq_map;
+    size_t cq_map_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+  };
+#endif
+
+  int uring_setup()
+  {
+#ifdef ASYNC_IO_URING
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(&ring_, 0, sizeof(ring_));
+    ring_.fd = syscall(__NR_io_uring_setup, options_.queue_depth, &params);
+    if (ring_.fd < 0)
+      return 1;
+
+    ring_.sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring_.cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = false;
+#ifdef IORING_FEAT_SINGLE_MMAP
+    single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+      ring_.sq_map_size = ring_.cq_map_size = std::max(ring_.sq_map_size, ring_.cq_map_size);
+#endif
+    ring_.sq_map = mmap(NULL, ring_.sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_.fd,
+                        IORING_OFF_SQ_RING);
+    ring_.cq_map = single ? ring_.sq_map : mmap(NULL, ring_.cq_map_size, PROT_READ | PROT_WRITE,
+                                                 MAP_SHARED | MAP_POPULATE, ring_.fd, IORING_OFF_CQ_RING);
+    ring_.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(NULL, ring_.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_.fd,
+                      IORING_OFF_SQES);
+    if (ring_.sq_map == MAP_FAILED || ring_.cq_map == MAP_FAILED || sqes == MAP_FAILED) {
+      if (sqes != MAP_FAILED)
+        munmap(sqes, ring_.sqes_size);
+      if (ring_.sq_map != MAP_FAILED)
+        munmap(ring_.sq_map, ring_.sq_map_size);
+      if (!single && ring_.cq_map != MAP_FAILED)
+        munmap(ring_.cq_map, ring_.cq_map_size);
+      close(ring_.fd);
+      return 1;
+    }
+
+    uint8_t* sq = (uint8_t*)ring_.sq_map;
+    uint8_t* cq = (uint8_t*)ring_.cq_map;
+    ring_.sqes = (struct io_uring_sqe*)sqes;
+    ring_.sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring_.sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring_.sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring_.cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring_.cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring_.cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring_.cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    uring_ = true;
+
+    //fixed buffers spare the kernel mapping the pages of every request
+    std::vector<struct iovec> buffers(blocks_.size());
+    for (size_t b = 0; b < blocks_.size(); ++b) {
+      buffers[b].iov_base = blocks_[b].data;
+      buffers[b].iov_len = options_.block_size;
+    }
+    registered_ = syscall(__NR_io_uring_register, ring_.fd, IORING_REGISTER_BUFFERS, &buffers[0],
+                          (unsigned)buffers.size()) == 0;
+    return 0;
+#else
+    return 1;
+#endif
+  }
+
+  void release()
+  {
+    pool_.reset();
+#ifdef ASYNC_IO_URING
+    if (uring_) {
+      munmap(ring_.sqes, ring_.sqes_size);
+      if (ring_.cq_map != ring_.sq_map)
+        munmap(ring_.cq_map, ring_.cq_map_size);
+      munmap(ring_.sq_map, ring_.sq_map_size);
+      close(ring_.fd);
+    }
+#endif
+    uring_ = registered_ = false;
+    for (async_block& block : blocks_)
+      free(block.data);
+    blocks_.clear();
+  }
+
+  bool uring_;
+  bool registered_;
+  async_io_options options_;
+  int error_;
+  std::vector<async_block> blocks_;
+#ifdef ASYNC_IO_URING
+  uring ring_;
+#endif
+  std::mutex completed_mutex_;
+  std::condition_variable completed_ready_;
+  std::deque<std::pair<int, int64_t> > completed_;
+  std::unique_ptr<work_stealing_pool> pool_;  ///< pread backend, goes first on destruction
+};
+
+//opens _path with O_DIRECT if asked for and the file system supports it
+inline int async_open(const std::string& _path, int _flags, bool& _direct)
+{
+  int fd = -1;
+  if (_direct)
+    fd = open(_path.c_str(), _flags | O_DIRECT, 0666);
+  if (fd < 0) {
+    _direct = false;
+    fd = open(_path.c_str(), _flags, 0666);
+  }
+  return fd;
+}
+
+/*
+ * sequential writer, e.g. the packet sink of an encoder:
+ *   async_writer out; out.open(path); out.write(data, size)...; out.close()
+ * the data is copied, the caller's buffer is free again when write returns
+ */
+class async_writer {
+
+public:
+  async_writer() : fd_(-1), current_(-1), offset_(0), direct_(false) {}
+  ~async_writer() { close(); }
+
+  int open(const std::string& _path, const async_io_options& _options = default_async_io_options())
+  {
+    close();
+    direct_ = _options.direct;
+    fd_ = async_open(_path, O_WRONLY | O_CREAT | O_TRUNC, direct_);
+    if (fd_ < 0)
+      return 1;
+    if (io_.setup(_options) != 0) {
+      ::close(fd_);
+      fd_ = -1;
+      return 1;
+    }
+    offset_ = 0;
+    current_ = 0;
+    start(current_);
+    return 0;
+  }
+
+  bool is_open() const { return fd_ >= 0; }
+  const char* backend() const { return io_.backend(); }
+  uint64_t bytes() const { return offset_ + (current_ >= 0 ? io_block().size : 0); }
+
+  int write(const void* _data, size_t _size)
+  {
+    const uint8_t* data = (const uint8_t*)_data;
+    while (_size && fd_ >= 0) {
+      async_block& block = io_.block(current_);
+      const size_t room = io_.options().block_size - block.size;
+      const size_t chunk = _size < room ? _size : room;
+      memcpy(block.data + block.size, data, chunk);
+      block.size += chunk;
+      data += chunk;
+      _size -= chunk;
+      if (block.size == io_.options().block_size && hand_over() != 0)
+        return 1;
+    }
+    return fd_ < 0 || io_.error() != 0;
+  }
+
+  //flushes the last block, waits for every write; returns 0 if all of them succeeded
+  int close()
+  {
+    if (fd_ < 0)
+      return 0;
+
+    async_block& block = io_.block(current_);
+    const uint64_t end = offset_ + block.size;
+    if (block.size) {
+      //O_DIRECT transfers whole aligned blocks, the padding is cut off below
+      if (direct_) {
+        const size_t padded = (block.size + async_io_alignment - 1) / async_io_alignment * async_io_alignment;
+        memset(block.data + block.size, 0, padded - block.size);
+        block.size = padded;
+      }
+      block.offset = offset_;
+      io_.submit(fd_, current_);
+    }
+    int rcode = io_.drain(fd_) || io_.error() != 0;
+    if (direct_ && ftruncate(fd_, end) != 0)
+      rcode = 1;
+    rcode |= ::close(fd_) != 0;
+    fd_ = -1;
+    current_ = -1;
+    offset_ = end;
+    return rcode;
+  }
+
+private:
+
+  const async_block& io_block() const { return const_cast<async_io&>(io_).block(current_); }
+
+  void start(int _block)
+  {
+    async_block& block = io_.block(_block);
+    block.size = 0;
+    block.done = 0;
+    block.write = true;
+  }
+
+  //submits the full current block and starts filling a free one
+  int hand_over()
+  {
+    async_block& full = io_.block(current_);
+    full.offset = offset_;
+    offset_ += full.size;
+    if (io_.submit(fd_, current_) != 0)
+      return 1;
+
+    int next = -1;
+    for (int b = 0; b < io_.blocks() && next < 0; ++b)
+      if (!io_.block(b).busy)
+        next = b;
+    if (next < 0 && (next = io_.wait(fd_)) < 0)
+      return 1;
+    current_ = next;
+    start(current_);
+    return 0;
+  }
+
+  async_io io_;
+  int fd_;
+  int current_;       ///< the block being filled
+  uint64_t offset_;   ///< file offset of the current block
+  bool direct_;
+};
+
+/*
+ * sequential reader with read-ahead: the blocks after the one being
+ * consumed are already on their way
+ */
+class async_reader {
+
+public:
+  async_reader() : fd_(-1), size_(0), next_offset_(0), consumed_(0), position_(0), direct_(false) {}
+  ~async_reader() { close(); }
+
+  int open(const std::string& _path, const async_io_options& _options = default_async_io_options())
+  {
+    close();
+    direct_ = _options.direct;
+    fd_ = async_open(_path, O_RDONLY, direct_);
+    struct stat st;
+    if (fd_ < 0 || fstat(fd_, &st) != 0 || io_.setup(_options) != 0) {
+      close();
+      return 1;
+    }
+    size_ = st.st_size;
+    return rewind();
+  }
+
+  bool is_open() const { return fd_ >= 0; }
+  const char* backend() const { return io_.backend(); }
+  uint64_t size() const { return size_; }
+  uint64_t position() const { return position_; }
+
+  //copies up to _size bytes to _data, returns the number of bytes copied (less at the end or on an error)
+  size_t read(void* _data, size_t _size)
+  {
+    uint8_t* data = (uint8_t*)_data;
+    size_t copied = 0;
+    while (copied < _size && fd_ >= 0 && !order_.empty()) {
+      const int front = order_.front();
+      while (io_.block(front).busy)
+        if (io_.wait(fd_) < 0)
+          return copied;
+
+      async_block& block = io_.block(front);
+      const size_t left = block.size - consumed_;
+      const size_t chunk = _size - copied < left ? _size - copied : left;
+      memcpy(data + copied, block.data + consumed_, chunk);
+      copied += chunk;
+      consumed_ += chunk;
+      position_ += chunk;
+
+      if (consumed_ == block.size) {
+        order_.pop_front();
+        consumed_ = 0;
+        if (block.size < io_.options().block_size)
+          order_.clear();  //end of the file, whatever is still in flight lies beyond it
+        else
+          prefetch(front);
+      }
+    }
+    return copied;
+  }
+
+  //reads the whole file into _data
+  int read_all(std::vector<uint8_t>& _data)
+  {
+    _data.resize(size_ - position_);
+    return _data.empty() || read(&_data[0], _data.size()) != _data.size();
+  }
+
+  //back to the start of the file
+  int rewind()
+  {
+    if (fd_ < 0)
+      return 1;
+    io_.drain(fd_);
+    order_.clear();
+    next_offset_ = 0;
+    consumed_ = 0;
+    position_ = 0;
+    for (int b = 0; b < io_.blocks() && next_offset_ < size_; ++b)
+      prefetch(b);
+    return io_.error() != 0;
+  }
+
+  void close()
+  {
+    if (fd_ < 0)
+      return;
+    io_.drain(fd_);
+    ::close(fd_);
+    fd_ = -1;
+    order_.clear();
+  }
+
+private:
+
+  void prefetch(int _block)
+  {
+    if (next_offset_ >= size_)
+      return;
+    async_block& block = io_.block(_block);
+    block.offset = next_offset_;
+    block.size = io_.options().block_size;
+    block.done = 0;
+    block.write = false;
+    next_offset_ += block.size;
+    if (io_.submit(fd_, _block) == 0)
+      order_.push_back(_block);
+  }
+
+  async_io io_;
+  int fd_;
+  uint64_t size_;
+  uint64_t next_offset_;   ///< of the next block to prefetch
+  size_t consumed_;        ///< of the front block
+  uint64_t position_;
+  bool direct_;
+  std::deque<int> order_;  ///< blocks in file order
+};
+
+//reads _path as a whole through an async_reader; returns 0 on success
+inline int async_read_file(const std::string& _path, std::vector<uint8_t>& _data,
+                           const async_io_options& _options = default_async_io_options())
+{
+  async_reader reader;
+  return reader.open(_path, _options) != 0 || reader.read_all(_data) != 0;
+}
+
+#endif /* _ASYNC_IO_H_ */
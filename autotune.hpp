@@ -0,0 +1,245 @@
+#ifndef _AUTOTUNE_H_
+#define _AUTOTUNE_H_
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "encoder.hpp"
+#include "ratecontrol.hpp"
+
+/*
+ * automatic codec/preset selection: a few slices spread over the volume
+ * are trial-encoded at constant quality with every candidate, speed and
+ * compression ratio are measured, and the candidate that meets the target
+ * is picked:
+ *
+ *   throughput=<slices/s>  the best ratio among the fast enough candidates
+ *   ratio=<raw/coded>      the fastest among the small enough candidates
+ *
+ * If no candidate meets the target, the one closest to it is taken. The
+ * decision is cached per dataset class (a name given by the user, the
+ * slice size otherwise), target and quality (the CRF or QP of the trials,
+ * which moves the speed/ratio trade-off) in $H26X_AUTOTUNE_CACHE,
+ * ~/.h26x_autotune by default, so later volumes of the class skip the
+ * trials.
+ */
+
+struct autotune_candidate {
+  AVCodecID codec_id;
+  std::string preset;
+  double slices_per_second;  ///< measured by the trial
+  double ratio;              ///< raw yuv420p bytes / coded bytes
+};
+
+struct autotune_target {
+  bool throughput;           ///< true: value is slices/s, false: value is a ratio
+  double value;
+};
+
+//"throughput=<slices/s>" or "ratio=<raw/coded>"; returns 0 on success
+inline int autotune_target_from_string(const std::string& _text, autotune_target& _target)
+{
+  const size_t equals = _text.find('=');
+  if (equals == std::string::npos)
+    return 1;
+  const std::string kind = _text.substr(0, equals);
+  _target.value = std::atof(_text.c_str() + equals + 1);
+  if (_target.value <= 0 || (kind != "throughput" && kind != "ratio"))
+    return 1;
+  _target.throughput = kind == "throughput";
+  return 0;
+}
+
+inline std::string autotune_target_to_string(const autotune_target& _target)
+{
+  std::ostringstream value;
+  value << (_target.throughput ? "throughput=" : "ratio=") << _target.value;
+  return value.str();
+}
+
+//the presets of libx264 and libx265 worth trying, fastest first
+inline std::vector<autotune_candidate> autotune_candidates()
+{
+  static const char* presets[] = { "ultrafast", "veryfast", "medium", "slow" };
+  std::vector<autotune_candidate> value;
+  for (int codec = 0; codec < 2; ++codec)
+    for (int p = 0; p < 4; ++p) {
+      autotune_candidate candidate = autotune_candidate();
+      candidate.codec_id = codec ? AV_CODEC_ID_HEVC : AV_CODEC_ID_H264;
+      candidate.preset = presets[p];
+      value.push_back(candidate);
+    }
+  return value;
+}
+
+//"crf=<crf>", "qp=<qp>" or "bitrate=<bit/s>": the rate control the trials of _settings run with
+inline std::string autotune_quality(const encoder_settings& _settings)
+{
+  std::ostringstream value;
+  if (_settings.crf >= 0)
+    value << "crf=" << _settings.crf;
+  else if (_settings.qp >= 0)
+    value << "qp=" << _settings.qp;
+  else
+    value << "bitrate=" << _settings.bit_rate;
+  return value.str();
+}
+
+inline std::string autotune_cache_path()
+{
+  const char* path = std::getenv("H26X_AUTOTUNE_CACHE");
+  if (path && *path)
+    return path;
+  const char* home = std::getenv("HOME");
+  return std::string(home ? home : ".") + "/.h26x_autotune";
+}
+
+/*
+ * cache lines: <class> <target> <quality> <h264|hevc> <preset> <slices/s> <ratio>;
+ * returns 0 and fills _choice if the class was tuned for _target at _quality
+ * (see autotune_quality) before; lines of older caches without the quality
+ * do not parse and are skipped
+ */
+inline int autotune_cache_lookup(const std::string& _class, const autotune_target& _target,
+                                 const std::string& _quality, autotune_candidate& _choice)
+{
+  std::ifstream cache(autotune_cache_path().c_str());
+  const std::string target = autotune_target_to_string(_target);
+  std::string line;
+  int found = 1;
+  while (std::getline(cache, line)) {
+    std::istringstream fields(line);
+    std::string cls, tgt, quality, codec;
+    autotune_candidate candidate;
+    if (!(fields >> cls >> tgt >> quality >> codec >> candidate.preset >> candidate.slices_per_second >>
+          candidate.ratio) || cls != _class || tgt != target || quality != _quality)
+      continue;
+    candidate.codec_id = codec == "hevc" ? AV_CODEC_ID_HEVC : AV_CODEC_ID_H264;
+    _choice = candidate;
+    found = 0;  //later lines win, a re-tune is simply appended
+  }
+  return found;
+}
+
+inline void autotune_cache_store(const std::string& _class, const autotune_target& _target,
+                                 const std::string& _quality, const autotune_candidate& _choice)
+{
+  std::ofstream cache(autotune_cache_path().c_str(), std::ios::app);
+  cache << _class << " " << autotune_target_to_string(_target) << " " << _quality << " "
+        << (_choice.codec_id == AV_CODEC_ID_HEVC ? "hevc" : "h264") << " " << _choice.preset << " "
+        << _choice.slices_per_second << " " << _choice.ratio << "\n";
+}
+
+/*
+ * trial-encodes _samples slices spread over the volume with _candidate's
+ * codec and preset on top of _settings (which should ask for constant
+ * quality, a fixed bit rate makes every candidate equally small); only the
+ * encode calls are timed: opening the codec and starting its lookahead
+ * would outweigh a few slices
+ */
+inline int autotune_trial(const encoder_settings& _settings, int _depth, const slice_source& _source,
+                          int _samples, autotune_candidate& _candidate)
+{
+  const int samples = _samples < _depth ? _samples : _depth;
+  encoder_settings trial = _settings;
+  trial.codec_id = _candidate.codec_id;
+  trial.preset = _candidate.preset;
+  trial.pass = 0;
+
+  slice_source sample = [&](AVFrame* _frame, int _s) {
+    _source(_frame, (int)((int64_t)_s * _depth / samples));
+    _frame->pts = _s;
+    _frame->pict_type = AV_PICTURE_TYPE_NONE;
+  };
+  int64_t bytes = 0;
+  packet_sink count = [&bytes](const AVPacket& _pkt) { bytes += _pkt.size; };
+
+  encoder_session session;
+  if (encoder_open(session, trial) != 0)
+    return 1;
+  std::chrono::high_resolution_clock::duration busy(0);
+  int rcode = 0;
+  for (int s = 0; s < samples && rcode == 0; ++s) {
+    sample(session.frame, s);
+    auto start = std::chrono::high_resolution_clock::now();
+    rcode = encoder_encode(session, session.frame, count) < 0;
+    busy += std::chrono::high_resolution_clock::now() - start;
+  }
+  auto start = std::chrono::high_resolution_clock::now();
+  if (rcode == 0)
+    rcode = encoder_flush(session, count) < 0;
+  busy += std::chrono::high_resolution_clock::now() - start;
+  encoder_close(session);
+  if (rcode != 0)
+    return 1;
+
+  const double seconds = std::chrono::duration<double>(busy).count();
+  _candidate.slices_per_second = samples / (seconds > 0 ? seconds : 1e-9);
+  _candidate.ratio = (double)_settings.width * _settings.height * 3 / 2 * samples / (bytes > 0 ? bytes : 1);
+  return 0;
+}
+
+//the candidate that meets _target best (see above)
+inline const autotune_candidate& autotune_pick(const std::vector<autotune_candidate>& _tried,
+                                               const autotune_target& _target)
+{
+  size_t best = 0;
+  bool best_meets = false;
+  for (size_t c = 0; c < _tried.size(); ++c) {
+    const autotune_candidate& candidate = _tried[c];
+    const double measure = _target.throughput ? candidate.slices_per_second : candidate.ratio;
+    const double other = _target.throughput ? candidate.ratio : candidate.slices_per_second;
+    const double best_measure = _target.throughput ? _tried[best].slices_per_second : _tried[best].ratio;
+    const double best_other = _target.throughput ? _tried[best].ratio : _tried[best].slices_per_second;
+    const bool meets = measure >= _target.value;
+    if (c == 0 || (meets && !best_meets) || (meets && best_meets && other > best_other) ||
+        (!meets && !best_meets && measure > best_measure)) {
+      best = c;
+      best_meets = meets;
+    }
+  }
+  return _tried[best];
+}
+
+/*
+ * the codec and preset for a volume of class _class: from the cache, or by
+ * trial encoding every available candidate; returns 0 on success
+ */
+inline int autotune_choose(const encoder_settings& _settings, int _depth, const slice_source& _source,
+                           const std::string& _class, const autotune_target& _target,
+                           autotune_candidate& _choice, int _samples = 16)
+{
+  const std::string quality = autotune_quality(_settings);
+  if (autotune_cache_lookup(_class, _target, quality, _choice) == 0) {
+    std::cerr << "autotune: " << _class << " " << autotune_target_to_string(_target) << " " << quality << " cached, "
+              << (_choice.codec_id == AV_CODEC_ID_HEVC ? "hevc" : "h264") << " " << _choice.preset << "\n";
+    return 0;
+  }
+
+  std::vector<autotune_candidate> tried;
+  std::vector<autotune_candidate> candidates = autotune_candidates();
+  for (size_t c = 0; c < candidates.size(); ++c) {
+    if (!avcodec_find_encoder(candidates[c].codec_id))
+      continue;
+    if (autotune_trial(_settings, _depth, _source, _samples, candidates[c]) != 0)
+      continue;
+    std::cerr << "autotune: " << (candidates[c].codec_id == AV_CODEC_ID_HEVC ? "hevc" : "h264") << " "
+              << candidates[c].preset << ": " << candidates[c].slices_per_second << " slices/s, ratio "
+              << candidates[c].ratio << "\n";
+    tried.push_back(candidates[c]);
+  }
+  if (tried.empty())
+    return 1;
+
+  _choice = autotune_pick(tried, _target);
+  autotune_cache_store(_class, _target, quality, _choice);
+  return 0;
+}
+
+#endif /* _AUTOTUNE_H_ */
@@ -0,0 +1,288 @@
+#ifndef _CHANNELS_H_
+#define _CHANNELS_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "codec_lock.hpp"
+#include "decoder.hpp"
+#include "encoder.hpp"
+#include "thread_pool.hpp"
+
+/*
+ * multi-channel volumes (e.g. 2-4 fluorescence channels per voxel), coded
+ * as a set of streams by one of two policies:
+ *
+ *   packed    channels go three at a time into the Y, U and V planes of a
+ *             4:4:4 stream (unused planes are neutral 128)
+ *   parallel  one 4:2:0 stream per channel, luma only
+ *
+ * The streams of a set are encoded concurrently, one worker per stream,
+ * so the wall time follows the slowest stream rather than the sum of all
+ * of them, and decoded concurrently in the same way into one planar or
+ * channel-interleaved buffer. Stream s is written to <stem>-c<first>.<ext>
+ * (<first> being its first channel) and the set is described next to the
+ * name the caller gave:
+ *
+ *   <stream>.channels: "H26XCH1 <channels> <packed|parallel> <streams>",
+ *                      then one line per stream "<first channel> <count>"
+ */
+
+enum channel_policy {
+  CHANNELS_PACKED,
+  CHANNELS_PARALLEL
+};
+
+enum channel_order {
+  CHANNELS_PLANAR,       ///< channel c of slice z at ((c * depth + z) * height + y) * width + x
+  CHANNELS_INTERLEAVED   ///< ((z * height + y) * width + x) * channels + c
+};
+
+struct channel_layout {
+  int channels;
+  channel_policy policy;
+  std::vector<int> first;  ///< first channel of every stream
+  std::vector<int> count;  ///< channels of every stream: 1, or up to 3 when packed
+};
+
+//"packed" or "parallel", -1 if unknown
+inline int channel_policy_from_name(const std::string& _name)
+{
+  return _name == "packed" ? CHANNELS_PACKED : _name == "parallel" ? CHANNELS_PARALLEL : -1;
+}
+
+inline const char* channel_policy_name(channel_policy _policy)
+{
+  return _policy == CHANNELS_PACKED ? "packed" : "parallel";
+}
+
+inline channel_layout channel_plan(int _channels, channel_policy _policy)
+{
+  channel_layout layout;
+  layout.channels = _channels;
+  layout.policy = _policy;
+  const int per_stream = _policy == CHANNELS_PACKED ? 3 : 1;
+  for (int c = 0; c < _channels; c += per_stream) {
+    layout.first.push_back(c);
+    layout.count.push_back(std::min(per_stream, _channels - c));
+  }
+  return layout;
+}
+
+inline int channel_streams(const channel_layout& _layout)
+{
+  return (int)_layout.first.size();
+}
+
+//file of stream _s of the set _stream: "vol.h264" -> "vol-c3.h264"
+inline std::string channel_stream_name(const std::string& _stream, const channel_layout& _layout, int _s)
+{
+  const size_t slash = _stream.rfind('/');
+  size_t dot = _stream.rfind('.');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+    dot = _stream.size();
+  return _stream.substr(0, dot) + "-c" + std::to_string(_layout.first[_s]) + _stream.substr(dot);
+}
+
+inline int channel_write_layout(const channel_layout& _layout, const std::string& _stream)
+{
+  std::ofstream file((_stream + ".channels").c_str(), std::ios_base::trunc | std::ios_base::out);
+  if (!file.good())
+    return 1;
+  file << "H26XCH1 " << _layout.channels << ' ' << channel_policy_name(_layout.policy) << ' '
+       << channel_streams(_layout) << '\n';
+  for (int s = 0; s < channel_streams(_layout); ++s)
+    file << _layout.first[s] << ' ' << _layout.count[s] << '\n';
+  return file.good() ? 0 : 1;
+}
+
+//returns 1 if _stream has no (valid) .channels sidecar
+inline int channel_read_layout(const std::string& _stream, channel_layout& _layout)
+{
+  std::ifstream file((_stream + ".channels").c_str());
+  std::string magic, policy;
+  int streams = 0;
+  if (!(file >> magic >> _layout.channels >> policy >> streams) || magic != "H26XCH1" ||
+      channel_policy_from_name(policy) < 0 || streams < 1)
+    return 1;
+  _layout.policy = (channel_policy)channel_policy_from_name(policy);
+  _layout.first.assign(streams, 0);
+  _layout.count.assign(streams, 0);
+  int channels = 0;
+  for (int s = 0; s < streams; ++s) {
+    if (!(file >> _layout.first[s] >> _layout.count[s]) || _layout.first[s] != channels ||
+        _layout.count[s] < 1 || _layout.count[s] > 3)
+      return 1;
+    channels += _layout.count[s];
+  }
+  return channels == _layout.channels ? 0 : 1;
+}
+
+struct channel_encoder {
+  channel_layout layout;
+  std::vector<encoder_session> sessions;
+  std::vector<uint64_t> busy_ns;           ///< encoding time of every stream
+  std::unique_ptr<work_stealing_pool> pool; ///< a worker per stream
+};
+
+inline void channel_encoder_close(channel_encoder& _encoder)
+{
+  _encoder.pool.reset();
+  for (encoder_session& session : _encoder.sessions)
+    encoder_close(session);
+  _encoder.sessions.clear();
+}
+
+/*
+ * opens an encoder session per stream of _layout: packed streams of more
+ * than one channel are 4:4:4 and get the bit rate of their channels; the
+ * cores are shared out among the streams unless _settings.threads is set
+ */
+inline int channel_encoder_open(channel_encoder& _encoder, const encoder_settings& _settings,
+                                const channel_layout& _layout)
+{
+  const int streams = channel_streams(_layout);
+  _encoder.layout = _layout;
+  _encoder.sessions.assign(streams, encoder_session());
+  _encoder.busy_ns.assign(streams, 0);
+
+  const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+  for (int s = 0; s < streams; ++s) {
+    encoder_settings settings = _settings;
+    if (_layout.count[s] > 1) {
+      settings.pix_fmt = AV_PIX_FMT_YUV444P;
+      settings.bit_rate *= _layout.count[s];
+    }
+    if (settings.threads <= 0)
+      settings.threads = std::max(1, (int)cores / streams);
+    if (encoder_open(_encoder.sessions[s], settings) != 0) {
+      channel_encoder_close(_encoder);
+      return 1;
+    }
+
+    //planes without a channel stay neutral
+    AVFrame* frame = _encoder.sessions[s].frame;
+    const int chroma_height = settings.pix_fmt == AV_PIX_FMT_YUV444P ? frame->height : frame->height / 2;
+    for (int p = _layout.count[s]; p < 3; ++p)
+      if (p > 0)
+        memset(frame->data[p], 128, (size_t)frame->linesize[p] * chroma_height);
+  }
+  _encoder.pool.reset(new work_stealing_pool(streams));
+  return 0;
+}
+
+//runs _work(s) for every stream on the pool, returns 0 if none of them failed
+template <typename work_type>
+inline int channel_encoder_run(channel_encoder& _encoder, const work_type& _work)
+{
+  std::atomic<int> failed(0);
+  for (int s = 0; s < channel_streams(_encoder.layout); ++s)
+    _encoder.pool->submit([&_encoder, &_work, &failed, s]() {
+        auto start = std::chrono::steady_clock::now();
+        if (_work(s) != 0)
+          failed = 1;
+        _encoder.busy_ns[s] += std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - start).count();
+      });
+  _encoder.pool->wait();
+  return failed.load();
+}
+
+/*
+ * encodes one slice of every channel (_planes[c], rows _linesize apart,
+ * used in place) with presentation time _pts; the packets of stream s go
+ * to _sinks[s]
+ */
+inline int channel_encoder_encode(channel_encoder& _encoder, const uint8_t* const* _planes, int _linesize,
+                                  int64_t _pts, const std::vector<packet_sink>& _sinks)
+{
+  return channel_encoder_run(_encoder, [&](int _s) {
+      encoder_session& session = _encoder.sessions[_s];
+      AVFrame* frame = session.frame;
+      uint8_t* own[3];
+      int own_linesize[3];
+      for (int p = 0; p < _encoder.layout.count[_s]; ++p) {
+        own[p] = frame->data[p];
+        own_linesize[p] = frame->linesize[p];
+        frame->data[p] = const_cast<uint8_t*>(_planes[_encoder.layout.first[_s] + p]);
+        frame->linesize[p] = _linesize;
+      }
+      frame->pts = _pts;
+      const int rcode = encoder_encode(session, frame, _sinks[_s]) < 0;
+      for (int p = 0; p < _encoder.layout.count[_s]; ++p) {
+        frame->data[p] = own[p];
+        frame->linesize[p] = own_linesize[p];
+      }
+      return rcode;
+    });
+}
+
+inline int channel_encoder_flush(channel_encoder& _encoder, const std::vector<packet_sink>& _sinks)
+{
+  return channel_encoder_run(_encoder, [&](int _s) {
+      return encoder_flush(_encoder.sessions[_s], _sinks[_s]) < 0;
+    });
+}
+
+inline size_t channel_volume_size(const channel_layout& _layout, int _width, int _height, int _depth)
+{
+  return (size_t)_layout.channels * _width * _height * _depth;
+}
+
+/*
+ * decodes the streams of the set _stream concurrently into _dst (of
+ * channel_volume_size bytes) in _order; every stream must hold _depth
+ * slices of _width x _height. Returns 0 on success.
+ */
+inline int channel_decode(const std::string& _stream, const channel_layout& _layout, channel_order _order,
+                          int _width, int _height, int _depth, uint8_t* _dst)
+{
+  const int streams = channel_streams(_layout);
+  const size_t slice_size = (size_t)_width * _height;
+  std::vector<int> failed(streams, 0);
+  std::vector<std::thread> threads;
+
+  av_register_all(); //once, before the threads open their inputs
+  if (codec_lock_init() != 0) //and their decoders, all at the same time
+    return 1;
+  for (int s = 0; s < streams; ++s)
+    threads.push_back(std::thread([&, s]() {
+          int slices = 0;
+          failed[s] = decode_file(channel_stream_name(_stream, _layout, s), [&](const AVFrame* frame, int z) {
+              if (z >= _depth || frame->width != _width || frame->height != _height)
+                return;
+              ++slices;
+              for (int p = 0; p < _layout.count[s]; ++p) {
+                const int c = _layout.first[s] + p;
+                for (int y = 0; y < _height; ++y) {
+                  const uint8_t* src = frame->data[p] + (size_t)y * frame->linesize[p];
+                  if (_order == CHANNELS_PLANAR) {
+                    memcpy(_dst + ((size_t)c * _depth + z) * slice_size + (size_t)y * _width, src, _width);
+                    continue;
+                  }
+                  uint8_t* dst = _dst + ((size_t)z * slice_size + (size_t)y * _width) * _layout.channels + c;
+                  for (int x = 0; x < _width; ++x)
+                    dst[(size_t)x * _layout.channels] = src[x];
+                }
+              }
+            });
+          failed[s] |= slices != _depth;
+        }));
+
+  int rcode = 0;
+  for (int s = 0; s < streams; ++s) {
+    threads[s].join();
+    rcode |= failed[s];
+  }
+  return rcode;
+}
+
+#endif /* _CHANNELS_H_ */
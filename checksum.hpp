@@ -0,0 +1,278 @@
+#ifndef _CHECKSUM_H_
+#define _CHECKSUM_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#endif
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+/*
+ * per-slice checksums for bit-exact roundtrip verification: CRC32C
+ * (Castagnoli) of the luma rows, with the crc32 instruction of SSE4.2 on
+ * the CPUs that have it (picked at run time, no build flag needed), a
+ * table otherwise; both give the same values
+ *
+ * At encode time the fresh packets are decoded once more (checksum_tap),
+ * and the CRCs of the decoded and of the source slices go to a sidecar
+ * next to the stream:
+ *
+ *   <stream>.crc: "H26XCRC1 <width>x<height> <slices>", then one line per
+ *                 slice "<n> <decoded crc> <source crc>" (hex)
+ *
+ * Every decode path can then check its slices against the sidecar
+ * (checksum_verifier) without writing images to disk.
+ */
+
+struct crc32c_lookup {
+  uint32_t table[256];
+  crc32c_lookup() {
+    for (uint32_t n = 0; n < 256; ++n) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; ++k)
+        c = c & 1 ? (c >> 1) ^ 0x82f63b78u : c >> 1;
+      table[n] = c;
+    }
+  }
+};
+
+inline const uint32_t* crc32c_table()
+{
+  static const crc32c_lookup lookup; //thread-safe initialisation in C++11
+  return lookup.table;
+}
+
+//table-driven, for CPUs without SSE4.2; _crc and the result are not inverted
+inline uint32_t crc32c_bytes(uint32_t _crc, const uint8_t* _data, size_t _size)
+{
+  const uint32_t* table = crc32c_table();
+  for (size_t n = 0; n < _size; ++n)
+    _crc = table[(_crc ^ _data[n]) & 0xff] ^ (_crc >> 8);
+  return _crc;
+}
+
+#ifdef __x86_64__
+//the crc32 instruction, 8 bytes at a time; compiled for SSE4.2 whatever the build flags
+__attribute__((target("sse4.2"))) inline uint32_t crc32c_sse42(uint32_t _crc, const uint8_t* _data, size_t _size)
+{
+  uint64_t wide = _crc;
+  size_t n = 0;
+  for (; n + 8 <= _size; n += 8) {
+    uint64_t word;
+    memcpy(&word, _data + n, 8);
+    wide = _mm_crc32_u64(wide, word);
+  }
+  uint32_t crc = (uint32_t)wide;
+  for (; n < _size; ++n)
+    crc = _mm_crc32_u8(crc, _data[n]);
+  return crc;
+}
+
+inline bool crc32c_hardware()
+{
+  static const bool supported = __builtin_cpu_supports("sse4.2");
+  return supported;
+}
+#endif
+
+//continues _crc (start with 0) over _size bytes
+inline uint32_t crc32c(uint32_t _crc, const uint8_t* _data, size_t _size)
+{
+#ifdef __x86_64__
+  if (crc32c_hardware())
+    return ~crc32c_sse42(~_crc, _data, _size);
+#endif
+  return ~crc32c_bytes(~_crc, _data, _size);
+}
+
+//CRC32C of the _width visible bytes of every row, padding excluded
+inline uint32_t plane_crc32c(const uint8_t* _data, int _linesize, int _width, int _height)
+{
+  uint32_t crc = 0;
+  for (int y = 0; y < _height; ++y)
+    crc = crc32c(crc, _data + (size_t)y * _linesize, _width);
+  return crc;
+}
+
+struct slice_checksums {
+  int width;
+  int height;
+  std::vector<uint32_t> decoded;  ///< of the slices as the reference decode returned them
+  std::vector<uint32_t> source;   ///< of the slices handed to the encoder
+};
+
+inline std::string checksum_path(const std::string& _stream)
+{
+  return _stream + ".crc";
+}
+
+inline int checksums_write(const std::string& _stream, const slice_checksums& _sums)
+{
+  FILE* out = fopen(checksum_path(_stream).c_str(), "w");
+  if (!out)
+    return 1;
+  fprintf(out, "H26XCRC1 %dx%d %zu\n", _sums.width, _sums.height, _sums.decoded.size());
+  for (size_t s = 0; s < _sums.decoded.size(); ++s)
+    fprintf(out, "%zu %08x %08x\n", s, _sums.decoded[s], s < _sums.source.size() ? _sums.source[s] : 0u);
+  return fclose(out) != 0;
+}
+
+//returns 0 if the sidecar of _stream exists and is well-formed
+inline int checksums_read(const std::string& _stream, slice_checksums& _sums)
+{
+  FILE* in = fopen(checksum_path(_stream).c_str(), "r");
+  if (!in)
+    return 1;
+
+  size_t slices = 0;
+  int rcode = fscanf(in, "H26XCRC1 %dx%d %zu", &_sums.width, &_sums.height, &slices) != 3;
+  _sums.decoded.assign(slices, 0);
+  _sums.source.assign(slices, 0);
+  for (size_t s = 0; s < slices && !rcode; ++s) {
+    size_t index = 0;
+    unsigned decoded = 0, source = 0;
+    if (fscanf(in, "%zu %x %x", &index, &decoded, &source) != 3 || index != s)
+      rcode = 1;
+    _sums.decoded[s] = decoded;
+    _sums.source[s] = source;
+  }
+  fclose(in);
+  return rcode;
+}
+
+/*
+ * reference decode at encode time: every packet the encoder hands out is
+ * decoded right away and the CRC of each decoded slice is appended to
+ * _sums.decoded
+ */
+struct checksum_tap {
+  AVCodecContext* context;
+  AVFrame* frame;
+  slice_checksums* sums;
+};
+
+inline int checksum_tap_open(checksum_tap& _tap, AVCodecID _codec_id, slice_checksums& _sums)
+{
+  _tap = checksum_tap();
+  AVCodec* codec = avcodec_find_decoder(_codec_id);
+  _tap.context = codec ? avcodec_alloc_context3(codec) : NULL;
+  _tap.frame = av_frame_alloc();
+  if (!_tap.context || !_tap.frame || avcodec_open2(_tap.context, codec, NULL) < 0) {
+    av_frame_free(&_tap.frame);
+    av_free(_tap.context);
+    _tap.context = NULL;
+    return 1;
+  }
+  _tap.sums = &_sums;
+  return 0;
+}
+
+//_pkt NULL drains the decoder
+inline void checksum_tap_packet(checksum_tap& _tap, const AVPacket* _pkt)
+{
+  AVPacket pkt;
+  if (_pkt)
+    pkt = *_pkt;
+  else {
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+  }
+
+  int got_frame = 1;
+  while (got_frame) {
+    if (avcodec_decode_video2(_tap.context, _tap.frame, &got_frame, &pkt) < 0)
+      return;
+    if (got_frame)
+      _tap.sums->decoded.push_back(plane_crc32c(_tap.frame->data[0], _tap.frame->linesize[0],
+                                                _tap.context->width, _tap.context->height));
+    if (_pkt)
+      break;
+  }
+}
+
+inline void checksum_tap_close(checksum_tap& _tap)
+{
+  if (!_tap.context)
+    return;
+  checksum_tap_packet(_tap, NULL);
+  av_frame_free(&_tap.frame);
+  avcodec_close(_tap.context);
+  av_free(_tap.context);
+  _tap.context = NULL;
+}
+
+//compares the slices of one decode path with the sidecar
+struct checksum_verifier {
+  slice_checksums expected;
+  bool available;       ///< a sidecar was found
+  size_t checked;
+  size_t mismatches;
+  long first_mismatch;  ///< -1 if none
+  uint32_t first_expected;
+  uint32_t first_got;
+};
+
+inline void checksum_verifier_open(checksum_verifier& _verifier, const std::string& _stream)
+{
+  _verifier = checksum_verifier();
+  _verifier.available = checksums_read(_stream, _verifier.expected) == 0;
+  _verifier.first_mismatch = -1;
+}
+
+inline void checksum_verify(checksum_verifier& _verifier, int _slice, const uint8_t* _data, int _linesize,
+                            int _width, int _height)
+{
+  if (!_verifier.available)
+    return;
+
+  const uint32_t crc = plane_crc32c(_data, _linesize, _width, _height);
+  const bool known = _slice >= 0 && (size_t)_slice < _verifier.expected.decoded.size();
+  ++_verifier.checked;
+  if (known && crc == _verifier.expected.decoded[_slice])
+    return;
+
+  if (_verifier.mismatches++ == 0) {
+    _verifier.first_mismatch = _slice;
+    _verifier.first_expected = known ? _verifier.expected.decoded[_slice] : 0;
+    _verifier.first_got = crc;
+  }
+}
+
+//prints the outcome for _name, returns 1 on a mismatch or a slice count that differs
+inline int checksum_report(const checksum_verifier& _verifier, const std::string& _name, std::ostream& _out)
+{
+  if (!_verifier.available) {
+    _out << _name << ": no checksums to verify against\n";
+    return 0;
+  }
+
+  const size_t expected = _verifier.expected.decoded.size();
+  if (_verifier.mismatches == 0 && _verifier.checked == expected) {
+    _out << _name << ": " << _verifier.checked << " slices bit-exact\n";
+    return 0;
+  }
+
+  _out << _name << ": " << _verifier.mismatches << " of " << _verifier.checked << " slices differ";
+  if (_verifier.first_mismatch >= 0) {
+    char crcs[64];
+    snprintf(crcs, sizeof(crcs), "expected %08x, got %08x", _verifier.first_expected, _verifier.first_got);
+    _out << ", first at slice " << _verifier.first_mismatch << " (" << crcs << ")";
+  }
+  if (_verifier.checked != expected)
+    _out << ", " << _verifier.checked << " slices decoded, " << expected << " expected";
+  _out << "\n";
+  return 1;
+}
+
+#endif /* _CHECKSUM_H_ */
@@ -0,0 +1,50 @@
+#ifndef _CODEC_LOCK_H_
+#define _CODEC_LOCK_H_
+
+#include <mutex>
+#include <new>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+/*
+ * libav 2.5 guards avcodec_open2/avcodec_close with the lock manager of
+ * the application only: without one, two opens that overlap (encoders of
+ * h26xbatch jobs, GOP decoders of h26xdec -j, the streams of a channel
+ * set) fail with "insufficient thread locking". codec_lock_init registers
+ * std::mutex as the lock manager, once per process, before the first
+ * thread opens a codec.
+ */
+
+inline int codec_lock_manager(void** _mutex, enum AVLockOp _op)
+{
+  std::mutex*& mutex = *reinterpret_cast<std::mutex**>(_mutex);
+  switch (_op) {
+  case AV_LOCK_CREATE:
+    mutex = new (std::nothrow) std::mutex();
+    return mutex ? 0 : 1;
+  case AV_LOCK_OBTAIN:
+    mutex->lock();
+    return 0;
+  case AV_LOCK_RELEASE:
+    mutex->unlock();
+    return 0;
+  case AV_LOCK_DESTROY:
+    delete mutex;
+    mutex = NULL;
+    return 0;
+  }
+  return 1;
+}
+
+//0 on success; later calls return the result of the first one
+inline int codec_lock_init()
+{
+  static std::once_flag once;
+  static int rcode = 1;
+  std::call_once(once, []() { rcode = av_lockmgr_register(codec_lock_manager) != 0; });
+  return rcode;
+}
+
+#endif /* _CODEC_LOCK_H_ */
@@ -0,0 +1,276 @@
+#ifndef _CONTAINER_H_
+#define _CONTAINER_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/mathematics.h>
+}
+
+#include "nal_edit.hpp"
+
+/*
+ * MP4 and Matroska output instead of bare Annex-B streams: the encoder's
+ * packets are muxed through libavformat with their timestamps, so that
+ * readers get a sample index (moov, or Matroska cues) and seek to any
+ * slice without scanning the stream.
+ *
+ *   - slice s has the presentation time s / 25 s (the encoders' time base),
+ *     counted from the stream's start time: containers that cannot store
+ *     negative timestamps shift the whole stream by the B-frame delay
+ *   - MP4 is written with faststart (moov in front), Matroska reserves room
+ *     for the cues in front when the number of slices is known
+ *   - the volume is described in the "comment" tag, which both formats keep:
+ *       "H26XVOL1 <width>x<height>x<slices> <bits> <voxel x> <voxel y> <voxel z>"
+ *
+ * The parameter sets go into the codec extradata, taken from the first
+ * packet (the packets themselves stay Annex-B with in-band parameter sets,
+ * the muxers convert them to avcC/hvcC).
+ */
+
+struct volume_metadata {
+  int width;
+  int height;
+  int slices;          ///< 0 if not known up front
+  int bit_depth;       ///< of the source samples (16 for windowed gray16 input)
+  double voxel[3];     ///< voxel size, x y z
+};
+
+inline volume_metadata default_volume_metadata(int _width, int _height, int _slices)
+{
+  volume_metadata value;
+  value.width = _width;
+  value.height = _height;
+  value.slices = _slices;
+  value.bit_depth = 8;
+  value.voxel[0] = value.voxel[1] = value.voxel[2] = 1.;
+  return value;
+}
+
+inline AVRational container_slice_time_base()
+{
+  return (AVRational){1, 25};
+}
+
+//"mp4" or "matroska" by the extension of _path, "" for Annex-B
+inline std::string container_format(const std::string& _path)
+{
+  const size_t dot = _path.rfind('.');
+  const std::string ext = dot == std::string::npos ? "" : _path.substr(dot + 1);
+  if (ext == "mp4" || ext == "m4v" || ext == "mov")
+    return "mp4";
+  if (ext == "mkv")
+    return "matroska";
+  return "";
+}
+
+inline std::string container_comment(const volume_metadata& _meta)
+{
+  char comment[256];
+  snprintf(comment, sizeof(comment), "H26XVOL1 %dx%dx%d %d %g %g %g", _meta.width, _meta.height, _meta.slices,
+           _meta.bit_depth, _meta.voxel[0], _meta.voxel[1], _meta.voxel[2]);
+  return comment;
+}
+
+//reads the volume description of an opened input; returns 0 if there was one
+inline int container_read_metadata(const AVFormatContext* _input, volume_metadata& _meta)
+{
+  const AVDictionaryEntry* comment = av_dict_get(_input->metadata, "comment", NULL, 0);
+  if (!comment)
+    return 1;
+  volume_metadata meta = volume_metadata();
+  if (sscanf(comment->value, "H26XVOL1 %dx%dx%d %d %lf %lf %lf", &meta.width, &meta.height, &meta.slices,
+             &meta.bit_depth, &meta.voxel[0], &meta.voxel[1], &meta.voxel[2]) != 7)
+    return 1;
+  _meta = meta;
+  return 0;
+}
+
+//slice number of timestamp _ts of _stream
+inline int container_slice(const AVStream* _stream, int64_t _ts)
+{
+  const int64_t start = _stream->start_time != AV_NOPTS_VALUE ? _stream->start_time : 0;
+  return (int)av_rescale_q(_ts - start, _stream->time_base, container_slice_time_base());
+}
+
+inline int64_t container_timestamp(const AVStream* _stream, int _slice)
+{
+  const int64_t start = _stream->start_time != AV_NOPTS_VALUE ? _stream->start_time : 0;
+  return start + av_rescale_q(_slice, container_slice_time_base(), _stream->time_base);
+}
+
+//inputs with a sample index, where container_seek does not read the stream up to the target
+inline bool container_indexed(const AVFormatContext* _input, const AVStream* _stream)
+{
+  return _stream->nb_index_entries > 0 && !(_input->iformat->flags & AVFMT_GENERIC_INDEX);
+}
+
+/*
+ * positions _input at the keyframe at or before slice _slice; the frames
+ * decoded next are numbered by container_slice of their timestamps
+ */
+inline int container_seek(AVFormatContext* _input, const AVStream* _stream, int _slice)
+{
+  return av_seek_frame(_input, _stream->index, container_timestamp(_stream, _slice), AVSEEK_FLAG_BACKWARD) < 0;
+}
+
+struct container_muxer {
+  AVFormatContext* context;
+  AVStream* stream;
+  std::string format;
+  volume_metadata meta;
+  bool header;          ///< written with the first packet
+  int64_t packets;
+};
+
+inline void container_free(container_muxer& _muxer)
+{
+  if (!_muxer.context)
+    return;
+  if (_muxer.context->pb && !(_muxer.context->oformat->flags & AVFMT_NOFILE))
+    avio_closep(&_muxer.context->pb);
+  avformat_free_context(_muxer.context);
+  _muxer.context = NULL;
+}
+
+/*
+ * opens _path for a video stream of codec _codec_id (H.264 or HEVC) in the
+ * format given by its extension (see container_format); returns 0 on success
+ */
+inline int container_open(container_muxer& _muxer, const std::string& _path, AVCodecID _codec_id,
+                          const volume_metadata& _meta)
+{
+  _muxer = container_muxer();
+  _muxer.format = container_format(_path);
+  _muxer.meta = _meta;
+  if (_muxer.format.empty())
+    return 1;
+
+  av_register_all();
+  if (avformat_alloc_output_context2(&_muxer.context, NULL, _muxer.format.c_str(), _path.c_str()) < 0 ||
+      !_muxer.context) {
+    fprintf(stderr, "Could not allocate the %s muxer\n", _muxer.format.c_str());
+    return 1;
+  }
+
+  _muxer.stream = avformat_new_stream(_muxer.context, NULL);
+  if (!_muxer.stream) {
+    container_free(_muxer);
+    return 1;
+  }
+  AVCodecContext* c = _muxer.stream->codec;
+  c->codec_type = AVMEDIA_TYPE_VIDEO;
+  c->codec_id = _codec_id;
+  c->width = _meta.width;
+  c->height = _meta.height;
+  c->pix_fmt = AV_PIX_FMT_YUV420P;
+  c->time_base = container_slice_time_base();
+  _muxer.stream->time_base = container_slice_time_base();
+  _muxer.stream->avg_frame_rate = (AVRational){25, 1};
+  if (_muxer.context->oformat->flags & AVFMT_GLOBALHEADER)
+    c->flags |= CODEC_FLAG_GLOBAL_HEADER;
+
+  av_dict_set(&_muxer.context->metadata, "comment", container_comment(_meta).c_str(), 0);
+
+  if (!(_muxer.context->oformat->flags & AVFMT_NOFILE) &&
+      avio_open(&_muxer.context->pb, _path.c_str(), AVIO_FLAG_WRITE) < 0) {
+    fprintf(stderr, "Could not open %s\n", _path.c_str());
+    container_free(_muxer);
+    return 1;
+  }
+  return 0;
+}
+
+//copies the parameter sets of the Annex-B access unit _data to the extradata, then writes the header
+inline int container_write_header(container_muxer& _muxer, const uint8_t* _data, size_t _size)
+{
+  std::vector<nal_unit> units;
+  split_nal_units(_data, _size, units);
+  const nal_codec codec = _muxer.stream->codec->codec_id == AV_CODEC_ID_HEVC ? NAL_CODEC_HEVC : NAL_CODEC_H264;
+  int types[3];
+  nal_parameter_set_types(codec, types);
+
+  std::vector<uint8_t> extradata;
+  for (const nal_unit& nal : units) {
+    const int type = codec == NAL_CODEC_HEVC ? (_data[nal.offset] >> 1) & 0x3f : _data[nal.offset] & 0x1f;
+    if (type == types[0] || type == types[1] || type == types[2]) {
+      static const uint8_t start_code[4] = { 0, 0, 0, 1 };
+      extradata.insert(extradata.end(), start_code, start_code + 4);
+      extradata.insert(extradata.end(), _data + nal.offset, _data + nal.offset + nal.size);
+    }
+  }
+  if (extradata.empty()) {
+    fprintf(stderr, "No parameter sets in the first packet\n");
+    return 1;
+  }
+
+  AVCodecContext* c = _muxer.stream->codec;
+  c->extradata = (uint8_t*)av_mallocz(extradata.size() + FF_INPUT_BUFFER_PADDING_SIZE);
+  if (!c->extradata)
+    return 1;
+  memcpy(c->extradata, &extradata[0], extradata.size());
+  c->extradata_size = (int)extradata.size();
+
+  AVDictionary* options = NULL;
+  if (_muxer.format == "mp4")
+    av_dict_set(&options, "movflags", "faststart", 0);
+  else if (_muxer.meta.slices > 0)
+    //a cue point per keyframe at most, each well below 32 bytes
+    av_dict_set(&options, "reserve_index_space", std::to_string(1024 + 32 * _muxer.meta.slices).c_str(), 0);
+  int ret = avformat_write_header(_muxer.context, &options);
+  av_dict_free(&options);
+  if (ret < 0) {
+    fprintf(stderr, "Could not write the %s header\n", _muxer.format.c_str());
+    return 1;
+  }
+  _muxer.header = true;
+  return 0;
+}
+
+//muxes one Annex-B packet, _pts/_dts in slices; returns 0 on success
+inline int container_write(container_muxer& _muxer, const uint8_t* _data, size_t _size, int64_t _pts,
+                           int64_t _dts, bool _keyframe)
+{
+  if (!_muxer.context)
+    return 1;
+  if (!_muxer.header && container_write_header(_muxer, _data, _size) != 0)
+    return 1;
+
+  AVPacket pkt;
+  av_init_packet(&pkt);
+  pkt.data = const_cast<uint8_t*>(_data);
+  pkt.size = (int)_size;
+  pkt.stream_index = _muxer.stream->index;
+  pkt.pts = av_rescale_q(_pts, container_slice_time_base(), _muxer.stream->time_base);
+  pkt.dts = _dts == AV_NOPTS_VALUE ? pkt.pts : av_rescale_q(_dts, container_slice_time_base(), _muxer.stream->time_base);
+  pkt.duration = (int)av_rescale_q(1, container_slice_time_base(), _muxer.stream->time_base);
+  if (_keyframe)
+    pkt.flags |= AV_PKT_FLAG_KEY;
+  //not interleaved: a single stream, and the caller keeps the packet's buffer
+  if (av_write_frame(_muxer.context, &pkt) < 0)
+    return 1;
+  ++_muxer.packets;
+  return 0;
+}
+
+inline int container_write_packet(container_muxer& _muxer, const AVPacket& _pkt)
+{
+  return container_write(_muxer, _pkt.data, _pkt.size, _pkt.pts, _pkt.dts, (_pkt.flags & AV_PKT_FLAG_KEY) != 0);
+}
+
+//writes the index (trailer) and closes the file; returns 0 on success
+inline int container_close(container_muxer& _muxer)
+{
+  if (!_muxer.context)
+    return 1;
+  int rcode = !_muxer.header || av_write_trailer(_muxer.context) < 0;
+  container_free(_muxer);
+  return rcode;
+}
+
+#endif /* _CONTAINER_H_ */
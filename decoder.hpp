@@ -0,0 +1,145 @@
+#ifndef _DECODER_H_
+#define _DECODER_H_
+
+#include <climits>
+#include <functional>
+#include <iostream>
+#include <string>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+#include "container.hpp"
+#include "frame_pool.hpp"
+#include "memory.h"
+#include "telemetry.h"
+
+/*
+ * the decode loop of decode_video_file with the per-frame work (saveFrame
+ * and friends) handed to a callback; frames arrive in display order,
+ * frameNumber counts them from 0
+ */
+
+typedef std::function<void(const AVFrame* frame, int frameNumber)> frame_sink;
+
+/*
+ * decodes slices [_first, _first + _count) of the first video stream of an
+ * opened input (_count < 0: to the end), frameNumber is the slice number;
+ * inputs with a sample index (MP4, Matroska) are positioned at the keyframe
+ * before _first with container_seek, the others are decoded from the start
+ */
+inline int decode_stream_range(AVFormatContext* _formatContext, int _first, int _count, const frame_sink& _sink)
+{
+    if (avformat_find_stream_info(_formatContext, NULL) < 0)
+        return 1;
+
+    if (_formatContext->nb_streams < 1 ||
+        _formatContext->streams[0]->codec->codec_type != AVMEDIA_TYPE_VIDEO)
+        return 1;
+
+    AVStream* stream = _formatContext->streams[0];
+    AVCodecContext* codecContext = stream->codec;
+
+    codecContext->codec = avcodec_find_decoder(codecContext->codec_id);
+    if (codecContext->codec == NULL)
+        return 1;
+    use_frame_pool(codecContext);
+    size_t rss = memory_rss();
+    if (avcodec_open2(codecContext, codecContext->codec, NULL) != 0)
+    {
+        avcodec_close(codecContext);
+        return 1;
+    }
+    const size_t codec_bytes = memory_account_rss(MEMORY_DECODE, rss);
+
+    AVFrame* frame = av_frame_alloc();
+    if (!frame)
+    {
+        avcodec_close(codecContext);
+        memory_release(MEMORY_DECODE, codec_bytes);
+        return 1;
+    }
+
+    AVPacket packet;
+    av_init_packet(&packet);
+
+    //after a seek the frames are numbered by their timestamps, otherwise they are counted
+    const bool seeked = _first > 0 && container_indexed(_formatContext, stream) &&
+        container_seek(_formatContext, stream, _first) == 0;
+    const int end = _count < 0 ? INT_MAX : _first + _count;
+    int frameNumber = 0;
+    auto take = [&](uint64_t _start, int _size) {
+        const int64_t timestamp = av_frame_get_best_effort_timestamp(frame);
+        const int slice = seeked ? container_slice(stream, timestamp) : frameNumber;
+        ++frameNumber;
+        telemetry_record_frame('D', slice, timestamp, _start, 0, _size, frame->pict_type, -1);
+        if (slice >= _first && slice < end)
+            _sink(frame, slice);
+        return slice < end - 1;
+    };
+
+    bool more = true;
+    while (more && av_read_frame(_formatContext, &packet) == 0)
+    {
+        if (packet.stream_index == stream->index)
+        {
+            int frameFinished = 0;
+            uint64_t start = telemetry_start();
+            avcodec_decode_video2(codecContext, frame, &frameFinished, &packet);
+
+            if (frameFinished)
+                more = take(start, packet.size);
+        }
+        av_free_packet(&packet);
+    }
+
+    int frameFinished = 1;
+    while (more && frameFinished)
+    {
+        packet.data = NULL;
+        packet.size = 0;
+        uint64_t start = telemetry_start();
+        int rcode = avcodec_decode_video2(codecContext, frame, &frameFinished, &packet);
+        if (rcode < 0)
+        {
+            std::cerr << "[delayed]\tdecode error detected\n";
+            break;
+        }
+
+        if (frameFinished)
+            more = take(start, 0);
+    }
+
+    av_frame_free(&frame);
+    avcodec_close(codecContext);
+    memory_release(MEMORY_DECODE, codec_bytes);
+    return 0;
+}
+
+//decodes the first video stream of an opened input
+inline int decode_stream(AVFormatContext* _formatContext, const frame_sink& _sink)
+{
+    return decode_stream_range(_formatContext, 0, -1, _sink);
+}
+
+inline int decode_file_range(const std::string& _fname, int _first, int _count, const frame_sink& _sink)
+{
+    av_register_all();
+
+    AVFormatContext* formatContext = NULL;
+    if (avformat_open_input(&formatContext, _fname.c_str(), NULL, NULL) != 0)
+        return 1;
+
+    int rcode = decode_stream_range(formatContext, _first, _count, _sink);
+    avformat_close_input(&formatContext);
+    return rcode;
+}
+
+inline int decode_file(const std::string& _fname, const frame_sink& _sink)
+{
+    return decode_file_range(_fname, 0, -1, _sink);
+}
+
+#endif /* _DECODER_H_ */
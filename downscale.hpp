@@ -0,0 +1,109 @@
+#ifndef _DOWNSCALE_H_
+#define _DOWNSCALE_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * box filter downscaling of 8-bit planes by an integer factor
+ * (the output is (_width/_factor)x(_height/_factor), remainders are cropped)
+ */
+
+//exact 2x2 box filter, 16 output pixels per iteration with SSE2
+inline void box_downscale2(const uint8_t* _src, int _src_linesize, int _width, int _height,
+                           uint8_t* _dst, int _dst_linesize)
+{
+  const int dst_width = _width / 2;
+  const int dst_height = _height / 2;
+
+  for (int y = 0; y < dst_height; ++y) {
+    const uint8_t* row0 = _src + (2 * y) * _src_linesize;
+    const uint8_t* row1 = row0 + _src_linesize;
+    uint8_t* out = _dst + y * _dst_linesize;
+    int x = 0;
+
+#ifdef __SSE2__
+    const __m128i low = _mm_set1_epi16(0x00ff);
+    const __m128i two = _mm_set1_epi16(2);
+    for (; x + 16 <= dst_width; x += 16) {
+      //each 16-bit lane holds a horizontal pair, add both bytes of both rows
+      __m128i a0 = _mm_loadu_si128((const __m128i*)(row0 + 2 * x));
+      __m128i a1 = _mm_loadu_si128((const __m128i*)(row0 + 2 * x + 16));
+      __m128i b0 = _mm_loadu_si128((const __m128i*)(row1 + 2 * x));
+      __m128i b1 = _mm_loadu_si128((const __m128i*)(row1 + 2 * x + 16));
+
+      __m128i s0 = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a0, low), _mm_srli_epi16(a0, 8)),
+                                 _mm_add_epi16(_mm_and_si128(b0, low), _mm_srli_epi16(b0, 8)));
+      __m128i s1 = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a1, low), _mm_srli_epi16(a1, 8)),
+                                 _mm_add_epi16(_mm_and_si128(b1, low), _mm_srli_epi16(b1, 8)));
+
+      s0 = _mm_srli_epi16(_mm_add_epi16(s0, two), 2);
+      s1 = _mm_srli_epi16(_mm_add_epi16(s1, two), 2);
+      _mm_storeu_si128((__m128i*)(out + x), _mm_packus_epi16(s0, s1));
+    }
+#endif
+
+    for (; x < dst_width; ++x)
+      out[x] = (row0[2 * x] + row0[2 * x + 1] + row1[2 * x] + row1[2 * x + 1] + 2) >> 2;
+  }
+}
+
+//generic box filter for factors 1..16: rows are accumulated in 16-bit, then reduced horizontally
+inline void box_downscale(const uint8_t* _src, int _src_linesize, int _width, int _height,
+                          int _factor, uint8_t* _dst, int _dst_linesize)
+{
+  if (_factor == 2) {
+    box_downscale2(_src, _src_linesize, _width, _height, _dst, _dst_linesize);
+    return;
+  }
+
+  const int dst_width = _width / _factor;
+  const int dst_height = _height / _factor;
+  const int used_width = dst_width * _factor;
+  const uint32_t area = _factor * _factor;
+
+  if (_factor == 1) {
+    for (int y = 0; y < dst_height; ++y)
+      std::copy(_src + y * _src_linesize, _src + y * _src_linesize + dst_width,
+                _dst + y * _dst_linesize);
+    return;
+  }
+
+  std::vector<uint16_t> acc(used_width + 16);
+
+  for (int y = 0; y < dst_height; ++y) {
+    std::fill(acc.begin(), acc.end(), 0);
+
+    for (int r = 0; r < _factor; ++r) {
+      const uint8_t* row = _src + (y * _factor + r) * _src_linesize;
+      int x = 0;
+#ifdef __SSE2__
+      const __m128i zero = _mm_setzero_si128();
+      for (; x + 16 <= used_width; x += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(row + x));
+        __m128i lo = _mm_loadu_si128((const __m128i*)(&acc[x]));
+        __m128i hi = _mm_loadu_si128((const __m128i*)(&acc[x + 8]));
+        _mm_storeu_si128((__m128i*)(&acc[x]), _mm_add_epi16(lo, _mm_unpacklo_epi8(v, zero)));
+        _mm_storeu_si128((__m128i*)(&acc[x + 8]), _mm_add_epi16(hi, _mm_unpackhi_epi8(v, zero)));
+      }
+#endif
+      for (; x < used_width; ++x)
+        acc[x] += row[x];
+    }
+
+    uint8_t* out = _dst + y * _dst_linesize;
+    for (int x = 0; x < dst_width; ++x) {
+      uint32_t sum = 0;
+      for (int k = 0; k < _factor; ++k)
+        sum += acc[x * _factor + k];
+      out[x] = (sum + area / 2) / area;
+    }
+  }
+}
+
+#endif /* _DOWNSCALE_H_ */
@@ -1,91 +1,67 @@
-
-#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include "volume.h"
 
 #define WIDTH 352
 #define HEIGHT 288
 #define DEPTH 25
 
-void fill_volume(unsigned char* _volume){
-
-  uint32_t z =0;
-  uint32_t y =0;
-  uint32_t x =0;
-  uint32_t i =0;
-
-  float offset = 0.f;
-  float ymin = 0;
-  float ymax = 0;
-	
-  for (z=0; z<DEPTH; ++z)
-    {
-      for (y=0; y<HEIGHT; ++y)
-	{
-	  offset = .05*(z/5)*HEIGHT;
-	  ymin = (.1*HEIGHT)+offset;
-	  ymax = (.13*HEIGHT)+offset;
-	  
-	  for (x=0; x < WIDTH; ++x)
-	    {
-	      i = (z*WIDTH*HEIGHT) + (y*WIDTH) + x;
-
-	      _volume[i] = x + y + z * 3;
-
-	      if((y>ymin && y<ymax) &&
-		 (x % 4 < 2) && x<=(5*(i+1)))
-		_volume[i] = 16;
-	    
-            }
-	  
-	  x = 0;
-	}
-      y = 0;
-    }
-
-}
-
 int main(int argc, char **argv)
 {
-  uint32_t num_elements = WIDTH*HEIGHT*DEPTH;
-  uint32_t pixels_per_frame = WIDTH*HEIGHT;
-
-  unsigned char y [num_elements];
-  unsigned char u [num_elements/4];
-  unsigned char v [num_elements/4];
-
-  uint32_t i =0;
-  for(;i<num_elements;++i){
-    y [i] = 0;
+  int width = WIDTH, height = HEIGHT, depth = DEPTH;
+  int pattern = VOLUME_STRIPES;
+  uint64_t seed = 0;
+  volume_generator gen;
+  char fname[256];
+
+  if (argc > 1 && (pattern = volume_pattern_from_name(argv[1])) < 0) {
+    fprintf(stderr, "usage: ./dump_yuv [stripes|noise|gradient|blobs] [<width>x<height>x<depth>] [<seed>]\n");
+    return 1;
+  }
+  if (argc > 2 && (sscanf(argv[2], "%dx%dx%d", &width, &height, &depth) != 3 ||
+                   width < 2 || height < 2 || depth < 1 || (width | height) & 1)) {
+    fprintf(stderr, "volume size %s not understood (even width and height)\n", argv[2]);
+    return 1;
   }
+  if (argc > 3)
+    seed = strtoull(argv[3], NULL, 10);
 
-  fill_volume(y);
+  volume_generator_init(&gen, pattern, width, height, depth, seed);
 
-  i =0;
-  for(;i<num_elements/4;++i){
-    u [i] = 128;
-    v [i] = 128;
+  /* one slice at a time, the volume is never held in memory */
+  size_t pixels_per_frame = (size_t)width * height;
+  unsigned char *slice = malloc(pixels_per_frame * 3 / 2);
+  if (!slice) {
+    fprintf(stderr, "Could not allocate a %dx%d slice\n", width, height);
+    return 1;
+  }
+  /* the raw dump always had neutral chroma (u and v) */
+  memset(slice + pixels_per_frame, 128, pixels_per_frame / 2);
+
+  snprintf(fname, sizeof(fname), "yuv420p_%df_%dx%d.bin", depth, width, height);
+  FILE* out = fopen(fname, "wb");
+  if (!out) {
+    fprintf(stderr, "Could not open %s\n", fname);
+    free(slice);
+    return 1;
   }
 
-  unsigned int z = 0;
-
-  FILE* out = fopen("yuv420p_25f_352x288.bin","wb");
+  int z = 0;
+  for(;z<depth;++z){
 
-  for(;z<DEPTH;++z){
-    
-    fwrite(&y[z*pixels_per_frame],1,pixels_per_frame,out);
-    
-    fwrite(&u[z*pixels_per_frame/4],1,pixels_per_frame/4,out);
+    volume_fill_luma(&gen, z, slice, width);
 
-    fwrite(&v[z*pixels_per_frame/4],1,pixels_per_frame/4,out);
-    
+    fwrite(slice, 1, pixels_per_frame * 3 / 2, out);
   }
   fclose(out);
+  free(slice);
 
   //works after rename: ffmpeg -s 352x288 -pix_fmt yuv420p -i yuv420p_25f_352x288.yuv -vframes 25 test_yuv.mp4
   //works: ffmpeg -vc rawvideo -f rawvideo -r 25 -s 352x288 -pix_fmt yuv420p -i yuv420p_25f_352x288.bin -vframes 25 raw_yuv.mp4
-  printf("%i frames (%ix%i) written to yuv420p_25f_352x288.bin\n",DEPTH,WIDTH,HEIGHT);
-  
+  printf("%i frames (%ix%i) written to %s\n", depth, width, height, fname);
+
   return 0;
 }
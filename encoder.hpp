@@ -0,0 +1,327 @@
+#ifndef _ENCODER_H_
+#define _ENCODER_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+extern "C" {
+#include <libavutil/opt.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/imgutils.h>
+}
+
+#include "codec_lock.hpp"
+#include "frame_pool.hpp"
+#include "memory.h"
+#include "telemetry.h"
+
+/*
+ * encoder session: the codec setup of video_encode_example packed into
+ * open/encode/flush/close so that several streams (e.g. pyramid levels)
+ * can be encoded side by side; packets are handed to a sink callback
+ */
+
+struct encoder_settings {
+  AVCodecID codec_id;
+  int width;           ///< must be a multiple of two
+  int height;
+  AVPixelFormat pix_fmt; ///< AV_PIX_FMT_YUV420P, or AV_PIX_FMT_YUV444P for three full planes
+  int bit_rate;        ///< bits per second at 25 slices per second (average bit rate mode)
+  float crf;           ///< >= 0: constant rate factor instead of bit_rate (0 is lossless in x264), -1 unset
+  int qp;              ///< >= 0: constant quantizer instead of bit_rate
+  int pass;            ///< 0 single pass, 1/2 first/second pass of x264's two-pass mode
+  std::string stats;   ///< statistics file of x264's two passes (encoder_stats_file), written by pass 1
+  int gop_size;
+  int max_b_frames;
+  int refs;            ///< reference frames, 0 for the codec default
+  std::string preset;  ///< x264/x265 preset, empty for the codec default
+  bool forced_idr;     ///< frames submitted with pict_type AV_PICTURE_TYPE_I become IDR frames
+  int threads;         ///< codec threads, 0 lets the codec decide
+  bool wait_for_memory; ///< encoder_open waits for other sessions to free the memory budget
+};
+
+inline encoder_settings default_encoder_settings(AVCodecID _codec_id, int _width, int _height)
+{
+  encoder_settings value;
+  value.codec_id = _codec_id;
+  value.width = _width;
+  value.height = _height;
+  value.pix_fmt = AV_PIX_FMT_YUV420P;
+  value.bit_rate = 400000;
+  value.crf = -1;
+  value.qp = -1;
+  value.pass = 0;
+  value.gop_size = 10;
+  value.max_b_frames = 1;
+  value.refs = 0;
+  value.preset = (_codec_id == AV_CODEC_ID_H264) ? "slow" : "";
+  value.forced_idr = false;
+  value.threads = 0;
+  value.wait_for_memory = false;
+  return value;
+}
+
+/*
+ * rough upper bound of what an encoder session holds: the input frame plus
+ * the frames inside the codec (rc lookahead, b frames, references, one per
+ * frame thread); x264's slow preset looks 50 frames ahead
+ */
+inline size_t encoder_footprint(const encoder_settings& _settings)
+{
+  const size_t planes = _settings.pix_fmt == AV_PIX_FMT_YUV444P ? 6 : 3;
+  const size_t frame_size = (size_t)_settings.width * _settings.height * planes / 2;
+  const int threads = _settings.threads > 0 ? _settings.threads : 4;
+  const int lookahead = _settings.codec_id == AV_CODEC_ID_H264 ? 50 : 25;
+  const int refs = _settings.refs > 4 ? _settings.refs : 4;
+  return frame_size * (1 + lookahead + _settings.max_b_frames + refs + threads);
+}
+
+//largest packet the encoder may produce for one picture (I_PCM plus headers)
+inline size_t encoder_packet_bound(const encoder_settings& _settings)
+{
+  return (size_t)_settings.width * _settings.height * 3 + (64 << 10);
+}
+
+struct encoder_session {
+  AVCodecContext* context;
+  AVFrame* frame;      ///< input picture of the session's size, owned by the session
+  int64_t frames_in;
+  int64_t packets_out;
+  int64_t bytes_out;
+  size_t packet_bound; ///< size of the pooled packet buffers handed to the encoder
+  size_t reserved;     ///< bytes accounted to MEMORY_ENCODE (see memory.h)
+};
+
+typedef std::function<void(const AVPacket&)> packet_sink;
+
+//sink that appends the Annex-B packets to a byte buffer (like video_encode_to_buffer),
+//the buffer's capacity is accounted to MEMORY_MUX until release_stream
+inline packet_sink append_to(std::vector<uint8_t>& _buffer)
+{
+  return [&_buffer](const AVPacket& _pkt) {
+    const size_t capacity = _buffer.capacity();
+    _buffer.insert(_buffer.end(), _pkt.data, _pkt.data + _pkt.size);
+    if (_buffer.capacity() > capacity)
+      memory_account(MEMORY_MUX, _buffer.capacity() - capacity);
+  };
+}
+
+//frees a buffer filled through append_to
+inline void release_stream(std::vector<uint8_t>& _buffer)
+{
+  memory_release(MEMORY_MUX, _buffer.capacity());
+  std::vector<uint8_t>().swap(_buffer);
+}
+
+inline void encoder_close(encoder_session& _session);
+
+inline int encoder_open(encoder_session& _session, const encoder_settings& _settings)
+{
+  _session = encoder_session();
+
+  //the budget gate: libav gives no hook into the codec's own allocations
+  const size_t footprint = encoder_footprint(_settings);
+  if (memory_reserve(MEMORY_ENCODE, footprint, _settings.wait_for_memory) != 0) {
+    fprintf(stderr, "Encoder needs ~%zu bytes, over the memory budget\n", footprint);
+    return 1;
+  }
+  _session.reserved = footprint;
+
+  AVCodec* codec = avcodec_find_encoder(_settings.codec_id);
+  if (!codec) {
+    fprintf(stderr, "Codec not found\n");
+    encoder_close(_session);
+    return 1;
+  }
+
+  AVCodecContext* c = avcodec_alloc_context3(codec);
+  if (!c) {
+    fprintf(stderr, "Could not allocate video codec context\n");
+    encoder_close(_session);
+    return 1;
+  }
+
+  c->bit_rate = _settings.bit_rate;
+  c->width = _settings.width;
+  c->height = _settings.height;
+  c->time_base = (AVRational){1,25};
+  c->gop_size = _settings.gop_size;
+  c->max_b_frames = _settings.max_b_frames;
+  c->pix_fmt = _settings.pix_fmt;
+  if (_settings.threads > 0)
+    c->thread_count = _settings.threads;
+
+  if (!_settings.preset.empty())
+    av_opt_set(c->priv_data, "preset", _settings.preset.c_str(), 0);
+
+  //constant quality replaces the bit rate; libx265 of libav 2.5 has no qp option
+  //and ignores refs, both go through x265-params
+  std::string x265_params;
+  if (_settings.crf >= 0)
+    av_opt_set_double(c->priv_data, "crf", _settings.crf, 0);
+  else if (_settings.qp >= 0) {
+    if (_settings.codec_id == AV_CODEC_ID_HEVC)
+      x265_params = "qp=" + std::to_string(_settings.qp);
+    else
+      av_opt_set_int(c->priv_data, "qp", _settings.qp, 0);
+  }
+  if (_settings.refs > 0) {
+    c->refs = _settings.refs;
+    if (_settings.codec_id == AV_CODEC_ID_HEVC)
+      x265_params += (x265_params.empty() ? "ref=" : ":ref=") + std::to_string(_settings.refs);
+  }
+  if (!x265_params.empty())
+    av_opt_set(c->priv_data, "x265-params", x265_params.c_str(), 0);
+
+  //the libx264 wrapper neither fills stats_out nor reads stats_in: x264 keeps the statistics in
+  //a file of its own, x264_2pass.log in the working directory unless named here
+  if (_settings.pass == 1)
+    c->flags |= CODEC_FLAG_PASS1;
+  if (_settings.pass == 2)
+    c->flags |= CODEC_FLAG_PASS2;
+  if (_settings.pass != 0 && !_settings.stats.empty())
+    av_opt_set(c->priv_data, "stats", _settings.stats.c_str(), 0);
+
+  //without it libx264 turns forced I frames into non-IDR I frames (not every
+  //libx265 wrapper knows the option, those keep their own keyframe type)
+  if (_settings.forced_idr)
+    av_opt_set(c->priv_data, "forced-idr", "1", 0);
+
+  //sessions of several threads open at the same time (h26xbatch jobs, channel streams)
+  if (codec_lock_init() != 0 || avcodec_open2(c, codec, NULL) < 0) {
+    fprintf(stderr, "Could not open codec\n");
+    av_free(c);
+    encoder_close(_session);
+    return 1;
+  }
+
+  AVFrame* frame = av_frame_alloc();
+  if (!frame) {
+    fprintf(stderr, "Could not allocate video frame\n");
+    avcodec_close(c);
+    av_free(c);
+    encoder_close(_session);
+    return 1;
+  }
+  frame->format = c->pix_fmt;
+  frame->width  = c->width;
+  frame->height = c->height;
+
+  if (pool_image(frame, c->width, c->height, c->pix_fmt) != 0) {
+    fprintf(stderr, "Could not allocate raw picture buffer\n");
+    av_frame_free(&frame);
+    avcodec_close(c);
+    av_free(c);
+    encoder_close(_session);
+    return 1;
+  }
+
+  _session.context = c;
+  _session.frame = frame;
+  _session.packet_bound = encoder_packet_bound(_settings);
+  return 0;
+}
+
+/*
+ * encodes _frame (NULL drains one delayed packet), every packet produced
+ * is handed to _sink; returns 1 if a packet was produced, 0 if not and
+ * a negative value on error
+ */
+inline int encoder_encode(encoder_session& _session, const AVFrame* _frame, const packet_sink& _sink)
+{
+  AVPacket pkt;
+  av_init_packet(&pkt);
+  //the encoder writes into a pooled buffer instead of allocating a packet per frame
+  if (pool_packet(&pkt, _session.packet_bound) != 0) {
+    pkt.data = NULL;
+    pkt.size = 0;
+  }
+
+  int got_output = 0;
+  uint64_t start = telemetry_start();
+  int ret = avcodec_encode_video2(_session.context, &pkt, _frame, &got_output);
+  if (ret < 0) {
+    fprintf(stderr, "Error encoding frame\n");
+    return ret;
+  }
+
+  const AVFrame* coded = got_output ? _session.context->coded_frame : NULL;
+  telemetry_record_frame('E', _frame ? _session.frames_in : -1, _frame ? _frame->pts : AV_NOPTS_VALUE,
+                         start, 0, got_output ? pkt.size : 0, coded ? coded->pict_type : 0,
+                         coded && coded->quality ? coded->quality / FF_QP2LAMBDA : -1);
+
+  if (_frame)
+    ++_session.frames_in;
+
+  if (got_output) {
+    //av_free_packet clears pkt.size
+    const int size = pkt.size;
+    ++_session.packets_out;
+    _session.bytes_out += size;
+    memory_account(MEMORY_ENCODE, size);
+    _sink(pkt);
+    av_free_packet(&pkt);
+    memory_release(MEMORY_ENCODE, size);
+  }
+
+  return got_output;
+}
+
+//drains all delayed packets
+inline int encoder_flush(encoder_session& _session, const packet_sink& _sink)
+{
+  int ret = 1;
+  while (ret > 0)
+    ret = encoder_encode(_session, NULL, _sink);
+  return ret;
+}
+
+/*
+ * a new file for the statistics of a two-pass encode, "" if none could be
+ * created: every encode needs its own, concurrent ones would otherwise
+ * share x264_2pass.log and read each other's first pass
+ */
+inline std::string encoder_stats_file()
+{
+  const char* dir = getenv("TMPDIR");
+  std::string name = std::string(dir && *dir ? dir : "/tmp") + "/h26x-2pass-XXXXXX";
+  int fd = mkstemp(&name[0]);
+  if (fd < 0)
+    return "";
+  close(fd);
+  return name;
+}
+
+//removes _stats and the macroblock tree x264 writes next to it
+inline void encoder_stats_remove(const std::string& _stats)
+{
+  if (_stats.empty())
+    return;
+  std::remove(_stats.c_str());
+  std::remove((_stats + ".temp").c_str());
+  std::remove((_stats + ".mbtree").c_str());
+  std::remove((_stats + ".mbtree.temp").c_str());
+}
+
+inline void encoder_close(encoder_session& _session)
+{
+  if (_session.context) {
+    avcodec_close(_session.context);
+    av_free(_session.context);
+    _session.context = NULL;
+  }
+  if (_session.frame)
+    av_frame_free(&_session.frame);
+  if (_session.reserved) {
+    memory_release(MEMORY_ENCODE, _session.reserved);
+    _session.reserved = 0;
+  }
+}
+
+#endif /* _ENCODER_H_ */
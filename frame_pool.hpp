@@ -0,0 +1,234 @@
+#ifndef _FRAME_POOL_H_
+#define _FRAME_POOL_H_
+
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+
+#include <sys/mman.h>
+
+#include "numa_topology.hpp"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/buffer.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+}
+
+/*
+ * pooled, reference counted frame and packet buffers shared by all encoder
+ * and decoder sessions of a process: requests are rounded up to a size
+ * bucket, every bucket is an AVBufferPool, so a buffer that is unreferenced
+ * (av_frame_unref, av_free_packet) goes back to its bucket instead of to the
+ * allocator. All buffers and plane pointers are 64-byte aligned.
+ *
+ * With H26X_HUGEPAGES=1 buckets of 2 MiB and more are mmap'ed and advised
+ * as transparent hugepages, which saves page faults and TLB misses on
+ * large slices.
+ *
+ * On NUMA machines there is one such pool per node: a thread takes its
+ * buffers from the pool of the node it runs on, and new buffers are bound
+ * to that node (see numa_topology.hpp).
+ */
+
+static const size_t pool_alignment = 64;
+static const size_t pool_page = 4096;
+static const size_t pool_hugepage = 2 << 20;
+
+struct buffer_pool {
+  std::mutex mutex;
+  std::map<size_t, AVBufferPool*> buckets;
+  bool hugepages;
+  std::atomic<size_t> requests{0};   ///< buffers handed out
+  std::atomic<size_t> allocations{0}; ///< of which had to be allocated (pool misses)
+  std::atomic<size_t> allocated{0};   ///< bytes allocated by all buckets
+
+  buffer_pool() : mutex(), buckets(), hugepages(false)
+  {
+    const char* huge = std::getenv("H26X_HUGEPAGES");
+    hugepages = huge && *huge && std::strcmp(huge, "0") != 0;
+  }
+
+  //buffers still referenced elsewhere keep their pool alive until they return
+  ~buffer_pool()
+  {
+    for (std::map<size_t, AVBufferPool*>::iterator b = buckets.begin(); b != buckets.end(); ++b)
+      av_buffer_pool_uninit(&b->second);
+  }
+};
+
+//the pool of the calling thread's node
+inline buffer_pool& shared_buffer_pool()
+{
+  static std::deque<buffer_pool> pools(numa_nodes().size());
+  return pools[numa_thread_node()];
+}
+
+inline void pool_free_aligned(void*, uint8_t* _data)
+{
+  free(_data);
+}
+
+inline void pool_free_huge(void* _size, uint8_t* _data)
+{
+  munmap(_data, (size_t)_size);
+}
+
+//AVBufferPool allocators only get the size, so there is one per kind of arena
+inline AVBufferRef* pool_alloc_aligned(int _size)
+{
+  void* data = NULL;
+  //whole pages where they get bound to a node
+  if (posix_memalign(&data, numa_enabled() ? pool_page : pool_alignment, _size) != 0)
+    return NULL;
+  numa_prefer(data, _size, numa_thread_node());
+
+  AVBufferRef* buffer = av_buffer_create((uint8_t*)data, _size, pool_free_aligned, NULL, 0);
+  if (!buffer) {
+    free(data);
+    return NULL;
+  }
+  shared_buffer_pool().allocations.fetch_add(1);
+  shared_buffer_pool().allocated.fetch_add(_size);
+  return buffer;
+}
+
+inline AVBufferRef* pool_alloc_huge(int _size)
+{
+  void* data = mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (data == MAP_FAILED)
+    return NULL;
+#ifdef MADV_HUGEPAGE
+  madvise(data, _size, MADV_HUGEPAGE);
+#endif
+  numa_prefer(data, _size, numa_thread_node());
+
+  AVBufferRef* buffer = av_buffer_create((uint8_t*)data, _size, pool_free_huge, (void*)(size_t)_size, 0);
+  if (!buffer) {
+    munmap(data, _size);
+    return NULL;
+  }
+  shared_buffer_pool().allocations.fetch_add(1);
+  shared_buffer_pool().allocated.fetch_add(_size);
+  return buffer;
+}
+
+//size bucket of a request: whole pages, whole hugepages for large requests if enabled
+inline size_t pool_bucket(size_t _size, bool _hugepages)
+{
+  const size_t granule = (_hugepages && _size >= pool_hugepage) ? pool_hugepage : pool_page;
+  return (_size + granule - 1) / granule * granule;
+}
+
+//buffer of at least _size bytes, NULL if out of memory
+inline AVBufferRef* pool_buffer(size_t _size, buffer_pool& _pool = shared_buffer_pool())
+{
+  const size_t bucket = pool_bucket(_size, _pool.hugepages);
+  if (bucket > INT_MAX)
+    return NULL;
+
+  AVBufferPool* pool = NULL;
+  {
+    std::lock_guard<std::mutex> lock(_pool.mutex);
+    AVBufferPool*& slot = _pool.buckets[bucket];
+    if (!slot)
+      slot = av_buffer_pool_init(bucket, (_pool.hugepages && bucket >= pool_hugepage) ?
+                                 pool_alloc_huge : pool_alloc_aligned);
+    pool = slot;
+  }
+  if (!pool)
+    return NULL;
+
+  _pool.requests.fetch_add(1);
+  return av_buffer_pool_get(pool);
+}
+
+/*
+ * backs the planes of _frame with one pooled buffer for a picture of
+ * _width x _height in _format (rows padded to 64 bytes); width, height and
+ * format of the frame are left alone so that decoders can ask for padded
+ * dimensions; returns 0 on success
+ */
+inline int pool_image(AVFrame* _frame, int _width, int _height, AVPixelFormat _format,
+                      buffer_pool& _pool = shared_buffer_pool())
+{
+  const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(_format);
+  int linesize[4] = { 0, 0, 0, 0 };
+  if (!desc || (desc->flags & AV_PIX_FMT_FLAG_PAL) ||
+      av_image_fill_linesizes(linesize, _format, _width) < 0)
+    return 1;
+
+  size_t offset[4] = { 0, 0, 0, 0 };
+  size_t size = 0;
+  for (int p = 0; p < 4 && linesize[p]; ++p) {
+    linesize[p] = (linesize[p] + pool_alignment - 1) / pool_alignment * pool_alignment;
+    const int rows = (p == 1 || p == 2) ? -((-_height) >> desc->log2_chroma_h) : _height;
+    offset[p] = size;
+    //codecs may read a little past the last row (SIMD over-reads)
+    size += (size_t)linesize[p] * rows + pool_alignment;
+  }
+
+  AVBufferRef* buffer = pool_buffer(size, _pool);
+  if (!buffer)
+    return 1;
+
+  av_buffer_unref(&_frame->buf[0]);
+  _frame->buf[0] = buffer;
+  for (int p = 0; p < 4; ++p) {
+    _frame->data[p] = linesize[p] ? buffer->data + offset[p] : NULL;
+    _frame->linesize[p] = linesize[p];
+  }
+  return 0;
+}
+
+/*
+ * hands _packet a pooled buffer of _size bytes for the encoder to write
+ * into; the encoder fails instead of reallocating if the packet it produces
+ * does not fit, so _size has to be an upper bound (see encoder_packet_bound)
+ */
+inline int pool_packet(AVPacket* _packet, size_t _size, buffer_pool& _pool = shared_buffer_pool())
+{
+  AVBufferRef* buffer = pool_buffer(_size + FF_INPUT_BUFFER_PADDING_SIZE, _pool);
+  if (!buffer)
+    return 1;
+
+  _packet->buf = buffer;
+  _packet->data = buffer->data;
+  _packet->size = (int)_size;
+  return 0;
+}
+
+/*
+ * get_buffer2 callback that takes decoded pictures from the shared pool;
+ * codecs without direct rendering and formats we do not handle fall back to
+ * libav's own per-context pools
+ */
+inline int pool_get_buffer2(AVCodecContext* _context, AVFrame* _frame, int _flags)
+{
+  if (!(_context->codec->capabilities & CODEC_CAP_DR1))
+    return avcodec_default_get_buffer2(_context, _frame, _flags);
+
+  int width = _frame->width;
+  int height = _frame->height;
+  int linesize_align[AV_NUM_DATA_POINTERS];
+  avcodec_align_dimensions2(_context, &width, &height, linesize_align);
+
+  if (pool_image(_frame, width, height, (AVPixelFormat)_frame->format) != 0)
+    return avcodec_default_get_buffer2(_context, _frame, _flags);
+  return 0;
+}
+
+//decoded pictures of _context come from the shared pool from now on (call before avcodec_open2)
+inline void use_frame_pool(AVCodecContext* _context)
+{
+  _context->get_buffer2 = pool_get_buffer2;
+  _context->thread_safe_callbacks = 1;
+}
+
+#endif /* _FRAME_POOL_H_ */
@@ -1,67 +1,48 @@
+#include <stdio.h>
+#include <stdlib.h>
 
-#include <math.h>
+#include "h26xvol.h"
+#include "memory.h"
+#include "volume.h"
 
-#include <libavutil/opt.h>
-#include <libavcodec/avcodec.h>
-#include <libavutil/channel_layout.h>
-#include <libavutil/common.h>
-#include <libavutil/imgutils.h>
-#include <libavutil/mathematics.h>
-#include <libavutil/samplefmt.h>
+#define WIDTH 352
+#define HEIGHT 288
+#define DEPTH 25
 
-#define INBUF_SIZE 4096
+/* writes every packet the encoder has ready to f */
+static void write_packets(h26xvol_encoder *enc, FILE *f, int *packets, int64_t *bytes)
+{
+    h26xvol_packet pkt;
+    while (h26xvol_encoder_pull_packet(enc, &pkt) > 0) {
+        (*packets)++;
+        *bytes += pkt.size;
+        fwrite(pkt.data, 1, pkt.size, f);
+    }
+}
 
 /*
- * Video encoding example
+ * Video encoding example (on libh26xvol)
  */
-static void video_encode_example(const char *filename, int codec_id)
+static void video_encode_example(const char *filename, int codec)
 {
-    AVCodec *codec;
-    AVCodecContext *c= NULL;
-    int i, ret, x, y, got_output;
+    h26xvol_encoder_config config;
+    h26xvol_encoder *enc = NULL;
+    volume_generator gen;
+    uint8_t *slice, *cb, *cr;
+    int i, ret;
+    int packets = 0;
+    int64_t bytes = 0;
     FILE *f;
-    AVFrame *frame;
-    AVPacket pkt;
-
 
     printf("Encode video file %s\n", filename);
 
-    /* find the mpeg1 video encoder */
-    codec = avcodec_find_encoder(codec_id);
-    if (!codec) {
-        fprintf(stderr, "Codec not found\n");
-        exit(1);
-    }
-
-    c = avcodec_alloc_context3(codec);
-    if (!c) {
-        fprintf(stderr, "Could not allocate video codec context\n");
-        exit(1);
-    }
+    /* bit rate 400000, one intra frame every ten frames, 1 B frame */
+    h26xvol_encoder_config_default(&config, codec, WIDTH, HEIGHT);
+    config.preset = "ultrafast";
 
-    /* put sample parameters */
-    c->bit_rate = 400000;
-    /* resolution must be a multiple of two */
-    c->width = 352;
-    c->height = 288;
-    /* frames per second */
-    c->time_base = (AVRational){1,25};
-    /* emit one intra frame every ten frames
-     * check frame pict_type before passing frame
-     * to encoder, if frame->pict_type is AV_PICTURE_TYPE_I
-     * then gop_size is ignored and the output of encoder
-     * will always be I frame irrespective to gop_size
-     */
-    c->gop_size = 10;
-    c->max_b_frames = 1;
-    c->pix_fmt = AV_PIX_FMT_YUV420P;
-
-    if (codec_id == AV_CODEC_ID_HEVC)
-        av_opt_set(c->priv_data, "preset", "ultrafast", 0);
-
-    /* open it */
-    if (avcodec_open2(c, codec, NULL) < 0) {
-        fprintf(stderr, "Could not open codec\n");
+    ret = h26xvol_encoder_open(&enc, &config);
+    if (ret < 0) {
+        fprintf(stderr, "Could not open codec: %s\n", h26xvol_strerror(ret));
         exit(1);
     }
 
@@ -71,110 +52,55 @@ static void video_encode_example(const char *filename, int codec_id)
         exit(1);
     }
 
-    frame = av_frame_alloc();
-    if (!frame) {
-        fprintf(stderr, "Could not allocate video frame\n");
-        exit(1);
-    }
-    frame->format = c->pix_fmt;
-    frame->width  = c->width;
-    frame->height = c->height;
-
-    /* the image can be allocated by any means and av_image_alloc() is
-     * just the most convenient way if av_malloc() is to be used */
-    ret = av_image_alloc(frame->data, frame->linesize, c->width, c->height,
-                         c->pix_fmt, 32);
-    if (ret < 0) {
+    slice = malloc(WIDTH * HEIGHT * 3 / 2);
+    if (!slice) {
         fprintf(stderr, "Could not allocate raw picture buffer\n");
         exit(1);
     }
+    cb = slice + WIDTH * HEIGHT;
+    cr = cb + WIDTH * HEIGHT / 4;
+    memory_account(MEMORY_GENERATION, WIDTH * HEIGHT * 3 / 2);
 
-    /* encode 1 second of video */
-    for (i = 0; i < 25; i++) {
-        av_init_packet(&pkt);
-        pkt.data = NULL;    // packet data will be allocated by the encoder
-        pkt.size = 0;
+    volume_generator_init(&gen, VOLUME_STRIPES, WIDTH, HEIGHT, DEPTH, 0);
 
-        fflush(stdout);
+    /* encode 1 second of video */
+    for (i = 0; i < DEPTH; i++) {
         /* prepare a dummy image */
-        /* Y */
-	float offset = 0.f;
-	float ymin = 0;
-	float ymax = 0;
-        for (y = 0; y < c->height; y++) {
-	  
-	  offset = .05*(i/5)*c->height;
-	  ymin = (.1*c->height)+offset;
-	  ymax = (.13*c->height)+offset;
-	  for (x = 0; x < c->width; x++) {
-	      
-	    frame->data[0][y * frame->linesize[0] + x] = x + y + i * 3;
-	    if((y>ymin && y<ymax) &&
-	       (x % 4 < 2) && x<=(5*(i+1)))
-	      frame->data[0][(y) * frame->linesize[0] + x] = 16;
-	    
-            }
-        }
-
-        /* Cb and Cr */
-        for (y = 0; y < c->height/2; y++) {
-            for (x = 0; x < c->width/2; x++) {
-                frame->data[1][y * frame->linesize[1] + x] = 128 + y + i * 2;
-                frame->data[2][y * frame->linesize[2] + x] = 64 + x + i * 5;
-
-            }
-        }
-
-        frame->pts = i;
+        volume_fill_luma(&gen, i, slice, WIDTH);
+        volume_fill_chroma(&gen, i, cb, WIDTH / 2, cr, WIDTH / 2);
 
         /* encode the image */
-        ret = avcodec_encode_video2(c, &pkt, frame, &got_output);
+        ret = h26xvol_encoder_push_slice(enc, slice, WIDTH, cb, WIDTH / 2, cr, WIDTH / 2);
         if (ret < 0) {
-            fprintf(stderr, "Error encoding frame\n");
+            fprintf(stderr, "Error encoding frame: %s\n", h26xvol_strerror(ret));
             exit(1);
         }
-
-        if (got_output) {
-	  printf("Write frame %3d (size=%5d)\n", i,pkt.size);
-	  fwrite(pkt.data, 1, pkt.size, f);
-	  av_free_packet(&pkt);
-        }
+        write_packets(enc, f, &packets, &bytes);
     }
 
     /* get the delayed frames */
-    for (got_output = 1; got_output; i++) {
-        fflush(stdout);
-
-        ret = avcodec_encode_video2(c, &pkt, NULL, &got_output);
-        if (ret < 0) {
-            fprintf(stderr, "Error encoding frame\n");
-            exit(1);
-        }
-
-        if (got_output) {
-            printf("Write frame %3d (size=%5d) [delayed]\n", i, pkt.size);
-            fwrite(pkt.data, 1, pkt.size, f);
-            av_free_packet(&pkt);
-        }
+    ret = h26xvol_encoder_finish(enc);
+    if (ret < 0) {
+        fprintf(stderr, "Error encoding frame: %s\n", h26xvol_strerror(ret));
+        exit(1);
     }
+    write_packets(enc, f, &packets, &bytes);
 
-    /* add sequence end code to have a real mpeg file */
     fclose(f);
 
-    avcodec_close(c);
-    av_free(c);
-    av_freep(&frame->data[0]);
-    av_frame_free(&frame);
-    printf("\n");
+    h26xvol_encoder_close(enc);
+    free(slice);
+    memory_release(MEMORY_GENERATION, WIDTH * HEIGHT * 3 / 2);
+    printf("Wrote %d frames (%lld bytes) to %s\n", packets, (long long)bytes, filename);
 }
 
 int main(int argc, char **argv)
 {
 
-    /* register all the codecs */
-    avcodec_register_all();
+    /* register all the codecs, telemetry and memory accounting */
+    h26xvol_init();
+
+    video_encode_example("test.hevc", H26XVOL_HEVC);
 
-    video_encode_example("test.hevc", AV_CODEC_ID_HEVC);
-    
     return 0;
 }
@@ -0,0 +1,509 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "async_io.hpp"
+#include "h26xvol.h"
+#include "memory.h"
+#include "numa_topology.hpp"
+#include "ratecontrol.hpp"
+#include "thread_pool.hpp"
+#include "window.h"
+
+/*
+ * batch encoder: takes a manifest of raw yuv420p volumes (as written by
+ * dump_yuv) and encodes all of them from one process, one job per volume
+ * on a work-stealing pool; workers x codec threads is kept at the number
+ * of cores so that the pool and the codecs do not oversubscribe the machine
+ *
+ * on NUMA machines there is one pool per node with its workers pinned to
+ * the node; the volumes are dealt to the nodes by size, so each volume is
+ * read, converted and encoded in the memory of one node
+ *
+ * manifest, one volume per line ('#' starts a comment):
+ *   <input.yuv> <width>x<height> <output> [h264|hevc|h265] [<rate>] [window=<window>]
+ * with <rate> bitrate=<bit/s>, crf=<crf>, qp=<qp> or size=<bytes>[k|M|G]
+ * (see ratecontrol.hpp; target sizes are encoded in two passes)
+ *
+ * with a window the input is 16-bit little endian luma (gray16le) that is
+ * mapped to 8 bits on the way into the encoder (window.h), <window> is
+ *   <low>-<high>|auto|slice[:linear|log|gamma<gamma>]
+ * auto/slice take the 0.1 and 99.9 percentiles of the volume/of each slice;
+ * the windows used are written to <output>.window
+ *
+ * outputs named *.mp4 or *.mkv are muxed into that container (with the
+ * volume's size, bit depth and voxel=<x>,<y>,<z> in its tags) instead of
+ * being written as Annex-B
+ */
+
+enum batch_window {
+  BATCH_WINDOW_NONE,   ///< 8-bit yuv420p input
+  BATCH_WINDOW_FIXED,
+  BATCH_WINDOW_VOLUME, ///< percentiles of the whole volume, from a histogram pass
+  BATCH_WINDOW_SLICE   ///< percentiles of every slice
+};
+
+static const double window_lower = 0.001;
+static const double window_upper = 0.999;
+
+struct batch_job {
+  std::string input;
+  std::string output;
+  int width;
+  int height;
+  int codec;           ///< H26XVOL_H264 or H26XVOL_HEVC
+  rate_request rate;   ///< RATE_BITRATE with value 0: the library's default bit rate
+  int window;          ///< batch_window
+  h26xvol_window map;  ///< mapping, gamma and (fixed) range of 16-bit input
+  double voxel[3];     ///< voxel size, for the tags of MP4/Matroska outputs
+  size_t bytes_in;
+};
+
+//bytes of one input slice
+static size_t slice_bytes(const batch_job& _job)
+{
+  const size_t luma = (size_t)_job.width * _job.height;
+  return _job.window != BATCH_WINDOW_NONE ? luma * 2 : luma * 3 / 2;
+}
+
+//"<low>-<high>|auto|slice[:linear|log|gamma<gamma>]", returns 0 on success
+static int parse_window(const std::string& _spec, batch_job& _job)
+{
+  const size_t colon = _spec.find(':');
+  const std::string range = _spec.substr(0, colon);
+  const std::string mapping = colon == std::string::npos ? "linear" : _spec.substr(colon + 1);
+  unsigned low = 0, high = 0;
+
+  _job.map.gamma = 1;
+  if (mapping.compare(0, 5, "gamma") == 0) {
+    _job.map.mapping = H26XVOL_MAP_GAMMA;
+    _job.map.gamma = mapping.size() > 5 ? std::atof(mapping.c_str() + 5) : 2.2f;
+    if (_job.map.gamma <= 0)
+      return 1;
+  }
+  else if (mapping == "log")
+    _job.map.mapping = H26XVOL_MAP_LOG;
+  else if (mapping == "linear")
+    _job.map.mapping = H26XVOL_MAP_LINEAR;
+  else
+    return 1;
+
+  if (range == "auto")
+    _job.window = BATCH_WINDOW_VOLUME;
+  else if (range == "slice")
+    _job.window = BATCH_WINDOW_SLICE;
+  else if (sscanf(range.c_str(), "%u-%u", &low, &high) == 2 && low < high && high < 65536) {
+    _job.window = BATCH_WINDOW_FIXED;
+    _job.map.low = low;
+    _job.map.high = high;
+  }
+  else
+    return 1;
+  return 0;
+}
+
+struct batch_result {
+  int rcode;
+  int64_t slices;
+  int64_t bytes_out;
+  double seconds;
+};
+
+static void print_usage()
+{
+  std::cout << "usage: ./h26xbatch [-j <workers>] [-t <codec threads>] <manifest>\n"
+            << "encode every volume listed in <manifest> on a work-stealing thread pool\n"
+            << "manifest lines: <input.yuv> <width>x<height> <output> [h264|hevc|h265] [<rate>] [window=<window>]\n"
+            << "\t[voxel=<x>,<y>,<z>]; outputs named *.mp4 or *.mkv are muxed into that container\n"
+            << "<rate>: bitrate=<bit/s>, crf=<crf>, qp=<qp> or size=<bytes>[k|M|G] (two-pass)\n"
+            << "<window>: 16-bit gray input mapped to 8 bits,\n"
+            << "\t<low>-<high>|auto|slice[:linear|log|gamma<gamma>] (auto: volume percentiles)\n"
+            << "-j\tnumber of concurrent volumes (default: min(volumes, cores))\n"
+            << "-t\tthreads per encoder (default: cores / workers)\n";
+}
+
+static int read_manifest(const std::string& _fname, std::vector<batch_job>& _jobs)
+{
+  std::ifstream manifest(_fname.c_str());
+  if (!manifest.good()) {
+    std::cerr << "unable to open manifest " << _fname << "\n";
+    return 1;
+  }
+
+  std::string line;
+  int number = 0;
+  while (std::getline(manifest, line)) {
+    ++number;
+    line = line.substr(0, line.find('#'));
+    std::istringstream fields(line);
+    std::string size, option;
+    batch_job job = batch_job();
+    job.rate.mode = RATE_BITRATE;
+    job.rate.value = 0;
+    job.codec = H26XVOL_H264;
+    job.voxel[0] = job.voxel[1] = job.voxel[2] = 1.;
+    if (!(fields >> job.input))
+      continue;
+    if (!(fields >> size >> job.output) ||
+        sscanf(size.c_str(), "%dx%d", &job.width, &job.height) != 2 ||
+        job.width < 2 || job.height < 2 || (job.width | job.height) & 1) {
+      std::cerr << _fname << ":" << number << ": expected <input> <even width>x<even height> <output> [codec]\n";
+      return 1;
+    }
+    while (fields >> option) {
+      if (option == "h264" || option == "hevc" || option == "h265")
+        job.codec = option == "h264" ? H26XVOL_H264 : H26XVOL_HEVC;
+      else if (option.compare(0, 7, "window=") == 0) {
+        if (parse_window(option.substr(7), job) != 0) {
+          std::cerr << _fname << ":" << number << ": window " << option.substr(7) << " not understood\n";
+          return 1;
+        }
+      }
+      else if (option.compare(0, 6, "voxel=") == 0) {
+        if (sscanf(option.c_str() + 6, "%lf,%lf,%lf", &job.voxel[0], &job.voxel[1], &job.voxel[2]) != 3) {
+          std::cerr << _fname << ":" << number << ": voxel size " << option.substr(6) << " not understood\n";
+          return 1;
+        }
+      }
+      //a PSNR target needs the decoding probes of ratecontrol.hpp, which the library does not run
+      else if (rate_request_from_string(option, job.rate) != 0 || job.rate.mode == RATE_PSNR) {
+        std::cerr << _fname << ":" << number << ": rate " << option << " not understood\n";
+        return 1;
+      }
+    }
+
+    std::ifstream input(job.input.c_str(), std::ios::binary | std::ios::ate);
+    if (!input.good()) {
+      std::cerr << _fname << ":" << number << ": unable to open " << job.input << "\n";
+      return 1;
+    }
+    job.bytes_in = input.tellg();
+    _jobs.push_back(job);
+  }
+
+  return 0;
+}
+
+//reads one yuv420p slice (luma, Cb, Cr planes back to back)
+static bool read_slice(async_reader& _in, std::vector<uint8_t>& _slice)
+{
+  return _in.read(&_slice[0], _slice.size()) == _slice.size();
+}
+
+//the window of 16-bit slice _luma: fixed, or the percentiles of the slice
+static h26xvol_window slice_window(const batch_job& _job, const std::vector<uint16_t>& _luma,
+                                   std::vector<uint64_t>& _histogram)
+{
+  h26xvol_window window = _job.map;
+  if (_job.window == BATCH_WINDOW_SLICE) {
+    std::fill(_histogram.begin(), _histogram.end(), 0);
+    window_histogram_add(&_histogram[0], &_luma[0], _job.width, _job.width, _job.height);
+    window.low = window_histogram_percentile(&_histogram[0], window_lower);
+    window.high = window_histogram_percentile(&_histogram[0], window_upper);
+  }
+  return window;
+}
+
+//percentile window of the whole 16-bit volume in _in (rewound afterwards)
+static void volume_window(batch_job& _job, async_reader& _in)
+{
+  std::vector<uint64_t> histogram(65536, 0);
+  std::vector<uint16_t> luma((size_t)_job.width * _job.height);
+  while (_in.read(&luma[0], luma.size() * 2) == luma.size() * 2)
+    window_histogram_add(&histogram[0], &luma[0], _job.width, _job.width, _job.height);
+  _in.rewind();
+  _job.map.low = window_histogram_percentile(&histogram[0], window_lower);
+  _job.map.high = window_histogram_percentile(&histogram[0], window_upper);
+}
+
+//where the packets of the final pass go: the output file as is, or a container
+typedef std::function<void(const h26xvol_packet&)> batch_sink;
+
+/*
+ * one pass over the volume in _in; packets go to _out, or only get counted
+ * when _out is NULL (first pass); pass 1 leaves the name of its statistics
+ * file in _stats (pass 2 removes it);
+ * the window of every 16-bit slice goes to _windows if given
+ */
+static int encode_pass(const batch_job& _job, const h26xvol_encoder_config& _config, async_reader& _in,
+                       const batch_sink* _out,
+                       batch_result& _result, std::string* _stats = NULL, FILE* _windows = NULL)
+{
+  h26xvol_encoder* encoder = NULL;
+  int rcode = h26xvol_encoder_open(&encoder, &_config);
+  if (rcode != H26XVOL_OK)
+    return rcode;
+
+  const size_t luma = (size_t)_job.width * _job.height;
+  std::vector<uint8_t> slice(_job.window == BATCH_WINDOW_NONE ? luma * 3 / 2 : 0);
+  std::vector<uint16_t> slice16(_job.window != BATCH_WINDOW_NONE ? luma : 0);
+  std::vector<uint64_t> histogram(_job.window == BATCH_WINDOW_SLICE ? 65536 : 0);
+
+  _result.slices = 0;
+  _result.bytes_out = 0;
+  h26xvol_packet pkt;
+  auto drain = [&]() {
+    while (h26xvol_encoder_pull_packet(encoder, &pkt) > 0) {
+      if (_out)
+        (*_out)(pkt);
+      _result.bytes_out += pkt.size;
+    }
+  };
+
+  if (_job.window == BATCH_WINDOW_NONE) {
+    const uint8_t* cb = &slice[luma];
+    const uint8_t* cr = cb + luma / 4;
+    while (rcode == H26XVOL_OK && read_slice(_in, slice)) {
+      ++_result.slices;
+      rcode = h26xvol_encoder_push_slice(encoder, &slice[0], _job.width, cb, _job.width / 2, cr, _job.width / 2);
+      drain();
+    }
+  }
+  else {
+    //gray16le, read as is on little endian hosts
+    while (rcode == H26XVOL_OK && _in.read(&slice16[0], luma * 2) == luma * 2) {
+      const h26xvol_window window = slice_window(_job, slice16, histogram);
+      window_file_slice(_windows, (int)_result.slices, window.low, window.high);
+      ++_result.slices;
+      rcode = h26xvol_encoder_push_slice16(encoder, &slice16[0], _job.width, &window);
+      drain();
+    }
+  }
+  if (rcode == H26XVOL_OK)
+    rcode = h26xvol_encoder_finish(encoder);
+  drain();
+  if (_stats)
+    *_stats = h26xvol_encoder_stats(encoder);
+
+  h26xvol_encoder_close(encoder);
+  return rcode;
+}
+
+static void encode_job(batch_job _job, int _codec_threads, batch_result& _result)
+{
+  auto start = std::chrono::high_resolution_clock::now();
+  _result = batch_result();
+  _result.rcode = 1;
+
+  //reads run ahead of the encoder and packets are written behind it, see async_io.hpp
+  async_reader in;
+  if (in.open(_job.input) != 0) {
+    fprintf(stderr, "Could not open %s\n", _job.input.c_str());
+    return;
+  }
+
+  h26xvol_encoder_config config;
+  h26xvol_encoder_config_default(&config, _job.codec, _job.width, _job.height);
+
+  async_writer out;
+  h26xvol_muxer* muxer = NULL;
+  int mux_error = H26XVOL_OK;
+  const bool contained = h26xvol_muxer_supported(_job.output.c_str());
+  if (contained) {
+    h26xvol_volume_info volume;
+    volume.slices = (int)(_job.bytes_in / slice_bytes(_job));
+    volume.bit_depth = _job.window != BATCH_WINDOW_NONE ? 16 : 8;
+    for (int d = 0; d < 3; ++d)
+      volume.voxel_size[d] = _job.voxel[d];
+    mux_error = h26xvol_muxer_open(&muxer, _job.output.c_str(), &config, &volume);
+  }
+  if (contained ? mux_error != H26XVOL_OK : out.open(_job.output) != 0) {
+    fprintf(stderr, "Could not open %s\n", _job.output.c_str());
+    return;
+  }
+  //the slices are coded in order: sidecars of an earlier 4D or sparse stream do not apply
+  std::remove((_job.output + ".4d").c_str());
+  std::remove((_job.output + ".sparse").c_str());
+  batch_sink sink = [&](const h26xvol_packet& _pkt) {
+    if (muxer && mux_error == H26XVOL_OK)
+      mux_error = h26xvol_muxer_write(muxer, &_pkt);
+    else if (!muxer)
+      out.write(_pkt.data, _pkt.size);
+  };
+
+  config.threads = _codec_threads;
+  //with H26X_MEMORY_BUDGET set, jobs queue up here until enough sessions have finished
+  config.flags |= H26XVOL_WAIT_FOR_MEMORY;
+
+  if (_job.window == BATCH_WINDOW_VOLUME)
+    volume_window(_job, in);
+
+  int rcode = H26XVOL_OK;
+  std::string stats;
+  switch (_job.rate.mode) {
+  case RATE_CRF:
+    config.crf = _job.rate.value;
+    break;
+  case RATE_QP:
+    config.qp = (int)_job.rate.value;
+    break;
+  case RATE_SIZE: {
+    //the input size gives the depth, x264 spreads the bytes by the statistics of a first pass
+    config.bit_rate = h26xvol_bit_rate_for_size((uint64_t)_job.rate.value, (int)(_job.bytes_in / slice_bytes(_job)));
+    if (_job.codec == H26XVOL_H264) {
+      config.pass = 1;
+      rcode = encode_pass(_job, config, in, NULL, _result, &stats);
+      in.rewind();
+      config.pass = 2;
+      config.stats = stats.c_str();
+    }
+    break;
+  }
+  default:
+    if (_job.rate.value > 0)
+      config.bit_rate = (int)_job.rate.value;
+  }
+
+  //the mapping of every slice, for decoders that map back to 16 bits
+  FILE* windows = NULL;
+  if (_job.window != BATCH_WINDOW_NONE)
+    windows = window_file_open(_job.output.c_str(), _job.map.mapping, _job.map.gamma,
+                               (int)(_job.bytes_in / slice_bytes(_job)));
+
+  if (rcode == H26XVOL_OK)
+    rcode = encode_pass(_job, config, in, &sink, _result, NULL, windows);
+  if (rcode != H26XVOL_OK)
+    fprintf(stderr, "%s: %s\n", _job.output.c_str(), h26xvol_strerror(rcode));
+  _result.rcode = rcode != H26XVOL_OK;
+  if (windows && fclose(windows) != 0)
+    _result.rcode = 1;
+
+  in.close();
+  if (muxer && (h26xvol_muxer_close(muxer) != H26XVOL_OK || mux_error != H26XVOL_OK)) {
+    fprintf(stderr, "Could not write %s\n", _job.output.c_str());
+    _result.rcode = 1;
+  }
+  if (!muxer && out.close() != 0) {
+    fprintf(stderr, "Could not write %s\n", _job.output.c_str());
+    _result.rcode = 1;
+  }
+
+  auto end = std::chrono::high_resolution_clock::now();
+  _result.seconds = std::chrono::duration<double>(end - start).count();
+}
+
+int main(int argc, char **argv)
+{
+  int workers = 0;
+  int codec_threads = 0;
+  std::string manifest;
+
+  for (int a = 1; a < argc; ++a) {
+    std::string arg = argv[a];
+    if (arg == "-j" && a + 1 < argc)
+      workers = std::atoi(argv[++a]);
+    else if (arg == "-t" && a + 1 < argc)
+      codec_threads = std::atoi(argv[++a]);
+    else
+      manifest = arg;
+  }
+
+  if (manifest.empty()) {
+    print_usage();
+    return 1;
+  }
+
+  std::vector<batch_job> jobs;
+  if (read_manifest(manifest, jobs) != 0)
+    return 1;
+  if (jobs.empty()) {
+    std::cerr << "nothing to do in " << manifest << "\n";
+    return 0;
+  }
+
+  const int cores = std::max(1u, std::thread::hardware_concurrency());
+  if (workers < 1)
+    workers = std::min<int>(jobs.size(), cores);
+  if (codec_threads < 1)
+    codec_threads = std::max(1, cores / workers);
+
+  //largest volumes first, the small ones fill the gaps at the end
+  std::vector<size_t> order(jobs.size());
+  for (size_t j = 0; j < jobs.size(); ++j)
+    order[j] = j;
+  std::stable_sort(order.begin(), order.end(), [&jobs](size_t _a, size_t _b) {
+      return jobs[_a].bytes_in > jobs[_b].bytes_in;
+    });
+
+  /* register all the codecs, once for the whole batch */
+  h26xvol_init();
+
+  std::vector<batch_result> results(jobs.size());
+  std::mutex report;
+
+  //largest volumes first, each to the node with the fewest bytes per worker so far
+  const int nodes = (int)numa_nodes().size();
+  std::vector<int> node_workers(nodes);
+  std::vector<double> node_bytes(nodes, 0);
+  std::vector<std::vector<size_t> > node_jobs(nodes);
+  for (int n = 0; n < nodes; ++n)
+    node_workers[n] = std::min(numa_share(n, workers), (int)jobs.size());
+  for (size_t n = 0; n < order.size(); ++n) {
+    int node = 0;
+    for (int m = 1; m < nodes; ++m)
+      if (node_bytes[m] / node_workers[m] < node_bytes[node] / node_workers[node])
+        node = m;
+    node_bytes[node] += jobs[order[n]].bytes_in;
+    node_jobs[node].push_back(order[n]);
+  }
+
+  auto start = std::chrono::high_resolution_clock::now();
+  size_t steals = 0;
+  {
+    std::vector<std::unique_ptr<work_stealing_pool> > pools;
+    for (int n = 0; n < nodes; ++n) {
+      if (node_jobs[n].empty())
+        continue;
+      pools.push_back(std::unique_ptr<work_stealing_pool>(
+          new work_stealing_pool(node_workers[n], [n](unsigned) { numa_pin(n); })));
+      for (size_t j : node_jobs[n])
+        pools.back()->submit([&, j, n]() {
+            encode_job(jobs[j], codec_threads, results[j]);
+            numa_count(n, results[j].slices, results[j].bytes_out, (uint64_t)(results[j].seconds * 1e9));
+            std::lock_guard<std::mutex> lock(report);
+            std::cout << jobs[j].output << ": " << results[j].slices << " slices, "
+                      << results[j].bytes_out << "B in " << results[j].seconds << " s"
+                      << (results[j].rcode ? " FAILED" : "") << "\n";
+          });
+    }
+    for (size_t p = 0; p < pools.size(); ++p) {
+      pools[p]->wait();
+      steals += pools[p]->steals();
+    }
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  double seconds = std::chrono::duration<double>(end - start).count();
+
+  int failed = 0;
+  int64_t slices = 0, bytes_out = 0;
+  size_t bytes_in = 0;
+  for (size_t j = 0; j < jobs.size(); ++j) {
+    failed += results[j].rcode != 0;
+    slices += results[j].slices;
+    bytes_out += results[j].bytes_out;
+    bytes_in += jobs[j].bytes_in;
+  }
+
+  std::cout << jobs.size() << " volumes (" << failed << " failed) on " << workers
+            << " workers x " << codec_threads << " codec threads, " << steals << " steals\n"
+            << slices << " slices in " << seconds << " s: " << slices / seconds << " slices/s, "
+            << bytes_in / seconds / (1 << 20) << " MiB/s in, "
+            << bytes_out / seconds / (1 << 20) << " MiB/s out\n"
+            << "peak RSS " << memory_peak_rss() / (1 << 20) << " MiB";
+  if (memory.budget)
+    std::cout << ", budget " << (memory.budget >> 20) << " MiB, " << memory.waits << " jobs waited";
+  std::cout << "\n";
+  numa_report(std::cout, seconds);
+
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,236 @@
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "nal_edit.hpp"
+#include "checksum.hpp"
+#include "window.h"
+
+/*
+ * cuts slice ranges out of Annex-B H.264/HEVC streams and joins streams,
+ * both in the compressed domain: access units are copied, not re-encoded
+ */
+
+static void print_usage()
+{
+  std::cout << "usage: ./h26xcut -x <first>-<last> <stream> <output>\n"
+            << "       ./h26xcut -j <output> <stream> <stream>...\n"
+            << "-x\tcopy slices <first> to <last> (inclusive) of <stream> to <output>, starting\n"
+            << "\tat the nearest IDR before them; the slices to drop after decoding are\n"
+            << "\trecorded in <output>.trim\n"
+            << "-j\tappend streams that start with a closed GOP to <output>\n"
+            << "the .crc and .window sidecars of the inputs are carried over\n";
+}
+
+struct mapped_stream {
+  const uint8_t* data;
+  size_t size;
+};
+
+static int map_stream(const std::string& _name, mapped_stream& _stream)
+{
+  int fd = open(_name.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "unable to open " << _name << "\n";
+    return 1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    std::cerr << "unable to stat " << _name << " or empty file\n";
+    close(fd);
+    return 1;
+  }
+
+  _stream.size = st.st_size;
+  void* mapped = mmap(NULL, _stream.size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    std::cerr << "unable to map " << _name << "\n";
+    return 1;
+  }
+  madvise(mapped, _stream.size, MADV_SEQUENTIAL);
+  _stream.data = (const uint8_t*)mapped;
+  return 0;
+}
+
+static int index_stream(const std::string& _name, const mapped_stream& _stream, nal_stream& _indexed)
+{
+  _indexed.data = _stream.data;
+  _indexed.size = _stream.size;
+  scan_nal_stream(_stream.data, _stream.size, _indexed.scan);
+  if (_indexed.scan.codec == NAL_CODEC_UNKNOWN || _indexed.scan.pictures.empty()) {
+    std::cerr << _name << " does not look like an H.264/HEVC Annex-B stream\n";
+    return 1;
+  }
+  if (nal_trim_read(_name, _indexed.trim) != 0) {
+    std::cerr << "invalid " << nal_trim_path(_name) << "\n";
+    return 1;
+  }
+  return 0;
+}
+
+static int write_stream(const std::string& _name, const std::vector<nal_segment>& _segments, const nal_trim& _trim)
+{
+  FILE* out = fopen(_name.c_str(), "wb");
+  if (!out) {
+    std::cerr << "unable to open " << _name << "\n";
+    return 1;
+  }
+  int rcode = nal_write_segments(_segments, out);
+  rcode |= fclose(out) != 0;
+  rcode |= nal_trim_write(_name, _trim);
+  if (rcode)
+    std::cerr << "unable to write " << _name << "\n";
+  return rcode;
+}
+
+/*
+ * sidecars: the output holds slices [_firsts[k], _firsts[k] + _counts[k])
+ * of every input k in turn; if an input has no sidecar, neither has the output
+ */
+static void carry_sidecars(const std::vector<std::string>& _inputs, const std::vector<int>& _firsts,
+                           const std::vector<int>& _counts, const std::string& _output)
+{
+  //4D and sparse layouts are not carried over, stale ones of an earlier output would misnumber the slices
+  std::remove((_output + ".4d").c_str());
+  std::remove((_output + ".sparse").c_str());
+
+  slice_checksums sums = slice_checksums();
+  bool crc = true;
+  for (size_t k = 0; k < _inputs.size() && crc; ++k) {
+    slice_checksums input;
+    crc = checksums_read(_inputs[k], input) == 0 && _firsts[k] + _counts[k] <= (int)input.decoded.size() &&
+      (k == 0 || (input.width == sums.width && input.height == sums.height));
+    sums.width = input.width;
+    sums.height = input.height;
+    for (int s = _firsts[k]; crc && s < _firsts[k] + _counts[k]; ++s) {
+      sums.decoded.push_back(input.decoded[s]);
+      sums.source.push_back(input.source[s]);
+    }
+  }
+  if (!crc)
+    std::remove(checksum_path(_output).c_str());
+  else if (checksums_write(_output, sums) != 0)
+    std::cerr << "unable to write " << checksum_path(_output) << "\n";
+
+  static window_map map;
+  std::vector<uint16_t> lows, highs;
+  int mapping = -1;
+  float gamma = 0;
+  for (size_t k = 0; k < _inputs.size(); ++k) {
+    const int slices = window_file_read(_inputs[k].c_str(), &map, NULL, NULL, 0);
+    if (slices < _firsts[k] + _counts[k] || (k > 0 && (map.mapping != mapping || map.gamma != gamma))) {
+      std::remove((_output + ".window").c_str());
+      return;
+    }
+    mapping = map.mapping;
+    gamma = map.gamma;
+    std::vector<uint16_t> low(slices), high(slices);
+    window_file_read(_inputs[k].c_str(), &map, low.data(), high.data(), slices);
+    lows.insert(lows.end(), low.begin() + _firsts[k], low.begin() + _firsts[k] + _counts[k]);
+    highs.insert(highs.end(), high.begin() + _firsts[k], high.begin() + _firsts[k] + _counts[k]);
+  }
+
+  FILE* windows = window_file_open(_output.c_str(), mapping, gamma, (int)lows.size());
+  for (size_t s = 0; s < lows.size(); ++s)
+    window_file_slice(windows, (int)s, lows[s], highs[s]);
+  if (!windows || fclose(windows) != 0)
+    std::cerr << "unable to write " << _output << ".window\n";
+}
+
+static int extract(const std::string& _range, const std::string& _input, const std::string& _output)
+{
+  int first = 0, last = -1;
+  if (sscanf(_range.c_str(), "%d-%d", &first, &last) != 2 || first < 0 || last < first) {
+    std::cerr << "invalid slice range " << _range << "\n";
+    return 1;
+  }
+
+  mapped_stream mapped;
+  if (map_stream(_input, mapped) != 0)
+    return 1;
+
+  nal_stream stream;
+  std::vector<nal_segment> segments;
+  nal_trim trim;
+  int rcode = index_stream(_input, mapped, stream);
+  if (!rcode && nal_plan_extract(stream.data, stream.scan, stream.trim, first, last - first + 1, segments, trim) != 0) {
+    std::cerr << "slices " << _range << " are not in " << _input << " or no IDR precedes them\n";
+    rcode = 1;
+  }
+  if (!rcode)
+    rcode = write_stream(_output, segments, trim);
+
+  if (!rcode) {
+    size_t bytes = 0;
+    for (const nal_segment& segment : segments)
+      bytes += segment.size;
+    std::cerr << _output << ": slices " << first << " to " << last << ", " << bytes << " bytes"
+              << (trim.ranges.empty() ? "\n" : ", decoders drop the extra slices listed in " + nal_trim_path(_output) + "\n");
+    carry_sidecars(std::vector<std::string>(1, _input), std::vector<int>(1, first),
+                   std::vector<int>(1, last - first + 1), _output);
+  }
+
+  munmap(const_cast<uint8_t*>(mapped.data), mapped.size);
+  return rcode;
+}
+
+static int join(const std::string& _output, const std::vector<std::string>& _inputs)
+{
+  std::vector<mapped_stream> mapped;
+  std::vector<nal_stream> streams(_inputs.size());
+  std::vector<int> firsts, counts;
+  int rcode = 0;
+  for (size_t k = 0; k < _inputs.size() && !rcode; ++k) {
+    mapped_stream input;
+    rcode = map_stream(_inputs[k], input);
+    if (rcode)
+      break;
+    mapped.push_back(input);
+    rcode = index_stream(_inputs[k], input, streams[k]);
+    firsts.push_back(0);
+    counts.push_back(nal_trim_slices(streams[k].trim, (int)streams[k].scan.pictures.size()));
+  }
+
+  std::vector<nal_segment> segments;
+  nal_trim trim;
+  std::string error;
+  if (!rcode && nal_plan_join(streams, segments, trim, error) != 0) {
+    std::cerr << "unable to join: " << error << "\n";
+    rcode = 1;
+  }
+  if (!rcode)
+    rcode = write_stream(_output, segments, trim);
+  if (!rcode) {
+    int slices = 0;
+    for (int count : counts)
+      slices += count;
+    std::cerr << _output << ": " << _inputs.size() << " streams, " << slices << " slices\n";
+    carry_sidecars(_inputs, firsts, counts, _output);
+  }
+
+  for (const mapped_stream& input : mapped)
+    munmap(const_cast<uint8_t*>(input.data), input.size);
+  return rcode;
+}
+
+int main(int argc, char **argv)
+{
+  std::vector<std::string> args(argv + 1, argv + argc);
+
+  if (args.size() == 4 && args[0] == "-x")
+    return extract(args[1], args[2], args[3]);
+  if (args.size() >= 4 && args[0] == "-j")
+    return join(args[1], std::vector<std::string>(args.begin() + 2, args.end()));
+
+  print_usage();
+  return 1;
+}
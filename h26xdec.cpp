@@ -3,6 +3,12 @@
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <vector>
+#include <thread>
 
 extern "C"
 {
@@ -12,9 +18,258 @@ extern "C"
 #include <libswscale/swscale.h>
 };
 
+#include "utils.hpp"
+#include "async_io.hpp"
+#include "checksum.hpp"
+#include "decoder.hpp"
+#include "nal_edit.hpp"
+#include "sparse.hpp"
+#include "timeseries.hpp"
+#include "window.h"
+#include "preview.hpp"
+#include "frame_pool.hpp"
+#include "telemetry.h"
+#include "h26xvol.h"
+
+static void print_usage()
+{
+    std::cout << "usage: ./h26xdec [-p <factor>] [-V] [-16] [-j <threads>] [-r <first>-<last>] <stream>\n"
+              << "decode every slice of <stream> to <stream>-slice<n>.ppm\n"
+              << "and check it against the checksums in <stream>.crc if present;\n"
+              << "slices a <stream>.trim (see h26xcut) does not keep are decoded but dropped,\n"
+              << "4D streams with a <stream>.4d go to <stream>-t<timepoint>-slice<n>.ppm,\n"
+              << "slices a <stream>.sparse (see roundtrip -Z) left out are filled in\n"
+              << "-V\tverify only, write no ppm files\n"
+              << "-16\tmap the slices back to 16 bits with <stream>.window (see h26xbatch),\n"
+              << "\tslices are written to <stream>-slice<n>.pgm\n"
+              << "-j\tdecode the closed GOPs of an Annex-B stream in parallel, each on its own\n"
+              << "\tdecoder instance (0: one thread per core)\n"
+              << "-r\tdecode slices <first> to <last> only; MP4/Matroska streams (see h26xbatch)\n"
+              << "\tseek to the keyframe before <first> through their index\n"
+              << "-p\tpreview: decode keyframes only and box filter them down by <factor> (1-16),\n"
+              << "\tslices are written to <stream>-preview-slice<n>.ppm\n";
+}
+
+
+/*
+ * decodes an Annex-B stream with h26xvol_decode_parallel into one volume and
+ * hands its slices to _sink in order; returns the number of slices, or -1
+ * without handing on any if a GOP of the stream failed to decode
+ */
+static int decode_parallel(const std::string& _fname, int _threads, int& _width, int& _height,
+                           const std::function<void(const uint8_t*, int, int)>& _sink)
+{
+    std::vector<uint8_t> stream;
+    if (async_read_file(_fname, stream) != 0)
+    {
+        std::cerr << "unable to read " << _fname << "\n";
+        return -1;
+    }
+
+    h26xvol_init();
+    h26xvol_decoder* decoder = NULL;
+    h26xvol_stream_info info;
+    int rcode = h26xvol_decoder_open(&decoder, &stream[0], stream.size());
+    if (rcode != H26XVOL_OK)
+    {
+        std::cerr << _fname << ": " << h26xvol_strerror(rcode) << "\n";
+        return -1;
+    }
+    h26xvol_decoder_info(decoder, &info);
+    _width = info.width;
+    _height = info.height;
+
+    const size_t slice_size = (size_t)info.width * info.height;
+    std::vector<uint8_t> volume(slice_size * info.slices);
+    memory_account(MEMORY_DECODE, volume.size());
+    rcode = h26xvol_decode_parallel(decoder, 0, info.slices, &volume[0], info.width, slice_size, _threads);
+    h26xvol_decoder_close(decoder);
+    if (rcode < 0)
+    {
+        std::cerr << _fname << ": " << h26xvol_strerror(rcode) << "\n";
+        memory_release(MEMORY_DECODE, volume.size());
+        return -1;
+    }
+    for (int s = 0; s < rcode; ++s)
+        _sink(&volume[s * slice_size], info.width, s);
+    memory_release(MEMORY_DECODE, volume.size());
+    return rcode;
+}
 
 int main(int argc, char **argv)
 {
+    std::string fname;
+    int preview_factor = 0;
+    bool dump_slices = true;
+    bool sixteen_bit = false;
+    int threads = 0;
+    int range_first = 0, range_last = -1;
+    for (int a = 1; a < argc; ++a)
+    {
+        std::string arg = argv[a];
+        if (arg == "-p" && a + 1 < argc)
+            preview_factor = std::atoi(argv[++a]);
+        else if (arg == "-V")
+            dump_slices = false;
+        else if (arg == "-16")
+            sixteen_bit = true;
+        else if (arg == "-r" && a + 1 < argc)
+        {
+            if (sscanf(argv[++a], "%d-%d", &range_first, &range_last) != 2 || range_first < 0 ||
+                range_last < range_first)
+            {
+                std::cerr << "invalid slice range " << argv[a] << "\n";
+                return 1;
+            }
+        }
+        else if (arg == "-j" && a + 1 < argc)
+        {
+            threads = std::atoi(argv[++a]);
+            if (threads == 0)
+                threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        else
+            fname = arg;
+    }
+
+    if (fname.empty())
+    {
+        print_usage();
+        return 1;
+    }
+
+    telemetry_init();
+    memory_init();
+
+    if (preview_factor > 0)
+    {
+        preview_volume preview;
+        if (decode_preview_file(fname, preview_factor, preview) != 0)
+            return 1;
+
+        const size_t slice_size = (size_t)preview.width * preview.height;
+        for (size_t s = 0; s < preview.slices.size(); ++s)
+        {
+            savePlane(&preview.voxels[s * slice_size], preview.width, preview.width, preview.height,
+                      preview.slices[s], fname + "-preview");
+            std::cout << s << ":\tslice: " << preview.slices[s]
+                      << "\t" << preview.width << "x" << preview.height << '\n';
+        }
+        return 0;
+    }
+
+    checksum_verifier verifier;
+    checksum_verifier_open(verifier, fname);
+
+    //windows of the 16-bit source slices, mapped back through a table per slice
+    static window_map inverse;
+    std::vector<uint16_t> lows, highs;
+    if (sixteen_bit)
+    {
+        int slices = window_file_read(fname.c_str(), &inverse, NULL, NULL, 0);
+        if (slices < 0)
+        {
+            std::cerr << "no valid " << fname << ".window to map back to 16 bits\n";
+            return 1;
+        }
+        lows.resize(slices);
+        highs.resize(slices);
+        window_file_read(fname.c_str(), &inverse, lows.data(), highs.data(), slices);
+    }
+
+    nal_trim trim;
+    if (nal_trim_read(fname, trim) != 0)
+    {
+        std::cerr << "invalid " << nal_trim_path(fname) << "\n";
+        return 1;
+    }
+
+    //4D streams (see roundtrip -T): coded pictures are (timepoint, slice) pairs
+    timeseries_layout timeseries;
+    const bool four_d = timeseries_read_layout(fname, timeseries) == 0;
+
+    int kept = 0;
+    int width = 0, height = 0;
+    auto write_slice = [&](const uint8_t* _data, int _linesize, int _decoded) {
+        const int number = nal_trim_slice(trim, _decoded);
+        if (number < 0)
+            return;
+        ++kept;
+        checksum_verify(verifier, number, _data, _linesize, width, height);
+        if (!dump_slices)
+            return;
+        if (four_d && number < timeseries_pictures(timeseries))
+        {
+            int t = 0, z = 0;
+            timeseries_position(timeseries, number, t, z);
+            savePlane(_data, _linesize, width, height, z, fname + "-t" + std::to_string(t));
+            return;
+        }
+        if (!sixteen_bit || (size_t)number >= lows.size())
+        {
+            savePlane(_data, _linesize, width, height, number, fname);
+            return;
+        }
+        uint16_t lut[256];
+        inverse.low = lows[number];
+        inverse.high = highs[number];
+        for (int v = 0; v < 256; ++v)
+            lut[v] = window_invert(&inverse, v);
+        savePlane16(_data, _linesize, width, height, lut, number, fname);
+    };
+
+    //sparse streams: the coded pictures are not the slices, the left out ones are filled in
+    sparse_map sparse;
+    if (sparse_read_map(fname, sparse) == 0)
+    {
+        int decoded = 0, synthesized = 0;
+        const int rcode = decode_file_sparse(fname, sparse, [&](const AVFrame* frame, int slice) {
+                width = frame->width;
+                height = frame->height;
+                write_slice(frame->data[0], frame->linesize[0], slice);
+                ++decoded;
+            }, &synthesized);
+        std::cerr << decoded << " slices of " << fname << ", " << synthesized << " of them filled in";
+        if (range_last >= 0 || threads > 0)
+            std::cerr << " (sparse streams are decoded whole on one thread)";
+        std::cerr << "\n";
+        int mismatch = verifier.available ? checksum_report(verifier, fname, std::cerr) : 0;
+        return rcode != 0 || mismatch;
+    }
+
+    if (range_last >= 0)
+    {
+        int decoded = 0;
+        const int rcode = decode_file_range(fname, range_first, range_last - range_first + 1,
+                                            [&](const AVFrame* frame, int slice) {
+                                                width = frame->width;
+                                                height = frame->height;
+                                                write_slice(frame->data[0], frame->linesize[0], slice);
+                                                ++decoded;
+                                            });
+        std::cerr << decoded << " frames decoded from " << fname << " (slices " << range_first << " to "
+                  << range_last << ")";
+        if (verifier.available)
+            std::cerr << ", " << verifier.mismatches << " differ from the checksums";
+        std::cerr << "\n";
+        return rcode != 0 || verifier.mismatches > 0;
+    }
+
+    if (threads > 0)
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        int decoded = decode_parallel(fname, threads, width, height, write_slice);
+        if (decoded < 0)
+            return 1;
+        auto end = std::chrono::high_resolution_clock::now();
+        std::cerr << decoded << " frames decoded from " << fname << " on " << threads << " threads";
+        if (!trim.ranges.empty())
+            std::cerr << ", " << kept << " kept";
+        std::cerr << "\n";
+        numa_report(std::cerr, std::chrono::duration<double>(end - start).count());
+        return verifier.available ? checksum_report(verifier, fname, std::cerr) : 0;
+    }
+
     av_register_all();
     AVFrame* frame = avcodec_alloc_frame();
     if (!frame)
@@ -23,7 +278,7 @@ int main(int argc, char **argv)
     }
 
     AVFormatContext* formatContext = NULL;
-    if (avformat_open_input(&formatContext, argv[1], NULL, NULL) != 0)
+    if (avformat_open_input(&formatContext, fname.c_str(), NULL, NULL) != 0)
     {
         av_free(frame);
         return 1;
@@ -47,6 +302,7 @@ int main(int argc, char **argv)
     AVStream* stream = formatContext->streams[0];
     AVCodecContext* codecContext = stream->codec;
 
+    use_frame_pool(codecContext);
     codecContext->codec = avcodec_find_decoder(codecContext->codec_id);
     if (codecContext->codec == NULL)
     {
@@ -63,6 +319,9 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    width = codecContext->width;
+    height = codecContext->height;
+
     AVPacket packet;
     av_init_packet(&packet);
 
@@ -74,14 +333,14 @@ int main(int argc, char **argv)
         if (packet.stream_index == stream->index)
         {
             int frameFinished = 0;
+            uint64_t start = telemetry_start();
             avcodec_decode_video2(codecContext, frame, &frameFinished, &packet);
 
             if (frameFinished)
             {
-	      saveFrame(frame, codecContext->width, codecContext->height, frameNumber++,argv[1]);
-                std::cout << frameNumber << ":\trepeat: " << frame->repeat_pict
-                      << "\tkeyframe: " << frame->key_frame
-                      << "\tbest_ts: " << frame->best_effort_timestamp << '\n';
+                telemetry_record_frame('D', frameNumber, frame->best_effort_timestamp, start, 0,
+                                       packet.size, frame->pict_type, -1);
+	      write_slice(frame->data[0], frame->linesize[0], frameNumber++);
             }
         }
     }
@@ -92,6 +351,7 @@ int main(int argc, char **argv)
 
       packet.data = NULL;
       packet.size = 0;
+      uint64_t start = telemetry_start();
       int rcode = avcodec_decode_video2(codecContext, frame, &frameFinished, &packet);
       if(rcode < 0 ){
 	std::cerr << "[delayed]\tdecide error detected\n";
@@ -100,16 +360,21 @@ int main(int argc, char **argv)
       
       if (frameFinished)
 	{
-	  saveFrame(frame, codecContext->width, codecContext->height, frameNumber++,argv[1]);
-	  std::cout << frameNumber << ":\trepeat: " << frame->repeat_pict
-		<< "\tkeyframe: " << frame->key_frame
-		<< "\tbest_ts: " << frame->best_effort_timestamp << "[delayed]\n";
+	  telemetry_record_frame('D', frameNumber, frame->best_effort_timestamp, start, 0,
+				 0, frame->pict_type, -1);
+	  write_slice(frame->data[0], frame->linesize[0], frameNumber++);
 	}
     }
     
+    std::cerr << frameNumber << " frames decoded from " << fname;
+    if (!trim.ranges.empty())
+        std::cerr << ", " << kept << " kept";
+    std::cerr << "\n";
+    int mismatch = verifier.available ? checksum_report(verifier, fname, std::cerr) : 0;
+
     av_free_packet(&packet);
     av_free(frame);
     avcodec_close(codecContext);
     avformat_close_input(&formatContext);
-    return 0;
+    return mismatch;
 }
@@ -0,0 +1,127 @@
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "nal_scan.hpp"
+
+/*
+ * scans an Annex-B H.264/HEVC stream without decoding it and reports
+ * one line per coded picture (decode order): byte range, type, POC, keyframe
+ */
+
+static void print_usage()
+{
+  std::cout << "usage: ./h26xscan [-o <index.csv>] [-q] [-c h264|hevc] <stream>\n"
+            << "index an Annex-B elementary stream in the compressed domain\n"
+            << "-o\twrite the picture index as CSV to the given file\n"
+            << "-q\tdo not print the picture table, only the summary\n"
+            << "-c\tforce the codec instead of detecting it from the parameter sets\n";
+}
+
+int main(int argc, char **argv)
+{
+  std::string index_name;
+  std::string stream_name;
+  bool quiet = false;
+  nal_codec codec = NAL_CODEC_UNKNOWN;
+
+  for (int a = 1; a < argc; ++a) {
+    std::string arg = argv[a];
+    if (arg == "-o" && a + 1 < argc)
+      index_name = argv[++a];
+    else if (arg == "-q")
+      quiet = true;
+    else if (arg == "-c" && a + 1 < argc) {
+      std::string name = argv[++a];
+      codec = name.find("hevc") != std::string::npos ? NAL_CODEC_HEVC : NAL_CODEC_H264;
+    }
+    else
+      stream_name = arg;
+  }
+
+  if (stream_name.empty()) {
+    print_usage();
+    return 1;
+  }
+
+  //map the stream so that the scan runs straight off the page cache
+  int fd = open(stream_name.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "unable to open " << stream_name << "\n";
+    return 1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    std::cerr << "unable to stat " << stream_name << " or empty file\n";
+    close(fd);
+    return 1;
+  }
+
+  size_t size = st.st_size;
+  void* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    std::cerr << "unable to map " << stream_name << "\n";
+    return 1;
+  }
+  madvise(mapped, size, MADV_SEQUENTIAL);
+
+  auto start = std::chrono::high_resolution_clock::now();
+  nal_scan_result result;
+  scan_nal_stream((const uint8_t*)mapped, size, result, codec);
+  auto end = std::chrono::high_resolution_clock::now();
+  double seconds = std::chrono::duration<double>(end - start).count();
+
+  munmap(mapped, size);
+
+  if (result.codec == NAL_CODEC_UNKNOWN) {
+    std::cerr << stream_name << " does not look like an H.264/HEVC Annex-B stream\n";
+    return 1;
+  }
+
+  if (!quiet) {
+    std::cout << "#pic\toffset\tsize\tnal\ttype\tpoc\tkey\tslices\n";
+    for (const nal_picture& pic : result.pictures)
+      std::cout << pic.index << '\t' << pic.start << '\t' << pic.end - pic.start
+                << '\t' << pic.nal_type << '\t' << pic.type << '\t' << pic.poc
+                << '\t' << pic.keyframe << '\t' << pic.slices << '\n';
+  }
+
+  if (!index_name.empty()) {
+    std::ofstream index(index_name.c_str(), std::ios_base::trunc | std::ios_base::out);
+    if (!index.good()) {
+      std::cerr << "unable to open " << index_name << "\n";
+      return 1;
+    }
+    index << "picture,offset,size,nal_type,type,poc,keyframe,slices\n";
+    for (const nal_picture& pic : result.pictures)
+      index << pic.index << ',' << pic.start << ',' << pic.end - pic.start
+            << ',' << pic.nal_type << ',' << pic.type << ',' << pic.poc
+            << ',' << pic.keyframe << ',' << pic.slices << '\n';
+  }
+
+  size_t counts[3] = { 0, 0, 0 };
+  size_t keyframes = 0;
+  for (const nal_picture& pic : result.pictures) {
+    counts[pic.type == 'I' ? 0 : (pic.type == 'P' ? 1 : 2)]++;
+    keyframes += pic.keyframe;
+  }
+
+  std::cerr << stream_name << ": " << (result.codec == NAL_CODEC_HEVC ? "hevc" : "h264")
+            << " " << result.width << "x" << result.height
+            << ", " << result.units.size() << " NAL units, " << result.pictures.size()
+            << " pictures (I " << counts[0] << ", P " << counts[1] << ", B " << counts[2]
+            << ", keyframes " << keyframes << "), " << result.errors << " errors\n"
+            << "scanned " << size << "B in " << seconds * 1e3 << " ms ("
+            << (seconds > 0 ? size / seconds / (1 << 20) : 0) << " MiB/s)\n";
+
+  return result.errors ? 2 : 0;
+}
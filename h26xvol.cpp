@@ -0,0 +1,712 @@
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#include "h26xvol.h"
+#include "codec_lock.hpp"
+#include "container.hpp"
+#include "encoder.hpp"
+#include "frame_pool.hpp"
+#include "memory.h"
+#include "numa_topology.hpp"
+#include "nal_edit.hpp"
+#include "ratecontrol.hpp"
+#include "reduction.hpp"
+#include "telemetry.h"
+#include "thread_pool.hpp"
+#include "window.h"
+
+/*
+ * libh26xvol on top of the tools' headers: encoder sessions from
+ * encoder.hpp, the stream index of nal_scan.hpp for decoding from memory
+ * without a demuxer, buffers from the shared frame pool
+ */
+
+struct h26xvol_encoder {
+  encoder_session session;
+  std::deque<AVPacket> packets;  ///< references to pooled packets, oldest first
+  AVPacket pulled;               ///< handed out by the last pull, released by the next
+  bool finished;
+  uint8_t* planes[3];            ///< the session frame's own planes (neutral chroma)
+  int linesizes[3];
+  int pass;                      ///< 0, or 1/2 of a two-pass encode
+  std::string stats;             ///< x264's statistics file of a two-pass encode
+  bool remove_stats;             ///< close removes stats: pass 2, or a pass 1 of its own that did not finish
+  window_map* window;            ///< of the last push_slice16, NULL before
+};
+
+struct h26xvol_muxer {
+  container_muxer muxer;
+  int error;                     ///< of the first write that failed
+};
+
+struct h26xvol_decoder {
+  const uint8_t* data;
+  size_t size;
+  nal_scan_result scan;
+  std::vector<int> display;      ///< slice number of every picture, see nal_display_order
+  AVCodecContext* context;
+  AVFrame* frame;
+  std::vector<uint8_t> padded;   ///< copy of an access unit too close to the end of data
+  int next_picture;              ///< decode order position to feed next
+  int next_output;               ///< display index of the next frame the decoder returns
+};
+
+extern "C" {
+
+void h26xvol_init(void)
+{
+  avcodec_register_all();
+  codec_lock_init();
+  telemetry_init();
+  memory_init();
+}
+
+unsigned h26xvol_version(void)
+{
+  return (H26XVOL_VERSION_MAJOR << 16) | H26XVOL_VERSION_MINOR;
+}
+
+const char* h26xvol_strerror(int error)
+{
+  switch (error) {
+  case H26XVOL_OK: return "success";
+  case H26XVOL_ERROR_ARGUMENT: return "invalid argument";
+  case H26XVOL_ERROR_CODEC: return "codec not available";
+  case H26XVOL_ERROR_MEMORY: return "out of memory";
+  case H26XVOL_ERROR_STREAM: return "stream could not be encoded/decoded";
+  case H26XVOL_ERROR_STATE: return "call not allowed in this state";
+  default: return "unknown error";
+  }
+}
+
+void h26xvol_encoder_config_default(h26xvol_encoder_config* config, int codec, int width, int height)
+{
+  encoder_settings settings = default_encoder_settings(codec == H26XVOL_HEVC ? AV_CODEC_ID_HEVC : AV_CODEC_ID_H264,
+                                                       width, height);
+  config->codec = codec;
+  config->width = width;
+  config->height = height;
+  config->bit_rate = settings.bit_rate;
+  config->crf = settings.crf;
+  config->qp = settings.qp;
+  config->pass = settings.pass;
+  config->stats = NULL;
+  config->gop_size = settings.gop_size;
+  config->max_b_frames = settings.max_b_frames;
+  config->threads = settings.threads;
+  config->preset = codec == H26XVOL_H264 ? "slow" : NULL;
+  config->flags = 0;
+}
+
+int h26xvol_encoder_open(h26xvol_encoder** encoder, const h26xvol_encoder_config* config)
+{
+  if (!encoder || !config || config->width < 2 || config->height < 2 || (config->width | config->height) & 1 ||
+      (config->codec != H26XVOL_H264 && config->codec != H26XVOL_HEVC) || config->pass < 0 || config->pass > 2 ||
+      (config->pass == 2 && !config->stats))
+    return H26XVOL_ERROR_ARGUMENT;
+
+  encoder_settings settings = default_encoder_settings(config->codec == H26XVOL_HEVC ? AV_CODEC_ID_HEVC :
+                                                       AV_CODEC_ID_H264, config->width, config->height);
+  settings.bit_rate = config->bit_rate;
+  settings.crf = config->crf;
+  settings.qp = config->qp;
+  settings.pass = config->pass;
+  settings.stats = config->stats ? config->stats : "";
+  const bool own_stats = config->pass == 1 && settings.stats.empty();
+  if (own_stats) {
+    settings.stats = encoder_stats_file();
+    if (settings.stats.empty())
+      return H26XVOL_ERROR_STREAM;
+  }
+  settings.gop_size = config->gop_size;
+  settings.max_b_frames = config->max_b_frames;
+  settings.threads = config->threads;
+  settings.preset = config->preset ? config->preset : "";
+  settings.wait_for_memory = (config->flags & H26XVOL_WAIT_FOR_MEMORY) != 0;
+
+  h26xvol_encoder* value = new (std::nothrow) h26xvol_encoder();
+  if (!value) {
+    if (own_stats)
+      encoder_stats_remove(settings.stats);
+    return H26XVOL_ERROR_MEMORY;
+  }
+  value->stats = settings.stats;
+  value->pass = config->pass;
+  value->remove_stats = own_stats || config->pass == 2;
+  if (encoder_open(value->session, settings) != 0) {
+    if (value->remove_stats)
+      encoder_stats_remove(settings.stats);
+    delete value;
+    return avcodec_find_encoder(settings.codec_id) ? H26XVOL_ERROR_MEMORY : H26XVOL_ERROR_CODEC;
+  }
+
+  AVFrame* frame = value->session.frame;
+  for (int p = 0; p < 3; ++p) {
+    value->planes[p] = frame->data[p];
+    value->linesizes[p] = frame->linesize[p];
+  }
+  for (int y = 0; y < config->height / 2; ++y) {
+    memset(frame->data[1] + y * frame->linesize[1], 128, config->width / 2);
+    memset(frame->data[2] + y * frame->linesize[2], 128, config->width / 2);
+  }
+
+  av_init_packet(&value->pulled);
+  value->finished = false;
+  *encoder = value;
+  return H26XVOL_OK;
+}
+
+static int queue_packets(h26xvol_encoder* encoder, const AVFrame* frame)
+{
+  std::deque<AVPacket>& packets = encoder->packets;
+  packet_sink keep = [&packets](const AVPacket& pkt) {
+    AVPacket ref;
+    av_init_packet(&ref);
+    ref.buf = pkt.buf ? av_buffer_ref(pkt.buf) : av_buffer_alloc(pkt.size + FF_INPUT_BUFFER_PADDING_SIZE);
+    if (!ref.buf)
+      return;
+    ref.data = pkt.buf ? pkt.data : ref.buf->data;
+    if (!pkt.buf)
+      memcpy(ref.data, pkt.data, pkt.size);
+    ref.size = pkt.size;
+    ref.pts = pkt.pts;
+    ref.dts = pkt.dts;
+    ref.flags = pkt.flags;
+    packets.push_back(ref);
+  };
+
+  if (frame)
+    return encoder_encode(encoder->session, frame, keep) < 0 ? H26XVOL_ERROR_STREAM : H26XVOL_OK;
+  return encoder_flush(encoder->session, keep) < 0 ? H26XVOL_ERROR_STREAM : H26XVOL_OK;
+}
+
+int h26xvol_encoder_push_slice(h26xvol_encoder* encoder, const uint8_t* luma, int luma_stride,
+                               const uint8_t* cb, int cb_stride, const uint8_t* cr, int cr_stride)
+{
+  if (!encoder || !luma || (!cb != !cr))
+    return H26XVOL_ERROR_ARGUMENT;
+  if (encoder->finished)
+    return H26XVOL_ERROR_STATE;
+
+  //the codecs copy the input picture, so the caller's planes are used in place
+  AVFrame* frame = encoder->session.frame;
+  frame->data[0] = const_cast<uint8_t*>(luma);
+  frame->linesize[0] = luma_stride;
+  if (cb) {
+    frame->data[1] = const_cast<uint8_t*>(cb);
+    frame->linesize[1] = cb_stride;
+    frame->data[2] = const_cast<uint8_t*>(cr);
+    frame->linesize[2] = cr_stride;
+  }
+  frame->pts = encoder->session.frames_in;
+
+  int rcode = queue_packets(encoder, frame);
+
+  for (int p = 0; p < 3; ++p) {
+    frame->data[p] = encoder->planes[p];
+    frame->linesize[p] = encoder->linesizes[p];
+  }
+  return rcode;
+}
+
+int h26xvol_encoder_push_slice16(h26xvol_encoder* encoder, const uint16_t* luma, int stride,
+                                 const h26xvol_window* window)
+{
+  if (!encoder || !luma || !window || window->mapping < H26XVOL_MAP_LINEAR || window->mapping > H26XVOL_MAP_LOG)
+    return H26XVOL_ERROR_ARGUMENT;
+  if (encoder->finished)
+    return H26XVOL_ERROR_STATE;
+
+  //the table of gamma/log windows is only rebuilt when the window changes
+  window_map* map = encoder->window;
+  if (!map) {
+    map = encoder->window = new (std::nothrow) window_map();
+    if (!map)
+      return H26XVOL_ERROR_MEMORY;
+    window_map_init(map, (window_mapping)window->mapping, window->gamma, window->low, window->high);
+  }
+  else if (map->mapping != window->mapping || map->gamma != window->gamma || map->low != window->low ||
+           map->high != window->high)
+    window_map_init(map, (window_mapping)window->mapping, window->gamma, window->low, window->high);
+
+  AVFrame* frame = encoder->session.frame;
+  window_plane(map, luma, stride, frame->data[0], frame->linesize[0], frame->width, frame->height);
+  frame->pts = encoder->session.frames_in;
+  return queue_packets(encoder, frame);
+}
+
+int h26xvol_encoder_finish(h26xvol_encoder* encoder)
+{
+  if (!encoder)
+    return H26XVOL_ERROR_ARGUMENT;
+  if (encoder->finished)
+    return H26XVOL_OK;
+
+  encoder->finished = true;
+  int rcode = queue_packets(encoder, NULL);
+  encoder_close(encoder->session); //x264 writes the statistics out on close
+  if (rcode == H26XVOL_OK && encoder->pass == 1)
+    encoder->remove_stats = false;
+  return rcode;
+}
+
+int h26xvol_encoder_pull_packet(h26xvol_encoder* encoder, h26xvol_packet* packet)
+{
+  if (!encoder || !packet)
+    return H26XVOL_ERROR_ARGUMENT;
+
+  av_free_packet(&encoder->pulled);
+  if (encoder->packets.empty())
+    return 0;
+
+  encoder->pulled = encoder->packets.front();
+  encoder->packets.pop_front();
+
+  packet->data = encoder->pulled.data;
+  packet->size = encoder->pulled.size;
+  packet->pts = encoder->pulled.pts;
+  packet->dts = encoder->pulled.dts;
+  packet->keyframe = (encoder->pulled.flags & AV_PKT_FLAG_KEY) != 0;
+  return 1;
+}
+
+const char* h26xvol_encoder_stats(h26xvol_encoder* encoder)
+{
+  return encoder && encoder->pass == 1 && encoder->finished && !encoder->remove_stats ?
+    encoder->stats.c_str() : "";
+}
+
+int h26xvol_bit_rate_for_size(uint64_t bytes, int slices)
+{
+  return rate_bit_rate_for_size((double)bytes, slices);
+}
+
+void h26xvol_encoder_close(h26xvol_encoder* encoder)
+{
+  if (!encoder)
+    return;
+
+  av_free_packet(&encoder->pulled);
+  for (size_t p = 0; p < encoder->packets.size(); ++p)
+    av_free_packet(&encoder->packets[p]);
+  encoder_close(encoder->session);
+  if (encoder->remove_stats)
+    encoder_stats_remove(encoder->stats);
+  delete encoder->window;
+  delete encoder;
+}
+
+int h26xvol_muxer_supported(const char* path)
+{
+  return path && !container_format(path).empty();
+}
+
+int h26xvol_muxer_open(h26xvol_muxer** muxer, const char* path, const h26xvol_encoder_config* config,
+                       const h26xvol_volume_info* volume)
+{
+  if (!muxer || !config || !h26xvol_muxer_supported(path) ||
+      (config->codec != H26XVOL_H264 && config->codec != H26XVOL_HEVC))
+    return H26XVOL_ERROR_ARGUMENT;
+
+  volume_metadata meta = default_volume_metadata(config->width, config->height, 0);
+  if (volume) {
+    meta.slices = volume->slices;
+    meta.bit_depth = volume->bit_depth;
+    for (int d = 0; d < 3; ++d)
+      meta.voxel[d] = volume->voxel_size[d];
+  }
+
+  h26xvol_muxer* value = new (std::nothrow) h26xvol_muxer();
+  if (!value)
+    return H26XVOL_ERROR_MEMORY;
+  if (container_open(value->muxer, path, config->codec == H26XVOL_HEVC ? AV_CODEC_ID_HEVC : AV_CODEC_ID_H264,
+                     meta) != 0) {
+    delete value;
+    return H26XVOL_ERROR_STREAM;
+  }
+  *muxer = value;
+  return H26XVOL_OK;
+}
+
+int h26xvol_muxer_write(h26xvol_muxer* muxer, const h26xvol_packet* packet)
+{
+  if (!muxer || !packet || !packet->data)
+    return H26XVOL_ERROR_ARGUMENT;
+  if (container_write(muxer->muxer, packet->data, packet->size, packet->pts, packet->dts, packet->keyframe != 0) != 0)
+    muxer->error = H26XVOL_ERROR_STREAM;
+  return muxer->error;
+}
+
+int h26xvol_muxer_close(h26xvol_muxer* muxer)
+{
+  if (!muxer)
+    return H26XVOL_ERROR_ARGUMENT;
+  int rcode = container_close(muxer->muxer) != 0 ? H26XVOL_ERROR_STREAM : muxer->error;
+  delete muxer;
+  return rcode;
+}
+
+int h26xvol_decoder_open(h26xvol_decoder** decoder, const uint8_t* data, size_t size)
+{
+  if (!decoder || !data || !size)
+    return H26XVOL_ERROR_ARGUMENT;
+
+  h26xvol_decoder* value = new (std::nothrow) h26xvol_decoder();
+  if (!value)
+    return H26XVOL_ERROR_MEMORY;
+  value->data = data;
+  value->size = size;
+  scan_nal_stream(data, size, value->scan);
+  if (value->scan.codec == NAL_CODEC_UNKNOWN || value->scan.pictures.empty()) {
+    delete value;
+    return H26XVOL_ERROR_STREAM;
+  }
+  nal_display_order(value->scan, value->display);
+
+  AVCodec* codec = avcodec_find_decoder(value->scan.codec == NAL_CODEC_HEVC ? AV_CODEC_ID_HEVC : AV_CODEC_ID_H264);
+  value->context = codec ? avcodec_alloc_context3(codec) : NULL;
+  if (!value->context) {
+    delete value;
+    return codec ? H26XVOL_ERROR_MEMORY : H26XVOL_ERROR_CODEC;
+  }
+
+  use_frame_pool(value->context);
+  value->frame = av_frame_alloc();
+  if (!value->frame || avcodec_open2(value->context, codec, NULL) != 0) {
+    av_frame_free(&value->frame);
+    av_free(value->context);
+    delete value;
+    return H26XVOL_ERROR_CODEC;
+  }
+
+  *decoder = value;
+  return H26XVOL_OK;
+}
+
+int h26xvol_decoder_info(const h26xvol_decoder* decoder, h26xvol_stream_info* info)
+{
+  if (!decoder || !info)
+    return H26XVOL_ERROR_ARGUMENT;
+
+  info->codec = decoder->scan.codec == NAL_CODEC_HEVC ? H26XVOL_HEVC : H26XVOL_H264;
+  info->width = decoder->scan.width;
+  info->height = decoder->scan.height;
+  info->slices = decoder->scan.pictures.size();
+  info->keyframes = 0;
+  for (size_t p = 0; p < decoder->scan.pictures.size(); ++p)
+    info->keyframes += decoder->scan.pictures[p].keyframe;
+  return H26XVOL_OK;
+}
+
+//hands the decoder's current frame to _sink if its slice is inside [first, end)
+static void take_frame(h26xvol_decoder* decoder, int first, int end, const frame_sink& sink, int& written)
+{
+  const int slice = decoder->next_output++;
+  if (slice < first || slice >= end)
+    return;
+
+  sink(decoder->frame, slice);
+  ++written;
+}
+
+//the decode loop of h26xvol_decode_range and h26xvol_decode_reduce, arguments checked by the caller
+static int decode_frames(h26xvol_decoder* decoder, int first, int count, const frame_sink& sink)
+{
+  const int slices = (int)decoder->scan.pictures.size();
+  const int end = first + count;
+  int written = 0;
+
+  //sequential calls continue where the last one stopped, anything else
+  //starts over at the closest clean random access point before the range
+  if (first != decoder->next_output && count > 0) {
+    int start = 0, last = 0;
+    if (nal_range_pictures(decoder->scan, decoder->display, first, count, start, last) != 0)
+      start = last = 0;
+    avcodec_flush_buffers(decoder->context);
+    decoder->next_picture = start;
+    decoder->next_output = decoder->display[start];
+    for (int i = start; i <= last; ++i)
+      decoder->next_output = std::min(decoder->next_output, decoder->display[i]);
+  }
+
+  AVPacket packet;
+  av_init_packet(&packet);
+
+  while (decoder->next_output < end && decoder->next_picture < slices) {
+    const nal_picture& picture = decoder->scan.pictures[decoder->next_picture++];
+    packet.data = const_cast<uint8_t*>(decoder->data) + picture.start;
+    packet.size = picture.end - picture.start;
+
+    //decoders may read FF_INPUT_BUFFER_PADDING_SIZE bytes past the packet
+    if (picture.end + FF_INPUT_BUFFER_PADDING_SIZE > decoder->size) {
+      decoder->padded.assign(packet.data, packet.data + packet.size);
+      decoder->padded.resize(packet.size + FF_INPUT_BUFFER_PADDING_SIZE, 0);
+      packet.data = &decoder->padded[0];
+    }
+
+    int frameFinished = 0;
+    uint64_t start = telemetry_start();
+    if (avcodec_decode_video2(decoder->context, decoder->frame, &frameFinished, &packet) < 0)
+      continue;
+
+    if (frameFinished) {
+      telemetry_record_frame('D', decoder->next_output, picture.index, start, 0, packet.size,
+                             decoder->frame->pict_type, -1);
+      take_frame(decoder, first, end, sink, written);
+    }
+  }
+
+  //all pictures fed, the rest sits in the decoder's reorder buffer
+  int frameFinished = 1;
+  while (decoder->next_output < end && frameFinished) {
+    packet.data = NULL;
+    packet.size = 0;
+    if (avcodec_decode_video2(decoder->context, decoder->frame, &frameFinished, &packet) < 0)
+      break;
+    if (frameFinished)
+      take_frame(decoder, first, end, sink, written);
+  }
+
+  return written > 0 || count == 0 ? written : H26XVOL_ERROR_STREAM;
+}
+
+int h26xvol_decode_range(h26xvol_decoder* decoder, int first, int count, uint8_t* dst,
+                         size_t row_stride, size_t slice_stride)
+{
+  const int slices = decoder ? (int)decoder->scan.pictures.size() : 0;
+  if (!decoder || !dst || first < 0 || count < 0 || first + count > slices ||
+      row_stride < (size_t)decoder->scan.width)
+    return H26XVOL_ERROR_ARGUMENT;
+
+  return decode_frames(decoder, first, count, [&](const AVFrame* frame, int slice) {
+      uint8_t* out = dst + (size_t)(slice - first) * slice_stride;
+      for (int y = 0; y < frame->height; ++y)
+        memcpy(out + y * row_stride, frame->data[0] + y * frame->linesize[0], frame->width);
+    });
+}
+
+int h26xvol_decode_reduce(h26xvol_decoder* decoder, int first, int count, h26xvol_reduction* reduction)
+{
+  const int slices = decoder ? (int)decoder->scan.pictures.size() : 0;
+  if (!decoder || !reduction || first < 0 || count < 0 || first + count > slices)
+    return H26XVOL_ERROR_ARGUMENT;
+
+  volume_reductions reductions;
+  reductions_init(reductions, (reduction->mip ? REDUCE_MIP : 0) | (reduction->histogram ? REDUCE_HISTOGRAM : 0) |
+                  (reduction->stats ? REDUCE_STATS : 0));
+  const int rcode = decode_frames(decoder, first, count, reduce_frames({ reduce_into(reductions) }));
+
+  const size_t mip_size = (size_t)decoder->scan.width * decoder->scan.height;
+  if (reduction->mip) {
+    if (reductions.mip.size() == mip_size)
+      memcpy(reduction->mip, &reductions.mip[0], mip_size);
+    else
+      memset(reduction->mip, 0, mip_size);
+  }
+  if (reduction->histogram)
+    memcpy(reduction->histogram, reductions.histogram, sizeof(reductions.histogram));
+  for (size_t n = 0; reduction->stats && n < reductions.stats.size() && n < (size_t)count; ++n) {
+    reduction->stats[n].slice = reductions.stats[n].slice;
+    reduction->stats[n].min = reductions.stats[n].min;
+    reduction->stats[n].max = reductions.stats[n].max;
+    reduction->stats[n].mean = reductions.stats[n].mean;
+  }
+  return rcode;
+}
+
+//a decoder instance of one worker of h26xvol_decode_parallel
+struct gop_decoder {
+  AVCodecContext* context;
+  AVFrame* frame;
+  std::vector<uint8_t> padded;
+};
+
+static int gop_decoder_open(gop_decoder& instance, nal_codec codec_id)
+{
+  AVCodec* codec = avcodec_find_decoder(codec_id == NAL_CODEC_HEVC ? AV_CODEC_ID_HEVC : AV_CODEC_ID_H264);
+  instance.context = codec ? avcodec_alloc_context3(codec) : NULL;
+  instance.frame = av_frame_alloc();
+  if (!instance.context || !instance.frame)
+    return codec ? H26XVOL_ERROR_MEMORY : H26XVOL_ERROR_CODEC;
+
+  //the parallelism is across GOPs, one thread per instance
+  instance.context->thread_count = 1;
+  use_frame_pool(instance.context);
+  if (avcodec_open2(instance.context, codec, NULL) != 0) {
+    av_free(instance.context);
+    instance.context = NULL;
+    return H26XVOL_ERROR_CODEC;
+  }
+  return H26XVOL_OK;
+}
+
+static void gop_decoder_close(gop_decoder& instance)
+{
+  av_frame_free(&instance.frame);
+  if (instance.context) {
+    avcodec_close(instance.context);
+    av_free(instance.context);
+  }
+}
+
+/*
+ * decodes one GOP and copies its slices inside [first, end) to dst; returns
+ * the slices written. wait_ns, the time the GOP waited for a worker, goes to
+ * the telemetry record of its first frame.
+ */
+static int decode_gop(const h26xvol_decoder* decoder, gop_decoder& instance, const nal_gop& gop, int first,
+                      int end, uint8_t* dst, size_t row_stride, size_t slice_stride, uint32_t wait_ns)
+{
+  int slice = gop.first;
+  int written = 0;
+  auto take = [&]() {
+    const AVFrame* frame = instance.frame;
+    if (slice >= first && slice < end) {
+      uint8_t* out = dst + (size_t)(slice - first) * slice_stride;
+      for (int y = 0; y < frame->height; ++y)
+        memcpy(out + y * row_stride, frame->data[0] + y * frame->linesize[0], frame->width);
+      ++written;
+    }
+    ++slice;
+  };
+
+  AVPacket packet;
+  av_init_packet(&packet);
+  for (int p = gop.start; p < gop.end && slice < end; ++p) {
+    const nal_picture& picture = decoder->scan.pictures[p];
+    packet.data = const_cast<uint8_t*>(decoder->data) + picture.start;
+    packet.size = picture.end - picture.start;
+    if (picture.end + FF_INPUT_BUFFER_PADDING_SIZE > decoder->size) {
+      instance.padded.assign(packet.data, packet.data + packet.size);
+      instance.padded.resize(packet.size + FF_INPUT_BUFFER_PADDING_SIZE, 0);
+      packet.data = &instance.padded[0];
+    }
+
+    int frameFinished = 0;
+    uint64_t start = telemetry_start();
+    if (avcodec_decode_video2(instance.context, instance.frame, &frameFinished, &packet) < 0)
+      continue;
+    if (frameFinished) {
+      telemetry_record_frame('D', slice, picture.index, start, wait_ns, packet.size, instance.frame->pict_type, -1);
+      wait_ns = 0;
+      take();
+    }
+  }
+
+  int frameFinished = 1;
+  while (slice < end && frameFinished) {
+    packet.data = NULL;
+    packet.size = 0;
+    if (avcodec_decode_video2(instance.context, instance.frame, &frameFinished, &packet) < 0)
+      break;
+    if (frameFinished)
+      take();
+  }
+
+  //the instance goes on with an unrelated GOP
+  avcodec_flush_buffers(instance.context);
+  return written;
+}
+
+int h26xvol_decode_parallel(const h26xvol_decoder* decoder, int first, int count, uint8_t* dst,
+                            size_t row_stride, size_t slice_stride, int threads)
+{
+  const int slices = decoder ? (int)decoder->scan.pictures.size() : 0;
+  if (!decoder || !dst || first < 0 || count < 0 || first + count > slices ||
+      row_stride < (size_t)decoder->scan.width || threads < 0)
+    return H26XVOL_ERROR_ARGUMENT;
+
+  const int end = first + count;
+  std::vector<nal_gop> gops, wanted;
+  nal_closed_gops(decoder->scan, decoder->display, gops);
+  for (const nal_gop& gop : gops)
+    if (gop.first < end && gop.first + (gop.end - gop.start) > first)
+      wanted.push_back(gop);
+  if (wanted.empty())
+    return 0;
+
+  if (threads == 0)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  threads = std::min(threads, (int)wanted.size());
+  //the workers open their decoders at the same time, also for callers that skipped h26xvol_init
+  if (codec_lock_init() != 0)
+    return H26XVOL_ERROR_CODEC;
+
+  //NUMA: every node decodes its share of consecutive GOPs on workers pinned to it
+  const int nodes = (int)numa_nodes().size();
+  std::vector<int> gop_first(nodes), gop_end(nodes), workers(nodes), instance_base(nodes);
+  int instance_count = 0;
+  for (int n = 0; n < nodes; ++n) {
+    numa_split(n, (int)wanted.size(), gop_first[n], gop_end[n]);
+    workers[n] = std::min(numa_share(n, threads), gop_end[n] - gop_first[n]);
+    instance_base[n] = instance_count;
+    instance_count += std::max(0, workers[n]);
+  }
+
+  std::vector<gop_decoder> instances(instance_count, gop_decoder());
+  std::atomic<int> written(0);
+  std::atomic<int> error(H26XVOL_OK);
+  {
+    std::vector<std::unique_ptr<work_stealing_pool> > pools;
+    for (int n = 0; n < nodes; ++n) {
+      if (workers[n] < 1)
+        continue;
+      pools.push_back(std::unique_ptr<work_stealing_pool>(
+          new work_stealing_pool(workers[n], [n](unsigned) { numa_pin(n); })));
+      for (int g = gop_first[n]; g < gop_end[n]; ++g) {
+        const nal_gop gop = wanted[g];
+        const uint64_t queued_ns = telemetry_start();
+        pools.back()->submit([&, gop, n, queued_ns]() {
+            const uint32_t wait_ns = telemetry_wait(queued_ns);
+            gop_decoder& instance = instances[instance_base[n] + work_stealing_pool::current_worker()];
+            if (!instance.context) {
+              int rcode = gop_decoder_open(instance, decoder->scan.codec);
+              if (rcode != H26XVOL_OK) {
+                error = rcode;
+                return;
+              }
+            }
+            const uint64_t start = telemetry_clock();
+            const int slices = decode_gop(decoder, instance, gop, first, end, dst, row_stride, slice_stride,
+                                          wait_ns);
+            written += slices;
+            numa_count(n, slices, decoder->scan.pictures[gop.end - 1].end - decoder->scan.pictures[gop.start].start,
+                       telemetry_clock() - start);
+          });
+      }
+    }
+    for (size_t p = 0; p < pools.size(); ++p)
+      pools[p]->wait();
+  }
+
+  for (gop_decoder& instance : instances)
+    gop_decoder_close(instance);
+
+  //a GOP that failed leaves a hole in dst: no partial count, the caller cannot tell where it is
+  if (written == count)
+    return count;
+  return error != H26XVOL_OK ? error.load() : H26XVOL_ERROR_STREAM;
+}
+
+void h26xvol_decoder_close(h26xvol_decoder* decoder)
+{
+  if (!decoder)
+    return;
+
+  av_frame_free(&decoder->frame);
+  avcodec_close(decoder->context);
+  av_free(decoder->context);
+  delete decoder;
+}
+
+}
@@ -0,0 +1,234 @@
+#ifndef _H26XVOL_H_
+#define _H26XVOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * libh26xvol: encode volumes slice by slice into H.264/HEVC and decode
+ * slice ranges back, in-process and from memory
+ *
+ * The API is plain C and only uses opaque handles, fixed-size integers and
+ * caller-owned buffers, so that it stays stable when the implementation
+ * (libav version, pooling, threading) changes. Functions return
+ * H26XVOL_OK (0) or a negative H26XVOL_ERROR_* code unless noted.
+ *
+ *   h26xvol_init();
+ *   h26xvol_encoder_config config;
+ *   h26xvol_encoder_config_default(&config, H26XVOL_H264, width, height);
+ *   h26xvol_encoder_open(&enc, &config);
+ *   for each slice:
+ *     h26xvol_encoder_push_slice(enc, luma, width, NULL, 0, NULL, 0);
+ *     while (h26xvol_encoder_pull_packet(enc, &packet) > 0)
+ *       write(packet.data, packet.size);
+ *   h26xvol_encoder_finish(enc); pull the remaining packets
+ *   h26xvol_encoder_close(enc);
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define H26XVOL_VERSION_MAJOR 1
+#define H26XVOL_VERSION_MINOR 5
+
+enum h26xvol_codec {
+  H26XVOL_H264 = 1,
+  H26XVOL_HEVC = 2
+};
+
+enum h26xvol_error {
+  H26XVOL_OK = 0,
+  H26XVOL_ERROR_ARGUMENT = -1,  /* NULL handle, bad size, range outside the volume */
+  H26XVOL_ERROR_CODEC = -2,     /* codec not available or failed to open */
+  H26XVOL_ERROR_MEMORY = -3,    /* out of memory or over the memory budget */
+  H26XVOL_ERROR_STREAM = -4,    /* encoding failed or the stream could not be decoded */
+  H26XVOL_ERROR_STATE = -5      /* e.g. push after finish */
+};
+
+typedef struct h26xvol_encoder h26xvol_encoder;
+typedef struct h26xvol_decoder h26xvol_decoder;
+typedef struct h26xvol_muxer h26xvol_muxer;
+
+typedef struct h26xvol_encoder_config {
+  int codec;           /* enum h26xvol_codec */
+  int width;           /* even */
+  int height;          /* even */
+  int bit_rate;        /* bits per second at 25 slices per second, see h26xvol_bit_rate_for_size */
+  int gop_size;        /* slices between keyframes */
+  int max_b_frames;
+  int threads;         /* 0: let the codec decide */
+  const char *preset;  /* x264/x265 preset or NULL, copied by h26xvol_encoder_open */
+  unsigned flags;      /* H26XVOL_WAIT_FOR_MEMORY */
+  /* since 1.5, after the fields of 1.0 so that their offsets stay */
+  float crf;           /* >= 0: constant rate factor instead of bit_rate (0: lossless H.264), < 0 unset */
+  int qp;              /* >= 0: constant quantizer instead of bit_rate */
+  int pass;            /* 0, or 1/2 for the passes of a two-pass encode (H.264 only) */
+  const char *stats;   /* statistics file: h26xvol_encoder_stats of pass 1 for pass 2, copied by open */
+} h26xvol_encoder_config;
+
+/* open waits for other sessions to free the memory budget instead of failing */
+#define H26XVOL_WAIT_FOR_MEMORY 1u
+
+enum h26xvol_mapping {
+  H26XVOL_MAP_LINEAR = 0,
+  H26XVOL_MAP_GAMMA = 1,  /* 255 t^(1/gamma) */
+  H26XVOL_MAP_LOG = 2     /* 255 ln(1 + v - low) / ln(1 + high - low) */
+};
+
+/* the 16-bit values [low, high] mapped onto 0..255, see window.h */
+typedef struct h26xvol_window {
+  int mapping;         /* enum h26xvol_mapping */
+  float gamma;
+  uint16_t low;
+  uint16_t high;
+} h26xvol_window;
+
+typedef struct h26xvol_packet {
+  const uint8_t *data; /* Annex-B, valid until the next pull or close */
+  size_t size;
+  int64_t pts;         /* slice index of the picture */
+  int64_t dts;
+  int keyframe;
+} h26xvol_packet;
+
+/* what the slices are, kept in the tags of MP4/Matroska files */
+typedef struct h26xvol_volume_info {
+  int slices;          /* 0 if not known up front */
+  int bit_depth;       /* of the source samples: 8, or 16 for push_slice16 */
+  double voxel_size[3]; /* x y z */
+} h26xvol_volume_info;
+
+typedef struct h26xvol_slice_stats {
+  int slice;
+  uint8_t min;
+  uint8_t max;
+  double mean;
+} h26xvol_slice_stats;
+
+/* caller-owned results of h26xvol_decode_reduce, NULL members are not computed */
+typedef struct h26xvol_reduction {
+  uint8_t *mip;        /* width x height, rows width apart: maximum-intensity projection along z */
+  uint64_t *histogram; /* 256 counts of the luma values */
+  h26xvol_slice_stats *stats; /* count entries, min/max/mean of every slice */
+} h26xvol_reduction;
+
+typedef struct h26xvol_stream_info {
+  int codec;
+  int width;
+  int height;
+  int slices;          /* coded pictures in the stream */
+  int keyframes;
+} h26xvol_stream_info;
+
+/* registers the codecs and reads the H26X_* environment (telemetry, memory budget); idempotent */
+void h26xvol_init(void);
+
+/* version the library was built as, (major << 16) | minor */
+unsigned h26xvol_version(void);
+
+const char *h26xvol_strerror(int error);
+
+void h26xvol_encoder_config_default(h26xvol_encoder_config *config, int codec, int width, int height);
+
+int h26xvol_encoder_open(h26xvol_encoder **encoder, const h26xvol_encoder_config *config);
+
+/*
+ * encodes one slice of width x height; cb/cr are the 4:2:0 chroma planes
+ * of (width/2) x (height/2), NULL encodes neutral chroma; the planes are
+ * only read during the call
+ */
+int h26xvol_encoder_push_slice(h26xvol_encoder *encoder, const uint8_t *luma, int luma_stride,
+                               const uint8_t *cb, int cb_stride, const uint8_t *cr, int cr_stride);
+
+/*
+ * encodes one 16-bit slice of width x height (stride in elements) mapped
+ * to 8 bits through window, straight into the encoder's own picture;
+ * chroma is neutral
+ */
+int h26xvol_encoder_push_slice16(h26xvol_encoder *encoder, const uint16_t *luma, int stride,
+                                 const h26xvol_window *window);
+
+/* no more slices: the delayed packets become available to pull */
+int h26xvol_encoder_finish(h26xvol_encoder *encoder);
+
+/* 1 if a packet was returned, 0 if none is pending, < 0 on error */
+int h26xvol_encoder_pull_packet(h26xvol_encoder *encoder, h26xvol_packet *packet);
+
+/*
+ * pass 1: the name of x264's statistics file for config.stats of pass 2,
+ * complete after h26xvol_encoder_finish and valid until close; "" before
+ * and for other passes. Pass 1 creates a file of its own (removed again if
+ * it does not finish) unless config.stats names one; the close of pass 2
+ * removes the file it read.
+ */
+const char *h26xvol_encoder_stats(h26xvol_encoder *encoder);
+
+void h26xvol_encoder_close(h26xvol_encoder *encoder);
+
+/* 1 if path names a container h26xvol_muxer_open can write (.mp4, .mov, .m4v, .mkv) */
+int h26xvol_muxer_supported(const char *path);
+
+/*
+ * an MP4 (with faststart) or Matroska file by the extension of path, for
+ * the packets of an encoder opened with config: slice s gets the time
+ * s / 25 s and volume (NULL: 8 bits, unit voxels) goes into the tags, so
+ * that demuxers get a sample index to seek in instead of scanning
+ */
+int h26xvol_muxer_open(h26xvol_muxer **muxer, const char *path, const h26xvol_encoder_config *config,
+                       const h26xvol_volume_info *volume);
+
+/* muxes a packet as returned by h26xvol_encoder_pull_packet */
+int h26xvol_muxer_write(h26xvol_muxer *muxer, const h26xvol_packet *packet);
+
+/* writes the index, closes the file and frees muxer; H26XVOL_ERROR_STREAM if the file is incomplete */
+int h26xvol_muxer_close(h26xvol_muxer *muxer);
+
+/* bit rate that spends about bytes on slices slices (exact with two passes) */
+int h26xvol_bit_rate_for_size(uint64_t bytes, int slices);
+
+/*
+ * opens an Annex-B H.264/HEVC stream held in memory; the buffer is not
+ * copied and has to stay valid until h26xvol_decoder_close
+ */
+int h26xvol_decoder_open(h26xvol_decoder **decoder, const uint8_t *data, size_t size);
+
+int h26xvol_decoder_info(const h26xvol_decoder *decoder, h26xvol_stream_info *info);
+
+/*
+ * decodes the luma of slices [first, first + count) into dst, slice s at
+ * dst + (s - first) * slice_stride, rows row_stride bytes apart; returns
+ * the number of slices written or a negative error
+ */
+int h26xvol_decode_range(h26xvol_decoder *decoder, int first, int count, uint8_t *dst,
+                         size_t row_stride, size_t slice_stride);
+
+/*
+ * h26xvol_decode_range split at every IDR: the closed GOPs of the range
+ * are decoded on threads threads (0: one per core), each by its own decoder
+ * instance that writes its slices straight into dst. Streams of open GOPs
+ * (libx265's default) have a single GOP and decode on one thread. On NUMA
+ * machines every node decodes a contiguous share of the GOPs on workers
+ * pinned to it, so pages of dst that were not touched before end up on the
+ * node that writes them. The position of decoder for h26xvol_decode_range
+ * is not changed. Returns count, or a negative error if any slice of the
+ * range could not be decoded (dst then holds the slices of the other GOPs).
+ */
+int h26xvol_decode_parallel(const h26xvol_decoder *decoder, int first, int count, uint8_t *dst,
+                            size_t row_stride, size_t slice_stride, int threads);
+
+/*
+ * decodes slices [first, first + count) like h26xvol_decode_range but only
+ * reduces them (see reduction.hpp): the members of reduction are
+ * overwritten with the results over the range, no slice is kept beyond the
+ * decoder's own pictures; returns the number of slices reduced
+ */
+int h26xvol_decode_reduce(h26xvol_decoder *decoder, int first, int count, h26xvol_reduction *reduction);
+
+void h26xvol_decoder_close(h26xvol_decoder *decoder);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _H26XVOL_H_ */
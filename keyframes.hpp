@@ -0,0 +1,169 @@
+#ifndef _KEYFRAMES_H_
+#define _KEYFRAMES_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * content-adaptive keyframe placement: an analysis pass measures how much
+ * consecutive slices differ (SAD/SSE on luma) and IDR frames are placed
+ * where the structure changes abruptly, with a maximum GOP length as upper
+ * bound for the random-access latency
+ */
+
+//sum of absolute differences of two 8-bit planes
+inline uint64_t plane_sad(const uint8_t* _a, int _a_linesize, const uint8_t* _b, int _b_linesize,
+                          int _width, int _height)
+{
+  uint64_t sad = 0;
+
+  for (int y = 0; y < _height; ++y) {
+    const uint8_t* a = _a + y * _a_linesize;
+    const uint8_t* b = _b + y * _b_linesize;
+    int x = 0;
+#ifdef __SSE2__
+    __m128i acc = _mm_setzero_si128();
+    for (; x + 16 <= _width; x += 16)
+      acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(a + x)),
+                                            _mm_loadu_si128((const __m128i*)(b + x))));
+    sad += (uint64_t)_mm_cvtsi128_si32(acc) + (uint64_t)_mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+    for (; x < _width; ++x)
+      sad += a[x] > b[x] ? a[x] - b[x] : b[x] - a[x];
+  }
+
+  return sad;
+}
+
+//sum of squared differences of two 8-bit planes
+inline uint64_t plane_sse(const uint8_t* _a, int _a_linesize, const uint8_t* _b, int _b_linesize,
+                          int _width, int _height)
+{
+  uint64_t sse = 0;
+
+  for (int y = 0; y < _height; ++y) {
+    const uint8_t* a = _a + y * _a_linesize;
+    const uint8_t* b = _b + y * _b_linesize;
+    int x = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128(); //4x32 bit, a row of 4096 pixels cannot overflow it
+    for (; x + 16 <= _width; x += 16) {
+      __m128i va = _mm_loadu_si128((const __m128i*)(a + x));
+      __m128i vb = _mm_loadu_si128((const __m128i*)(b + x));
+      __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+      __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+      acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+    }
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    sse += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+    for (; x < _width; ++x) {
+      int d = a[x] - b[x];
+      sse += d * d;
+    }
+  }
+
+  return sse;
+}
+
+struct keyframe_plan {
+  int max_gop;                     ///< keyframe at least every max_gop slices
+  int min_gop;                     ///< no content keyframe closer than this to the previous one
+  double threshold;                ///< mean absolute difference above which a slice becomes a keyframe
+  std::vector<double> difference;  ///< mean absolute difference to the previous slice
+  std::vector<double> mse;         ///< mean squared difference to the previous slice
+  std::vector<bool> keyframe;
+};
+
+//analysis pass, to be called for every slice in order (_previous is NULL for the first)
+inline void keyframe_analyse(keyframe_plan& _plan, const uint8_t* _previous, int _previous_linesize,
+                             const uint8_t* _current, int _current_linesize, int _width, int _height)
+{
+  if (!_previous) {
+    _plan.difference.push_back(0);
+    _plan.mse.push_back(0);
+    return;
+  }
+
+  const double pixels = (double)_width * _height;
+  _plan.difference.push_back(plane_sad(_previous, _previous_linesize, _current, _current_linesize,
+                                       _width, _height) / pixels);
+  _plan.mse.push_back(plane_sse(_previous, _previous_linesize, _current, _current_linesize,
+                                _width, _height) / pixels);
+}
+
+/*
+ * places the keyframes: slice 0, every slice whose difference exceeds
+ * median + _sensitivity * MAD of all differences (robust against the many
+ * near identical slices) and wherever the GOP would exceed max_gop
+ */
+inline void keyframe_place(keyframe_plan& _plan, double _sensitivity = 6.)
+{
+  const size_t depth = _plan.difference.size();
+  _plan.keyframe.assign(depth, false);
+  if (!depth)
+    return;
+
+  std::vector<double> sorted(_plan.difference.begin() + 1, _plan.difference.end());
+  double median = 0, mad = 0;
+  if (!sorted.empty()) {
+    std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+    median = sorted[sorted.size() / 2];
+    for (size_t i = 0; i < sorted.size(); ++i)
+      sorted[i] = std::fabs(sorted[i] - median);
+    std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+    mad = sorted[sorted.size() / 2];
+  }
+  //a perfectly smooth volume has MAD 0, require at least one grey level on top of the median
+  _plan.threshold = median + std::max(_sensitivity * mad, 1.);
+
+  size_t last = 0;
+  _plan.keyframe[0] = true;
+  for (size_t i = 1; i < depth; ++i) {
+    size_t distance = i - last;
+    bool change = _plan.difference[i] > _plan.threshold && distance >= (size_t)_plan.min_gop;
+    if (change || distance >= (size_t)_plan.max_gop) {
+      _plan.keyframe[i] = true;
+      last = i;
+    }
+  }
+}
+
+//size vs. random access: keyframe count and how many slices must be decoded to reach any slice
+inline void keyframe_report(const keyframe_plan& _plan, std::ostream& _out)
+{
+  size_t keyframes = 0, content = 0, longest = 0, run = 0;
+  double decode_cost = 0;
+
+  for (size_t i = 0; i < _plan.keyframe.size(); ++i) {
+    if (_plan.keyframe[i]) {
+      ++keyframes;
+      if (i > 0 && _plan.difference[i] > _plan.threshold)
+        ++content;
+      run = 0;
+    }
+    ++run;
+    longest = std::max(longest, run);
+    decode_cost += run;
+  }
+
+  const size_t depth = _plan.keyframe.size();
+  _out << "keyframes: " << keyframes << " of " << depth << " slices ("
+       << content << " at content changes, threshold " << _plan.threshold
+       << " mean abs diff, max gop " << _plan.max_gop << ")\n"
+       << "random access: " << (depth ? decode_cost / depth : 0)
+       << " slices decoded on average, " << longest << " worst case; a fixed gop of "
+       << _plan.max_gop << " would need " << (depth + _plan.max_gop - 1) / std::max(_plan.max_gop, 1)
+       << " keyframes\n";
+}
+
+#endif /* _KEYFRAMES_H_ */
@@ -0,0 +1,204 @@
+#ifndef _MEMORY_H_
+#define _MEMORY_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <libavutil/mem.h>
+#ifdef __cplusplus
+}
+#endif
+
+/*
+ * memory accounting per pipeline stage (usable from C and C++)
+ *
+ * Every stage keeps counters of allocations, live and peak bytes. Buffers
+ * we allocate ourselves are accounted exactly; what libav allocates inside
+ * the codecs (lookahead, reference frames, thread contexts) cannot be
+ * hooked with libav 2.5, so it is accounted as the growth of the resident
+ * set across avcodec_open2 (approximate when several threads open codecs
+ * at the same time).
+ *
+ * H26X_MEMORY_BUDGET=<MiB> sets a hard budget on the accounted bytes:
+ * memory_reserve() then either waits until other threads release enough
+ * (backpressure) or reports failure, and av_max_alloc() caps any single
+ * libav allocation to the budget. H26X_MEMORY_REPORT=1 prints the per
+ * stage table and the peak RSS at exit.
+ */
+
+enum memory_stage {
+  MEMORY_GENERATION,   /* input slices */
+  MEMORY_ENCODE,       /* encoder contexts and packets */
+  MEMORY_MUX,          /* encoded streams held in memory */
+  MEMORY_DEMUX,        /* avio buffers and streams read back */
+  MEMORY_DECODE,       /* decoder contexts and frames */
+  MEMORY_OUTPUT,       /* previews, slices cut out of mosaics */
+  MEMORY_STAGES
+};
+
+typedef struct memory_counters {
+  size_t allocations;
+  size_t releases;
+  size_t live;
+  size_t peak;
+} memory_counters;
+
+typedef struct memory_state {
+  memory_counters stages[MEMORY_STAGES];
+  size_t live;         /* sum over all stages */
+  size_t peak;
+  size_t budget;       /* 0: unlimited */
+  size_t waits;        /* reservations that had to wait for the budget */
+  int initialized;
+} memory_state;
+
+/* weak: one instance per process, also when linked with libh26xvol */
+__attribute__((weak)) memory_state memory = { { { 0, 0, 0, 0 } }, 0, 0, 0, 0, 0 };
+
+static inline const char *memory_stage_name(int stage)
+{
+  static const char *names[MEMORY_STAGES] = { "generation", "encode", "mux", "demux", "decode", "output" };
+  return stage >= 0 && stage < MEMORY_STAGES ? names[stage] : "?";
+}
+
+static inline void memory_raise_peak(size_t *peak, size_t value)
+{
+  size_t seen = __atomic_load_n(peak, __ATOMIC_RELAXED);
+  while (value > seen &&
+         !__atomic_compare_exchange_n(peak, &seen, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/* accounts _bytes to _stage without looking at the budget (e.g. already allocated) */
+static inline void memory_account(int stage, size_t bytes)
+{
+  memory_counters *c = &memory.stages[stage];
+  __atomic_fetch_add(&c->allocations, 1, __ATOMIC_RELAXED);
+  memory_raise_peak(&c->peak, __atomic_add_fetch(&c->live, bytes, __ATOMIC_RELAXED));
+  memory_raise_peak(&memory.peak, __atomic_add_fetch(&memory.live, bytes, __ATOMIC_RELAXED));
+}
+
+static inline void memory_release(int stage, size_t bytes)
+{
+  memory_counters *c = &memory.stages[stage];
+  __atomic_fetch_add(&c->releases, 1, __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&c->live, bytes, __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&memory.live, bytes, __ATOMIC_RELAXED);
+}
+
+/*
+ * accounts _bytes to _stage if they fit into the budget; if not and _wait
+ * is set, sleeps until other threads have released enough. A reservation
+ * is always granted when nothing else is accounted, so one request larger
+ * than the budget degrades to running alone instead of blocking forever.
+ * Returns 0 if the bytes were accounted, 1 if over budget (_wait == 0).
+ */
+static inline int memory_reserve(int stage, size_t bytes, int wait)
+{
+  struct timespec pause = { 0, 1000000 };
+  int waited = 0;
+
+  while (memory.budget) {
+    size_t live = __atomic_load_n(&memory.live, __ATOMIC_RELAXED);
+    if (live == 0 || live + bytes <= memory.budget) {
+      if (__atomic_compare_exchange_n(&memory.live, &live, live + bytes, 0,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        memory_counters *c = &memory.stages[stage];
+        __atomic_fetch_add(&c->allocations, 1, __ATOMIC_RELAXED);
+        memory_raise_peak(&c->peak, __atomic_add_fetch(&c->live, bytes, __ATOMIC_RELAXED));
+        memory_raise_peak(&memory.peak, live + bytes);
+        return 0;
+      }
+      continue;
+    }
+    if (!wait)
+      return 1;
+    if (!waited++)
+      __atomic_fetch_add(&memory.waits, 1, __ATOMIC_RELAXED);
+    nanosleep(&pause, NULL);
+  }
+
+  memory_account(stage, bytes);
+  return 0;
+}
+
+/* resident set size of the process right now, from /proc/self/statm */
+static inline size_t memory_rss(void)
+{
+  unsigned long pages = 0, resident = 0;
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (!statm)
+    return 0;
+  if (fscanf(statm, "%lu %lu", &pages, &resident) != 2)
+    resident = 0;
+  fclose(statm);
+  return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+/* high water mark of the resident set size */
+static inline size_t memory_peak_rss(void)
+{
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+  return (size_t)usage.ru_maxrss * 1024; /* kilobytes on linux */
+}
+
+/* accounts the growth of the resident set since _rss_before (see memory_rss) */
+static inline size_t memory_account_rss(int stage, size_t rss_before)
+{
+  size_t now = memory_rss();
+  size_t grown = now > rss_before ? now - rss_before : 0;
+  memory_account(stage, grown);
+  return grown;
+}
+
+static inline void memory_report(FILE *out)
+{
+  int s;
+  fprintf(out, "%-12s %12s %12s %14s %14s\n", "stage", "allocations", "releases", "live [B]", "peak [B]");
+  for (s = 0; s < MEMORY_STAGES; ++s) {
+    const memory_counters *c = &memory.stages[s];
+    fprintf(out, "%-12s %12zu %12zu %14zu %14zu\n", memory_stage_name(s),
+            c->allocations, c->releases, c->live, c->peak);
+  }
+  fprintf(out, "%-12s %12s %12s %14zu %14zu\n", "total", "", "", memory.live, memory.peak);
+  if (memory.budget)
+    fprintf(out, "budget %zu B, %zu reservations waited\n", memory.budget, memory.waits);
+  fprintf(out, "peak RSS %zu B\n", memory_peak_rss());
+}
+
+static inline void memory_report_at_exit(void)
+{
+  memory_report(stderr);
+}
+
+/* reads the environment, call once at startup */
+static inline void memory_init(void)
+{
+  const char *budget = getenv("H26X_MEMORY_BUDGET");
+  const char *report = getenv("H26X_MEMORY_REPORT");
+
+  if (memory.initialized)
+    return;
+  memory.initialized = 1;
+
+  if (budget && *budget) {
+    memory.budget = (size_t)strtoull(budget, NULL, 10) << 20;
+    if (memory.budget)
+      av_max_alloc(memory.budget);
+  }
+
+  if (report && *report && strcmp(report, "0") != 0)
+    atexit(memory_report_at_exit);
+}
+
+#endif /* _MEMORY_H_ */
@@ -0,0 +1,144 @@
+#ifndef _MOSAIC_H_
+#define _MOSAIC_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+/*
+ * mosaic packing: cols x rows consecutive Z slices are tiled into one coded
+ * picture (row major), which amortises the per-picture cost of the encoder
+ * (headers, lookahead, thread synchronisation) for small slices. The
+ * codecs see nothing but a larger video; the layout travels next to the
+ * stream in a small text file (<stream>.mosaic).
+ */
+
+struct mosaic_layout {
+  int cols;
+  int rows;
+  int slice_width;
+  int slice_height;
+  int depth;          ///< number of slices in the volume
+};
+
+inline int mosaic_tiles(const mosaic_layout& _layout) { return _layout.cols * _layout.rows; }
+inline int mosaic_width(const mosaic_layout& _layout) { return _layout.cols * _layout.slice_width; }
+inline int mosaic_height(const mosaic_layout& _layout) { return _layout.rows * _layout.slice_height; }
+inline int mosaic_pictures(const mosaic_layout& _layout)
+{
+  return (_layout.depth + mosaic_tiles(_layout) - 1) / mosaic_tiles(_layout);
+}
+
+//largest coded picture a mosaic may use (H.264 level 5.1)
+static const int mosaic_max_width = 4096;
+static const int mosaic_max_height = 2304;
+
+//false if the picture of _layout exceeds mosaic_max_width x mosaic_max_height
+inline bool mosaic_fits(const mosaic_layout& _layout)
+{
+  return (int64_t)_layout.cols * _layout.slice_width <= mosaic_max_width &&
+    (int64_t)_layout.rows * _layout.slice_height <= mosaic_max_height;
+}
+
+/*
+ * picks the tiling: each encoder thread should get a few hundred kilo pixels
+ * of work per picture, the picture must stay within mosaic_max_width x
+ * mosaic_max_height and there is no point in tiling more slices than the
+ * volume has
+ */
+inline mosaic_layout choose_mosaic_layout(int _slice_width, int _slice_height, int _depth, unsigned _cpus)
+{
+  const int max_width = mosaic_max_width;
+  const int max_height = mosaic_max_height;
+
+  mosaic_layout layout = { 1, 1, _slice_width, _slice_height, _depth };
+
+  const double slice_area = (double)_slice_width * _slice_height;
+  const double target_area = std::min(std::max(_cpus, 1u) * 256. * 1024., (double)max_width * max_height);
+  int tiles = std::max(1, (int)(target_area / slice_area));
+  tiles = std::min(tiles, std::max(_depth, 1));
+
+  const int max_cols = std::max(1, max_width / _slice_width);
+  const int max_rows = std::max(1, max_height / _slice_height);
+  tiles = std::min(tiles, max_cols * max_rows);
+
+  //as square as possible in pixels
+  int cols = (int)std::lround(std::sqrt(tiles * (double)_slice_height / _slice_width));
+  cols = std::min(std::max(cols, 1), max_cols);
+  int rows = std::min((tiles + cols - 1) / cols, max_rows);
+
+  //do not leave a whole row of tiles empty
+  while (rows > 1 && (rows - 1) * cols >= tiles)
+    --rows;
+
+  layout.cols = cols;
+  layout.rows = rows;
+  return layout;
+}
+
+//copies _slice (yuv420p) into tile _tile of _picture
+inline void mosaic_pack(const AVFrame* _slice, int _tile, const mosaic_layout& _layout, AVFrame* _picture)
+{
+  const int tx = _tile % _layout.cols;
+  const int ty = _tile / _layout.cols;
+
+  for (int p = 0; p < 3; ++p) {
+    const int shift = p ? 1 : 0;
+    const int w = _layout.slice_width >> shift;
+    const int h = _layout.slice_height >> shift;
+    uint8_t* dst = _picture->data[p] + (ty * h) * _picture->linesize[p] + tx * w;
+    for (int y = 0; y < h; ++y)
+      std::memcpy(dst + y * _picture->linesize[p], _slice->data[p] + y * _slice->linesize[p], w);
+  }
+}
+
+//fills tile _tile with flat black, used past the last slice of the volume
+inline void mosaic_clear(int _tile, const mosaic_layout& _layout, AVFrame* _picture)
+{
+  const int tx = _tile % _layout.cols;
+  const int ty = _tile / _layout.cols;
+
+  for (int p = 0; p < 3; ++p) {
+    const int shift = p ? 1 : 0;
+    const int w = _layout.slice_width >> shift;
+    const int h = _layout.slice_height >> shift;
+    uint8_t* dst = _picture->data[p] + (ty * h) * _picture->linesize[p] + tx * w;
+    for (int y = 0; y < h; ++y)
+      std::memset(dst + y * _picture->linesize[p], p ? 128 : 16, w);
+  }
+}
+
+//luma plane of tile _tile inside a decoded mosaic picture (no copy)
+inline const uint8_t* mosaic_tile_luma(const AVFrame* _picture, int _tile, const mosaic_layout& _layout)
+{
+  const int tx = _tile % _layout.cols;
+  const int ty = _tile / _layout.cols;
+  return _picture->data[0] + (ty * _layout.slice_height) * _picture->linesize[0] + tx * _layout.slice_width;
+}
+
+inline int mosaic_write_layout(const mosaic_layout& _layout, const std::string& _fname)
+{
+  std::ofstream file(_fname.c_str(), std::ios_base::trunc | std::ios_base::out);
+  if (!file.good())
+    return 1;
+  file << _layout.cols << ' ' << _layout.rows << ' ' << _layout.slice_width << ' '
+       << _layout.slice_height << ' ' << _layout.depth << '\n';
+  return file.good() ? 0 : 1;
+}
+
+inline int mosaic_read_layout(const std::string& _fname, mosaic_layout& _layout)
+{
+  std::ifstream file(_fname.c_str());
+  if (!(file >> _layout.cols >> _layout.rows >> _layout.slice_width >> _layout.slice_height >> _layout.depth))
+    return 1;
+  return (_layout.cols > 0 && _layout.rows > 0) ? 0 : 1;
+}
+
+#endif /* _MOSAIC_H_ */
@@ -0,0 +1,510 @@
+#ifndef _NAL_EDIT_H_
+#define _NAL_EDIT_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "nal_scan.hpp"
+
+/*
+ * Compressed-domain editing of Annex-B streams (as written by
+ * video_encode_example/video_encode_to_buffer) on top of the NAL index of
+ * nal_scan.hpp: nothing is decoded, an edit is a list of byte ranges of the
+ * inputs that is written out in one go.
+ *
+ * Extracting slices [first, first + count) copies the access units from
+ * the nearest clean random access point (IDR, BLA, or CRA without RASL
+ * pictures) up to the last picture the range needs; parameter sets that
+ * were sent before that point are copied in front. The copy usually holds
+ * a few more slices than asked for, which slices a decoder has to keep is
+ * recorded next to the stream:
+ *
+ *   <stream>.trim: "H26XTRIM1 <ranges>", then one line per range of
+ *                  decoded slices to keep "<first> <count>"
+ *
+ * Joining appends streams that each start with a clean random access
+ * point, with an end of sequence NAL unit between them so that POC and
+ * reference state start over; a stream without parameter sets in front of
+ * its first picture gets those of the stream before it. Every stream
+ * brings its own parameter sets, which replace those of the same id before
+ * them; parameter sets are not rewritten, so the SPS of the streams must
+ * agree in the fields decoders keep across a sequence (profile, chroma
+ * format, bit depth, frame_num and POC coding), else the join is refused.
+ */
+
+struct nal_segment {
+  const uint8_t* data;
+  size_t size;
+  bool start_code;     ///< write a 4-byte start code first (data is a bare NAL unit)
+};
+
+struct nal_keep {
+  int first;
+  int count;
+};
+
+struct nal_trim {
+  std::vector<nal_keep> ranges;  ///< empty: keep every decoded slice
+};
+
+//an input of nal_plan_join: a mapped stream, its index and its trim
+struct nal_stream {
+  const uint8_t* data;
+  size_t size;
+  nal_scan_result scan;
+  nal_trim trim;
+};
+
+/*
+ * display order: _display[i] is the slice number of picture i (decode
+ * order); POC counts within the pictures between two IDR/BLA pictures
+ */
+inline void nal_display_order(const nal_scan_result& _scan, std::vector<int>& _display)
+{
+  const int pictures = (int)_scan.pictures.size();
+  _display.resize(pictures);
+  for (int i = 0; i < pictures; ++i)
+    _display[i] = i;
+
+  for (int i = 0; i < pictures; ++i)
+    if (_scan.pictures[i].poc < 0)
+      return;  //without POC decode order is the best guess
+
+  std::vector<int> order;
+  for (int a = 0; a < pictures;) {
+    int b = a + 1;
+    while (b < pictures) {
+      const nal_picture& pic = _scan.pictures[b];
+      const bool reset = _scan.codec == NAL_CODEC_HEVC ? pic.nal_type >= 16 && pic.nal_type <= 20 : pic.keyframe;
+      if (reset)
+        break;
+      ++b;
+    }
+    order.clear();
+    for (int i = a; i < b; ++i)
+      order.push_back(i);
+    std::stable_sort(order.begin(), order.end(), [&_scan](int _l, int _r) {
+      return _scan.pictures[_l].poc < _scan.pictures[_r].poc;
+    });
+    for (int k = 0; k < b - a; ++k)
+      _display[order[k]] = a + k;
+    a = b;
+  }
+}
+
+//decoding can start at picture _index without anything decoded before it
+inline bool nal_clean_start(const nal_scan_result& _scan, int _index)
+{
+  const nal_picture& pic = _scan.pictures[_index];
+  if (!pic.keyframe)
+    return false;
+  if (_scan.codec != NAL_CODEC_HEVC || pic.nal_type != 21)
+    return true;
+  //the RASL pictures of a CRA reference pictures before it
+  for (size_t i = _index + 1; i < _scan.pictures.size() && !_scan.pictures[i].keyframe; ++i)
+    if (_scan.pictures[i].nal_type == 8 || _scan.pictures[i].nal_type == 9)
+      return false;
+  return true;
+}
+
+struct nal_gop {
+  int start;           ///< decode order: pictures [start, end)
+  int end;
+  int first;           ///< display order: slices [first, first + end - start)
+};
+
+/*
+ * splits the stream at every clean random access point into GOPs that
+ * decode independently of each other (a stream of open GOPs is one GOP)
+ */
+inline void nal_closed_gops(const nal_scan_result& _scan, const std::vector<int>& _display, std::vector<nal_gop>& _gops)
+{
+  _gops.clear();
+  const int pictures = (int)_scan.pictures.size();
+  for (int i = 0; i < pictures; ++i) {
+    if (i == 0 || nal_clean_start(_scan, i)) {
+      nal_gop gop = { i, i + 1, _display[i] };
+      _gops.push_back(gop);
+    }
+    else
+      _gops.back().end = i + 1;
+    //leading pictures of a CRA come out before it
+    _gops.back().first = std::min(_gops.back().first, _display[i]);
+  }
+}
+
+/*
+ * decode order range [_start, _last] that yields the slices [_first,
+ * _first + _count); returns 0 on success, 1 if the range is invalid or no
+ * clean random access point precedes it
+ */
+inline int nal_range_pictures(const nal_scan_result& _scan, const std::vector<int>& _display, int _first,
+                              int _count, int& _start, int& _last)
+{
+  const int pictures = (int)_scan.pictures.size();
+  if (_first < 0 || _count <= 0 || _first + _count > pictures)
+    return 1;
+
+  int lowest = pictures;
+  _last = -1;
+  for (int i = 0; i < pictures; ++i)
+    if (_display[i] >= _first && _display[i] < _first + _count) {
+      lowest = std::min(lowest, i);
+      _last = std::max(_last, i);
+    }
+
+  _start = lowest;
+  while (_start >= 0 && !nal_clean_start(_scan, _start))
+    --_start;
+  return _start < 0;
+}
+
+//the parameter set types of _codec: VPS (HEVC only, -1 otherwise), SPS, PPS
+inline void nal_parameter_set_types(nal_codec _codec, int _types[3])
+{
+  const bool hevc = _codec == NAL_CODEC_HEVC;
+  _types[0] = hevc ? 32 : -1;
+  _types[1] = hevc ? 33 : 7;
+  _types[2] = hevc ? 34 : 8;
+}
+
+/*
+ * the last unit of every parameter set type sent before offset _before;
+ * returns 1 if one was never sent
+ */
+inline int nal_last_parameter_sets(const nal_scan_result& _scan, size_t _before, std::vector<const nal_unit*>& _units)
+{
+  int types[3];
+  nal_parameter_set_types(_scan.codec, types);
+  const nal_unit* last[3] = { NULL, NULL, NULL };
+  for (const nal_unit& nal : _scan.units) {
+    if (nal.start >= _before)
+      break;
+    for (int t = 0; t < 3; ++t)
+      if (nal.type == types[t])
+        last[t] = &nal;
+  }
+
+  _units.clear();
+  for (int t = 0; t < 3; ++t) {
+    if (types[t] < 0)
+      continue;
+    if (!last[t])
+      return 1;
+    _units.push_back(last[t]);
+  }
+  return 0;
+}
+
+/*
+ * the units of the parameter set types missing in front of the first slice
+ * of picture _index, each taken from its last occurrence earlier in the
+ * stream; returns 1 if one was never sent
+ */
+inline int nal_missing_parameter_sets(const nal_scan_result& _scan, int _index, std::vector<const nal_unit*>& _units)
+{
+  int types[3];
+  nal_parameter_set_types(_scan.codec, types);
+  const nal_picture& pic = _scan.pictures[_index];
+
+  bool present[3] = { types[0] < 0, false, false };
+  for (const nal_unit& nal : _scan.units) {
+    if (nal.start < pic.start)
+      continue;
+    if (nal_is_vcl(_scan.codec, nal.type))
+      break;
+    for (int t = 0; t < 3; ++t)
+      present[t] = present[t] || nal.type == types[t];
+  }
+  if (present[0] && present[1] && present[2]) {
+    _units.clear();
+    return 0;
+  }
+
+  std::vector<const nal_unit*> last;
+  if (nal_last_parameter_sets(_scan, pic.start, last) != 0)
+    return 1;
+  _units.clear();
+  for (const nal_unit* nal : last) {
+    bool sent = false;
+    for (int t = 0; t < 3; ++t)
+      sent = sent || (present[t] && nal->type == types[t]);
+    if (!sent)
+      _units.push_back(nal);
+  }
+  return 0;
+}
+
+inline void nal_segment_unit(const uint8_t* _data, const nal_unit& _nal, std::vector<nal_segment>& _segments)
+{
+  nal_segment segment = { _data + _nal.offset, _nal.size, true };
+  _segments.push_back(segment);
+}
+
+//slices a decode of _trim's stream yields, _decoded of them before trimming
+inline int nal_trim_slices(const nal_trim& _trim, int _decoded)
+{
+  if (_trim.ranges.empty())
+    return _decoded;
+  int slices = 0;
+  for (const nal_keep& keep : _trim.ranges)
+    slices += keep.count;
+  return slices;
+}
+
+//number of the slice the _decoded-th decoded slice becomes after trimming, -1 if it is dropped
+inline int nal_trim_slice(const nal_trim& _trim, int _decoded)
+{
+  if (_trim.ranges.empty())
+    return _decoded;
+  int kept = 0;
+  for (const nal_keep& keep : _trim.ranges) {
+    if (_decoded >= keep.first && _decoded < keep.first + keep.count)
+      return kept + _decoded - keep.first;
+    kept += keep.count;
+  }
+  return -1;
+}
+
+//the inverse: decoded slice that becomes slice _kept after trimming, -1 if there is none
+inline int nal_trim_decoded(const nal_trim& _trim, int _kept)
+{
+  if (_trim.ranges.empty())
+    return _kept;
+  for (const nal_keep& keep : _trim.ranges) {
+    if (_kept < keep.count)
+      return keep.first + _kept;
+    _kept -= keep.count;
+  }
+  return -1;
+}
+
+/*
+ * plans the extraction of slices [_first, _first + _count) of the stream
+ * _data/_scan (counted after _input's trim) into _segments, with the
+ * slices to keep in _trim; returns 0 on success
+ */
+inline int nal_plan_extract(const uint8_t* _data, const nal_scan_result& _scan, const nal_trim& _input,
+                            int _first, int _count, std::vector<nal_segment>& _segments, nal_trim& _trim)
+{
+  const int decoded = (int)_scan.pictures.size();
+  if (_first < 0 || _count <= 0 || _first + _count > nal_trim_slices(_input, decoded))
+    return 1;
+  const int decoded_first = nal_trim_decoded(_input, _first);
+  const int decoded_end = nal_trim_decoded(_input, _first + _count - 1) + 1;
+
+  std::vector<int> display;
+  nal_display_order(_scan, display);
+
+  int start = 0, last = 0;
+  std::vector<const nal_unit*> parameter_sets;
+  if (nal_range_pictures(_scan, display, decoded_first, decoded_end - decoded_first, start, last) != 0 ||
+      nal_missing_parameter_sets(_scan, start, parameter_sets) != 0)
+    return 1;
+
+  _segments.clear();
+  for (const nal_unit* nal : parameter_sets)
+    nal_segment_unit(_data, *nal, _segments);
+  nal_segment pictures = { _data + _scan.pictures[start].start,
+                           _scan.pictures[last].end - _scan.pictures[start].start, false };
+  _segments.push_back(pictures);
+
+  //the copy decodes its pictures in display order, slice n of it being the
+  //n-th smallest display number among them (not contiguous when B-frames
+  //follow last); what lies outside the range is dropped
+  std::vector<int> copied(display.begin() + start, display.begin() + last + 1);
+  std::sort(copied.begin(), copied.end());
+  auto rank = [&copied](int _display) {
+    return (int)(std::lower_bound(copied.begin(), copied.end(), _display) - copied.begin());
+  };
+
+  nal_trim input = _input;
+  if (input.ranges.empty()) {
+    nal_keep all = { 0, decoded };
+    input.ranges.push_back(all);
+  }
+  _trim.ranges.clear();
+  for (const nal_keep& keep : input.ranges) {
+    const int low = std::max(keep.first, decoded_first);
+    const int high = std::min(keep.first + keep.count, decoded_end);
+    if (low < high) {
+      nal_keep kept = { rank(low), rank(high) - rank(low) };
+      if (kept.count > 0)
+        _trim.ranges.push_back(kept);
+    }
+  }
+  if (_trim.ranges.size() == 1 && _trim.ranges[0].first == 0 && _trim.ranges[0].count == last - start + 1)
+    _trim.ranges.clear();
+  return 0;
+}
+
+//the first field in which the SPS of two streams to join differ, NULL if none
+inline const char* nal_sps_mismatch(const nal_sps& _a, const nal_sps& _b, bool _hevc)
+{
+  if (_a.profile_idc != _b.profile_idc)
+    return "profile";
+  if (_a.chroma_format_idc != _b.chroma_format_idc || _a.separate_colour_plane != _b.separate_colour_plane)
+    return "chroma format";
+  if (_a.bit_depth_luma != _b.bit_depth_luma || _a.bit_depth_chroma != _b.bit_depth_chroma)
+    return "bit depth";
+  if (_a.log2_max_poc_lsb != _b.log2_max_poc_lsb)
+    return "log2_max_pic_order_cnt_lsb";
+  if (_hevc)
+    return NULL;
+  if (_a.poc_type != _b.poc_type)
+    return "pic_order_cnt_type";
+  if (_a.log2_max_frame_num != _b.log2_max_frame_num)
+    return "log2_max_frame_num";
+  if (_a.frame_mbs_only != _b.frame_mbs_only)
+    return "frame_mbs_only_flag";
+  return NULL;
+}
+
+/*
+ * plans joining _streams in order; the trims of the inputs are carried
+ * over into _trim; returns 0 on success, else 1 with the reason in _error
+ */
+inline int nal_plan_join(const std::vector<nal_stream>& _streams, std::vector<nal_segment>& _segments,
+                         nal_trim& _trim, std::string& _error)
+{
+  static const uint8_t h264_end_of_sequence[1] = { 0x0a };
+  static const uint8_t hevc_end_of_sequence[2] = { 0x48, 0x01 };
+
+  _segments.clear();
+  _trim.ranges.clear();
+  if (_streams.empty()) {
+    _error = "nothing to join";
+    return 1;
+  }
+
+  const nal_scan_result& head = _streams[0].scan;
+  const bool hevc = head.codec == NAL_CODEC_HEVC;
+  int base = 0;
+  bool trimmed = false;
+
+  for (size_t k = 0; k < _streams.size(); ++k) {
+    const nal_stream& stream = _streams[k];
+    const nal_scan_result& scan = stream.scan;
+    const std::string which = "stream " + std::to_string(k + 1);
+    if (scan.codec != head.codec || scan.width != head.width || scan.height != head.height) {
+      _error = which + " differs in codec or slice size";
+      return 1;
+    }
+    if (scan.pictures.empty() || !nal_clean_start(scan, 0)) {
+      _error = which + " does not start with a closed GOP";
+      return 1;
+    }
+    const char* mismatch = nal_sps_mismatch(head.sps, scan.sps, hevc);
+    if (mismatch) {
+      _error = which + " differs in the " + mismatch + " of its SPS";
+      return 1;
+    }
+
+    std::vector<const nal_unit*> parameter_sets;
+    int missing = nal_missing_parameter_sets(scan, 0, parameter_sets);
+    if (missing && k == 0) {
+      _error = which + " has no parameter sets";
+      return 1;
+    }
+
+    if (k > 0) {
+      nal_segment end_of_sequence = { hevc ? hevc_end_of_sequence : h264_end_of_sequence,
+                                      hevc ? sizeof(hevc_end_of_sequence) : sizeof(h264_end_of_sequence),
+                                      true };
+      _segments.push_back(end_of_sequence);
+
+      //parameter sets sent out of band: go on with those of the stream before
+      if (missing) {
+        const nal_stream& before = _streams[k - 1];
+        if (nal_last_parameter_sets(before.scan, before.size, parameter_sets) != 0) {
+          _error = which + " has no parameter sets";
+          return 1;
+        }
+        for (const nal_unit* nal : parameter_sets)
+          nal_segment_unit(before.data, *nal, _segments);
+      }
+    }
+
+    const size_t first = scan.pictures[0].start;
+    nal_segment pictures = { stream.data + first, stream.size - first, false };
+    _segments.push_back(pictures);
+
+    const int decoded = (int)scan.pictures.size();
+    if (stream.trim.ranges.empty()) {
+      nal_keep keep = { base, decoded };
+      _trim.ranges.push_back(keep);
+    }
+    else {
+      trimmed = true;
+      for (const nal_keep& keep : stream.trim.ranges) {
+        nal_keep shifted = { base + keep.first, keep.count };
+        _trim.ranges.push_back(shifted);
+      }
+    }
+    base += decoded;
+  }
+
+  if (!trimmed)
+    _trim.ranges.clear();
+  return 0;
+}
+
+//writes the segments to _out; returns 0 on success
+inline int nal_write_segments(const std::vector<nal_segment>& _segments, FILE* _out)
+{
+  static const uint8_t start_code[4] = { 0, 0, 0, 1 };
+  for (const nal_segment& segment : _segments) {
+    if (segment.start_code && fwrite(start_code, 1, sizeof(start_code), _out) != sizeof(start_code))
+      return 1;
+    if (fwrite(segment.data, 1, segment.size, _out) != segment.size)
+      return 1;
+  }
+  return 0;
+}
+
+inline std::string nal_trim_path(const std::string& _stream)
+{
+  return _stream + ".trim";
+}
+
+//writes the sidecar of _stream, removes a stale one if _trim keeps everything
+inline int nal_trim_write(const std::string& _stream, const nal_trim& _trim)
+{
+  if (_trim.ranges.empty()) {
+    std::remove(nal_trim_path(_stream).c_str());
+    return 0;
+  }
+  FILE* out = fopen(nal_trim_path(_stream).c_str(), "w");
+  if (!out)
+    return 1;
+  fprintf(out, "H26XTRIM1 %zu\n", _trim.ranges.size());
+  for (const nal_keep& keep : _trim.ranges)
+    fprintf(out, "%d %d\n", keep.first, keep.count);
+  return fclose(out) != 0;
+}
+
+//reads the sidecar of _stream; no sidecar is an empty trim, returns 1 if it is malformed
+inline int nal_trim_read(const std::string& _stream, nal_trim& _trim)
+{
+  _trim.ranges.clear();
+  FILE* in = fopen(nal_trim_path(_stream).c_str(), "r");
+  if (!in)
+    return 0;
+
+  size_t ranges = 0;
+  int rcode = fscanf(in, "H26XTRIM1 %zu", &ranges) != 1;
+  for (size_t r = 0; r < ranges && !rcode; ++r) {
+    nal_keep keep;
+    if (fscanf(in, "%d %d", &keep.first, &keep.count) != 2 || keep.first < 0 || keep.count < 0)
+      rcode = 1;
+    else
+      _trim.ranges.push_back(keep);
+  }
+  fclose(in);
+  return rcode;
+}
+
+#endif /* _NAL_EDIT_H_ */
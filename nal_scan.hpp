@@ -0,0 +1,696 @@
+#ifndef _NAL_SCAN_H_
+#define _NAL_SCAN_H_
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Compressed-domain inspection of H.264/HEVC Annex-B elementary streams
+ * (as written by video_encode_example). Nothing in here touches libav:
+ * start codes are located with a SIMD search, NAL unit headers are
+ * classified and only the leading fields of SPS/PPS/slice headers are
+ * parsed, enough to recover slice type, POC and keyframe flags per picture.
+ */
+
+enum nal_codec {
+  NAL_CODEC_UNKNOWN = 0,
+  NAL_CODEC_H264,
+  NAL_CODEC_HEVC
+};
+
+struct nal_unit {
+  size_t start;        ///< offset of the start code
+  size_t offset;       ///< offset of the NAL header (first byte after the start code)
+  size_t size;         ///< size of the NAL unit without start code
+  int type;
+  int temporal_id;     ///< HEVC only, 0 for H.264
+  int ref_idc;         ///< H.264 nal_ref_idc, 1 for HEVC reference pictures
+};
+
+struct nal_picture {
+  size_t start;        ///< first byte of the access unit (including parameter sets/SEI)
+  size_t end;          ///< one past the last byte of the access unit
+  int index;           ///< decode order
+  int poc;             ///< picture order count, -1 if it could not be derived
+  char type;           ///< 'I', 'P' or 'B' (combined over all slices)
+  bool keyframe;       ///< IDR (H.264) or IRAP (HEVC)
+  int nal_type;        ///< NAL unit type of the first slice
+  int slices;
+};
+
+/*
+ * start code search
+ */
+
+//returns the offset of the next 00 00 01 at or after _pos, _size if there is none
+inline size_t find_start_code(const uint8_t* _data, size_t _size, size_t _pos)
+{
+  size_t i = _pos;
+
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi8(1);
+
+  //compare 16 candidate positions at once: byte i == 0, i+1 == 0 and i+2 == 1
+  for (; i + 18 <= _size; i += 16) {
+    __m128i b2 = _mm_loadu_si128((const __m128i*)(_data + i + 2));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(b2, one));
+    if (!mask)
+      continue;
+
+    __m128i b0 = _mm_loadu_si128((const __m128i*)(_data + i));
+    __m128i b1 = _mm_loadu_si128((const __m128i*)(_data + i + 1));
+    mask &= _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(b0, zero),
+                                            _mm_cmpeq_epi8(b1, zero)));
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+#endif
+
+  for (; i + 3 <= _size; ++i) {
+    if (_data[i + 2] > 1) {
+      i += 2;
+      continue;
+    }
+    if (_data[i] == 0 && _data[i + 1] == 0 && _data[i + 2] == 1)
+      return i;
+  }
+
+  return _size;
+}
+
+//splits an Annex-B buffer into NAL units (headers are not interpreted)
+inline void split_nal_units(const uint8_t* _data, size_t _size, std::vector<nal_unit>& _units)
+{
+  size_t sc = find_start_code(_data, _size, 0);
+
+  while (sc < _size) {
+    nal_unit nal = nal_unit();
+    nal.start = sc;
+    //a zero byte right before 00 00 01 belongs to a 4-byte start code
+    if (sc > 0 && _data[sc - 1] == 0 &&
+        (_units.empty() || sc - 1 >= _units.back().offset + _units.back().size))
+      nal.start = sc - 1;
+    nal.offset = sc + 3;
+
+    size_t next = find_start_code(_data, _size, nal.offset);
+    size_t end = next;
+    //trailing_zero_8bits and the leading zero of a 4-byte start code
+    while (end > nal.offset && _data[end - 1] == 0)
+      --end;
+
+    nal.size = end - nal.offset;
+    nal.type = -1;
+    _units.push_back(nal);
+    sc = next;
+  }
+}
+
+/*
+ * RBSP bit reader (emulation prevention bytes are removed up front)
+ */
+
+struct rbsp_reader {
+  std::vector<uint8_t> bytes;
+  size_t pos;   ///< in bits
+  bool overrun;
+
+  rbsp_reader(const uint8_t* _nal, size_t _size, size_t _header_bytes, size_t _max_bytes = 0)
+    : bytes(), pos(0), overrun(false)
+  {
+    size_t end = _size;
+    if (_max_bytes && end > _header_bytes + _max_bytes)
+      end = _header_bytes + _max_bytes;
+
+    bytes.reserve(end);
+    int zeros = 0;
+    for (size_t i = _header_bytes; i < end; ++i) {
+      if (zeros >= 2 && _nal[i] == 3) {
+        zeros = 0;
+        continue;
+      }
+      zeros = _nal[i] ? 0 : zeros + 1;
+      bytes.push_back(_nal[i]);
+    }
+  }
+
+  uint32_t u(int _n)
+  {
+    uint32_t value = 0;
+    for (int b = 0; b < _n; ++b) {
+      if (pos >= bytes.size() * 8) {
+        overrun = true;
+        return 0;
+      }
+      value = (value << 1) | ((bytes[pos >> 3] >> (7 - (pos & 7))) & 1);
+      ++pos;
+    }
+    return value;
+  }
+
+  void skip(size_t _n) { pos += _n; if (pos > bytes.size() * 8) overrun = true; }
+
+  uint32_t ue()
+  {
+    int leading_zeros = 0;
+    while (!overrun && u(1) == 0) {
+      if (++leading_zeros > 31) {
+        overrun = true;
+        return 0;
+      }
+    }
+    return ((1u << leading_zeros) - 1) + u(leading_zeros);
+  }
+
+  int32_t se()
+  {
+    uint32_t k = ue();
+    return (k & 1) ? (int32_t)((k + 1) / 2) : -(int32_t)(k / 2);
+  }
+};
+
+/*
+ * parameter sets, only the fields needed to get through a slice header
+ */
+
+struct nal_sps {
+  bool valid;
+  int width, height;
+  int profile_idc;                 // general_profile_idc for HEVC
+  int chroma_format_idc;
+  int bit_depth_luma;
+  int bit_depth_chroma;
+  bool separate_colour_plane;
+  int log2_max_frame_num;          // H.264
+  int poc_type;                    // H.264
+  int log2_max_poc_lsb;
+  bool frame_mbs_only;             // H.264
+  int pic_size_in_ctbs;            // HEVC
+};
+
+struct nal_pps {
+  bool valid;
+  int sps_id;
+  bool dependent_slice_segments;   // HEVC
+  bool output_flag_present;        // HEVC
+  int num_extra_slice_header_bits; // HEVC
+};
+
+struct nal_slice {
+  bool first_in_picture;
+  bool dependent;
+  char type;
+  int pps_id;
+  int frame_num;
+  int poc_lsb;
+  bool field;
+};
+
+inline nal_codec detect_nal_codec(const uint8_t* _data, const std::vector<nal_unit>& _units)
+{
+  for (size_t i = 0; i < _units.size() && i < 8; ++i) {
+    const uint8_t* nal = _data + _units[i].offset;
+    if (_units[i].size < 2 || (nal[0] & 0x80))
+      continue;
+    //HEVC VPS/SPS/PPS/AUD have a 2-byte header with layer id 0 and tid 1
+    int hevc_type = (nal[0] >> 1) & 0x3f;
+    if (nal[1] == 0x01 && hevc_type >= 32 && hevc_type <= 35)
+      return NAL_CODEC_HEVC;
+    int h264_type = nal[0] & 0x1f;
+    if (h264_type == 7 || h264_type == 9 || h264_type == 5)
+      return NAL_CODEC_H264;
+  }
+  return NAL_CODEC_UNKNOWN;
+}
+
+inline void h264_skip_scaling_list(rbsp_reader& _r, int _size)
+{
+  int last = 8, next = 8;
+  for (int j = 0; j < _size; ++j) {
+    if (next != 0) {
+      int delta = _r.se();
+      next = (last + delta + 256) % 256;
+    }
+    last = (next == 0) ? last : next;
+  }
+}
+
+inline int h264_parse_sps(rbsp_reader& _r, nal_sps& _sps)
+{
+  int profile_idc = _r.u(8);
+  _r.skip(16); //constraint flags, level_idc
+  int id = _r.ue();
+
+  _sps = nal_sps();
+  _sps.profile_idc = profile_idc;
+  _sps.chroma_format_idc = 1;
+  _sps.bit_depth_luma = _sps.bit_depth_chroma = 8;
+  if (profile_idc == 100 || profile_idc == 110 || profile_idc == 122 ||
+      profile_idc == 244 || profile_idc == 44 || profile_idc == 83 ||
+      profile_idc == 86 || profile_idc == 118 || profile_idc == 128 ||
+      profile_idc == 138 || profile_idc == 139 || profile_idc == 134 ||
+      profile_idc == 135) {
+    _sps.chroma_format_idc = _r.ue();
+    if (_sps.chroma_format_idc == 3)
+      _sps.separate_colour_plane = _r.u(1);
+    _sps.bit_depth_luma = _r.ue() + 8;
+    _sps.bit_depth_chroma = _r.ue() + 8;
+    _r.u(1); //qpprime_y_zero_transform_bypass_flag
+    if (_r.u(1)) {
+      int lists = (_sps.chroma_format_idc != 3) ? 8 : 12;
+      for (int i = 0; i < lists; ++i)
+        if (_r.u(1))
+          h264_skip_scaling_list(_r, i < 6 ? 16 : 64);
+    }
+  }
+
+  _sps.log2_max_frame_num = _r.ue() + 4;
+  _sps.poc_type = _r.ue();
+  if (_sps.poc_type == 0) {
+    _sps.log2_max_poc_lsb = _r.ue() + 4;
+  }
+  else if (_sps.poc_type == 1) {
+    _r.u(1);
+    _r.se();
+    _r.se();
+    uint32_t cycle = _r.ue();
+    for (uint32_t i = 0; i < cycle && !_r.overrun; ++i)
+      _r.se();
+  }
+
+  _r.ue(); //max_num_ref_frames
+  _r.u(1); //gaps_in_frame_num_value_allowed_flag
+  int width_mbs = _r.ue() + 1;
+  int height_map_units = _r.ue() + 1;
+  _sps.frame_mbs_only = _r.u(1);
+  if (!_sps.frame_mbs_only)
+    _r.u(1); //mb_adaptive_frame_field_flag
+  _r.u(1);   //direct_8x8_inference_flag
+
+  _sps.width = width_mbs * 16;
+  _sps.height = height_map_units * 16 * (_sps.frame_mbs_only ? 1 : 2);
+  if (_r.u(1)) {
+    int sub_w = (_sps.chroma_format_idc == 1 || _sps.chroma_format_idc == 2) ? 2 : 1;
+    int sub_h = (_sps.chroma_format_idc == 1) ? 2 : 1;
+    if (_sps.separate_colour_plane || _sps.chroma_format_idc == 0)
+      sub_w = sub_h = 1;
+    sub_h *= _sps.frame_mbs_only ? 1 : 2;
+    int left = _r.ue(), right = _r.ue(), top = _r.ue(), bottom = _r.ue();
+    _sps.width -= (left + right) * sub_w;
+    _sps.height -= (top + bottom) * sub_h;
+  }
+
+  _sps.valid = !_r.overrun;
+  return _r.overrun || id > 31 ? -1 : id;
+}
+
+inline int h264_parse_pps(rbsp_reader& _r, nal_pps& _pps)
+{
+  _pps = nal_pps();
+  int id = _r.ue();
+  _pps.sps_id = _r.ue();
+  _pps.valid = !_r.overrun && _pps.sps_id < 32;
+  return _pps.valid && id < 256 ? id : -1;
+}
+
+inline bool h264_parse_slice(rbsp_reader& _r, int _nal_type,
+                             const std::vector<nal_sps>& _sps,
+                             const std::vector<nal_pps>& _pps,
+                             nal_slice& _slice)
+{
+  static const char types[] = { 'P', 'B', 'I', 'P', 'I' }; //P, B, I, SP, SI
+
+  _slice = nal_slice();
+  _slice.poc_lsb = -1;
+  _slice.first_in_picture = _r.ue() == 0;
+  uint32_t slice_type = _r.ue();
+  _slice.type = types[slice_type % 5];
+  _slice.pps_id = _r.ue();
+
+  if (_slice.pps_id < 0 || (size_t)_slice.pps_id >= _pps.size() || !_pps[_slice.pps_id].valid)
+    return false;
+  const nal_sps& sps = _sps[_pps[_slice.pps_id].sps_id];
+  if (!sps.valid)
+    return false;
+
+  if (sps.separate_colour_plane)
+    _r.u(2);
+  _slice.frame_num = _r.u(sps.log2_max_frame_num);
+  if (!sps.frame_mbs_only && _r.u(1)) {
+    _slice.field = true;
+    _r.u(1); //bottom_field_flag
+  }
+  if (_nal_type == 5)
+    _r.ue(); //idr_pic_id
+  if (sps.poc_type == 0)
+    _slice.poc_lsb = _r.u(sps.log2_max_poc_lsb);
+
+  return !_r.overrun;
+}
+
+//returns general_profile_idc
+inline int hevc_skip_profile_tier_level(rbsp_reader& _r, int _max_sub_layers_minus1)
+{
+  _r.skip(3);  //general_profile_space, general_tier_flag
+  const int profile_idc = _r.u(5);
+  _r.skip(80); //general compatibility flags ... general_reserved_zero_43bits + inbld flag
+  _r.skip(8);  //general_level_idc
+
+  bool profile_present[8] = { false };
+  bool level_present[8] = { false };
+  for (int i = 0; i < _max_sub_layers_minus1; ++i) {
+    profile_present[i] = _r.u(1);
+    level_present[i] = _r.u(1);
+  }
+  if (_max_sub_layers_minus1 > 0)
+    for (int i = _max_sub_layers_minus1; i < 8; ++i)
+      _r.skip(2);
+  for (int i = 0; i < _max_sub_layers_minus1; ++i) {
+    if (profile_present[i])
+      _r.skip(88);
+    if (level_present[i])
+      _r.skip(8);
+  }
+  return profile_idc;
+}
+
+inline int hevc_parse_sps(rbsp_reader& _r, nal_sps& _sps)
+{
+  _sps = nal_sps();
+  _sps.frame_mbs_only = true;
+
+  _r.u(4); //sps_video_parameter_set_id
+  int max_sub_layers_minus1 = _r.u(3);
+  _r.u(1); //sps_temporal_id_nesting_flag
+  const int profile_idc = hevc_skip_profile_tier_level(_r, max_sub_layers_minus1);
+
+  int id = _r.ue();
+  _sps.profile_idc = profile_idc;
+  _sps.chroma_format_idc = _r.ue();
+  if (_sps.chroma_format_idc == 3)
+    _sps.separate_colour_plane = _r.u(1);
+  _sps.width = _r.ue();
+  _sps.height = _r.ue();
+  int coded_width = _sps.width, coded_height = _sps.height;
+  if (_r.u(1)) {
+    int sub_w = (_sps.chroma_format_idc == 1 || _sps.chroma_format_idc == 2) ? 2 : 1;
+    int sub_h = (_sps.chroma_format_idc == 1) ? 2 : 1;
+    int left = _r.ue(), right = _r.ue(), top = _r.ue(), bottom = _r.ue();
+    _sps.width -= (left + right) * sub_w;
+    _sps.height -= (top + bottom) * sub_h;
+  }
+  _sps.bit_depth_luma = _r.ue() + 8;
+  _sps.bit_depth_chroma = _r.ue() + 8;
+  _sps.log2_max_poc_lsb = _r.ue() + 4;
+
+  bool ordering_info_present = _r.u(1);
+  for (int i = ordering_info_present ? 0 : max_sub_layers_minus1; i <= max_sub_layers_minus1; ++i) {
+    _r.ue();
+    _r.ue();
+    _r.ue();
+  }
+
+  int log2_min_cb = _r.ue() + 3;
+  int log2_ctb = log2_min_cb + _r.ue();
+  if (log2_ctb < 4 || log2_ctb > 6)
+    return -1;
+  int ctb = 1 << log2_ctb;
+  _sps.pic_size_in_ctbs = ((coded_width + ctb - 1) / ctb) * ((coded_height + ctb - 1) / ctb);
+
+  _sps.valid = !_r.overrun;
+  return _r.overrun || id > 15 ? -1 : id;
+}
+
+inline int hevc_parse_pps(rbsp_reader& _r, nal_pps& _pps)
+{
+  _pps = nal_pps();
+  int id = _r.ue();
+  _pps.sps_id = _r.ue();
+  _pps.dependent_slice_segments = _r.u(1);
+  _pps.output_flag_present = _r.u(1);
+  _pps.num_extra_slice_header_bits = _r.u(3);
+  _pps.valid = !_r.overrun && _pps.sps_id < 16;
+  return _pps.valid && id < 64 ? id : -1;
+}
+
+inline bool hevc_parse_slice(rbsp_reader& _r, int _nal_type,
+                             const std::vector<nal_sps>& _sps,
+                             const std::vector<nal_pps>& _pps,
+                             nal_slice& _slice)
+{
+  static const char types[] = { 'B', 'P', 'I' };
+
+  _slice = nal_slice();
+  _slice.poc_lsb = 0;
+  _slice.first_in_picture = _r.u(1);
+  if (_nal_type >= 16 && _nal_type <= 23)
+    _r.u(1); //no_output_of_prior_pics_flag
+  _slice.pps_id = _r.ue();
+
+  if (_slice.pps_id < 0 || (size_t)_slice.pps_id >= _pps.size() || !_pps[_slice.pps_id].valid)
+    return false;
+  const nal_pps& pps = _pps[_slice.pps_id];
+  const nal_sps& sps = _sps[pps.sps_id];
+  if (!sps.valid)
+    return false;
+
+  if (!_slice.first_in_picture) {
+    if (pps.dependent_slice_segments)
+      _slice.dependent = _r.u(1);
+    int bits = 0;
+    while ((1 << bits) < sps.pic_size_in_ctbs)
+      ++bits;
+    _r.u(bits); //slice_segment_address
+  }
+
+  if (_slice.dependent)
+    return !_r.overrun;
+
+  _r.skip(pps.num_extra_slice_header_bits);
+  uint32_t slice_type = _r.ue();
+  _slice.type = slice_type < 3 ? types[slice_type] : '?';
+  if (pps.output_flag_present)
+    _r.u(1);
+  if (sps.separate_colour_plane)
+    _r.u(2);
+  if (_nal_type != 19 && _nal_type != 20)
+    _slice.poc_lsb = _r.u(sps.log2_max_poc_lsb);
+
+  return !_r.overrun;
+}
+
+/*
+ * stream scanner, collects pictures (access units) in decode order
+ */
+
+struct nal_scan_result {
+  nal_codec codec;
+  int width, height;
+  std::vector<nal_unit> units;
+  std::vector<nal_picture> pictures;
+  nal_sps sps;    ///< active at the first picture, invalid before
+  size_t errors;  ///< NAL units that could not be parsed or referenced missing parameter sets
+};
+
+inline bool nal_is_vcl(nal_codec _codec, int _type)
+{
+  if (_codec == NAL_CODEC_H264)
+    return _type >= 1 && _type <= 5;
+  return _type >= 0 && _type <= 31;
+}
+
+inline bool nal_is_keyframe(nal_codec _codec, int _type)
+{
+  if (_codec == NAL_CODEC_H264)
+    return _type == 5;
+  return _type >= 16 && _type <= 23;
+}
+
+//NAL units that may only appear before the first VCL NAL of an access unit
+inline bool nal_starts_access_unit(nal_codec _codec, int _type)
+{
+  if (_codec == NAL_CODEC_H264)
+    return (_type >= 6 && _type <= 9) || (_type >= 14 && _type <= 18);
+  return (_type >= 32 && _type <= 35) || _type == 39 || (_type >= 41 && _type <= 44) ||
+    (_type >= 48 && _type <= 55);
+}
+
+inline void scan_nal_stream(const uint8_t* _data, size_t _size, nal_scan_result& _result,
+                            nal_codec _codec = NAL_CODEC_UNKNOWN)
+{
+  _result.units.clear();
+  _result.pictures.clear();
+  _result.errors = 0;
+  _result.width = _result.height = 0;
+  _result.sps = nal_sps();
+
+  split_nal_units(_data, _size, _result.units);
+  _result.codec = _codec != NAL_CODEC_UNKNOWN ? _codec : detect_nal_codec(_data, _result.units);
+  if (_result.codec == NAL_CODEC_UNKNOWN)
+    return;
+
+  const bool hevc = _result.codec == NAL_CODEC_HEVC;
+  const size_t header_bytes = hevc ? 2 : 1;
+  std::vector<nal_sps> sps(hevc ? 16 : 32, nal_sps());
+  std::vector<nal_pps> pps(hevc ? 64 : 256, nal_pps());
+
+  //POC state (H.264 poc_type 0/2, HEVC)
+  int prev_poc_msb = 0, prev_poc_lsb = 0;
+  int prev_frame_num = 0, frame_num_offset = 0;
+  bool first_irap = true;
+
+  size_t au_start = _size; //pending start of the next access unit
+  int index = 0;
+
+  for (size_t n = 0; n < _result.units.size(); ++n) {
+    nal_unit& nal = _result.units[n];
+    const uint8_t* p = _data + nal.offset;
+
+    if (nal.size < header_bytes || (p[0] & 0x80)) {
+      ++_result.errors;
+      continue;
+    }
+
+    if (hevc) {
+      nal.type = (p[0] >> 1) & 0x3f;
+      nal.temporal_id = (p[1] & 7) - 1;
+      //sub-layer non-reference pictures have even types up to RSV_VCL_N14
+      nal.ref_idc = (nal.type <= 14 && !(nal.type & 1)) ? 0 : 1;
+    }
+    else {
+      nal.type = p[0] & 0x1f;
+      nal.ref_idc = (p[0] >> 5) & 3;
+    }
+
+    if (nal_starts_access_unit(_result.codec, nal.type) && au_start == _size)
+      au_start = nal.start;
+
+    const int sps_type = hevc ? 33 : 7;
+    const int pps_type = hevc ? 34 : 8;
+
+    if (nal.type == sps_type) {
+      rbsp_reader r(p, nal.size, header_bytes);
+      nal_sps parsed;
+      int id = hevc ? hevc_parse_sps(r, parsed) : h264_parse_sps(r, parsed);
+      if (id < 0) {
+        ++_result.errors;
+      }
+      else {
+        sps[id] = parsed;
+        _result.width = parsed.width;
+        _result.height = parsed.height;
+      }
+    }
+    else if (nal.type == pps_type) {
+      rbsp_reader r(p, nal.size, header_bytes);
+      nal_pps parsed;
+      int id = hevc ? hevc_parse_pps(r, parsed) : h264_parse_pps(r, parsed);
+      if (id < 0)
+        ++_result.errors;
+      else
+        pps[id] = parsed;
+    }
+
+    if (!nal_is_vcl(_result.codec, nal.type))
+      continue;
+
+    //HEVC reserved VCL types carry no slice header we know how to read
+    if (hevc && ((nal.type >= 10 && nal.type <= 15) || nal.type >= 22))
+      continue;
+
+    //slice headers are short, there is no need to unescape the slice data
+    rbsp_reader r(p, nal.size, header_bytes, 64);
+    nal_slice slice;
+    bool ok = hevc ? hevc_parse_slice(r, nal.type, sps, pps, slice)
+      : h264_parse_slice(r, nal.type, sps, pps, slice);
+    if (!ok) {
+      ++_result.errors;
+      continue;
+    }
+
+    bool new_picture = slice.first_in_picture || _result.pictures.empty();
+    if (!new_picture) {
+      nal_picture& pic = _result.pictures.back();
+      ++pic.slices;
+      if (slice.type == 'B' || (slice.type == 'P' && pic.type == 'I'))
+        pic.type = slice.type;
+      continue;
+    }
+
+    size_t pic_start = (au_start != _size) ? au_start : nal.start;
+    if (!_result.pictures.empty())
+      _result.pictures.back().end = pic_start;
+    au_start = _size;
+
+    nal_picture pic = nal_picture();
+    pic.start = pic_start;
+    pic.end = _size;
+    pic.index = index++;
+    pic.type = slice.type;
+    pic.keyframe = nal_is_keyframe(_result.codec, nal.type);
+    pic.nal_type = nal.type;
+    pic.slices = 1;
+    pic.poc = -1;
+
+    const nal_sps& s = sps[pps[slice.pps_id].sps_id];
+    if (_result.pictures.empty())
+      _result.sps = s;
+    if (hevc) {
+      //IDR, BLA and the first CRA reset the POC msb (NoRaslOutputFlag)
+      bool reset = (nal.type >= 16 && nal.type <= 20) || (nal.type == 21 && first_irap);
+      int max_lsb = 1 << s.log2_max_poc_lsb;
+      int msb = 0;
+      if (!reset) {
+        if (slice.poc_lsb < prev_poc_lsb && prev_poc_lsb - slice.poc_lsb >= max_lsb / 2)
+          msb = prev_poc_msb + max_lsb;
+        else if (slice.poc_lsb > prev_poc_lsb && slice.poc_lsb - prev_poc_lsb > max_lsb / 2)
+          msb = prev_poc_msb - max_lsb;
+        else
+          msb = prev_poc_msb;
+      }
+      pic.poc = msb + slice.poc_lsb;
+      if (nal.type >= 16 && nal.type <= 23)
+        first_irap = false;
+      //prevTid0Pic excludes RASL, RADL and sub-layer non-reference pictures
+      bool radl_rasl = nal.type >= 6 && nal.type <= 9;
+      if (nal.temporal_id == 0 && !radl_rasl && nal.ref_idc) {
+        prev_poc_msb = msb;
+        prev_poc_lsb = slice.poc_lsb;
+      }
+    }
+    else if (s.poc_type == 0 && !slice.field) {
+      int max_lsb = 1 << s.log2_max_poc_lsb;
+      if (pic.keyframe)
+        prev_poc_msb = prev_poc_lsb = 0;
+      int msb = prev_poc_msb;
+      if (slice.poc_lsb < prev_poc_lsb && prev_poc_lsb - slice.poc_lsb >= max_lsb / 2)
+        msb = prev_poc_msb + max_lsb;
+      else if (slice.poc_lsb > prev_poc_lsb && slice.poc_lsb - prev_poc_lsb > max_lsb / 2)
+        msb = prev_poc_msb - max_lsb;
+      pic.poc = msb + slice.poc_lsb;
+      if (nal.ref_idc) {
+        prev_poc_msb = msb;
+        prev_poc_lsb = slice.poc_lsb;
+      }
+    }
+    else if (s.poc_type == 2 && !slice.field) {
+      if (pic.keyframe)
+        frame_num_offset = 0;
+      else if (prev_frame_num > slice.frame_num)
+        frame_num_offset += 1 << s.log2_max_frame_num;
+      int abs_frame_num = frame_num_offset + slice.frame_num;
+      pic.poc = pic.keyframe ? 0 : (nal.ref_idc ? 2 * abs_frame_num : 2 * abs_frame_num - 1);
+      prev_frame_num = slice.frame_num;
+    }
+
+    _result.pictures.push_back(pic);
+  }
+}
+
+#endif /* _NAL_SCAN_H_ */
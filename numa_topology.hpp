@@ -0,0 +1,231 @@
+#ifndef _NUMA_TOPOLOGY_H_
+#define _NUMA_TOPOLOGY_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * NUMA placement without libnuma: the nodes and their CPUs are read from
+ * /sys/devices/system/node, workers are pinned to the CPUs of one node and
+ * buffers are bound to the node of the thread that allocates them (mbind
+ * with MPOL_PREFERRED, so a full node spills over instead of failing).
+ *
+ * Machines without the sysfs tree, and H26X_NUMA=0, give a single node
+ * with no pinning at all. Per-node counters of the slices and bytes every
+ * node processed show whether the work was spread as intended.
+ */
+
+static const int numa_max_nodes = 64;
+
+struct numa_node {
+  int id;
+  std::vector<int> cpus;
+};
+
+//"0-3,8,10-11" as in sysfs cpulist files
+inline std::vector<int> numa_parse_cpulist(const std::string& _list)
+{
+  std::vector<int> cpus;
+  const char* p = _list.c_str();
+  while (*p) {
+    char* end = NULL;
+    long first = std::strtol(p, &end, 10);
+    if (end == p)
+      break;
+    long last = first;
+    p = end;
+    if (*p == '-') {
+      last = std::strtol(p + 1, &end, 10);
+      p = end;
+    }
+    for (long c = first; c <= last; ++c)
+      cpus.push_back((int)c);
+    if (*p == ',')
+      ++p;
+  }
+  return cpus;
+}
+
+inline std::vector<numa_node> numa_read_topology()
+{
+  std::vector<numa_node> nodes;
+  const char* numa = std::getenv("H26X_NUMA");
+  const bool enabled = !numa || std::strcmp(numa, "0") != 0;
+
+  for (int n = 0; enabled && n < numa_max_nodes; ++n) {
+    std::ifstream cpulist("/sys/devices/system/node/node" + std::to_string(n) + "/cpulist");
+    std::string list;
+    if (!std::getline(cpulist, list))
+      continue;
+    numa_node node;
+    node.id = n;
+    node.cpus = numa_parse_cpulist(list);
+    if (!node.cpus.empty())   //memory-only nodes run no workers
+      nodes.push_back(node);
+  }
+
+  if (nodes.size() < 2) {
+    nodes.assign(1, numa_node());
+    nodes[0].id = 0;          //no cpus: nothing gets pinned
+  }
+  return nodes;
+}
+
+//the nodes with CPUs, read once
+inline const std::vector<numa_node>& numa_nodes()
+{
+  static const std::vector<numa_node> nodes = numa_read_topology();
+  return nodes;
+}
+
+inline bool numa_enabled()
+{
+  return numa_nodes().size() > 1;
+}
+
+//index into numa_nodes() of the node _cpu belongs to, 0 if unknown
+inline int numa_node_of_cpu(int _cpu)
+{
+  const std::vector<numa_node>& nodes = numa_nodes();
+  for (size_t n = 0; n < nodes.size(); ++n)
+    for (int cpu : nodes[n].cpus)
+      if (cpu == _cpu)
+        return (int)n;
+  return 0;
+}
+
+/*
+ * node (index into numa_nodes()) of the calling thread: the one it was
+ * pinned to, else where it runs right now (codec threads inherit the
+ * affinity of the worker that started them)
+ */
+inline int& numa_pinned_node()
+{
+  static thread_local int node = -1;
+  return node;
+}
+
+inline int numa_thread_node()
+{
+  if (!numa_enabled())
+    return 0;
+  if (numa_pinned_node() >= 0)
+    return numa_pinned_node();
+  const int cpu = sched_getcpu();
+  return cpu < 0 ? 0 : numa_node_of_cpu(cpu);
+}
+
+//pins the calling thread to the CPUs of node _node; returns 0 on success
+inline int numa_pin(int _node)
+{
+  if (!numa_enabled())
+    return 0;
+
+  const numa_node& node = numa_nodes()[_node];
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : node.cpus)
+    if (cpu < CPU_SETSIZE)
+      CPU_SET(cpu, &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+    return 1;
+  numa_pinned_node() = _node;
+  return 0;
+}
+
+//the part [_first, _end) of _total items (workers, GOPs, ...) of node _node, by its number of CPUs
+inline void numa_split(int _node, int _total, int& _first, int& _end)
+{
+  const std::vector<numa_node>& nodes = numa_nodes();
+  size_t cpus = 0, before = 0;
+  for (size_t n = 0; n < nodes.size(); ++n) {
+    if ((int)n < _node)
+      before += nodes[n].cpus.size();
+    cpus += nodes[n].cpus.size();
+  }
+  if (cpus == 0) {
+    _first = 0;
+    _end = _total;
+    return;
+  }
+  _first = (int)((uint64_t)_total * before / cpus);
+  _end = (int)((uint64_t)_total * (before + nodes[_node].cpus.size()) / cpus);
+}
+
+//number of the _total items of node _node, at least 1
+inline int numa_share(int _node, int _total)
+{
+  int first = 0, end = 0;
+  numa_split(_node, _total, first, end);
+  return std::max(1, end - first);
+}
+
+/*
+ * prefers node _node for the pages of [_data, _data + _size) (page
+ * aligned); returns 0 on success, also on single node machines
+ */
+inline int numa_prefer(void* _data, size_t _size, int _node)
+{
+  if (!numa_enabled())
+    return 0;
+#ifdef SYS_mbind
+  const int mpol_preferred = 1;
+  unsigned long mask[numa_max_nodes / (8 * sizeof(unsigned long))] = { 0 };
+  const int id = numa_nodes()[_node].id;
+  mask[id / (8 * sizeof(unsigned long))] |= 1ul << (id % (8 * sizeof(unsigned long)));
+  return syscall(SYS_mbind, _data, _size, mpol_preferred, mask, (unsigned long)numa_max_nodes + 1, 0) != 0;
+#else
+  return 1;
+#endif
+}
+
+struct numa_counters {
+  std::atomic<uint64_t> slices{0};
+  std::atomic<uint64_t> bytes{0};     ///< compressed bytes written or read
+  std::atomic<uint64_t> busy_ns{0};   ///< summed over the node's workers
+};
+
+inline numa_counters& numa_node_counters(int _node)
+{
+  static numa_counters counters[numa_max_nodes];
+  return counters[_node % numa_max_nodes];
+}
+
+inline void numa_count(int _node, uint64_t _slices, uint64_t _bytes, uint64_t _busy_ns)
+{
+  numa_counters& counters = numa_node_counters(_node);
+  counters.slices.fetch_add(_slices);
+  counters.bytes.fetch_add(_bytes);
+  counters.busy_ns.fetch_add(_busy_ns);
+}
+
+//one line per node: slices, slices/s over _seconds of wall time, MiB/s, busy seconds
+inline void numa_report(std::ostream& _out, double _seconds)
+{
+  const std::vector<numa_node>& nodes = numa_nodes();
+  if (nodes.size() < 2)
+    return;
+  for (size_t n = 0; n < nodes.size(); ++n) {
+    const numa_counters& counters = numa_node_counters((int)n);
+    const double slices = counters.slices.load();
+    _out << "node " << nodes[n].id << " (" << nodes[n].cpus.size() << " cpus): " << slices << " slices, "
+         << slices / (_seconds > 0 ? _seconds : 1) << " slices/s, "
+         << counters.bytes.load() / (_seconds > 0 ? _seconds : 1) / (1 << 20) << " MiB/s, "
+         << counters.busy_ns.load() * 1e-9 << " s busy\n";
+  }
+}
+
+#endif /* _NUMA_TOPOLOGY_H_ */
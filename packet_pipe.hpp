@@ -0,0 +1,121 @@
+#ifndef _PACKET_PIPE_H_
+#define _PACKET_PIPE_H_
+
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#include "telemetry.h"
+
+/*
+ * bounded hand-over of encoded packets from the encoding thread to a
+ * decoding thread, for verifying a stream while it is being written: push
+ * takes a reference on the packet's buffer (the encoder's pooled packets
+ * are reference counted, see frame_pool.hpp) instead of copying it, and
+ * blocks while the pipe is full, so a slow decoder throttles the encoder
+ * rather than letting packets pile up
+ */
+
+class packet_pipe {
+
+public:
+  explicit packet_pipe(size_t _capacity = 16)
+    : capacity_(_capacity < 1 ? 1 : _capacity), closed_(false), peak_(0)
+  {
+  }
+
+  ~packet_pipe()
+  {
+    for (queued& entry : packets_)
+      av_free_packet(&entry.pkt);
+  }
+
+  //queues a reference to _pkt (a copy if it has no buffer); 1 if the pipe is closed or out of memory
+  int push(const AVPacket& _pkt)
+  {
+    AVPacket pkt = _pkt;
+    pkt.side_data = NULL;
+    pkt.side_data_elems = 0;
+    if (_pkt.buf)
+      pkt.buf = av_buffer_ref(_pkt.buf);
+    else {
+      pkt.buf = av_buffer_alloc(_pkt.size + FF_INPUT_BUFFER_PADDING_SIZE);
+      if (pkt.buf) {
+        memcpy(pkt.buf->data, _pkt.data, _pkt.size);
+        memset(pkt.buf->data + _pkt.size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+        pkt.data = pkt.buf->data;
+      }
+    }
+    if (!pkt.buf)
+      return 1;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this]() { return closed_ || packets_.size() < capacity_; });
+    if (closed_) {
+      av_buffer_unref(&pkt.buf);
+      return 1;
+    }
+    queued entry = { pkt, telemetry_start() };
+    packets_.push_back(entry);
+    if (packets_.size() > peak_)
+      peak_ = packets_.size();
+    not_empty_.notify_one();
+    return 0;
+  }
+
+  //no more packets: pop returns the queued ones, then false
+  void close()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    not_empty_.notify_all();
+    not_full_.notify_all();
+  }
+
+  /*
+   * waits for the next packet, the caller frees it with av_free_packet;
+   * false once closed and drained. _wait_ns gets the time the packet spent
+   * in the pipe when telemetry is on (see telemetry_wait), 0 otherwise.
+   */
+  bool pop(AVPacket& _pkt, uint32_t* _wait_ns = NULL)
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this]() { return closed_ || !packets_.empty(); });
+    if (packets_.empty())
+      return false;
+    _pkt = packets_.front().pkt;
+    if (_wait_ns)
+      *_wait_ns = telemetry_wait(packets_.front().pushed_ns);
+    packets_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  //most packets queued at once
+  size_t peak() const
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return peak_;
+  }
+
+private:
+  struct queued {
+    AVPacket pkt;
+    uint64_t pushed_ns;  ///< telemetry_start() of the push
+  };
+
+  size_t capacity_;
+  bool closed_;
+  size_t peak_;
+  std::deque<queued> packets_;
+  mutable std::mutex mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+};
+
+#endif /* _PACKET_PIPE_H_ */
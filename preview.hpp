@@ -0,0 +1,180 @@
+#ifndef _PREVIEW_H_
+#define _PREVIEW_H_
+
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+#include "downscale.hpp"
+#include "frame_pool.hpp"
+#include "memory.h"
+#include "telemetry.h"
+
+/*
+ * keyframe-only, reduced resolution decode for thumbnails and overviews:
+ * non-key packets are never handed to the decoder, the decoder is told
+ * to discard anything that is not a keyframe (skip_frame) and uses lowres
+ * where the codec supports it; the rest of the reduction is a box filter
+ */
+
+struct preview_volume {
+  int width;                     ///< of one preview slice
+  int height;
+  int factor;                    ///< downscaling factor relative to the coded slices
+  std::vector<int> slices;       ///< index of each preview slice in the full volume
+  std::vector<uint8_t> voxels;   ///< slices.size() preview slices of width*height each
+};
+
+inline void append_preview_slice(const AVFrame* _frame, int _factor, int _slice,
+                                 preview_volume& _preview)
+{
+  if (_preview.slices.empty()) {
+    _preview.width = _frame->width / _factor;
+    _preview.height = _frame->height / _factor;
+  }
+
+  const size_t slice_size = (size_t)_preview.width * _preview.height;
+  const size_t capacity = _preview.voxels.capacity();
+  _preview.voxels.resize(_preview.voxels.size() + slice_size);
+  if (_preview.voxels.capacity() > capacity)
+    memory_account(MEMORY_OUTPUT, _preview.voxels.capacity() - capacity);
+  box_downscale(_frame->data[0], _frame->linesize[0], _frame->width, _frame->height, _factor,
+                &_preview.voxels[_preview.voxels.size() - slice_size], _preview.width);
+  _preview.slices.push_back(_slice);
+}
+
+/*
+ * decodes the keyframes of the first video stream of an opened input,
+ * slice indices are packet numbers in decode order which match the
+ * display order at keyframes of closed GOPs (the default of our encoders)
+ */
+inline int decode_preview(AVFormatContext* _formatContext, int _factor, preview_volume& _preview)
+{
+    if (_factor < 1 || _factor > 16)
+    {
+        std::cerr << "preview factor " << _factor << " out of range [1,16]\n";
+        return 1;
+    }
+
+    if (avformat_find_stream_info(_formatContext, NULL) < 0)
+        return 1;
+
+    if (_formatContext->nb_streams < 1 ||
+        _formatContext->streams[0]->codec->codec_type != AVMEDIA_TYPE_VIDEO)
+        return 1;
+
+    AVStream* stream = _formatContext->streams[0];
+    AVCodecContext* codecContext = stream->codec;
+
+    codecContext->codec = avcodec_find_decoder(codecContext->codec_id);
+    if (codecContext->codec == NULL)
+        return 1;
+
+    //let the decoder drop the resolution itself as far as it can (not h264/hevc in libav), by powers of
+    //two that divide _factor, so that the box filter does the rest: remaining << lowres == _factor
+    int lowres = 0;
+    while (_factor % (2 << lowres) == 0 && lowres < codecContext->codec->max_lowres)
+        ++lowres;
+    codecContext->lowres = lowres;
+    codecContext->skip_frame = AVDISCARD_NONKEY;
+
+    use_frame_pool(codecContext);
+    size_t rss = memory_rss();
+    if (avcodec_open2(codecContext, codecContext->codec, NULL) != 0)
+    {
+        avcodec_close(codecContext);
+        return 1;
+    }
+    const size_t codec_bytes = memory_account_rss(MEMORY_DECODE, rss);
+
+    AVFrame* frame = av_frame_alloc();
+    if (!frame)
+    {
+        avcodec_close(codecContext);
+        memory_release(MEMORY_DECODE, codec_bytes);
+        return 1;
+    }
+
+    const int remaining = _factor >> lowres;
+    _preview.factor = _factor;
+    _preview.slices.clear();
+    _preview.voxels.clear();
+
+    //slice indices of the keyframes in flight inside the decoder
+    std::deque<int> pending;
+
+    AVPacket packet;
+    av_init_packet(&packet);
+
+    int packetNumber = 0;
+    while (av_read_frame(_formatContext, &packet) == 0)
+    {
+        if (packet.stream_index == stream->index)
+        {
+            int slice = packetNumber++;
+            if (packet.flags & AV_PKT_FLAG_KEY)
+            {
+                pending.push_back(slice);
+
+                int frameFinished = 0;
+                uint64_t start = telemetry_start();
+                avcodec_decode_video2(codecContext, frame, &frameFinished, &packet);
+
+                if (frameFinished && !pending.empty())
+                {
+                    telemetry_record_frame('D', pending.front(), av_frame_get_best_effort_timestamp(frame),
+                                           start, 0, packet.size, frame->pict_type, -1);
+                    append_preview_slice(frame, remaining, pending.front(), _preview);
+                    pending.pop_front();
+                }
+            }
+        }
+        av_free_packet(&packet);
+    }
+
+    int frameFinished = 1;
+    while (frameFinished && !pending.empty())
+    {
+        packet.data = NULL;
+        packet.size = 0;
+        int rcode = avcodec_decode_video2(codecContext, frame, &frameFinished, &packet);
+        if (rcode < 0)
+        {
+            std::cerr << "[delayed]\tdecode error detected\n";
+            break;
+        }
+
+        if (frameFinished)
+        {
+            append_preview_slice(frame, remaining, pending.front(), _preview);
+            pending.pop_front();
+        }
+    }
+
+    av_frame_free(&frame);
+    avcodec_close(codecContext);
+    memory_release(MEMORY_DECODE, codec_bytes);
+    return 0;
+}
+
+inline int decode_preview_file(const std::string& _fname, int _factor, preview_volume& _preview)
+{
+    av_register_all();
+
+    AVFormatContext* formatContext = NULL;
+    if (avformat_open_input(&formatContext, _fname.c_str(), NULL, NULL) != 0)
+        return 1;
+
+    int rcode = decode_preview(formatContext, _factor, _preview);
+    avformat_close_input(&formatContext);
+    return rcode;
+}
+
+#endif /* _PREVIEW_H_ */
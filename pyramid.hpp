@@ -0,0 +1,243 @@
+#ifndef _PYRAMID_H_
+#define _PYRAMID_H_
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "encoder.hpp"
+#include "downscale.hpp"
+
+/*
+ * multi-resolution pyramid: next to the full resolution stream, every
+ * slice is box filtered down by 2x, 4x, 8x, ... and each level is encoded
+ * as a stream of its own. All levels end up in one file:
+ *
+ *   "H26XPYR1" | uint32 level count | level table | streams
+ *
+ * The level table holds factor, width, height, offset and size of each
+ * stream (little endian). Streams are stored coarsest first, so a client
+ * can fetch the head of the file for a coarse view and refine with range
+ * reads of the finer levels.
+ */
+
+static const char pyramid_magic[8] = { 'H', '2', '6', 'X', 'P', 'Y', 'R', '1' };
+
+//levels of a pyramid file, full resolution included: 2^15 times down is far below 16x16
+static const uint32_t pyramid_max_levels = 16;
+
+struct pyramid_level {
+  uint32_t factor;
+  uint32_t width;
+  uint32_t height;
+  uint64_t offset;  ///< of the level's stream, from the start of the file
+  uint64_t size;
+};
+
+struct pyramid_encoder {
+  std::vector<encoder_session> sessions;  ///< [0] is the full resolution
+  std::vector<std::vector<uint8_t> > streams;
+  std::vector<pyramid_level> levels;
+};
+
+//opens the full resolution encoder plus _levels downsampled ones (2x, 4x, ...)
+inline int pyramid_open(pyramid_encoder& _pyramid, const encoder_settings& _settings, int _levels)
+{
+  _pyramid.sessions.clear();
+  _pyramid.streams.clear();
+  _pyramid.levels.clear();
+
+  for (int l = 0; l <= _levels; ++l) {
+    if (l >= (int)pyramid_max_levels) {
+      std::cerr << "pyramid stops at " << pyramid_max_levels - 1 << " levels\n";
+      break;
+    }
+    encoder_settings level = _settings;
+    //yuv420p needs even sizes, keep a floor on what the codecs accept
+    level.width = (_settings.width >> l) & ~1;
+    level.height = (_settings.height >> l) & ~1;
+    if (level.width < 16 || level.height < 16) {
+      std::cerr << "pyramid level " << l << " would be smaller than 16x16, stopping at "
+                << l - 1 << "\n";
+      break;
+    }
+    level.bit_rate = _settings.bit_rate >> (2 * l);
+
+    encoder_session session;
+    if (encoder_open(session, level) != 0) {
+      //the finer levels are open already
+      for (encoder_session& opened : _pyramid.sessions)
+        encoder_close(opened);
+      _pyramid.sessions.clear();
+      _pyramid.streams.clear();
+      _pyramid.levels.clear();
+      return 1;
+    }
+    _pyramid.sessions.push_back(session);
+    _pyramid.streams.push_back(std::vector<uint8_t>());
+
+    pyramid_level info = { 1u << l, (uint32_t)level.width, (uint32_t)level.height, 0, 0 };
+    _pyramid.levels.push_back(info);
+  }
+
+  return 0;
+}
+
+/*
+ * encodes the full resolution picture held in the frame of sessions[0]
+ * (callers fill _pyramid.sessions[0].frame and set its pts), each coarser
+ * level is filtered from the next finer one
+ */
+inline int pyramid_encode(pyramid_encoder& _pyramid)
+{
+  for (size_t l = 0; l < _pyramid.sessions.size(); ++l) {
+    AVFrame* frame = _pyramid.sessions[l].frame;
+
+    if (l > 0) {
+      const AVFrame* finer = _pyramid.sessions[l - 1].frame;
+      //luma and both 4:2:0 chroma planes, cropped to what the coarser level holds
+      for (int p = 0; p < 3; ++p) {
+        int shift = p ? 1 : 0;
+        box_downscale2(finer->data[p], finer->linesize[p],
+                       (frame->width >> shift) * 2, (frame->height >> shift) * 2,
+                       frame->data[p], frame->linesize[p]);
+      }
+      frame->pts = finer->pts;
+    }
+
+    if (encoder_encode(_pyramid.sessions[l], frame, append_to(_pyramid.streams[l])) < 0)
+      return 1;
+  }
+
+  return 0;
+}
+
+inline int pyramid_finish(pyramid_encoder& _pyramid)
+{
+  int rcode = 0;
+  for (size_t l = 0; l < _pyramid.sessions.size(); ++l) {
+    if (encoder_flush(_pyramid.sessions[l], append_to(_pyramid.streams[l])) < 0)
+      rcode = 1;
+    encoder_close(_pyramid.sessions[l]);
+  }
+  return rcode;
+}
+
+inline void put_le(std::vector<uint8_t>& _out, uint64_t _value, int _bytes)
+{
+  for (int b = 0; b < _bytes; ++b)
+    _out.push_back((_value >> (8 * b)) & 0xff);
+}
+
+inline uint64_t get_le(const uint8_t* _in, int _bytes)
+{
+  uint64_t value = 0;
+  for (int b = _bytes - 1; b >= 0; --b)
+    value = (value << 8) | _in[b];
+  return value;
+}
+
+static const size_t pyramid_entry_size = 3 * 4 + 2 * 8;
+
+inline int pyramid_write(const pyramid_encoder& _pyramid, const std::string& _fname)
+{
+  const size_t levels = _pyramid.streams.size();
+  std::vector<uint8_t> header(pyramid_magic, pyramid_magic + 8);
+  put_le(header, levels, 4);
+
+  uint64_t offset = header.size() + levels * pyramid_entry_size;
+  for (size_t n = 0; n < levels; ++n) {
+    size_t l = levels - 1 - n; //coarsest first
+    put_le(header, _pyramid.levels[l].factor, 4);
+    put_le(header, _pyramid.levels[l].width, 4);
+    put_le(header, _pyramid.levels[l].height, 4);
+    put_le(header, offset, 8);
+    put_le(header, _pyramid.streams[l].size(), 8);
+    offset += _pyramid.streams[l].size();
+  }
+
+  std::ofstream file(_fname.c_str(), std::ios_base::binary | std::ios_base::trunc | std::ios_base::out);
+  if (!file.good()) {
+    std::cerr << "unable to open " << _fname << "\n";
+    return 1;
+  }
+  file.write((const char*)&header[0], header.size());
+  for (size_t n = 0; n < levels; ++n) {
+    const std::vector<uint8_t>& stream = _pyramid.streams[levels - 1 - n];
+    if (!stream.empty())
+      file.write((const char*)&stream[0], stream.size());
+  }
+  return file.good() ? 0 : 1;
+}
+
+/*
+ * reads the level table, entries are ordered coarsest first; a count above
+ * pyramid_max_levels or a stream outside the file fail before anything is
+ * allocated or read from the file's offsets
+ */
+inline int pyramid_read_levels(std::istream& _in, std::vector<pyramid_level>& _levels)
+{
+  const std::istream::pos_type begin = _in.tellg();
+  if (!_in.seekg(0, std::ios_base::end))
+    return 1;
+  const uint64_t file_size = (uint64_t)(_in.tellg() - begin);
+  _in.seekg(begin);
+
+  uint8_t head[12];
+  if (!_in.read((char*)head, sizeof(head)) || std::memcmp(head, pyramid_magic, 8) != 0)
+    return 1;
+
+  uint32_t count = get_le(head + 8, 4);
+  const uint64_t streams_start = sizeof(head) + (uint64_t)count * pyramid_entry_size;
+  if (count > pyramid_max_levels || streams_start > file_size)
+    return 1;
+  std::vector<uint8_t> table(count * pyramid_entry_size);
+  if (count && !_in.read((char*)&table[0], table.size()))
+    return 1;
+
+  _levels.resize(count);
+  for (uint32_t n = 0; n < count; ++n) {
+    const uint8_t* e = &table[n * pyramid_entry_size];
+    _levels[n].factor = get_le(e, 4);
+    _levels[n].width = get_le(e + 4, 4);
+    _levels[n].height = get_le(e + 8, 4);
+    _levels[n].offset = get_le(e + 12, 8);
+    _levels[n].size = get_le(e + 20, 8);
+    if (_levels[n].offset < streams_start || _levels[n].size > file_size ||
+        _levels[n].offset > file_size - _levels[n].size)
+      return 1;
+  }
+  return 0;
+}
+
+//pulls the stream of one level (by factor) out of a pyramid file
+inline int pyramid_read_stream(const std::string& _fname, uint32_t _factor, std::vector<uint8_t>& _stream,
+                               pyramid_level* _level = NULL)
+{
+  std::ifstream file(_fname.c_str(), std::ios_base::binary | std::ios_base::in);
+  std::vector<pyramid_level> levels;
+  if (!file.good() || pyramid_read_levels(file, levels) != 0) {
+    std::cerr << _fname << " is not a pyramid file\n";
+    return 1;
+  }
+
+  for (size_t n = 0; n < levels.size(); ++n) {
+    if (levels[n].factor != _factor)
+      continue;
+    _stream.resize(levels[n].size);
+    file.seekg(levels[n].offset);
+    if (levels[n].size && !file.read((char*)&_stream[0], levels[n].size))
+      return 1;
+    if (_level)
+      *_level = levels[n];
+    return 0;
+  }
+
+  std::cerr << _fname << " has no level with factor " << _factor << "\n";
+  return 1;
+}
+
+#endif /* _PYRAMID_H_ */
@@ -0,0 +1,272 @@
+#ifndef _RATECONTROL_H_
+#define _RATECONTROL_H_
+
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#include "encoder.hpp"
+#include "keyframes.hpp"
+#include "memory.h"
+
+/*
+ * rate control for volumes: the fixed 400 kbit/s of the examples are
+ * meaningless for data that is not watched at 25 fps, so a volume is
+ * encoded either at constant quality (CRF or QP), to a target total size
+ * (two passes: x264 first gathers statistics, then distributes the bits)
+ * or to a target luma PSNR (a fast first pass searches the CRF on a sample
+ * of slices, then one constant quality pass)
+ */
+
+enum rate_mode {
+  RATE_BITRATE,   ///< value: bits per second at 25 slices per second
+  RATE_CRF,       ///< value: constant rate factor
+  RATE_QP,        ///< value: constant quantizer
+  RATE_SIZE,      ///< value: total bytes of the stream
+  RATE_PSNR       ///< value: mean luma PSNR in dB
+};
+
+struct rate_request {
+  rate_mode mode;
+  double value;
+};
+
+//fills the frame with slice _z of the volume (pts and pict_type included)
+typedef std::function<void(AVFrame* frame, int z)> slice_source;
+
+/*
+ * "bitrate=<n>[k|M]", "crf=<f>", "qp=<n>", "size=<n>[k|M|G]" (bytes) or
+ * "psnr=<dB>"; returns 0 on success
+ */
+inline int rate_request_from_string(const std::string& _text, rate_request& _request)
+{
+  const size_t equals = _text.find('=');
+  if (equals == std::string::npos)
+    return 1;
+
+  const std::string mode = _text.substr(0, equals);
+  char* end = NULL;
+  double value = std::strtod(_text.c_str() + equals + 1, &end);
+  if (end == _text.c_str() + equals + 1 || value < 0)
+    return 1;
+  //sizes count in powers of two, bit rates in powers of ten
+  const bool binary = mode != "bitrate";
+  switch (*end) {
+  case 'k': value *= binary ? 1024. : 1e3; break;
+  case 'M': value *= binary ? 1048576. : 1e6; break;
+  case 'G': value *= binary ? 1073741824. : 1e9; break;
+  case '\0': break;
+  default: return 1;
+  }
+
+  if (mode == "bitrate")
+    _request.mode = RATE_BITRATE;
+  else if (mode == "crf")
+    _request.mode = RATE_CRF;
+  else if (mode == "qp")
+    _request.mode = RATE_QP;
+  else if (mode == "size")
+    _request.mode = RATE_SIZE;
+  else if (mode == "psnr")
+    _request.mode = RATE_PSNR;
+  else
+    return 1;
+  _request.value = value;
+  return 0;
+}
+
+//average bit rate that spends _bytes on _depth slices (the encoder's time base is 1/25)
+inline int rate_bit_rate_for_size(double _bytes, int _depth)
+{
+  const double bit_rate = _bytes * 8. * 25. / (_depth > 0 ? _depth : 1);
+  return bit_rate > INT_MAX ? INT_MAX : bit_rate < 1000 ? 1000 : (int)bit_rate;
+}
+
+//one encode of slices [0, _depth) with _settings as they are
+inline int rate_encode_pass(const encoder_settings& _settings, int _depth, const slice_source& _source,
+                            const packet_sink& _sink)
+{
+  encoder_session session;
+  if (encoder_open(session, _settings) != 0)
+    return 1;
+
+  for (int z = 0; z < _depth; ++z) {
+    _source(session.frame, z);
+    if (encoder_encode(session, session.frame, _sink) < 0) {
+      encoder_close(session);
+      return 1;
+    }
+  }
+  int rcode = encoder_flush(session, _sink) < 0;
+  encoder_close(session);
+  return rcode;
+}
+
+/*
+ * target size: x264 runs a statistics pass and then distributes the bits
+ * over the slices by their complexity; the libx265 wrapper of libav 2.5 has
+ * no pass flags, HEVC uses the same average bit rate in a single pass
+ */
+inline int rate_encode_to_size(encoder_settings _settings, int _depth, const slice_source& _source,
+                               const packet_sink& _sink, double _bytes)
+{
+  _settings.bit_rate = rate_bit_rate_for_size(_bytes, _depth);
+  _settings.crf = -1;
+  _settings.qp = -1;
+  if (_settings.codec_id != AV_CODEC_ID_H264)
+    return rate_encode_pass(_settings, _depth, _source, _sink);
+
+  _settings.stats = encoder_stats_file();
+  if (_settings.stats.empty())
+    return 1;
+  encoder_settings first = _settings;
+  first.pass = 1;
+  packet_sink discard = [](const AVPacket&) {};
+  int rcode = rate_encode_pass(first, _depth, _source, discard);
+  if (rcode == 0) {
+    _settings.pass = 2;
+    rcode = rate_encode_pass(_settings, _depth, _source, _sink);
+  }
+  encoder_stats_remove(_settings.stats);
+  return rcode;
+}
+
+/*
+ * mean luma PSNR of _samples slices spread evenly over the volume, encoded
+ * as one short sequence with _settings and decoded again; the sampled
+ * slices are farther apart than neighbours, so the estimate errs on the
+ * low side
+ */
+inline double rate_sample_psnr(const encoder_settings& _settings, int _depth, const slice_source& _source,
+                               int _samples)
+{
+  const int samples = _samples < _depth ? _samples : _depth;
+  const size_t luma = (size_t)_settings.width * _settings.height;
+  std::vector<uint8_t> originals(luma * samples);
+  memory_account(MEMORY_GENERATION, originals.size());
+
+  AVCodec* codec = avcodec_find_decoder(_settings.codec_id);
+  AVCodecContext* decoder = codec ? avcodec_alloc_context3(codec) : NULL;
+  AVFrame* decoded = av_frame_alloc();
+  double psnr = -1;
+  if (!decoder || !decoded || avcodec_open2(decoder, codec, NULL) < 0) {
+    fprintf(stderr, "Could not open the decoder of the PSNR probe\n");
+    av_frame_free(&decoded);
+    av_free(decoder);
+    memory_release(MEMORY_GENERATION, originals.size());
+    return psnr;
+  }
+
+  uint64_t sse = 0;
+  int compared = 0;
+  auto compare = [&](AVPacket* _pkt) {
+    int got_frame = 1;
+    while (got_frame) {
+      if (avcodec_decode_video2(decoder, decoded, &got_frame, _pkt) < 0)
+        return;
+      //output comes in display order, the n-th picture is the n-th sample
+      if (got_frame && compared < samples) {
+        sse += plane_sse(&originals[compared * luma], _settings.width, decoded->data[0], decoded->linesize[0],
+                         _settings.width, _settings.height);
+        ++compared;
+      }
+      if (_pkt->size)
+        break;
+    }
+  };
+  packet_sink decode = [&](const AVPacket& _pkt) {
+    AVPacket pkt = _pkt;
+    compare(&pkt);
+  };
+
+  encoder_settings probe = _settings;
+  probe.pass = 0;
+  probe.forced_idr = false;
+  slice_source sample = [&](AVFrame* _frame, int _s) {
+    const int z = (int)((int64_t)_s * _depth / samples);
+    _source(_frame, z);
+    _frame->pts = _s;
+    _frame->pict_type = AV_PICTURE_TYPE_NONE;
+    for (int y = 0; y < _settings.height; ++y)
+      memcpy(&originals[_s * luma + (size_t)y * _settings.width], _frame->data[0] + y * _frame->linesize[0],
+             _settings.width);
+  };
+
+  if (rate_encode_pass(probe, samples, sample, decode) == 0) {
+    AVPacket drain;
+    av_init_packet(&drain);
+    drain.data = NULL;
+    drain.size = 0;
+    compare(&drain);
+    if (compared) {
+      const double mse = (double)sse / ((double)compared * luma);
+      psnr = mse > 0 ? 10. * std::log10(255. * 255. / mse) : 100.;
+    }
+  }
+
+  av_frame_free(&decoded);
+  avcodec_close(decoder);
+  av_free(decoder);
+  memory_release(MEMORY_GENERATION, originals.size());
+  return psnr;
+}
+
+//largest CRF whose sample PSNR still reaches _psnr (bisection over 0..51, about 6 probes)
+inline float rate_crf_for_psnr(const encoder_settings& _settings, int _depth, const slice_source& _source,
+                               double _psnr, int _samples = 32)
+{
+  encoder_settings probe = _settings;
+  probe.qp = -1;
+  int good = 0, bad = 52;
+  while (bad - good > 1) {
+    const int crf = (good + bad) / 2;
+    probe.crf = crf > 0 ? crf : 1;
+    const double psnr = rate_sample_psnr(probe, _depth, _source, _samples);
+    if (psnr < 0)
+      return -1;
+    fprintf(stderr, "crf %d: %.2f dB\n", crf, psnr);
+    if (psnr >= _psnr)
+      good = crf;
+    else
+      bad = crf;
+  }
+  return good > 0 ? good : 1;
+}
+
+//encodes slices [0, _depth) as _request asks for
+inline int rate_encode(encoder_settings _settings, int _depth, const slice_source& _source,
+                       const packet_sink& _sink, const rate_request& _request)
+{
+  switch (_request.mode) {
+  case RATE_SIZE:
+    return rate_encode_to_size(_settings, _depth, _source, _sink, _request.value);
+  case RATE_PSNR: {
+    const float crf = rate_crf_for_psnr(_settings, _depth, _source, _request.value);
+    if (crf < 0)
+      return 1;
+    _settings.crf = crf;
+    _settings.qp = -1;
+    break;
+  }
+  case RATE_CRF:
+    _settings.crf = _request.value;
+    break;
+  case RATE_QP:
+    _settings.qp = (int)_request.value;
+    break;
+  default:
+    _settings.bit_rate = _request.value > INT_MAX ? INT_MAX : (int)_request.value;
+  }
+  return rate_encode_pass(_settings, _depth, _source, _sink);
+}
+
+#endif /* _RATECONTROL_H_ */
@@ -0,0 +1,236 @@
+#ifndef _REDUCTION_H_
+#define _REDUCTION_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "decoder.hpp"
+
+/*
+ * reductions of a volume computed on the slices as they leave the decoder,
+ * for jobs that need a projection or statistics rather than the voxels:
+ * the state is O(slice), the volume is never held and no slice goes to
+ * disk
+ *
+ *   mip        maximum-intensity projection along z
+ *   histogram  counts of the 256 luma values over the volume
+ *   stats      min, max and mean of every slice
+ *
+ * Operators are plane_reducers, called once per decoded slice in display
+ * order; volume_reductions bundles the three above, reduce_frames turns a
+ * set of operators into the frame_sink of decode_file and friends.
+ */
+
+//one decoded luma plane of slice _slice
+typedef std::function<void(const uint8_t* plane, int linesize, int width, int height, int slice)> plane_reducer;
+
+//_mip[x] = max(_mip[x], _row[x])
+inline void mip_row(uint8_t* _mip, const uint8_t* _row, int _width)
+{
+  int x = 0;
+#ifdef __SSE2__
+  for (; x + 16 <= _width; x += 16)
+    _mm_storeu_si128((__m128i*)(_mip + x), _mm_max_epu8(_mm_loadu_si128((const __m128i*)(_mip + x)),
+                                                        _mm_loadu_si128((const __m128i*)(_row + x))));
+#endif
+  for (; x < _width; ++x)
+    _mip[x] = std::max(_mip[x], _row[x]);
+}
+
+/*
+ * adds the values of a plane to _bins (256 entries); four partial tables
+ * keep runs of equal values (background) from serialising on one counter
+ */
+inline void histogram_plane(uint64_t* _bins, const uint8_t* _plane, int _linesize, int _width, int _height)
+{
+  uint32_t partial[4][256];
+  memset(partial, 0, sizeof(partial));
+  for (int y = 0; y < _height; ++y) {
+    const uint8_t* row = _plane + (size_t)y * _linesize;
+    int x = 0;
+    for (; x + 4 <= _width; x += 4) {
+      ++partial[0][row[x]];
+      ++partial[1][row[x + 1]];
+      ++partial[2][row[x + 2]];
+      ++partial[3][row[x + 3]];
+    }
+    for (; x < _width; ++x)
+      ++partial[0][row[x]];
+  }
+  for (int v = 0; v < 256; ++v)
+    _bins[v] += (uint64_t)partial[0][v] + partial[1][v] + partial[2][v] + partial[3][v];
+}
+
+struct slice_stats {
+  int slice;
+  uint8_t min;
+  uint8_t max;
+  double mean;
+};
+
+inline slice_stats plane_stats(const uint8_t* _plane, int _linesize, int _width, int _height, int _slice)
+{
+  uint8_t low = 255, high = 0;
+  uint64_t sum = 0;
+
+  for (int y = 0; y < _height; ++y) {
+    const uint8_t* row = _plane + (size_t)y * _linesize;
+    int x = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    __m128i vlow = _mm_set1_epi8((char)0xff), vhigh = zero, acc = zero;
+    for (; x + 16 <= _width; x += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(row + x));
+      vlow = _mm_min_epu8(vlow, v);
+      vhigh = _mm_max_epu8(vhigh, v);
+      acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+    }
+    uint8_t lanes[2][16];
+    _mm_storeu_si128((__m128i*)lanes[0], vlow);
+    _mm_storeu_si128((__m128i*)lanes[1], vhigh);
+    for (int n = 0; n < 16; ++n) {
+      low = std::min(low, lanes[0][n]);
+      high = std::max(high, lanes[1][n]);
+    }
+    sum += (uint64_t)_mm_cvtsi128_si32(acc) + (uint64_t)_mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+    for (; x < _width; ++x) {
+      low = std::min(low, row[x]);
+      high = std::max(high, row[x]);
+      sum += row[x];
+    }
+  }
+
+  slice_stats value;
+  value.slice = _slice;
+  value.min = low;
+  value.max = high;
+  value.mean = _width > 0 && _height > 0 ? (double)sum / ((double)_width * _height) : 0.;
+  return value;
+}
+
+enum reduction_kind {
+  REDUCE_MIP = 1,
+  REDUCE_HISTOGRAM = 2,
+  REDUCE_STATS = 4
+};
+
+//"mip,histogram,stats" (any subset, "all") to a mask of reduction_kind, -1 if not understood
+inline int reduction_kinds_from_string(const std::string& _list)
+{
+  if (_list == "all")
+    return REDUCE_MIP | REDUCE_HISTOGRAM | REDUCE_STATS;
+  int kinds = 0;
+  size_t begin = 0;
+  while (begin <= _list.size()) {
+    size_t end = _list.find(',', begin);
+    if (end == std::string::npos)
+      end = _list.size();
+    const std::string name = _list.substr(begin, end - begin);
+    if (name == "mip")
+      kinds |= REDUCE_MIP;
+    else if (name == "histogram" || name == "hist")
+      kinds |= REDUCE_HISTOGRAM;
+    else if (name == "stats")
+      kinds |= REDUCE_STATS;
+    else
+      return -1;
+    begin = end + 1;
+  }
+  return kinds;
+}
+
+struct volume_reductions {
+  int kinds;                      ///< mask of reduction_kind
+  int width;                      ///< of the first slice, 0 before
+  int height;
+  int slices;                     ///< reduced so far
+  std::vector<uint8_t> mip;       ///< width x height, rows width apart
+  uint64_t histogram[256];
+  std::vector<slice_stats> stats; ///< in the order the slices came
+};
+
+inline void reductions_init(volume_reductions& _reductions, int _kinds)
+{
+  _reductions = volume_reductions();
+  _reductions.kinds = _kinds;
+}
+
+//slices of another size than the first one are skipped
+inline void reductions_add(volume_reductions& _reductions, const uint8_t* _plane, int _linesize, int _width,
+                           int _height, int _slice)
+{
+  if (_reductions.width == 0) {
+    _reductions.width = _width;
+    _reductions.height = _height;
+    if (_reductions.kinds & REDUCE_MIP)
+      _reductions.mip.assign((size_t)_width * _height, 0);
+  }
+  if (_width != _reductions.width || _height != _reductions.height)
+    return;
+
+  ++_reductions.slices;
+  if (_reductions.kinds & REDUCE_MIP)
+    for (int y = 0; y < _height; ++y)
+      mip_row(&_reductions.mip[(size_t)y * _width], _plane + (size_t)y * _linesize, _width);
+  if (_reductions.kinds & REDUCE_HISTOGRAM)
+    histogram_plane(_reductions.histogram, _plane, _linesize, _width, _height);
+  if (_reductions.kinds & REDUCE_STATS)
+    _reductions.stats.push_back(plane_stats(_plane, _linesize, _width, _height, _slice));
+}
+
+inline plane_reducer reduce_into(volume_reductions& _reductions)
+{
+  return [&_reductions](const uint8_t* _plane, int _linesize, int _width, int _height, int _slice) {
+    reductions_add(_reductions, _plane, _linesize, _width, _height, _slice);
+  };
+}
+
+//frame_sink that runs _reducers on the luma of every decoded frame
+inline frame_sink reduce_frames(const std::vector<plane_reducer>& _reducers)
+{
+  return [_reducers](const AVFrame* _frame, int _slice) {
+    for (const plane_reducer& reducer : _reducers)
+      reducer(_frame->data[0], _frame->linesize[0], _frame->width, _frame->height, _slice);
+  };
+}
+
+//smallest value v with at least _fraction of the voxels <= v
+inline int histogram_percentile(const uint64_t* _bins, double _fraction)
+{
+  uint64_t total = 0;
+  for (int v = 0; v < 256; ++v)
+    total += _bins[v];
+  uint64_t seen = 0;
+  for (int v = 0; v < 256; ++v) {
+    seen += _bins[v];
+    if (seen > 0 && seen >= _fraction * total)
+      return v;
+  }
+  return 255;
+}
+
+//text summary: histogram percentiles and one line per slice
+inline void reductions_report(const volume_reductions& _reductions, const std::string& _name, std::ostream& _out)
+{
+  _out << _name << ": " << _reductions.slices << " slices reduced\n";
+  if (_reductions.kinds & REDUCE_HISTOGRAM)
+    _out << "histogram: 1% " << histogram_percentile(_reductions.histogram, .01) << ", 50% "
+         << histogram_percentile(_reductions.histogram, .5) << ", 99% "
+         << histogram_percentile(_reductions.histogram, .99) << "\n";
+  if (_reductions.kinds & REDUCE_STATS)
+    for (const slice_stats& stats : _reductions.stats)
+      _out << "slice " << stats.slice << ": min " << (int)stats.min << " max " << (int)stats.max
+           << " mean " << stats.mean << "\n";
+}
+
+#endif /* _REDUCTION_H_ */
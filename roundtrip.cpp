@@ -3,6 +3,9 @@
 #include <cstdint>
 #include <vector>
 #include <iterator>
+#include <cstdlib>
+#include <thread>
+#include <chrono>
 
 extern "C" {
 #include <math.h>
@@ -19,6 +22,23 @@ extern "C" {
 }
 
 #include "utils.hpp"
+#include "async_io.hpp"
+#include "preview.hpp"
+#include "pyramid.hpp"
+#include "keyframes.hpp"
+#include "ratecontrol.hpp"
+#include "reduction.hpp"
+#include "sparse.hpp"
+#include "autotune.hpp"
+#include "channels.hpp"
+#include "checksum.hpp"
+#include "container.hpp"
+#include "decoder.hpp"
+#include "mosaic.hpp"
+#include "packet_pipe.hpp"
+#include "timeseries.hpp"
+#include "volume.h"
+#include "h26xvol.h"
 
 #define INBUF_SIZE 4096
 
@@ -26,169 +46,257 @@ static const uint32_t WIDTH = 352;
 static const uint32_t HEIGHT = 288;
 static const uint32_t DEPTH = 25;
 
+//-V: check the decoded slices against the checksums only, no ppm files
+static bool dump_slices = true;
+
+//pattern of the dummy volume (-g), stripes unless asked otherwise
+static volume_generator dummy_volume = { VOLUME_STRIPES, (int)WIDTH, (int)HEIGHT, (int)DEPTH, 0, 0, {} };
+
 /*
- * Video encoding example
+ * dummy image of slice i, see volume.h (the encoders' stripes by default:
+ * a diagonal ramp with a stripe pattern that moves down every 5 slices in
+ * luma, ramps in Cb and Cr); slices of other sizes than the volume (mosaic
+ * tiles) get a generator of their own
  */
-static void video_encode_example(const char *filename, AVCodecID codec_id)
+static void fill_dummy_frame(AVFrame* frame, uint32_t i)
 {
-    AVCodec *codec;
-    AVCodecContext *c= NULL;
-    int  ret,  got_output;
-    FILE *f;
-    AVFrame *frame;
-    AVPacket pkt;
-    /* uint8_t endcode[] = { 0, 0, 1, 0xb7 }; */
+    volume_generator gen = dummy_volume;
+    if (frame->width != gen.width || frame->height != gen.height)
+      volume_generator_init(&gen, gen.pattern, frame->width, frame->height, gen.depth, gen.seed);
 
-    printf("Encode video file %s\n", filename);
+    volume_fill_luma(&gen, i, frame->data[0], frame->linesize[0]);
+    volume_fill_chroma(&gen, i, frame->data[1], frame->linesize[1], frame->data[2], frame->linesize[2]);
+}
 
-    /* find the mpeg1 video encoder */
-    codec = avcodec_find_encoder(codec_id);
-    if (!codec) {
-        fprintf(stderr, "Codec not found\n");
-        exit(1);
+/*
+ * analysis pass of content-adaptive keyframe placement: the dummy volume is
+ * generated slice by slice and compared to its predecessor
+ */
+static void analyse_keyframes(keyframe_plan& _plan)
+{
+    AVFrame* slices[2];
+    int slice_bytes = 0;
+    for (int s = 0; s < 2; ++s) {
+      slices[s] = av_frame_alloc();
+      slices[s]->width = WIDTH;
+      slices[s]->height = HEIGHT;
+      pool_image(slices[s], WIDTH, HEIGHT, AV_PIX_FMT_YUV420P);
+      slice_bytes = slices[s]->buf[0]->size;
+      memory_account(MEMORY_GENERATION, slice_bytes);
     }
 
-    c = avcodec_alloc_context3(codec);
-    if (!c) {
-        fprintf(stderr, "Could not allocate video codec context\n");
-        exit(1);
+    _plan.difference.clear();
+    _plan.mse.clear();
+    for (uint32_t i = 0; i < DEPTH; i++) {
+      AVFrame* current = slices[i % 2];
+      AVFrame* previous = i ? slices[(i + 1) % 2] : NULL;
+      fill_dummy_frame(current, i);
+      keyframe_analyse(_plan, previous ? previous->data[0] : NULL, previous ? previous->linesize[0] : 0,
+		       current->data[0], current->linesize[0], WIDTH, HEIGHT);
     }
+    keyframe_place(_plan);
 
-    /* put sample parameters */
-    c->bit_rate = 400000;
-    /* resolution must be a multiple of two */
-    c->width = WIDTH;
-    c->height = HEIGHT;
-    /* frames per second */
-    c->time_base = (AVRational){1,25};
-    /* emit one intra frame every ten frames
-     * check frame pict_type before passing frame
-     * to encoder, if frame->pict_type is AV_PICTURE_TYPE_I
-     * then gop_size is ignored and the output of encoder
-     * will always be I frame irrespective to gop_size
-     */
-    c->gop_size = 10;
-    c->max_b_frames = 1;
-    c->pix_fmt = AV_PIX_FMT_YUV420P;
-
-    if (codec_id == AV_CODEC_ID_H264)
-        av_opt_set(c->priv_data, "preset", "slow", 0);
-
-    /* open it */
-    if (avcodec_open2(c, codec, NULL) < 0) {
-        fprintf(stderr, "Could not open codec\n");
-        exit(1);
+    for (int s = 0; s < 2; ++s) {
+      memory_release(MEMORY_GENERATION, slice_bytes);
+      av_frame_free(&slices[s]);
     }
+}
 
-    f = fopen(filename, "wb");
-    if (!f) {
-        fprintf(stderr, "Could not open %s\n", filename);
-        exit(1);
-    }
+/*
+ * Video encoding example
+ * (_plan: keyframes are forced where the plan says so, gop_size is the plan's max_gop;
+ *  _rate: constant quality, target size or PSNR instead of the fixed bit rate, see ratecontrol.hpp;
+ *  _preset: instead of the codec's default preset, e.g. chosen by autotune.hpp)
+ */
+static void video_encode_example(const char *filename, AVCodecID codec_id,
+				 const keyframe_plan* _plan = NULL, const rate_request* _rate = NULL,
+				 const std::string& _preset = "")
+{
+    async_writer f;
+    container_muxer muxer = container_muxer();
+    const bool contained = !container_format(filename).empty();
 
-    frame = av_frame_alloc();
-    if (!frame) {
-        fprintf(stderr, "Could not allocate video frame\n");
-        exit(1);
+    printf("Encode video file %s\n", filename);
+
+    encoder_settings settings = default_encoder_settings(codec_id, WIDTH, HEIGHT);
+    if (_plan) {
+      settings.gop_size = _plan->max_gop;
+      settings.forced_idr = true;
     }
-    frame->format = c->pix_fmt;
-    frame->width  = c->width;
-    frame->height = c->height;
+    if (!_preset.empty())
+      settings.preset = _preset;
 
-    /* the image can be allocated by any means and av_image_alloc() is
-     * just the most convenient way if av_malloc() is to be used */
-    ret = av_image_alloc(frame->data, frame->linesize, c->width, c->height,
-                         c->pix_fmt, 32);
-    if (ret < 0) {
-        fprintf(stderr, "Could not allocate raw picture buffer\n");
+    /* packets are queued and written while the encoder goes on, see async_io.hpp */
+    if (contained ? container_open(muxer, filename, codec_id, default_volume_metadata(WIDTH, HEIGHT, DEPTH)) != 0
+        : f.open(filename) != 0) {
+        fprintf(stderr, "Could not open %s\n", filename);
         exit(1);
     }
+    /* every slice coded in order: the sidecars of earlier -T/-Z runs do not apply */
+    timeseries_remove_layout(filename);
+    sparse_remove_map(filename);
+
+    /* checksums of the source slices and of a reference decode, stored next to the stream */
+    slice_checksums sums;
+    sums.width = WIDTH;
+    sums.height = HEIGHT;
+    sums.source.assign(DEPTH, 0);
+    checksum_tap tap;
+    if (checksum_tap_open(tap, codec_id, sums) != 0)
+        fprintf(stderr, "No reference decoder, %s gets no checksums\n", filename);
+
+    int64_t bytes_out = 0;
+    int mux_error = 0;
+    packet_sink write_packet = [&](const AVPacket& pkt) {
+      if (contained)
+        mux_error |= container_write_packet(muxer, pkt);
+      else
+        f.write(pkt.data, pkt.size);
+      bytes_out += pkt.size;
+      if (tap.context)
+        checksum_tap_packet(tap, &pkt);
+    };
+
+    /* prepare a dummy image per slice, every pass asks for it again */
+    slice_source dummy_slice = [_plan, &sums](AVFrame* frame, int i) {
+      fill_dummy_frame(frame, i);
+      frame->pts = i;
+      frame->pict_type = (_plan && _plan->keyframe[i]) ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+      sums.source[i] = plane_crc32c(frame->data[0], frame->linesize[0], WIDTH, HEIGHT);
+    };
+
+    rate_request rate = { RATE_BITRATE, (double)settings.bit_rate };
+    if (_rate)
+      rate = *_rate;
 
     /* encode 1 second of video */
-    for (uint32_t i = 0; i < DEPTH; i++) {
-        av_init_packet(&pkt);
-        pkt.data = NULL;    // packet data will be allocated by the encoder
-        pkt.size = 0;
-
-        fflush(stdout);
-        /* prepare a dummy image */
-        /* Y */
-	float offset = 0.f;
-	float ymin = 0;
-	float ymax = 0;
-        for (uint32_t y = 0; y < (uint32_t)c->height; y++) {
-	  
-	  offset = .05*(i/5)*c->height;
-	  ymin = (.1*c->height)+offset;
-	  ymax = (.13*c->height)+offset;
-	  
-	  for (uint32_t x = 0; x < (uint32_t)c->width; x++) {
-	      
-	    frame->data[0][y * frame->linesize[0] + x] = x + y + i * 3;
-	    if((y>ymin && y<ymax) &&
-	       (x % 4 < 2) && x<=(5*(i+1)))
-	      frame->data[0][(y) * frame->linesize[0] + x] = 16;
-	    
-            }
-        }
-
-        /* Cb and Cr */
-        for (uint32_t y = 0; y < c->height/2u; y++) {
-            for (uint32_t x = 0; x < c->width/2u; x++) {
-                frame->data[1][y * frame->linesize[1] + x] = 128 + y + i * 2;
-                frame->data[2][y * frame->linesize[2] + x] = 64 + x + i * 5;
-		/* if((y>(.1/2.*c->height) && y<(.3/2.*c->height)) && */
-		/*    (x % 2 < 1) && x<=(5*(i+1))){ */
-		/*   frame->data[1][y * frame->linesize[1] + x] = 128; */
-		/*   frame->data[2][y * frame->linesize[2] + x] = 128; */
-		/* } */
-
-            }
-        }
-
-        frame->pts = i;
-
-        /* encode the image */
-        ret = avcodec_encode_video2(c, &pkt, frame, &got_output);
-        if (ret < 0) {
-            fprintf(stderr, "Error encoding frame\n");
-            exit(1);
-        }
+    if (rate_encode(settings, DEPTH, dummy_slice, write_packet, rate) != 0)
+        exit(1);
 
-        if (got_output) {
-	  printf("Write frame %3d (size=%5d)\n", i,pkt.size);
-	  fwrite(pkt.data, 1, pkt.size, f);
-	  av_free_packet(&pkt);
-        }
+    if (contained ? container_close(muxer) != 0 || mux_error : f.close() != 0) {
+        fprintf(stderr, "Could not write %s\n", filename);
+        exit(1);
     }
 
-    /* get the delayed frames */
-    got_output = 1;
-    for (uint32_t i = DEPTH; got_output; i++) {
-        fflush(stdout);
+    if (tap.context) {
+        checksum_tap_close(tap);
+        if (checksums_write(filename, sums) != 0)
+            fprintf(stderr, "Could not write %s\n", checksum_path(filename).c_str());
+    }
 
-        ret = avcodec_encode_video2(c, &pkt, NULL, &got_output);
-        if (ret < 0) {
-            fprintf(stderr, "Error encoding frame\n");
-            exit(1);
-        }
+    printf("Wrote %u frames (%lld bytes) to %s\n", DEPTH, (long long)bytes_out, filename);
+}
 
-        if (got_output) {
-            printf("Write frame %3d (size=%5d) [delayed]\n", i, pkt.size);
-            fwrite(pkt.data, 1, pkt.size, f);
-            av_free_packet(&pkt);
-        }
+/*
+ * encode and verification decode side by side: the packets go through a
+ * packet_pipe to a decoder thread as the encoder emits them, no file and
+ * no stream buffer in between; every decoded slice is compared with the
+ * dummy slice it came from (PSNR), and its latency is the time from
+ * handing the source slice to the encoder to getting it back decoded
+ */
+static int video_roundtrip_overlapped(AVCodecID codec_id, const rate_request* _rate, const std::string& _preset)
+{
+    typedef std::chrono::steady_clock clock;
+    encoder_settings settings = default_encoder_settings(codec_id, WIDTH, HEIGHT);
+    if (!_preset.empty())
+      settings.preset = _preset;
+
+    AVCodec* codec = avcodec_find_decoder(codec_id);
+    AVCodecContext* decoder = codec ? avcodec_alloc_context3(codec) : NULL;
+    AVFrame* decoded = av_frame_alloc();
+    if (!decoder || !decoded || avcodec_open2(decoder, codec, NULL) < 0) {
+      std::cerr << "Could not open the verification decoder\n";
+      av_frame_free(&decoded);
+      av_free(decoder);
+      return 1;
     }
 
-    /* add sequence end code to have a real mpeg file */
-    //fwrite(endcode, 1, sizeof(endcode), f);
-    fclose(f);
-
-    avcodec_close(c);
-    av_free(c);
-    av_freep(&frame->data[0]);
-    av_frame_free(&frame);
-    printf("\n");
+    //the source lambda stamps a slice before its packet can be pushed, the pipe orders the two
+    std::vector<clock::time_point> submitted(DEPTH);
+    packet_pipe pipe;
+    int64_t bytes_out = 0;
+
+    int slices = 0;
+    uint64_t sse = 0;
+    double latency_sum = 0, latency_max = 0;
+    std::thread verify([&]() {
+	std::vector<uint8_t> original((size_t)WIDTH * HEIGHT);
+	auto take = [&]() {
+	  const clock::time_point now = clock::now();
+	  if (slices < (int)DEPTH) {
+	    const double latency = std::chrono::duration<double>(now - submitted[slices]).count();
+	    latency_sum += latency;
+	    latency_max = std::max(latency_max, latency);
+	    volume_fill_luma(&dummy_volume, slices, &original[0], WIDTH);
+	    sse += plane_sse(decoded->data[0], decoded->linesize[0], &original[0], WIDTH, WIDTH, HEIGHT);
+	  }
+	  ++slices;
+	};
+
+	AVPacket pkt;
+	uint32_t wait_ns = 0;
+	while (pipe.pop(pkt, &wait_ns)) {
+	  int got_frame = 0;
+	  uint64_t start = telemetry_start();
+	  if (avcodec_decode_video2(decoder, decoded, &got_frame, &pkt) >= 0 && got_frame) {
+	    telemetry_record_frame('D', slices, decoded->pts, start, wait_ns, pkt.size, decoded->pict_type, -1);
+	    take();
+	  }
+	  av_free_packet(&pkt);
+	}
+	av_init_packet(&pkt);
+	pkt.data = NULL;
+	pkt.size = 0;
+	int got_frame = 1;
+	while (got_frame && avcodec_decode_video2(decoder, decoded, &got_frame, &pkt) >= 0)
+	  if (got_frame)
+	    take();
+      });
+
+    slice_source dummy_slice = [&submitted](AVFrame* frame, int i) {
+      submitted[i] = clock::now();
+      fill_dummy_frame(frame, i);
+      frame->pts = i;
+    };
+    //a packet the pipe refuses (closed, out of memory) would leave a hole the verification cannot see:
+    //the sinks cannot stop the encoder, the pipe is closed so that the rest is dropped and the run fails
+    bool dropped = false;
+    packet_sink hand_over = [&pipe, &bytes_out, &dropped](const AVPacket& pkt) {
+      if (dropped)
+        return;
+      if (pipe.push(pkt) != 0) {
+        std::cerr << "could not hand packet " << pkt.pts << " to the verification decoder\n";
+        dropped = true;
+        pipe.close();
+        return;
+      }
+      bytes_out += pkt.size;
+    };
+
+    rate_request rate = { RATE_BITRATE, (double)settings.bit_rate };
+    if (_rate)
+      rate = *_rate;
+
+    const clock::time_point start = clock::now();
+    int rcode = rate_encode(settings, DEPTH, dummy_slice, hand_over, rate);
+    const clock::time_point encoded = clock::now();
+    pipe.close();
+    verify.join();
+    const clock::time_point end = clock::now();
+
+    av_frame_free(&decoded);
+    avcodec_close(decoder);
+    av_free(decoder);
+
+    const double wall = std::chrono::duration<double>(end - start).count();
+    const double mse = slices > 0 ? (double)sse / ((double)WIDTH * HEIGHT * std::min(slices, (int)DEPTH)) : 0;
+    std::cerr << "overlapped: " << slices << " of " << DEPTH << " slices encoded and decoded back (" << bytes_out
+	      << "B) in " << wall << " s, " << slices / wall << " slices/s; encoding done after "
+	      << std::chrono::duration<double>(encoded - start).count() << " s\n"
+	      << "latency per slice: mean " << (slices > 0 ? latency_sum / std::min(slices, (int)DEPTH) : 0.)
+	      << " s, max " << latency_max << " s; at most " << pipe.peak() << " packets in flight\n"
+	      << "PSNR " << (mse > 0 ? 10 * log10(255. * 255. / mse) : 99.) << " dB\n";
+    return rcode != 0 || dropped || slices != (int)DEPTH;
 }
 
 /*
@@ -196,320 +304,469 @@ static void video_encode_example(const char *filename, AVCodecID codec_id)
  */
 static void video_encode_to_buffer(std::vector<uint8_t>& _buffer, AVCodecID codec_id)
 {
-    AVCodec *codec;
-    AVCodecContext *c= NULL;
-    int  ret,  got_output;
-    AVFrame *frame;
-    AVPacket pkt;
-    
-    /* find the mpeg1 video encoder */
-    codec = avcodec_find_encoder(codec_id);
-    if (!codec) {
-        fprintf(stderr, "Codec not found\n");
-        exit(1);
-    }
-
-    c = avcodec_alloc_context3(codec);
-    if (!c) {
-        fprintf(stderr, "Could not allocate video codec context\n");
-        exit(1);
-    }
-
-    /* put sample parameters */
-    c->bit_rate = 400000;
-    /* resolution must be a multiple of two */
-    c->width = WIDTH;
-    c->height = HEIGHT;
-    /* frames per second */
-    c->time_base = (AVRational){1,25};
-    /* emit one intra frame every ten frames
-     * check frame pict_type before passing frame
-     * to encoder, if frame->pict_type is AV_PICTURE_TYPE_I
-     * then gop_size is ignored and the output of encoder
-     * will always be I frame irrespective to gop_size
-     */
-    c->gop_size = 10;
-    c->max_b_frames = 1;
-    c->pix_fmt = AV_PIX_FMT_YUV420P;
-
-    if (codec_id == AV_CODEC_ID_H264)
-        av_opt_set(c->priv_data, "preset", "slow", 0);
-
-    /* open it */
-    if (avcodec_open2(c, codec, NULL) < 0) {
-        fprintf(stderr, "Could not open codec\n");
+    encoder_session session;
+    if (encoder_open(session, default_encoder_settings(codec_id, WIDTH, HEIGHT)) != 0)
         exit(1);
-    }
-
-    frame = av_frame_alloc();
-    if (!frame) {
-        fprintf(stderr, "Could not allocate video frame\n");
-        exit(1);
-    }
-    frame->format = c->pix_fmt;
-    frame->width  = c->width;
-    frame->height = c->height;
-
-    /* the image can be allocated by any means and av_image_alloc() is
-     * just the most convenient way if av_malloc() is to be used */
-    ret = av_image_alloc(frame->data, frame->linesize, c->width, c->height,
-                         c->pix_fmt, 32);
-    if (ret < 0) {
-        fprintf(stderr, "Could not allocate raw picture buffer\n");
-        exit(1);
-    }
 
+    AVFrame* frame = session.frame;
     /* encode 1 second of video */
     for (uint32_t i = 0; i < DEPTH; i++) {
-        av_init_packet(&pkt);
-        pkt.data = NULL;    // packet data will be allocated by the encoder
-        pkt.size = 0;
-
-        fflush(stdout);
         /* prepare a dummy image */
-        /* Y */
-	float offset = 0.f;
-	float ymin = 0;
-	float ymax = 0;
-        for (uint32_t y = 0; y < (uint32_t)c->height; y++) {
-	  
-	  offset = .05*(i/5)*c->height;
-	  ymin = (.1*c->height)+offset;
-	  ymax = (.13*c->height)+offset;
-	  
-	  for (uint32_t x = 0; x < (uint32_t)c->width; x++) {
-	      
-	    frame->data[0][y * frame->linesize[0] + x] = x + y + i * 3;
-	    if((y>ymin && y<ymax) &&
-	       (x % 4 < 2) && x<=(5*(i+1)))
-	      frame->data[0][(y) * frame->linesize[0] + x] = 16;
-	    
-            }
-        }
-
-        /* Cb and Cr */
-        for (uint32_t y = 0; y < c->height/2u; y++) {
-            for (uint32_t x = 0; x < c->width/2u; x++) {
-                frame->data[1][y * frame->linesize[1] + x] = 128 + y + i * 2;
-                frame->data[2][y * frame->linesize[2] + x] = 64 + x + i * 5;
-		/* if((y>(.1/2.*c->height) && y<(.3/2.*c->height)) && */
-		/*    (x % 2 < 1) && x<=(5*(i+1))){ */
-		/*   frame->data[1][y * frame->linesize[1] + x] = 128; */
-		/*   frame->data[2][y * frame->linesize[2] + x] = 128; */
-		/* } */
-
-            }
-        }
+        fill_dummy_frame(frame, i);
 
         frame->pts = i;
 
         /* encode the image */
-        ret = avcodec_encode_video2(c, &pkt, frame, &got_output);
-        if (ret < 0) {
-            fprintf(stderr, "Error encoding frame\n");
+        if (encoder_encode(session, frame, append_to(_buffer)) < 0)
             exit(1);
-        }
 
-        if (got_output) {
-	  printf("Write frame %3d (size=%5d)\n", i,pkt.size);
-	  std::copy(pkt.data,pkt.data+pkt.size,std::back_inserter(_buffer));
-	    //	  fwrite(pkt.data, 1, pkt.size, f);
-	  av_free_packet(&pkt);
+        /* nobody else frees memory in this process, waiting would not help */
+        if (memory.budget && memory.live > memory.budget) {
+            fprintf(stderr, "Memory budget exceeded after %u frames (%zu bytes buffered)\n",
+                    i + 1, _buffer.size());
+            encoder_close(session);
+            exit(1);
         }
     }
 
     /* get the delayed frames */
-    got_output = 1;
-    for (uint32_t i = DEPTH; got_output; i++) {
-        fflush(stdout);
+    if (encoder_flush(session, append_to(_buffer)) < 0)
+        exit(1);
 
-        ret = avcodec_encode_video2(c, &pkt, NULL, &got_output);
-        if (ret < 0) {
-            fprintf(stderr, "Error encoding frame\n");
-            exit(1);
-        }
+    printf("Encoded %lld frames (%lld bytes) to memory\n", (long long)session.packets_out,
+           (long long)session.bytes_out);
+    encoder_close(session);
+}
 
-        if (got_output) {
-            printf("Write frame %3d (size=%5d) [delayed]\n", i, pkt.size);
-	    std::copy(pkt.data,pkt.data+pkt.size,std::back_inserter(_buffer));
-            // fwrite(pkt.data, 1, pkt.size, f);
-            av_free_packet(&pkt);
-        }
+/*
+ * encodes the dummy volume plus _levels downsampled versions (2x, 4x, ...)
+ * into a single pyramid file (see pyramid.hpp)
+ */
+static int video_encode_pyramid(const std::string& _fname, AVCodecID codec_id, int _levels)
+{
+    pyramid_encoder pyramid;
+    if (pyramid_open(pyramid, default_encoder_settings(codec_id, WIDTH, HEIGHT), _levels) != 0)
+      return 1;
+
+    AVFrame* frame = pyramid.sessions[0].frame;
+    for (uint32_t i = 0; i < DEPTH; i++) {
+      fill_dummy_frame(frame, i);
+      frame->pts = i;
+      if (pyramid_encode(pyramid) != 0)
+	return 1;
     }
 
-    /* add sequence end code to have a real mpeg file */
-    //fwrite(endcode, 1, sizeof(endcode), f);
-    // fclose(f);
+    if (pyramid_finish(pyramid) != 0)
+      return 1;
+
+    for (size_t l = 0; l < pyramid.levels.size(); ++l)
+      std::cerr << "pyramid level x" << pyramid.levels[l].factor << " "
+		<< pyramid.levels[l].width << "x" << pyramid.levels[l].height
+		<< ": " << pyramid.streams[l].size() << "B\n";
 
-    avcodec_close(c);
-    av_free(c);
-    av_freep(&frame->data[0]);
-    av_frame_free(&frame);
-    printf("\n");
+    int rcode = pyramid_write(pyramid, _fname);
+    for (size_t l = 0; l < pyramid.streams.size(); ++l)
+      release_stream(pyramid.streams[l]);
+    return rcode;
 }
 
-int decode_buffer_to_files(const std::vector<uint8_t>& _buffer, const std::string& _fbase){
+/*
+ * encodes the dummy volume with cols x rows slices tiled into each coded
+ * picture, the layout is written to <_fname>.mosaic
+ */
+static int video_encode_mosaic(const std::string& _fname, AVCodecID codec_id, const mosaic_layout& _layout)
+{
+    encoder_settings settings = default_encoder_settings(codec_id, mosaic_width(_layout), mosaic_height(_layout));
+    //keep the bits per slice of the plain encode
+    settings.bit_rate *= mosaic_tiles(_layout);
 
-    av_register_all();
-    AVFrame* frame = avcodec_alloc_frame();
-    if (!frame)
-    {
-        return 1;
+    encoder_session session;
+    if (encoder_open(session, settings) != 0)
+      return 1;
+    timeseries_remove_layout(_fname);
+    sparse_remove_map(_fname);
+
+    AVFrame* slice = av_frame_alloc();
+    slice->width = _layout.slice_width;
+    slice->height = _layout.slice_height;
+    pool_image(slice, slice->width, slice->height, AV_PIX_FMT_YUV420P);
+    const int slice_bytes = slice->buf[0]->size;
+    memory_account(MEMORY_GENERATION, slice_bytes);
+
+    std::vector<uint8_t> stream;
+    const int tiles = mosaic_tiles(_layout);
+    int rcode = 0;
+    for (int picture = 0; picture < mosaic_pictures(_layout) && !rcode; ++picture) {
+      for (int t = 0; t < tiles; ++t) {
+	int z = picture * tiles + t;
+	if (z < _layout.depth) {
+	  fill_dummy_frame(slice, z);
+	  mosaic_pack(slice, t, _layout, session.frame);
+	}
+	else
+	  mosaic_clear(t, _layout, session.frame);
+      }
+      session.frame->pts = picture;
+      if (encoder_encode(session, session.frame, append_to(stream)) < 0)
+	rcode = 1;
     }
+    if (encoder_flush(session, append_to(stream)) < 0)
+      rcode = 1;
+
+    std::cerr << "mosaic " << _layout.cols << "x" << _layout.rows << " of "
+	      << _layout.slice_width << "x" << _layout.slice_height << ": "
+	      << session.packets_out << " pictures, " << stream.size() << "B for "
+	      << _layout.depth << " slices\n";
+
+    encoder_close(session);
+    memory_release(MEMORY_GENERATION, slice_bytes);
+    av_frame_free(&slice);
+
+    //no packet at all: the encoder failed before its first picture
+    if (stream.empty())
+      rcode = 1;
+    std::ofstream ofile(_fname.c_str(), std::ios::binary | std::ios::out | std::ios::trunc);
+    if (!stream.empty())
+      ofile.write(reinterpret_cast<const char*>(&stream[0]), stream.size());
+    if (!ofile.good() || mosaic_write_layout(_layout, _fname + ".mosaic") != 0)
+      rcode = 1;
+    release_stream(stream);
+    return rcode;
+}
 
-    AVFormatContext* formatContext = NULL;
-    formatContext = avformat_alloc_context();//TODO: handle errors!!
+//decodes a mosaic stream and writes every tiled slice as a PPM of its own
+static int decode_mosaic_file(const std::string& _fname)
+{
+    mosaic_layout layout;
+    if (mosaic_read_layout(_fname + ".mosaic", layout) != 0) {
+      std::cerr << "no mosaic layout found for " << _fname << "\n";
+      return 1;
+    }
 
-    //taken from https://ffmpeg.org/doxygen/trunk/avio_reading_8c-example.html#a18
-    AVIOContext *avio_ctx = NULL;
-    uint8_t *avio_ctx_buffer = NULL;
-    size_t avio_ctx_buffer_size = 4096;
+    const int tiles = mosaic_tiles(layout);
+    return decode_file(_fname, [&](const AVFrame* frame, int frameNumber) {
+	for (int t = 0; t < tiles; ++t) {
+	  int z = frameNumber * tiles + t;
+	  if (z >= layout.depth)
+	    break;
+	  savePlane(mosaic_tile_luma(frame, t, layout), frame->linesize[0],
+		    layout.slice_width, layout.slice_height, z, _fname);
+	}
+      });
+}
 
-    
-    buffer_data read_data = {0};
-    read_data.ptr = &_buffer[0];
-    read_data.size = _buffer.size();
-      
-    avio_ctx_buffer = (uint8_t *)av_malloc(avio_ctx_buffer_size);
-    if (!avio_ctx_buffer) {
-      std::cerr << "failed to allocated avio_ctx_buffer\n";
-      //handle deallocation
-      avformat_close_input(&formatContext);
-      av_freep(&avio_ctx_buffer);
+/*
+ * encodes _layout.timepoints timepoints of the dummy volume (see
+ * volume_generator_at) in the interleaved order of timeseries.hpp, the
+ * layout is written to <_fname>.4d
+ */
+static int video_encode_timeseries(const std::string& _fname, AVCodecID codec_id, const timeseries_layout& _layout,
+				   const rate_request* _rate)
+{
+    encoder_settings settings = default_encoder_settings(codec_id, WIDTH, HEIGHT);
+    timeseries_settings(_layout, settings);
+
+    async_writer out;
+    if (out.open(_fname) != 0) {
+      std::cerr << "Could not open " << _fname << "\n";
       return 1;
     }
-    
-    avio_ctx = avio_alloc_context(avio_ctx_buffer, avio_ctx_buffer_size,
-                                  0, &read_data, &read_packet, NULL, NULL);
-    if (!avio_ctx) {
-      
-      std::cerr << "failed to allocated avio_ctx_buffer\n";
-      //handle deallocation
-      avformat_close_input(&formatContext);
+    sparse_remove_map(_fname);
+    int64_t bytes_out = 0;
+    packet_sink write_packet = [&out, &bytes_out](const AVPacket& pkt) {
+      out.write(pkt.data, pkt.size);
+      bytes_out += pkt.size;
+    };
+
+    slice_source timepoint_slice = [&_layout](AVFrame* frame, int i) {
+      int t = 0, z = 0;
+      timeseries_position(_layout, i, t, z);
+      volume_generator gen;
+      volume_generator_at(&dummy_volume, t, &gen);
+      volume_fill_luma(&gen, z, frame->data[0], frame->linesize[0]);
+      volume_fill_chroma(&gen, z, frame->data[1], frame->linesize[1], frame->data[2], frame->linesize[2]);
+      frame->pts = i;
+      frame->pict_type = timeseries_keyframe(_layout, i) ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+    };
+
+    rate_request rate = { RATE_BITRATE, (double)settings.bit_rate };
+    if (_rate)
+      rate = *_rate;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    int rcode = rate_encode(settings, timeseries_pictures(_layout), timepoint_slice, write_packet, rate);
+    rcode |= out.close();
+    rcode |= timeseries_write_layout(_layout, _fname);
+    auto end = std::chrono::high_resolution_clock::now();
+
+    std::cerr << "4d: " << _layout.timepoints << " timepoints of " << _layout.slices << " slices in blocks of "
+	      << _layout.block << ": " << bytes_out << "B (" << bytes_out / _layout.timepoints << "B per timepoint) in "
+	      << std::chrono::duration<double>(end - start).count() << " s\n";
+    return rcode;
+}
+
+//decodes a 4D stream, slice z of timepoint t goes to <_fname>-t<t>-slice<z>.ppm
+static int decode_timeseries_file(const std::string& _fname)
+{
+    timeseries_layout layout;
+    if (timeseries_read_layout(_fname, layout) != 0) {
+      std::cerr << "no 4d layout found for " << _fname << "\n";
       return 1;
-      
     }
-    formatContext->pb = avio_ctx;
-    
-    if (avformat_open_input(&formatContext, "", NULL, NULL) != 0)
-    {
-      avformat_close_input(&formatContext);
-      if (avio_ctx) {
-        av_freep(&avio_ctx->buffer);
-        av_freep(&avio_ctx);
-      }
-      av_free(frame);
+
+    int decoded = 0;
+    int rcode = decode_file(_fname, [&](const AVFrame* frame, int picture) {
+	int t = 0, z = 0;
+	timeseries_position(layout, picture, t, z);
+	++decoded;
+	if (dump_slices)
+	  savePlane(frame->data[0], frame->linesize[0], WIDTH, HEIGHT, z, _fname + "-t" + std::to_string(t));
+      });
+    std::cerr << decoded << " of " << timeseries_pictures(layout) << " slices decoded from " << _fname << "\n";
+    return rcode != 0 || decoded != timeseries_pictures(layout);
+}
+
+//slice z of channel c of the dummy multi-channel volume: the dummy volume seeded with seed + c
+static void fill_channel_slice(int c, int z, uint8_t* dst)
+{
+    volume_generator gen;
+    volume_generator_init(&gen, dummy_volume.pattern, WIDTH, HEIGHT, DEPTH, dummy_volume.seed + c);
+    volume_fill_luma(&gen, z, dst, WIDTH);
+}
+
+/*
+ * encodes _layout.channels channels of the dummy volume as the streams of
+ * channels.hpp (one per channel, or three per 4:4:4 stream when packed),
+ * the streams of a slice side by side; the layout goes to <_fname>.channels
+ */
+static int video_encode_channels(const std::string& _fname, AVCodecID codec_id, const channel_layout& _layout)
+{
+    const int streams = channel_streams(_layout);
+    encoder_settings settings = default_encoder_settings(codec_id, WIDTH, HEIGHT);
+    channel_encoder encoder;
+    if (channel_encoder_open(encoder, settings, _layout) != 0)
       return 1;
+
+    std::vector<async_writer> out(streams);
+    std::vector<packet_sink> sinks;
+    int rcode = 0;
+    for (int s = 0; s < streams; ++s) {
+      if (out[s].open(channel_stream_name(_fname, _layout, s)) != 0) {
+	std::cerr << "Could not open " << channel_stream_name(_fname, _layout, s) << "\n";
+	rcode = 1;
+      }
+      timeseries_remove_layout(channel_stream_name(_fname, _layout, s));
+      sparse_remove_map(channel_stream_name(_fname, _layout, s));
+      async_writer* writer = &out[s];
+      sinks.push_back([writer](const AVPacket& pkt) { writer->write(pkt.data, pkt.size); });
     }
 
-    if (avformat_find_stream_info(formatContext, NULL) < 0)
-    {
-        av_free(frame);
-        avformat_close_input(&formatContext);
-	if (avio_ctx) {
-	  av_freep(&avio_ctx->buffer);
-	  av_freep(&avio_ctx);
-	}
-        return 1;
+    const size_t slice_size = (size_t)WIDTH * HEIGHT;
+    std::vector<uint8_t> slices(slice_size * _layout.channels);
+    std::vector<const uint8_t*> planes(_layout.channels);
+    for (int c = 0; c < _layout.channels; ++c)
+      planes[c] = &slices[c * slice_size];
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (uint32_t z = 0; z < DEPTH && rcode == 0; ++z) {
+      for (int c = 0; c < _layout.channels; ++c)
+	fill_channel_slice(c, z, &slices[c * slice_size]);
+      rcode |= channel_encoder_encode(encoder, &planes[0], WIDTH, z, sinks);
     }
+    if (rcode == 0)
+      rcode |= channel_encoder_flush(encoder, sinks);
+    auto end = std::chrono::high_resolution_clock::now();
+    channel_encoder_close(encoder);
+
+    int64_t bytes_out = 0;
+    for (int s = 0; s < streams; ++s) {
+      bytes_out += out[s].bytes();
+      rcode |= out[s].close();
+    }
+    rcode |= channel_write_layout(_layout, _fname);
+
+    std::cerr << "channels: " << _layout.channels << " " << channel_policy_name(_layout.policy) << " in "
+	      << streams << " streams: " << bytes_out << "B in "
+	      << std::chrono::duration<double>(end - start).count() << " s (streams busy";
+    for (int s = 0; s < streams; ++s)
+      std::cerr << " " << encoder.busy_ns[s] / 1e9;
+    std::cerr << " s)\n";
+    return rcode;
+}
 
-    if (formatContext->nb_streams < 1 ||
-        formatContext->streams[0]->codec->codec_type != AVMEDIA_TYPE_VIDEO)
-    {
-        av_free(frame);
-        avformat_close_input(&formatContext);
-	if (avio_ctx) {
-	  av_freep(&avio_ctx->buffer);
-	  av_freep(&avio_ctx);
-	}
-        return 1;
+/*
+ * decodes the streams of a multi-channel volume side by side into one
+ * planar volume, reports the PSNR of every channel and writes channel c
+ * of slice z to <_fname>-c<c>-slice<z>.ppm
+ */
+static int decode_channels_file(const std::string& _fname)
+{
+    channel_layout layout;
+    if (channel_read_layout(_fname, layout) != 0) {
+      std::cerr << "no channel layout found for " << _fname << "\n";
+      return 1;
     }
 
-    AVStream* stream = formatContext->streams[0];
-    AVCodecContext* codecContext = stream->codec;
+    std::vector<uint8_t> volume(channel_volume_size(layout, WIDTH, HEIGHT, DEPTH));
+    auto start = std::chrono::high_resolution_clock::now();
+    if (channel_decode(_fname, layout, CHANNELS_PLANAR, WIDTH, HEIGHT, DEPTH, &volume[0]) != 0) {
+      std::cerr << "decoding the channels of " << _fname << " failed\n";
+      return 1;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    std::cerr << layout.channels << " channels of " << DEPTH << " slices decoded from " << channel_streams(layout)
+	      << " streams in " << std::chrono::duration<double>(end - start).count() << " s\n";
+
+    const size_t slice_size = (size_t)WIDTH * HEIGHT;
+    std::vector<uint8_t> original(slice_size);
+    for (int c = 0; c < layout.channels; ++c) {
+      uint64_t sse = 0;
+      for (uint32_t z = 0; z < DEPTH; ++z) {
+	const uint8_t* slice = &volume[(c * DEPTH + z) * slice_size];
+	fill_channel_slice(c, z, &original[0]);
+	sse += plane_sse(slice, WIDTH, &original[0], WIDTH, WIDTH, HEIGHT);
+	if (dump_slices)
+	  savePlane(slice, WIDTH, WIDTH, HEIGHT, z, _fname + "-c" + std::to_string(c));
+      }
+      const double mse = (double)sse / (slice_size * DEPTH);
+      std::cerr << "channel " << c << ": PSNR " << (mse > 0 ? 10 * log10(255. * 255. / mse) : 99.) << " dB\n";
+    }
+    return 0;
+}
 
-    codecContext->codec = avcodec_find_decoder(codecContext->codec_id);
-    if (codecContext->codec == NULL)
-    {
-        av_free(frame);
-        avcodec_close(codecContext);
-        avformat_close_input(&formatContext);
-	if (avio_ctx) {
-	  av_freep(&avio_ctx->buffer);
-	  av_freep(&avio_ctx);
-	}
-        return 1;
+/*
+ * encodes the dummy volume with its constant and repeated slices left out
+ * (see sparse.hpp, within _tolerance), the runs go to <_fname>.sparse
+ */
+static int video_encode_sparse(const std::string& _fname, AVCodecID codec_id, int _tolerance,
+			       const rate_request* _rate)
+{
+    encoder_settings settings = default_encoder_settings(codec_id, WIDTH, HEIGHT);
+    slice_source dummy_slice = [](AVFrame* frame, int i) {
+      fill_dummy_frame(frame, i);
+      frame->pts = i;
+    };
+
+    auto start = std::chrono::high_resolution_clock::now();
+    sparse_map map;
+    if (sparse_scan(map, WIDTH, HEIGHT, DEPTH, dummy_slice, _tolerance) != 0)
+      return 1;
+    auto scanned = std::chrono::high_resolution_clock::now();
+
+    async_writer out;
+    if (out.open(_fname) != 0) {
+      std::cerr << "Could not open " << _fname << "\n";
+      return 1;
     }
-    else if (avcodec_open2(codecContext, codecContext->codec, NULL) != 0)
-    {
-        av_free(frame);
-        avcodec_close(codecContext);
-        avformat_close_input(&formatContext);
-	if (avio_ctx) {
-	  av_freep(&avio_ctx->buffer);
-	  av_freep(&avio_ctx);
-	}
-        return 1;
+    timeseries_remove_layout(_fname);
+    packet_sink write_packet = [&out](const AVPacket& pkt) { out.write(pkt.data, pkt.size); };
+
+    rate_request rate = { RATE_BITRATE, (double)settings.bit_rate };
+    if (_rate)
+      rate = *_rate;
+    int rcode = sparse_encode(settings, map, dummy_slice, write_packet, rate);
+    const uint64_t bytes_out = out.bytes();
+    rcode |= out.close();
+    rcode |= sparse_write_map(map, _fname);
+    auto end = std::chrono::high_resolution_clock::now();
+
+    int constant = 0;
+    for (const sparse_slice& slice : map.slices)
+      constant += slice.kind == SPARSE_CONSTANT;
+    std::cerr << "sparse: " << map.coded.size() << " of " << DEPTH << " slices coded, " << constant << " constant, "
+	      << DEPTH - map.coded.size() - constant << " repeated: " << bytes_out << "B; scan "
+	      << std::chrono::duration<double>(scanned - start).count() << " s, encode "
+	      << std::chrono::duration<double>(end - scanned).count() << " s\n";
+    return rcode;
+}
+
+//decodes a sparse stream, the left out slices filled in; reports the PSNR against the dummy volume
+static int decode_sparse_file(const std::string& _fname)
+{
+    sparse_map map;
+    if (sparse_read_map(_fname, map) != 0) {
+      std::cerr << "no sparse map found for " << _fname << "\n";
+      return 1;
     }
 
-    AVPacket packet;
-    av_init_packet(&packet);
+    std::vector<uint8_t> original((size_t)WIDTH * HEIGHT);
+    uint64_t sse = 0;
+    int slices = 0, synthesized = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    int rcode = decode_file_sparse(_fname, map, [&](const AVFrame* frame, int z) {
+	volume_fill_luma(&dummy_volume, z, &original[0], WIDTH);
+	sse += plane_sse(frame->data[0], frame->linesize[0], &original[0], WIDTH, WIDTH, HEIGHT);
+	++slices;
+	if (dump_slices)
+	  savePlane(frame->data[0], frame->linesize[0], WIDTH, HEIGHT, z, _fname);
+      }, &synthesized);
+    auto end = std::chrono::high_resolution_clock::now();
+
+    const double mse = slices > 0 ? (double)sse / ((double)WIDTH * HEIGHT * slices) : 0;
+    std::cerr << slices << " slices from " << _fname << " (" << synthesized << " filled in without the codec) in "
+	      << std::chrono::duration<double>(end - start).count() << " s, PSNR "
+	      << (mse > 0 ? 10 * log10(255. * 255. / mse) : 99.) << " dB\n";
+    return rcode;
+}
 
+//-R: writes the MIP to <_name>-mip-slice0.ppm and reports the statistics
+static void save_reductions(const volume_reductions& _reductions, const std::string& _name)
+{
+    if (!_reductions.mip.empty())
+      savePlane(&_reductions.mip[0], _reductions.width, _reductions.width, _reductions.height, 0, _name + "-mip");
+    reductions_report(_reductions, _name, std::cerr);
+}
 
+//decodes an Annex-B stream held in memory through libh26xvol, no demuxer involved;
+//the slices are verified against the checksums of _checksummed (a stream file) if given
+//and handed to _reducers
+int decode_buffer_to_files(const std::vector<uint8_t>& _buffer, const std::string& _fbase,
+			   const std::string& _checksummed = "",
+			   const std::vector<plane_reducer>& _reducers = std::vector<plane_reducer>()){
 
-    int frameNumber = 0;
-    while (av_read_frame(formatContext, &packet) == 0)
-    {
-        if (packet.stream_index == stream->index)
-        {
-            int frameFinished = 0;
-            avcodec_decode_video2(codecContext, frame, &frameFinished, &packet);
+    if (_buffer.empty())
+        return 1;
 
-            if (frameFinished)
-            {
-	      saveFrame(frame, codecContext->width, codecContext->height, frameNumber++,_fbase.c_str());
-                std::cout << frameNumber << ":\trepeat: " << frame->repeat_pict
-                      << "\tkeyframe: " << frame->key_frame
-                      << "\tbest_ts: " << frame->best_effort_timestamp << '\n';
-            }
-        }
+    h26xvol_decoder* decoder = NULL;
+    int rcode = h26xvol_decoder_open(&decoder, &_buffer[0], _buffer.size());
+    if (rcode != H26XVOL_OK)
+    {
+        std::cerr << "h26xvol_decoder_open: " << h26xvol_strerror(rcode) << "\n";
+        return 1;
     }
 
+    h26xvol_stream_info info;
+    h26xvol_decoder_info(decoder, &info);
 
-    int frameFinished = 1;
-    while(frameFinished){
+    checksum_verifier verifier;
+    checksum_verifier_open(verifier, _checksummed);
 
-      packet.data = NULL;
-      packet.size = 0;
-      int rcode = avcodec_decode_video2(codecContext, frame, &frameFinished, &packet);
-      if(rcode < 0 ){
-	std::cerr << "[delayed]\tdecide error detected\n";
+    //one slice at a time, consecutive ranges continue decoding where the last one stopped
+    std::vector<uint8_t> slice((size_t)info.width*info.height);
+    int frameNumber = 0;
+    for(;frameNumber<info.slices;++frameNumber){
+      rcode = h26xvol_decode_range(decoder, frameNumber, 1, &slice[0], info.width, slice.size());
+      if(rcode != 1){
+	std::cerr << "slice " << frameNumber << ": " << h26xvol_strerror(rcode < 0 ? rcode : H26XVOL_ERROR_STREAM) << "\n";
 	break;
       }
-      
-      if (frameFinished)
-	{
-	  saveFrame(frame, codecContext->width, codecContext->height, frameNumber++,_fbase.c_str());
-	  std::cout << frameNumber << ":\trepeat: " << frame->repeat_pict
-		<< "\tkeyframe: " << frame->key_frame
-		<< "\tbest_ts: " << frame->best_effort_timestamp << "[delayed]\n";
-	}
+      checksum_verify(verifier, frameNumber, &slice[0], info.width, info.width, info.height);
+      for (const plane_reducer& reducer : _reducers)
+	reducer(&slice[0], info.width, info.width, info.height, frameNumber);
+      if (dump_slices)
+	savePlane(&slice[0], info.width, info.width, info.height, frameNumber, _fbase);
     }
-    
-    av_free_packet(&packet);
-    av_free(frame);
-    avcodec_close(codecContext);
-    avformat_close_input(&formatContext);
-    if (avio_ctx) {
-	  av_freep(&avio_ctx->buffer);
-	  av_freep(&avio_ctx);
-	}
-    return 0;
+
+    h26xvol_decoder_close(decoder);
+    int mismatch = _checksummed.empty() ? 0 : checksum_report(verifier, _fbase, std::cerr);
+    return frameNumber == info.slices && !mismatch ? 0 : 1;
 
 }
 
-int decode_video_file(const std::string& _fname)
+int decode_video_file(const std::string& _fname,
+		      const std::vector<plane_reducer>& _reducers = std::vector<plane_reducer>())
 {
+    const frame_sink reduce = reduce_frames(_reducers);
     av_register_all();
     AVFrame* frame = avcodec_alloc_frame();
     if (!frame)
@@ -542,6 +799,8 @@ int decode_video_file(const std::string& _fname)
     AVStream* stream = formatContext->streams[0];
     AVCodecContext* codecContext = stream->codec;
 
+    use_frame_pool(codecContext);
+    size_t rss = memory_rss();
     codecContext->codec = avcodec_find_decoder(codecContext->codec_id);
     if (codecContext->codec == NULL)
     {
@@ -558,6 +817,11 @@ int decode_video_file(const std::string& _fname)
         return 1;
     }
 
+    const size_t codec_bytes = memory_account_rss(MEMORY_DECODE, rss);
+
+    checksum_verifier verifier;
+    checksum_verifier_open(verifier, _fname);
+
     AVPacket packet;
     av_init_packet(&packet);
 
@@ -569,14 +833,19 @@ int decode_video_file(const std::string& _fname)
         if (packet.stream_index == stream->index)
         {
             int frameFinished = 0;
+            uint64_t start = telemetry_start();
             avcodec_decode_video2(codecContext, frame, &frameFinished, &packet);
 
             if (frameFinished)
             {
-	      saveFrame(frame, codecContext->width, codecContext->height, frameNumber++,_fname.c_str());
-                std::cout << frameNumber << ":\trepeat: " << frame->repeat_pict
-                      << "\tkeyframe: " << frame->key_frame
-                      << "\tbest_ts: " << frame->best_effort_timestamp << '\n';
+                telemetry_record_frame('D', frameNumber, frame->best_effort_timestamp, start, 0,
+                                       packet.size, frame->pict_type, -1);
+	      checksum_verify(verifier, frameNumber, frame->data[0], frame->linesize[0],
+			      codecContext->width, codecContext->height);
+	      reduce(frame, frameNumber);
+	      if (dump_slices)
+		saveFrame(frame, codecContext->width, codecContext->height, frameNumber,_fname.c_str());
+	      ++frameNumber;
             }
         }
     }
@@ -587,6 +856,7 @@ int decode_video_file(const std::string& _fname)
 
       packet.data = NULL;
       packet.size = 0;
+      uint64_t start = telemetry_start();
       int rcode = avcodec_decode_video2(codecContext, frame, &frameFinished, &packet);
       if(rcode < 0 ){
 	std::cerr << "[delayed]\tdecide error detected\n";
@@ -595,18 +865,23 @@ int decode_video_file(const std::string& _fname)
       
       if (frameFinished)
 	{
-	  saveFrame(frame, codecContext->width, codecContext->height, frameNumber++,_fname.c_str());
-	  std::cout << frameNumber << ":\trepeat: " << frame->repeat_pict
-		<< "\tkeyframe: " << frame->key_frame
-		<< "\tbest_ts: " << frame->best_effort_timestamp << "[delayed]\n";
+	  telemetry_record_frame('D', frameNumber, frame->best_effort_timestamp, start, 0,
+				 0, frame->pict_type, -1);
+	  checksum_verify(verifier, frameNumber, frame->data[0], frame->linesize[0],
+			  codecContext->width, codecContext->height);
+	  reduce(frame, frameNumber);
+	  if (dump_slices)
+	    saveFrame(frame, codecContext->width, codecContext->height, frameNumber,_fname.c_str());
+	  ++frameNumber;
 	}
     }
     
     av_free_packet(&packet);
     av_free(frame);
     avcodec_close(codecContext);
+    memory_release(MEMORY_DECODE, codec_bytes);
     avformat_close_input(&formatContext);
-    return 0;
+    return checksum_report(verifier, _fname, std::cerr);
 }
 
 
@@ -614,27 +889,175 @@ int main(int argc, char **argv)
 {
 
     /* register all the codecs */
-    avcodec_register_all();
+    h26xvol_init();
 
     if (argc < 2){
 
-      std::cout << "usage: ./roundtrip <codec>\n"
+      std::cout << "usage: ./roundtrip <codec> [-p <factor>] [-P <levels>] [-k <max_gop>] [-m <cols>x<rows>|auto] [-g <pattern>[:<seed>]] [-r <mode>=<value>] [-o mp4|mkv] [-T <timepoints>[:<block>]] [-C <channels>[:<policy>]] [-R <reductions>] [-S] [-Z <tolerance>] [-V]\n"
+		<< "       ./roundtrip auto -a <target> [-c <class>] [options as above]\n"
 		<< "app to experiment on how to decode an encoded piece of memory\nrather then writing it to disk"
-		<< "codec\tpossible values: 'h264' or 'hevc'\n";
+		<< "codec\tpossible values: 'h264', 'hevc' (or 'h265') or 'auto' (trial-encode sample slices, see -a)\n"
+		<< "-p\tdecode a keyframe-only preview downscaled by <factor> instead of all slices\n"
+		<< "-P\tencode a resolution pyramid with <levels> downsampled levels to <oname>.pyr\n"
+		<< "\tand decode every level from it, coarsest first\n"
+		<< "-k\tplace keyframes where consecutive slices differ strongly, at least every <max_gop> slices\n"
+		<< "-m\ttile <cols>x<rows> slices into each coded picture ('auto': by slice size and CPU count)\n"
+		<< "-g\tdummy volume: stripes (default), noise, gradient or blobs, seeded with <seed>\n"
+		<< "-r\trate control: bitrate=<bit/s>, crf=<crf>, qp=<qp>, size=<bytes>[k|M|G] (two-pass)\n"
+		<< "\tor psnr=<dB> (CRF searched on a sample of slices)\n"
+		<< "-a\tauto: throughput=<slices/s> (best ratio that fast) or ratio=<raw/coded> (fastest that small)\n"
+		<< "-c\tauto: dataset class the decision is cached for (default: <width>x<height>)\n"
+		<< "-o\tmux into <oname>.mp4 or <oname>.mkv instead of writing Annex-B, then decode\n"
+		<< "\tthe second half of the slices again after seeking in the container's index\n"
+		<< "-T\tencode <timepoints> timepoints of the dummy volume as one 4D stream, slices of\n"
+		<< "\t<block> (default 8, at most 15) timepoints interleaved so that every slice is\n"
+		<< "\tpredicted from itself one timepoint earlier; 1 codes the timepoints separately\n"
+		<< "-C\tencode <channels> channels of the dummy volume side by side, packed three to\n"
+		<< "\ta 4:4:4 stream or in parallel streams of one channel (default), and decode them\n"
+		<< "-R\treduce the decoded slices instead of writing them: mip, histogram, stats\n"
+		<< "\t(comma separated) or all; the MIP goes to <oname>-mip-slice0.ppm\n"
+		<< "-S\tencode and decode at the same time, packets handed to the decoder as they come,\n"
+		<< "\tno file written; reports the latency per slice and the throughput\n"
+		<< "-Z\tleave slices out of the stream that are constant or repeat the slice before\n"
+		<< "\twithin <tolerance> (0: exactly), the decode fills them in (try -g blobs)\n"
+		<< "-V\tverify the decoded slices against the checksums in <oname>.crc, write no ppm files\n";
       return 1;
     }
 
+    int preview_factor = 0;
+    int pyramid_levels = 0;
+    int max_gop = 0;
+    std::string mosaic;
+    std::string container;
+    int timepoints = 0, block = 8;
+    int channels = 0;
+    int reductions = 0;
+    bool overlapped = false;
+    int sparse_tolerance = -1;
+    channel_policy policy = CHANNELS_PARALLEL;
+    rate_request rate = { RATE_BITRATE, 0 };
+    bool rate_given = false;
+    std::string tune_target, tune_class = std::to_string(WIDTH) + "x" + std::to_string(HEIGHT);
+    for (int a = 2; a < argc; ++a){
+      if (std::string(argv[a]) == "-p" && a + 1 < argc)
+	preview_factor = std::atoi(argv[++a]);
+      if (std::string(argv[a]) == "-P" && a + 1 < argc)
+	pyramid_levels = std::atoi(argv[++a]);
+      if (std::string(argv[a]) == "-k" && a + 1 < argc)
+	max_gop = std::atoi(argv[++a]);
+      if (std::string(argv[a]) == "-m" && a + 1 < argc)
+	mosaic = argv[++a];
+      if (std::string(argv[a]) == "-T" && a + 1 < argc){
+	if (sscanf(argv[++a], "%d:%d", &timepoints, &block) < 1 || timepoints < 1 || block < 1 ||
+	    block > timeseries_max_block){
+	  std::cerr << "time series " << argv[a] << " not understood (block 1 to " << timeseries_max_block << ")\n";
+	  return 1;
+	}
+      }
+      if (std::string(argv[a]) == "-C" && a + 1 < argc){
+	std::string spec = argv[++a];
+	size_t colon = spec.find(':');
+	channels = std::atoi(spec.substr(0, colon).c_str());
+	int p = colon == std::string::npos ? CHANNELS_PARALLEL : channel_policy_from_name(spec.substr(colon + 1));
+	if (channels < 1 || p < 0){
+	  std::cerr << "channels " << spec << " not understood\n";
+	  return 1;
+	}
+	policy = (channel_policy)p;
+      }
+      if (std::string(argv[a]) == "-o" && a + 1 < argc){
+	container = argv[++a];
+	if (container_format("." + container).empty()){
+	  std::cerr << "container " << container << " unknown\n";
+	  return 1;
+	}
+      }
+      if (std::string(argv[a]) == "-r" && a + 1 < argc){
+	if (rate_request_from_string(argv[++a], rate) != 0){
+	  std::cerr << "rate control " << argv[a] << " not understood\n";
+	  return 1;
+	}
+	rate_given = true;
+      }
+      if (std::string(argv[a]) == "-a" && a + 1 < argc)
+	tune_target = argv[++a];
+      if (std::string(argv[a]) == "-c" && a + 1 < argc)
+	tune_class = argv[++a];
+      if (std::string(argv[a]) == "-V")
+	dump_slices = false;
+      if (std::string(argv[a]) == "-S")
+	overlapped = true;
+      if (std::string(argv[a]) == "-Z" && a + 1 < argc){
+	sparse_tolerance = std::atoi(argv[++a]);
+	if (sparse_tolerance < 0 || sparse_tolerance > 255){
+	  std::cerr << "tolerance " << argv[a] << " out of 0 to 255\n";
+	  return 1;
+	}
+      }
+      if (std::string(argv[a]) == "-R" && a + 1 < argc){
+	reductions = reduction_kinds_from_string(argv[++a]);
+	if (reductions <= 0){
+	  std::cerr << "reductions " << argv[a] << " not understood\n";
+	  return 1;
+	}
+	dump_slices = false;
+      }
+      if (std::string(argv[a]) == "-g" && a + 1 < argc){
+	std::string pattern = argv[++a];
+	unsigned long long seed = 0;
+	size_t colon = pattern.find(':');
+	if (colon != std::string::npos)
+	  seed = std::strtoull(pattern.c_str() + colon + 1, NULL, 10);
+	int p = volume_pattern_from_name(pattern.substr(0, colon).c_str());
+	if (p < 0){
+	  std::cerr << "pattern " << pattern << " unknown\n";
+	  return 1;
+	}
+	volume_generator_init(&dummy_volume, (volume_pattern)p, WIDTH, HEIGHT, DEPTH, seed);
+      }
+    }
+
     std::string oname;
     AVCodecID codec_id;
-    
+    std::string preset;
+
     std::string file_type = argv[1];
+    if(file_type == "auto"){
+      autotune_target target;
+      if(autotune_target_from_string(tune_target, target) != 0){
+	std::cerr << "auto needs -a throughput=<slices/s> or -a ratio=<raw/coded>\n";
+	return 1;
+      }
+      //the trials run at constant quality, the full volume too unless -r asks otherwise
+      if(!rate_given){
+	rate.mode = RATE_CRF;
+	rate.value = 23;
+	rate_given = true;
+      }
+      encoder_settings trial = default_encoder_settings(AV_CODEC_ID_H264, WIDTH, HEIGHT);
+      if(rate.mode == RATE_QP)
+	trial.qp = (int)rate.value;
+      else
+	trial.crf = rate.mode == RATE_CRF ? rate.value : 23;
+      autotune_candidate choice;
+      if(autotune_choose(trial, DEPTH, [](AVFrame* frame, int i){ fill_dummy_frame(frame, i); },
+			 tune_class, target, choice) != 0){
+	std::cerr << "autotune found no usable encoder\n";
+	return 1;
+      }
+      file_type = choice.codec_id == AV_CODEC_ID_HEVC ? "hevc" : "h264";
+      preset = choice.preset;
+      std::cerr << "autotune: " << file_type << " " << preset << " (" << choice.slices_per_second
+		<< " slices/s, ratio " << choice.ratio << ")\n";
+    }
+
     if(file_type.find("h264") != std::string::npos){
       codec_id = AV_CODEC_ID_H264;
       oname = "test.h264";
     }
     else{
 
-      if(file_type.find("hevc") != std::string::npos){
+      if(file_type.find("hevc") != std::string::npos || file_type.find("h265") != std::string::npos){
 	codec_id  = AV_CODEC_ID_HEVC;
 	oname = "test.hevc";
       }
@@ -645,24 +1068,153 @@ int main(int argc, char **argv)
       
     }
 
+    if(pyramid_levels > 0){
+      std::string pname = oname + ".pyr";
+      if(video_encode_pyramid(pname, codec_id, pyramid_levels) != 0){
+	std::cerr << "video_encode_pyramid failed\n";
+	return 1;
+      }
+
+      //a remote viewer would read the level table and range-read the coarse streams first
+      std::ifstream pfile(pname.c_str(), std::ios::binary | std::ios::in);
+      std::vector<pyramid_level> levels;
+      if(!pfile.good() || pyramid_read_levels(pfile, levels) != 0){
+	std::cerr << pname << " is not a pyramid file\n";
+	return 1;
+      }
+      for(size_t n = 0;n<levels.size();++n){
+	std::vector<uint8_t> level_stream;
+	if(pyramid_read_stream(pname, levels[n].factor, level_stream) != 0)
+	  return 1;
+	std::stringstream level_name;
+	level_name << "pyramid-x" << levels[n].factor << "-" << oname;
+	decode_buffer_to_files(level_stream, level_name.str());
+      }
+      return 0;
+    }
+
+    if(!mosaic.empty()){
+      mosaic_layout layout = choose_mosaic_layout(WIDTH, HEIGHT, DEPTH, std::thread::hardware_concurrency());
+      if(mosaic != "auto" && (sscanf(mosaic.c_str(), "%dx%d", &layout.cols, &layout.rows) != 2 ||
+			      layout.cols < 1 || layout.rows < 1)){
+	std::cerr << "mosaic layout " << mosaic << " not understood\n";
+	return 1;
+      }
+      if(!mosaic_fits(layout)){
+	std::cerr << "mosaic " << layout.cols << "x" << layout.rows << " of " << WIDTH << "x" << HEIGHT
+		  << " exceeds " << mosaic_max_width << "x" << mosaic_max_height << "\n";
+	return 1;
+      }
+      if(video_encode_mosaic(oname, codec_id, layout) != 0){
+	std::cerr << "video_encode_mosaic failed\n";
+	return 1;
+      }
+      return decode_mosaic_file(oname);
+    }
+
+    if(timepoints > 0){
+      timeseries_layout layout = { timepoints, (int)DEPTH, std::min(block, timepoints) };
+      if(video_encode_timeseries(oname, codec_id, layout, rate_given ? &rate : NULL) != 0){
+	std::cerr << "video_encode_timeseries failed\n";
+	return 1;
+      }
+      return decode_timeseries_file(oname);
+    }
+
+    if(channels > 0){
+      if(video_encode_channels(oname, codec_id, channel_plan(channels, policy)) != 0){
+	std::cerr << "video_encode_channels failed\n";
+	return 1;
+      }
+      return decode_channels_file(oname);
+    }
+
+    if(sparse_tolerance >= 0){
+      if(video_encode_sparse(oname, codec_id, sparse_tolerance, rate_given ? &rate : NULL) != 0){
+	std::cerr << "video_encode_sparse failed\n";
+	return 1;
+      }
+      return decode_sparse_file(oname);
+    }
+
+    if(overlapped)
+      return video_roundtrip_overlapped(codec_id, rate_given ? &rate : NULL, preset);
+
+    keyframe_plan plan = keyframe_plan();
+    if(max_gop > 0){
+      plan.max_gop = max_gop;
+      plan.min_gop = 2;
+      analyse_keyframes(plan);
+      keyframe_report(plan, std::cerr);
+    }
+
+    if(!container.empty())
+      oname += "." + container;
+
     //that works!
-    video_encode_example(oname.c_str(), codec_id);
-    decode_video_file(oname);
+    video_encode_example(oname.c_str(), codec_id, max_gop > 0 ? &plan : NULL, rate_given ? &rate : NULL, preset);
+
+    if(preview_factor > 0){
+      preview_volume preview;
+      if(decode_preview_file(oname, preview_factor, preview) != 0){
+	std::cerr << "decode_preview_file failed\n";
+	return 1;
+      }
+      const size_t slice_size = (size_t)preview.width*preview.height;
+      for(size_t s = 0;s<preview.slices.size();++s)
+	savePlane(&preview.voxels[s*slice_size], preview.width, preview.width, preview.height,
+		  preview.slices[s], oname + "-preview");
+      std::cerr << "preview: " << preview.slices.size() << " of " << DEPTH << " slices at "
+		<< preview.width << "x" << preview.height << "\n";
+      return 0;
+    }
+
+    //file and buffer decodes are both checked against the checksums of the encode
+    volume_reductions file_reductions, buffer_reductions;
+    reductions_init(file_reductions, reductions);
+    reductions_init(buffer_reductions, reductions);
+    std::vector<plane_reducer> file_reducers, buffer_reducers;
+    if(reductions){
+      file_reducers.push_back(reduce_into(file_reductions));
+      buffer_reducers.push_back(reduce_into(buffer_reductions));
+    }
+    int mismatch = decode_video_file(oname, file_reducers);
+    if(reductions)
+      save_reductions(file_reductions, oname);
+
+    //containers: random access through the sample index instead of the in-memory Annex-B decode
+    if(!container.empty()){
+      checksum_verifier verifier;
+      checksum_verifier_open(verifier, oname);
+      const int first = DEPTH/2;
+      int decoded = 0;
+      if(decode_file_range(oname, first, DEPTH - first, [&](const AVFrame* frame, int slice){
+	    checksum_verify(verifier, slice, frame->data[0], frame->linesize[0], WIDTH, HEIGHT);
+	    ++decoded;
+	  }) != 0 || decoded != DEPTH - first){
+	std::cerr << "seek to slice " << first << " in " << oname << " failed\n";
+	return 1;
+      }
+      std::cerr << "seek to slice " << first << ": " << decoded << " slices decoded";
+      if (verifier.available)
+	std::cerr << ", " << verifier.mismatches << " differ from the checksums";
+      std::cerr << "\n";
+      return mismatch | (verifier.mismatches > 0);
+    }
 
     std::vector<uint8_t> fbuffer;
-    std::ifstream ifile(oname, std::ios::binary | std::ios::in );
-    std::stringstream buffer;
-    buffer << ifile.rdbuf();
-    std::string content = buffer.str();
-    std::copy(content.begin(), content.end(),std::back_inserter(fbuffer));
-    ifile.close();
+    if (async_read_file(oname, fbuffer) != 0)
+      std::cerr << "unable to re-read " << oname << "\n";
     std::cerr << "(re-)read "<< fbuffer.size() <<"B from "<< oname <<"\n";
     
-    //TODO: that needs to work!
     std::string buffered_name = "buffered-";
     buffered_name += oname;
-    if(!decode_buffer_to_files(fbuffer,buffered_name))
+    if(decode_buffer_to_files(fbuffer,buffered_name,oname,buffer_reducers) != 0){
       std::cerr << "decode_buffer_to_files failed\n";
+      mismatch = 1;
+    }
+    if(reductions)
+      save_reductions(buffer_reductions, buffered_name);
     
     
     // std::string buffered = "buffered-";
@@ -676,5 +1228,5 @@ int main(int argc, char **argv)
 
 
     
-    return 0;
+    return mismatch;
 }
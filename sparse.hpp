@@ -0,0 +1,394 @@
+#ifndef _SPARSE_H_
+#define _SPARSE_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#include "decoder.hpp"
+#include "frame_pool.hpp"
+#include "ratecontrol.hpp"
+
+/*
+ * sparse volumes: long runs of background slices, all at one level or the
+ * same as the slice before. A pre-scan finds them and they are left out of
+ * the coded stream, no motion search or rate control is spent on them; the
+ * decoder side fills them in without the codec.
+ *
+ *   constant  every sample of each plane within tolerance of one value
+ *   repeat    every sample within tolerance of the previous slice (of the
+ *             one before the run)
+ *
+ * The first slice is always coded, so that the stream has parameter sets
+ * and a size. The coded pictures are the remaining slices in order, and
+ * the runs that were left out travel next to the stream:
+ *
+ *   <stream>.sparse: "H26XSPARSE1 <slices> <runs>", then one line per run
+ *                    "<first> <count> constant <y> <cb> <cr>" or
+ *                    "<first> <count> repeat"
+ *
+ * Streams with a .sparse sidecar are decoded as a whole (decode_file_sparse);
+ * seeking by slice number does not apply to their coded pictures.
+ */
+
+enum sparse_kind {
+  SPARSE_CODED,
+  SPARSE_CONSTANT,
+  SPARSE_REPEAT
+};
+
+struct sparse_slice {
+  uint8_t kind;      ///< sparse_kind
+  uint8_t value[3];  ///< constant: Y, Cb, Cr
+};
+
+struct sparse_map {
+  std::vector<sparse_slice> slices;
+  std::vector<int> coded;  ///< slice of every coded picture
+};
+
+/*
+ * true if max - min of a plane is at most _tolerance, _value is then the
+ * middle of the range; stops at the first row that exceeds it
+ */
+inline bool plane_constant(const uint8_t* _plane, int _linesize, int _width, int _height, int _tolerance,
+                           uint8_t& _value)
+{
+  uint8_t low = _plane[0], high = _plane[0];
+  for (int y = 0; y < _height; ++y) {
+    const uint8_t* row = _plane + (size_t)y * _linesize;
+    int x = 0;
+#ifdef __SSE2__
+    __m128i vlow = _mm_set1_epi8((char)low), vhigh = _mm_set1_epi8((char)high);
+    for (; x + 16 <= _width; x += 16) {
+      const __m128i v = _mm_loadu_si128((const __m128i*)(row + x));
+      vlow = _mm_min_epu8(vlow, v);
+      vhigh = _mm_max_epu8(vhigh, v);
+    }
+    uint8_t lanes[2][16];
+    _mm_storeu_si128((__m128i*)lanes[0], vlow);
+    _mm_storeu_si128((__m128i*)lanes[1], vhigh);
+    for (int n = 0; n < 16; ++n) {
+      low = std::min(low, lanes[0][n]);
+      high = std::max(high, lanes[1][n]);
+    }
+#endif
+    for (; x < _width; ++x) {
+      low = std::min(low, row[x]);
+      high = std::max(high, row[x]);
+    }
+    if (high - low > _tolerance)
+      return false;
+  }
+  _value = (uint8_t)((low + high + 1) / 2);
+  return true;
+}
+
+//true if no sample of _a differs from _b by more than _tolerance
+inline bool plane_near(const uint8_t* _a, int _a_linesize, const uint8_t* _b, int _b_linesize,
+                       int _width, int _height, int _tolerance)
+{
+  for (int y = 0; y < _height; ++y) {
+    const uint8_t* a = _a + (size_t)y * _a_linesize;
+    const uint8_t* b = _b + (size_t)y * _b_linesize;
+    int x = 0;
+#ifdef __SSE2__
+    //a - b > t exactly where the saturated (a - b) - t is not 0, same for b - a
+    const __m128i limit = _mm_set1_epi8((char)_tolerance);
+    __m128i over = _mm_setzero_si128();
+    for (; x + 16 <= _width; x += 16) {
+      const __m128i va = _mm_loadu_si128((const __m128i*)(a + x));
+      const __m128i vb = _mm_loadu_si128((const __m128i*)(b + x));
+      over = _mm_or_si128(over, _mm_or_si128(_mm_subs_epu8(_mm_subs_epu8(va, vb), limit),
+                                             _mm_subs_epu8(_mm_subs_epu8(vb, va), limit)));
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(over, _mm_setzero_si128())) != 0xffff)
+      return false;
+#endif
+    for (; x < _width; ++x)
+      if ((a[x] > b[x] ? a[x] - b[x] : b[x] - a[x]) > _tolerance)
+        return false;
+  }
+  return true;
+}
+
+inline bool frame_constant(const AVFrame* _frame, int _tolerance, uint8_t* _value)
+{
+  return plane_constant(_frame->data[0], _frame->linesize[0], _frame->width, _frame->height, _tolerance, _value[0]) &&
+    plane_constant(_frame->data[1], _frame->linesize[1], _frame->width / 2, _frame->height / 2, _tolerance, _value[1]) &&
+    plane_constant(_frame->data[2], _frame->linesize[2], _frame->width / 2, _frame->height / 2, _tolerance, _value[2]);
+}
+
+inline bool frame_near(const AVFrame* _a, const AVFrame* _b, int _tolerance)
+{
+  for (int p = 0; p < 3; ++p) {
+    const int shift = p > 0;
+    if (!plane_near(_a->data[p], _a->linesize[p], _b->data[p], _b->linesize[p], _a->width >> shift,
+                    _a->height >> shift, _tolerance))
+      return false;
+  }
+  return true;
+}
+
+/*
+ * the pre-scan: generates the _depth slices of _source once (4:2:0 of
+ * _width x _height) and classifies them; returns 0 on success
+ */
+inline int sparse_scan(sparse_map& _map, int _width, int _height, int _depth, const slice_source& _source,
+                       int _tolerance)
+{
+  _map = sparse_map();
+  AVFrame* frames[2] = { av_frame_alloc(), av_frame_alloc() };
+  for (AVFrame* frame : frames)
+    if (!frame || pool_image(frame, _width, _height, AV_PIX_FMT_YUV420P) != 0) {
+      av_frame_free(&frames[0]);
+      av_frame_free(&frames[1]);
+      return 1;
+    }
+
+  //repeats are compared with the last slice that is not one, so that runs do not drift
+  int current = 0;
+  for (int z = 0; z < _depth; ++z) {
+    AVFrame* frame = frames[current];
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width = _width;
+    frame->height = _height;
+    _source(frame, z);
+
+    sparse_slice slice = { SPARSE_CODED, { 0, 0, 0 } };
+    if (z > 0 && frame_constant(frame, _tolerance, slice.value))
+      slice.kind = SPARSE_CONSTANT;
+    else if (z > 0 && frame_near(frame, frames[1 - current], _tolerance))
+      slice.kind = SPARSE_REPEAT;
+    else
+      _map.coded.push_back(z);
+    _map.slices.push_back(slice);
+    if (slice.kind != SPARSE_REPEAT)
+      current = 1 - current;
+  }
+
+  av_frame_free(&frames[0]);
+  av_frame_free(&frames[1]);
+  return 0;
+}
+
+/*
+ * encodes the coded slices of _map as consecutive pictures through
+ * rate_encode (see ratecontrol.hpp), _source still numbers them by slice
+ */
+inline int sparse_encode(const encoder_settings& _settings, const sparse_map& _map, const slice_source& _source,
+                         const packet_sink& _sink, const rate_request& _request)
+{
+  slice_source coded = [&_map, &_source](AVFrame* _frame, int _picture) {
+    _source(_frame, _map.coded[_picture]);
+    _frame->pts = _picture;
+  };
+  return rate_encode(_settings, (int)_map.coded.size(), coded, _sink, _request);
+}
+
+//for encodes that write _stream with every slice coded: a stale sidecar would fill in slices
+inline void sparse_remove_map(const std::string& _stream)
+{
+  std::remove((_stream + ".sparse").c_str());
+}
+
+//writes the sidecar of _stream, removes a stale one if every slice is coded
+inline int sparse_write_map(const sparse_map& _map, const std::string& _stream)
+{
+  std::vector<int> starts;
+  for (size_t z = 0; z < _map.slices.size(); ++z) {
+    const sparse_slice& slice = _map.slices[z];
+    if (slice.kind == SPARSE_CODED)
+      continue;
+    const sparse_slice& last = _map.slices[z - 1]; //slice 0 is always coded
+    if (last.kind != slice.kind || memcmp(last.value, slice.value, sizeof(slice.value)) != 0)
+      starts.push_back((int)z);
+  }
+
+  if (starts.empty()) {
+    sparse_remove_map(_stream);
+    return 0;
+  }
+
+  std::ofstream file((_stream + ".sparse").c_str(), std::ios_base::trunc | std::ios_base::out);
+  if (!file.good())
+    return 1;
+  file << "H26XSPARSE1 " << _map.slices.size() << ' ' << starts.size() << '\n';
+  for (int first : starts) {
+    const sparse_slice& slice = _map.slices[first];
+    size_t end = first + 1;
+    while (end < _map.slices.size() && _map.slices[end].kind == slice.kind &&
+           memcmp(_map.slices[end].value, slice.value, sizeof(slice.value)) == 0)
+      ++end;
+    file << first << ' ' << end - first;
+    if (slice.kind == SPARSE_CONSTANT)
+      file << " constant " << (int)slice.value[0] << ' ' << (int)slice.value[1] << ' ' << (int)slice.value[2];
+    else
+      file << " repeat";
+    file << '\n';
+  }
+  return file.good() ? 0 : 1;
+}
+
+//returns 1 if _stream has no (valid) .sparse sidecar
+inline int sparse_read_map(const std::string& _stream, sparse_map& _map)
+{
+  std::ifstream file((_stream + ".sparse").c_str());
+  std::string magic;
+  int slices = 0, runs = 0;
+  if (!(file >> magic >> slices >> runs) || magic != "H26XSPARSE1" || slices < 1 || runs < 0)
+    return 1;
+
+  sparse_map map;
+  const sparse_slice coded = { SPARSE_CODED, { 0, 0, 0 } };
+  map.slices.assign(slices, coded);
+  for (int r = 0; r < runs; ++r) {
+    int first = 0, count = 0;
+    std::string kind;
+    sparse_slice slice = coded;
+    if (!(file >> first >> count >> kind) || first < 1 || count < 1 || first + count > slices)
+      return 1;
+    if (kind == "constant") {
+      int value[3];
+      if (!(file >> value[0] >> value[1] >> value[2]))
+        return 1;
+      slice.kind = SPARSE_CONSTANT;
+      for (int p = 0; p < 3; ++p)
+        slice.value[p] = (uint8_t)value[p];
+    }
+    else if (kind == "repeat")
+      slice.kind = SPARSE_REPEAT;
+    else
+      return 1;
+    std::fill(map.slices.begin() + first, map.slices.begin() + first + count, slice);
+  }
+  for (int z = 0; z < slices; ++z)
+    if (map.slices[z].kind == SPARSE_CODED)
+      map.coded.push_back(z);
+  _map = map;
+  return 0;
+}
+
+/*
+ * the decoder side: takes the coded pictures in order and hands every
+ * slice of the volume to the sink, the ones left out filled in from their
+ * constant or from the slice before
+ */
+class sparse_expander {
+
+public:
+  sparse_expander(const sparse_map& _map, const frame_sink& _sink)
+    : map_(_map), sink_(_sink), next_(0), synthesized_(0)
+  {
+    frame_ = av_frame_alloc();
+  }
+
+  ~sparse_expander()
+  {
+    av_frame_free(&frame_);
+  }
+
+  //coded picture _picture, decoded
+  void picture(const AVFrame* _frame, int _picture)
+  {
+    if (_picture >= (int)map_.coded.size())
+      return;
+    const int slice = map_.coded[_picture];
+    fill_to(slice, _frame->width, _frame->height);
+    sink_(_frame, slice);
+    next_ = slice + 1;
+    //a repeat run follows: keep the slice
+    if (next_ < (int)map_.slices.size() && map_.slices[next_].kind == SPARSE_REPEAT) {
+      resize(_frame->width, _frame->height);
+      for (int p = 0; p < 3; ++p) {
+        const int shift = p > 0;
+        for (int y = 0; y < _frame->height >> shift; ++y)
+          memcpy(frame_->data[p] + (size_t)y * frame_->linesize[p], _frame->data[p] + (size_t)y * _frame->linesize[p],
+                 _frame->width >> shift);
+      }
+    }
+  }
+
+  //all pictures decoded: the slices after the last coded one
+  void finish()
+  {
+    if (!planes_.empty())
+      fill_to((int)map_.slices.size(), frame_->width, frame_->height);
+  }
+
+  int slices() const { return next_; }
+  int synthesized() const { return synthesized_; }
+
+private:
+  void resize(int _width, int _height)
+  {
+    if (frame_->width == _width && frame_->height == _height && !planes_.empty())
+      return;
+    planes_.assign((size_t)_width * _height * 3 / 2, 0);
+    frame_->format = AV_PIX_FMT_YUV420P;
+    frame_->width = _width;
+    frame_->height = _height;
+    frame_->data[0] = &planes_[0];
+    frame_->data[1] = frame_->data[0] + (size_t)_width * _height;
+    frame_->data[2] = frame_->data[1] + (size_t)_width * _height / 4;
+    frame_->linesize[0] = _width;
+    frame_->linesize[1] = frame_->linesize[2] = _width / 2;
+  }
+
+  //hands the left out slices [next_, _end) to the sink
+  void fill_to(int _end, int _width, int _height)
+  {
+    resize(_width, _height);
+    for (; next_ < _end; ++next_) {
+      const sparse_slice& slice = map_.slices[next_];
+      if (slice.kind == SPARSE_CODED)
+        continue; //lost in decoding, skipped
+      if (slice.kind == SPARSE_CONSTANT) {
+        memset(frame_->data[0], slice.value[0], (size_t)_width * _height);
+        memset(frame_->data[1], slice.value[1], (size_t)_width * _height / 4);
+        memset(frame_->data[2], slice.value[2], (size_t)_width * _height / 4);
+      }
+      frame_->pts = next_;
+      sink_(frame_, next_);
+      ++synthesized_;
+    }
+  }
+
+  const sparse_map& map_;
+  frame_sink sink_;
+  int next_;                    ///< first slice not handed out yet
+  int synthesized_;
+  AVFrame* frame_;              ///< the fill-in slice, over planes_
+  std::vector<uint8_t> planes_;
+};
+
+/*
+ * decodes a stream written with sparse_encode, every slice of _map goes to
+ * _sink in order; returns 0 if all of them were handed out
+ */
+inline int decode_file_sparse(const std::string& _fname, const sparse_map& _map, const frame_sink& _sink,
+                              int* _synthesized = NULL)
+{
+  sparse_expander expander(_map, _sink);
+  int rcode = decode_file(_fname, [&expander](const AVFrame* _frame, int _picture) {
+      expander.picture(_frame, _picture);
+    });
+  expander.finish();
+  if (_synthesized)
+    *_synthesized = expander.synthesized();
+  return rcode != 0 || expander.slices() != (int)_map.slices.size();
+}
+
+#endif /* _SPARSE_H_ */
@@ -0,0 +1,220 @@
+#ifndef _TELEMETRY_H_
+#define _TELEMETRY_H_
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * per-frame telemetry for the encode/decode loops (usable from C and C++)
+ *
+ * Records go into a buffer that is allocated once up front; writers reserve
+ * a slot with an atomic increment, so recording from several threads needs
+ * no lock. Nothing is printed on the hot path: the records are written as
+ * CSV or JSON when telemetry_finish() is called, or whenever the process
+ * receives SIGUSR1 (snapshot of what has been recorded so far).
+ *
+ * Tools call telemetry_init() once at startup. Telemetry is off unless
+ * H26X_TELEMETRY names an output file (*.json for JSON, CSV otherwise);
+ * disabled, every call is a single predictable branch.
+ * H26X_TELEMETRY_CAPACITY sets the number of records (default 1<<16).
+ */
+
+typedef struct telemetry_record {
+  int64_t index;        /* frame/packet number within its stream */
+  int64_t pts;
+  uint64_t start_ns;    /* CLOCK_MONOTONIC, relative to telemetry_init() */
+  uint32_t duration_ns; /* time spent in the codec call */
+  uint32_t wait_ns;     /* time the input waited in a queue before, see telemetry_wait */
+  int32_t size;         /* packet size in bytes */
+  int16_t qp;           /* -1 if unknown */
+  char stage;           /* 'E'ncode, 'D'ecode */
+  char pict_type;       /* 'I', 'P', 'B', '?' */
+} telemetry_record;
+
+typedef struct telemetry_log {
+  telemetry_record *records;
+  size_t capacity;
+  size_t count;         /* slots handed out, may exceed capacity (dropped records) */
+  uint64_t origin_ns;
+  int enabled;
+  char path[1024];
+} telemetry_log;
+
+/* weak: one instance per process, also when linked with libh26xvol */
+__attribute__((weak)) telemetry_log telemetry = { NULL, 0, 0, 0, 0, { 0 } };
+__attribute__((weak)) volatile sig_atomic_t telemetry_dump_requested = 0;
+
+static inline uint64_t telemetry_clock(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline void telemetry_on_signal(int sig)
+{
+  (void)sig;
+  telemetry_dump_requested = 1;
+}
+
+static inline void telemetry_finish(void);
+
+/* reads the environment, the records are written at exit at the latest */
+static inline void telemetry_init(void)
+{
+  const char *path = getenv("H26X_TELEMETRY");
+  const char *capacity = getenv("H26X_TELEMETRY_CAPACITY");
+
+  if (!path || !*path || telemetry.enabled)
+    return;
+
+  telemetry.capacity = capacity ? strtoul(capacity, NULL, 10) : (1u << 16);
+  telemetry.records = (telemetry_record *)calloc(telemetry.capacity, sizeof(telemetry_record));
+  if (!telemetry.records) {
+    fprintf(stderr, "telemetry: could not allocate %zu records\n", telemetry.capacity);
+    return;
+  }
+
+  strncpy(telemetry.path, path, sizeof(telemetry.path) - 1);
+  telemetry.origin_ns = telemetry_clock();
+  telemetry.count = 0;
+  telemetry.enabled = 1;
+  signal(SIGUSR1, telemetry_on_signal);
+  atexit(telemetry_finish);
+}
+
+static inline int telemetry_enabled(void)
+{
+  return __builtin_expect(telemetry.enabled, 0);
+}
+
+static inline uint64_t telemetry_start(void)
+{
+  return telemetry_enabled() ? telemetry_clock() : 0;
+}
+
+/*
+ * time since queued_ns (a telemetry_start() taken when the input was
+ * queued) for the wait_ns of a record: packets handed over a packet_pipe,
+ * GOPs waiting for a worker of h26xvol_decode_parallel. Inputs that go
+ * straight from the reader or the slice source to the codec have none.
+ */
+static inline uint32_t telemetry_wait(uint64_t queued_ns)
+{
+  uint64_t wait;
+
+  if (!queued_ns || !telemetry_enabled())
+    return 0;
+  wait = telemetry_clock() - queued_ns;
+  return wait > UINT32_MAX ? UINT32_MAX : (uint32_t)wait;
+}
+
+static inline char telemetry_pict_type(int pict_type)
+{
+  /* AV_PICTURE_TYPE_I, _P, _B are 1, 2, 3 */
+  return pict_type >= 1 && pict_type <= 3 ? "IPB"[pict_type - 1] : '?';
+}
+
+static inline int telemetry_write(const char *path);
+
+/*
+ * records one codec call that started at start_ns (see telemetry_start);
+ * for encoders index/pts are those of the input frame while size, pict_type
+ * and qp describe the packet that came out of the same call (if any), which
+ * lags behind the input by the encoder delay
+ */
+static inline void telemetry_record_frame(char stage, int64_t index, int64_t pts, uint64_t start_ns,
+                                          uint32_t wait_ns, int32_t size, int pict_type, int qp)
+{
+  size_t slot;
+  telemetry_record *r;
+  uint64_t now;
+
+  if (!telemetry_enabled())
+    return;
+
+  now = telemetry_clock();
+  slot = __atomic_fetch_add(&telemetry.count, 1, __ATOMIC_RELAXED);
+  if (slot < telemetry.capacity) {
+    r = &telemetry.records[slot];
+    r->index = index;
+    r->pts = pts;
+    r->start_ns = start_ns - telemetry.origin_ns;
+    r->duration_ns = (uint32_t)(now - start_ns);
+    r->wait_ns = wait_ns;
+    r->size = size;
+    r->qp = (int16_t)qp;
+    r->stage = stage;
+    r->pict_type = telemetry_pict_type(pict_type);
+  }
+
+  if (telemetry_dump_requested) {
+    telemetry_dump_requested = 0;
+    telemetry_write(telemetry.path);
+  }
+}
+
+/* writes everything recorded so far, JSON if path ends in .json, CSV otherwise */
+static inline int telemetry_write(const char *path)
+{
+  size_t n, count;
+  size_t len = strlen(path);
+  int json = len > 5 && strcmp(path + len - 5, ".json") == 0;
+  FILE *f;
+
+  count = __atomic_load_n(&telemetry.count, __ATOMIC_ACQUIRE);
+  if (count > telemetry.capacity)
+    count = telemetry.capacity;
+
+  f = fopen(path, "w");
+  if (!f) {
+    fprintf(stderr, "telemetry: could not open %s\n", path);
+    return 1;
+  }
+
+  if (json)
+    fprintf(f, "{\"dropped\": %zu, \"frames\": [\n",
+            telemetry.count > telemetry.capacity ? telemetry.count - telemetry.capacity : 0);
+  else
+    fprintf(f, "stage,index,pts,start_ns,duration_ns,wait_ns,size,pict_type,qp\n");
+
+  for (n = 0; n < count; ++n) {
+    const telemetry_record *r = &telemetry.records[n];
+    if (json)
+      fprintf(f, "%s{\"stage\": \"%c\", \"index\": %lld, \"pts\": %lld, \"start_ns\": %llu, "
+              "\"duration_ns\": %u, \"wait_ns\": %u, \"size\": %d, \"pict_type\": \"%c\", \"qp\": %d}",
+              n ? ",\n" : "", r->stage, (long long)r->index, (long long)r->pts,
+              (unsigned long long)r->start_ns, r->duration_ns, r->wait_ns, r->size, r->pict_type, r->qp);
+    else
+      fprintf(f, "%c,%lld,%lld,%llu,%u,%u,%d,%c,%d\n", r->stage, (long long)r->index,
+              (long long)r->pts, (unsigned long long)r->start_ns, r->duration_ns, r->wait_ns,
+              r->size, r->pict_type, r->qp);
+  }
+
+  if (json)
+    fprintf(f, "\n]}\n");
+
+  return fclose(f) ? 1 : 0;
+}
+
+/* final dump and release of the buffer */
+static inline void telemetry_finish(void)
+{
+  if (!telemetry.enabled)
+    return;
+
+  telemetry_write(telemetry.path);
+  if (telemetry.count > telemetry.capacity)
+    fprintf(stderr, "telemetry: %zu records dropped, raise H26X_TELEMETRY_CAPACITY\n",
+            telemetry.count - telemetry.capacity);
+
+  telemetry.enabled = 0;
+  free(telemetry.records);
+  telemetry.records = NULL;
+}
+
+#endif /* _TELEMETRY_H_ */
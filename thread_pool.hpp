@@ -0,0 +1,169 @@
+#ifndef _THREAD_POOL_H_
+#define _THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * work-stealing thread pool: every worker owns a deque, it pops its own
+ * work from the back (LIFO, cache friendly for tasks that spawn tasks) and
+ * steals from the front of the other workers' deques when it runs dry.
+ * Tasks submitted from outside the pool are dealt round robin.
+ */
+
+class work_stealing_pool {
+
+public:
+  typedef std::function<void()> task;
+  typedef std::function<void(unsigned worker)> worker_hook;
+
+  //_on_start runs first thing on every worker thread (e.g. to pin it)
+  explicit work_stealing_pool(unsigned _workers, const worker_hook& _on_start = worker_hook())
+    : queues_(), threads_(), pending_(0), stop_(false), next_(0)
+  {
+    if (_workers < 1)
+      _workers = 1;
+
+    for (unsigned w = 0; w < _workers; ++w)
+      queues_.push_back(std::unique_ptr<queue>(new queue()));
+
+    for (unsigned w = 0; w < _workers; ++w)
+      threads_.push_back(std::thread([this, w, _on_start]() {
+            if (_on_start)
+              _on_start(w);
+            run(w);
+          }));
+  }
+
+  ~work_stealing_pool()
+  {
+    wait();
+    {
+      std::lock_guard<std::mutex> lock(wake_mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (size_t t = 0; t < threads_.size(); ++t)
+      threads_[t].join();
+  }
+
+  unsigned size() const { return queues_.size(); }
+
+  void submit(const task& _task)
+  {
+    //workers of other pools (e.g. an I/O pool fed from encoder workers) are outsiders here
+    int self = current_pool() == this ? current_worker() : -1;
+    unsigned target = self >= 0 ? (unsigned)self : next_.fetch_add(1) % queues_.size();
+
+    pending_.fetch_add(1);
+    {
+      std::lock_guard<std::mutex> lock(wake_mutex_);
+      queued_.fetch_add(1);
+    }
+    {
+      std::lock_guard<std::mutex> lock(queues_[target]->mutex);
+      queues_[target]->tasks.push_back(_task);
+    }
+    wake_.notify_one();
+  }
+
+  //blocks until every submitted task has finished (not to be called from a task)
+  void wait()
+  {
+    std::unique_lock<std::mutex> lock(wake_mutex_);
+    idle_.wait(lock, [this]() { return pending_.load() == 0; });
+  }
+
+  //index of the calling worker, -1 outside of the pool
+  static int& current_worker()
+  {
+    static thread_local int index = -1;
+    return index;
+  }
+
+  //tasks taken from another worker's deque so far
+  size_t steals() const { return steals_.load(); }
+
+private:
+
+  static const work_stealing_pool*& current_pool()
+  {
+    static thread_local const work_stealing_pool* pool = NULL;
+    return pool;
+  }
+
+  struct queue {
+    std::mutex mutex;
+    std::deque<task> tasks;
+  };
+
+  bool pop_local(unsigned _worker, task& _task)
+  {
+    std::lock_guard<std::mutex> lock(queues_[_worker]->mutex);
+    if (queues_[_worker]->tasks.empty())
+      return false;
+    _task = queues_[_worker]->tasks.back();
+    queues_[_worker]->tasks.pop_back();
+    queued_.fetch_sub(1);
+    return true;
+  }
+
+  bool steal(unsigned _worker, task& _task)
+  {
+    for (size_t offset = 1; offset < queues_.size(); ++offset) {
+      queue& victim = *queues_[(_worker + offset) % queues_.size()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (victim.tasks.empty())
+        continue;
+      _task = victim.tasks.front();
+      victim.tasks.pop_front();
+      queued_.fetch_sub(1);
+      steals_.fetch_add(1);
+      return true;
+    }
+    return false;
+  }
+
+  void run(unsigned _worker)
+  {
+    current_worker() = _worker;
+    current_pool() = this;
+
+    while (true) {
+      task next;
+      if (pop_local(_worker, next) || steal(_worker, next)) {
+        next();
+        if (pending_.fetch_sub(1) == 1) {
+          std::lock_guard<std::mutex> lock(wake_mutex_);
+          idle_.notify_all();
+        }
+        continue;
+      }
+
+      //queued_ is raised under the lock before submit() notifies, no wake up gets lost
+      std::unique_lock<std::mutex> lock(wake_mutex_);
+      wake_.wait(lock, [this]() { return stop_ || queued_.load() > 0; });
+      if (stop_)
+        return;
+    }
+  }
+
+  std::vector<std::unique_ptr<queue> > queues_;
+  std::vector<std::thread> threads_;
+  std::atomic<size_t> pending_;   ///< submitted, not yet finished
+  std::atomic<size_t> queued_{0}; ///< submitted, not yet picked up
+  std::atomic<size_t> steals_{0};
+  bool stop_;
+  std::atomic<unsigned> next_;
+  std::mutex wake_mutex_;
+  std::condition_variable wake_;
+  std::condition_variable idle_;
+};
+
+#endif /* _THREAD_POOL_H_ */
@@ -0,0 +1,110 @@
+#ifndef _TIMESERIES_H_
+#define _TIMESERIES_H_
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+#include "encoder.hpp"
+
+/*
+ * 4D (time-lapse) volumes: the same Z slices acquired at T timepoints.
+ * Coding the timepoints one after the other puts slice z at t-1 a whole
+ * volume back, out of reach of the codec's references. Instead the
+ * timepoints are grouped into blocks of B, and a block is coded slice by
+ * slice with its timepoints interleaved:
+ *
+ *   block 0: (t0,z0) (t1,z0) .. (tB-1,z0) (t0,z1) (t1,z1) .. (tB-1,zZ-1)
+ *   block 1: (tB,z0) ..
+ *
+ * so (z, t-1) is the previous picture and (z-1, t) is B pictures back;
+ * with B + 1 reference frames the codec can predict from both. Every
+ * block starts with an IDR: a timepoint is decoded from the start of its
+ * block (B volumes at most), which is the random-access granularity, and
+ * B = 1 is the plain per-volume encoding. The layout travels next to the
+ * stream:
+ *
+ *   <stream>.4d: "H26X4D1 <timepoints> <slices> <block>"
+ */
+
+struct timeseries_layout {
+  int timepoints;
+  int slices;         ///< Z, per timepoint
+  int block;          ///< timepoints per block (B)
+};
+
+//H.264 and HEVC keep at most 16 reference frames
+static const int timeseries_max_block = 15;
+
+inline int timeseries_pictures(const timeseries_layout& _layout)
+{
+  return _layout.timepoints * _layout.slices;
+}
+
+//timepoints in the block that starts at timepoint _first (the last block may be short)
+inline int timeseries_block_size(const timeseries_layout& _layout, int _first)
+{
+  return std::min(_layout.block, _layout.timepoints - _first);
+}
+
+//timepoint and slice of coded picture _picture
+inline void timeseries_position(const timeseries_layout& _layout, int _picture, int& _t, int& _z)
+{
+  const int per_block = _layout.block * _layout.slices;
+  const int first = _picture / per_block * _layout.block;
+  const int offset = _picture % per_block;
+  const int size = timeseries_block_size(_layout, first);
+  _t = first + offset % size;
+  _z = offset / size;
+}
+
+//coded picture of slice _z at timepoint _t
+inline int timeseries_picture(const timeseries_layout& _layout, int _t, int _z)
+{
+  const int first = _t / _layout.block * _layout.block;
+  return first * _layout.slices + _z * timeseries_block_size(_layout, first) + (_t - first);
+}
+
+inline bool timeseries_keyframe(const timeseries_layout& _layout, int _picture)
+{
+  return _picture % (_layout.block * _layout.slices) == 0;
+}
+
+/*
+ * the encoder side: a GOP per block, IDRs forced at the block starts and
+ * enough references for (z-1, t)
+ */
+inline void timeseries_settings(const timeseries_layout& _layout, encoder_settings& _settings)
+{
+  _settings.gop_size = _layout.block * _layout.slices;
+  _settings.forced_idr = true;
+  _settings.refs = std::max(_settings.refs, _layout.block + 1);
+}
+
+inline int timeseries_write_layout(const timeseries_layout& _layout, const std::string& _stream)
+{
+  std::ofstream file((_stream + ".4d").c_str(), std::ios_base::trunc | std::ios_base::out);
+  if (!file.good())
+    return 1;
+  file << "H26X4D1 " << _layout.timepoints << ' ' << _layout.slices << ' ' << _layout.block << '\n';
+  return file.good() ? 0 : 1;
+}
+
+//for encodes that write _stream as a plain volume: a stale sidecar would reorder its slices
+inline void timeseries_remove_layout(const std::string& _stream)
+{
+  std::remove((_stream + ".4d").c_str());
+}
+
+//returns 1 if _stream has no (valid) .4d sidecar
+inline int timeseries_read_layout(const std::string& _stream, timeseries_layout& _layout)
+{
+  std::ifstream file((_stream + ".4d").c_str());
+  std::string magic;
+  if (!(file >> magic >> _layout.timepoints >> _layout.slices >> _layout.block) || magic != "H26X4D1")
+    return 1;
+  return _layout.timepoints > 0 && _layout.slices > 0 && _layout.block > 0 ? 0 : 1;
+}
+
+#endif /* _TIMESERIES_H_ */
@@ -6,12 +6,13 @@
 #include <sstream>
 #include <stdexcept>
 #include <cmath>
+#include <vector>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
 }
 
-void saveFrame(const AVFrame* frame, int width, int height, int frameNumber, const std::string& _frame_base)
+void savePlane(const uint8_t* data, int linesize, int width, int height, int frameNumber, const std::string& _frame_base)
 {
 
     std::stringstream oname;
@@ -31,12 +32,52 @@ void saveFrame(const AVFrame* frame, int width, int height, int frameNumber, con
 
     for (int i = 0; i < height; ++i)
     {
-        file.write((char*)(frame->data[0] + i * frame->linesize[0]), width);
+        file.write((const char*)(data + i * linesize), width);
+    }
+
+    file.close();
+}
+
+//8-bit plane mapped through _lut (256 entries) to a 16-bit pgm
+void savePlane16(const uint8_t* data, int linesize, int width, int height, const uint16_t* _lut,
+                 int frameNumber, const std::string& _frame_base)
+{
+    std::stringstream oname;
+    oname << _frame_base << "-slice" << frameNumber << ".pgm";
+
+    std::ofstream file(oname.str().c_str(),
+		       std::ios_base::binary |
+		       std::ios_base::trunc |
+		       std::ios_base::out);
+
+    if (!file.good())
+    {
+        throw std::runtime_error("Unable to open the file to write the frame");
+    }
+
+    file << "P5\n" << width << '\n' << height << "\n65535\n";
+
+    //pgm samples above 255 are big endian
+    std::vector<uint8_t> row(2 * width);
+    for (int i = 0; i < height; ++i)
+    {
+        const uint8_t* src = data + i * linesize;
+        for (int x = 0; x < width; ++x)
+        {
+            row[2 * x] = _lut[src[x]] >> 8;
+            row[2 * x + 1] = _lut[src[x]] & 0xff;
+        }
+        file.write((const char*)&row[0], row.size());
     }
 
     file.close();
 }
 
+void saveFrame(const AVFrame* frame, int width, int height, int frameNumber, const std::string& _frame_base)
+{
+    savePlane(frame->data[0], frame->linesize[0], width, height, frameNumber, _frame_base);
+}
+
 //https://ffmpeg.org/doxygen/trunk/avio_reading_8c-example.html#a18
 
 struct buffer_data {
@@ -48,7 +89,6 @@ static int read_packet(void *opaque, uint8_t *buf, int buf_size)
 {
     struct buffer_data *bd = (struct buffer_data *)opaque;
     buf_size = std::min((decltype(bd->size))buf_size, bd->size);
-    printf("ptr:%p size:%zu\n", bd->ptr, bd->size);
     /* copy internal buffer data to buf */
     memcpy(buf, bd->ptr, buf_size);
     bd->ptr  += buf_size;
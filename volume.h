@@ -0,0 +1,275 @@
+#ifndef _VOLUME_H_
+#define _VOLUME_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * synthetic test volumes (usable from C and C++), generated slice by slice
+ * straight into the caller's planes, so memory stays O(slice) whatever the
+ * depth; every slice is a pure function of (pattern, size, seed, z), slices
+ * can be made in any order and on any thread
+ *
+ *   stripes   the diagonal ramp with a stripe band moving down every 5
+ *             slices that the encode examples always used (ramps in Cb/Cr)
+ *   noise     uniform white noise
+ *   gradient  linear ramp along x, y and z
+ *   blobs     dark background with sparse bright spheres (cells, beads)
+ *
+ * all patterns but stripes leave Cb/Cr neutral (128)
+ */
+
+enum volume_pattern {
+  VOLUME_STRIPES,
+  VOLUME_NOISE,
+  VOLUME_GRADIENT,
+  VOLUME_BLOBS
+};
+
+#define VOLUME_MAX_BLOBS 64
+
+typedef struct volume_blob {
+  int x, y, z;
+  int radius;
+  int peak;
+} volume_blob;
+
+typedef struct volume_generator {
+  enum volume_pattern pattern;
+  int width;
+  int height;
+  int depth;
+  uint64_t seed;
+  int blob_count;
+  volume_blob blobs[VOLUME_MAX_BLOBS];
+} volume_generator;
+
+/* splitmix64, the seed/position hash of all random patterns */
+static inline uint64_t volume_mix(uint64_t x)
+{
+  x += 0x9e3779b97f4a7c15ull;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+static inline void volume_generator_init(volume_generator *gen, enum volume_pattern pattern,
+                                         int width, int height, int depth, uint64_t seed)
+{
+  uint64_t state = seed;
+  int b, shortest = width < height ? width : height;
+
+  memset(gen, 0, sizeof(*gen));
+  gen->pattern = pattern;
+  gen->width = width;
+  gen->height = height;
+  gen->depth = depth;
+  gen->seed = seed;
+
+  if (pattern != VOLUME_BLOBS)
+    return;
+
+  /* about one blob per 64^3 voxels */
+  gen->blob_count = (int)(((uint64_t)width * height * (depth > 0 ? depth : 1)) >> 18);
+  if (gen->blob_count < 1)
+    gen->blob_count = 1;
+  if (gen->blob_count > VOLUME_MAX_BLOBS)
+    gen->blob_count = VOLUME_MAX_BLOBS;
+
+  for (b = 0; b < gen->blob_count; ++b) {
+    volume_blob *blob = &gen->blobs[b];
+    blob->x = (int)((state = volume_mix(state)) % (uint64_t)width);
+    blob->y = (int)((state = volume_mix(state)) % (uint64_t)height);
+    blob->z = (int)((state = volume_mix(state)) % (uint64_t)(depth > 0 ? depth : 1));
+    blob->radius = 2 + (int)((state = volume_mix(state)) % (uint64_t)(shortest / 16 + 1));
+    blob->peak = 128 + (int)((state = volume_mix(state)) % 128);
+  }
+}
+
+/* "stripes", "noise", "gradient" or "blobs", -1 if unknown */
+static inline int volume_pattern_from_name(const char *name)
+{
+  static const char *names[] = { "stripes", "noise", "gradient", "blobs" };
+  int p;
+  for (p = 0; p < 4; ++p)
+    if (strcmp(name, names[p]) == 0)
+      return p;
+  return -1;
+}
+
+/*
+ * the volume at timepoint t of a time-lapse (t = 0 is gen itself): blobs
+ * drift by up to half a pixel per timepoint and pulse in brightness, noise is
+ * drawn anew, stripes and gradient stay put
+ */
+static inline void volume_generator_at(const volume_generator *gen, int t, volume_generator *out)
+{
+  int b;
+  *out = *gen;
+  if (gen->pattern == VOLUME_NOISE)
+    out->seed = volume_mix(gen->seed + (uint64_t)t);
+  for (b = 0; b < gen->blob_count; ++b) {
+    volume_blob *blob = &out->blobs[b];
+    const uint64_t motion = volume_mix(gen->seed ^ (uint64_t)b);
+    blob->x += (int)(motion % 3) * t / 2 - t / 2;
+    blob->y += (int)((motion >> 8) % 3) * t / 2 - t / 2;
+    blob->peak -= (int)((motion >> 16) % 32) * (t % 8) / 8;
+  }
+}
+
+/* dst[x] = start + x (mod 256) */
+static inline void volume_ramp_row(uint8_t *dst, int width, uint8_t start)
+{
+  int x = 0;
+#ifdef __SSE2__
+  __m128i value = _mm_add_epi8(_mm_set1_epi8((char)start),
+                               _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+  const __m128i step = _mm_set1_epi8(16);
+  for (; x + 16 <= width; x += 16) {
+    _mm_storeu_si128((__m128i *)(dst + x), value);
+    value = _mm_add_epi8(value, step);
+  }
+#endif
+  for (; x < width; ++x)
+    dst[x] = (uint8_t)(start + x);
+}
+
+/* dst[x] = min(src[x] + add, 255) */
+static inline void volume_add_row(uint8_t *dst, const uint8_t *src, int width, uint8_t add)
+{
+  int x = 0;
+#ifdef __SSE2__
+  const __m128i offset = _mm_set1_epi8((char)add);
+  for (; x + 16 <= width; x += 16)
+    _mm_storeu_si128((__m128i *)(dst + x),
+                     _mm_adds_epu8(_mm_loadu_si128((const __m128i *)(src + x)), offset));
+#endif
+  for (; x < width; ++x)
+    dst[x] = src[x] + add > 255 ? 255 : (uint8_t)(src[x] + add);
+}
+
+static inline void volume_stripes_luma(const volume_generator *gen, int z, uint8_t *dst, int linesize)
+{
+  /* same float arithmetic as the original per pixel loop, evaluated per row */
+  float offset = .05 * (z / 5) * gen->height;
+  float ymin = (.1 * gen->height) + offset;
+  float ymax = (.13 * gen->height) + offset;
+  int limit = 5 * (z + 1) < gen->width - 1 ? 5 * (z + 1) : gen->width - 1;
+  int x, y;
+
+  for (y = 0; y < gen->height; ++y) {
+    uint8_t *row = dst + (size_t)y * linesize;
+    volume_ramp_row(row, gen->width, (uint8_t)(y + z * 3));
+    if (y > ymin && y < ymax)
+      for (x = 0; x <= limit; x += 4) {
+        row[x] = 16;
+        if (x + 1 <= limit)
+          row[x + 1] = 16;
+      }
+  }
+}
+
+static inline void volume_noise_luma(const volume_generator *gen, int z, uint8_t *dst, int linesize)
+{
+  int x, y;
+  for (y = 0; y < gen->height; ++y) {
+    uint8_t *row = dst + (size_t)y * linesize;
+    uint64_t state = volume_mix(gen->seed ^ volume_mix(((uint64_t)z << 32) | (uint32_t)y));
+    for (x = 0; x + 8 <= gen->width; x += 8) {
+      uint64_t bits = volume_mix(state++);
+      memcpy(row + x, &bits, 8);
+    }
+    if (x < gen->width) {
+      uint64_t bits = volume_mix(state);
+      memcpy(row + x, &bits, gen->width - x);
+    }
+  }
+}
+
+static inline void volume_gradient_luma(const volume_generator *gen, int z, uint8_t *dst, int linesize)
+{
+  /* x contributes up to 128, y up to 64, z up to 63 */
+  const int zterm = gen->depth > 1 ? z * 63 / (gen->depth - 1) : 0;
+  int x, y;
+
+  for (x = 0; x < gen->width; ++x)
+    dst[x] = (uint8_t)(x * 128 / gen->width + zterm);
+
+  for (y = 1; y < gen->height; ++y)
+    volume_add_row(dst + (size_t)y * linesize, dst, gen->width, (uint8_t)(y * 64 / gen->height));
+}
+
+static inline void volume_blobs_luma(const volume_generator *gen, int z, uint8_t *dst, int linesize)
+{
+  const int background = 16;
+  int b, x, y;
+
+  for (y = 0; y < gen->height; ++y)
+    memset(dst + (size_t)y * linesize, background, gen->width);
+
+  for (b = 0; b < gen->blob_count; ++b) {
+    const volume_blob *blob = &gen->blobs[b];
+    const int r2 = blob->radius * blob->radius;
+    const int dz = z - blob->z;
+    if (dz * dz >= r2)
+      continue;
+
+    for (y = blob->y - blob->radius; y <= blob->y + blob->radius; ++y) {
+      uint8_t *row = dst + (size_t)y * linesize;
+      const int dy = y - blob->y;
+      if (y < 0 || y >= gen->height)
+        continue;
+      for (x = blob->x - blob->radius; x <= blob->x + blob->radius; ++x) {
+        const int dx = x - blob->x;
+        const int d2 = dx * dx + dy * dy + dz * dz;
+        int value;
+        if (x < 0 || x >= gen->width || d2 >= r2)
+          continue;
+        value = background + (blob->peak - background) * (r2 - d2) / r2;
+        if (value > row[x])
+          row[x] = (uint8_t)value;
+      }
+    }
+  }
+}
+
+/* writes luma slice z (width x height) */
+static inline void volume_fill_luma(const volume_generator *gen, int z, uint8_t *dst, int linesize)
+{
+  switch (gen->pattern) {
+  case VOLUME_NOISE:
+    volume_noise_luma(gen, z, dst, linesize);
+    break;
+  case VOLUME_GRADIENT:
+    volume_gradient_luma(gen, z, dst, linesize);
+    break;
+  case VOLUME_BLOBS:
+    volume_blobs_luma(gen, z, dst, linesize);
+    break;
+  default:
+    volume_stripes_luma(gen, z, dst, linesize);
+  }
+}
+
+/* writes the 4:2:0 chroma planes of slice z (width/2 x height/2) */
+static inline void volume_fill_chroma(const volume_generator *gen, int z, uint8_t *cb, int cb_linesize,
+                                      uint8_t *cr, int cr_linesize)
+{
+  int y;
+  for (y = 0; y < gen->height / 2; ++y) {
+    if (gen->pattern == VOLUME_STRIPES) {
+      memset(cb + (size_t)y * cb_linesize, (uint8_t)(128 + y + z * 2), gen->width / 2);
+      volume_ramp_row(cr + (size_t)y * cr_linesize, gen->width / 2, (uint8_t)(64 + z * 5));
+    }
+    else {
+      memset(cb + (size_t)y * cb_linesize, 128, gen->width / 2);
+      memset(cr + (size_t)y * cr_linesize, 128, gen->width / 2);
+    }
+  }
+}
+
+#endif /* _VOLUME_H_ */
@@ -0,0 +1,263 @@
+#ifndef _WINDOW_H_
+#define _WINDOW_H_
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * 16-bit to 8-bit conversion in front of the encoders (usable from C and
+ * C++): a window [low, high] of the 16-bit values is mapped onto 0..255
+ *
+ *   linear  255 t                          with t = (v - low) / (high - low)
+ *   gamma   255 t^(1/gamma)                gamma > 1 lifts the dark end
+ *   log     255 ln(1 + v - low) / ln(1 + high - low)
+ *
+ * values outside the window are clamped. Linear windows of at least 256
+ * values run on SSE2 (saturating subtract and a 16.16 fixed point multiply,
+ * within one of the exact value), everything else goes through a 64K entry
+ * table. The window can be fixed, or taken from percentiles of a histogram
+ * of one slice or of the whole volume (window_histogram_*).
+ *
+ * The mapping of every slice is saved next to the stream so that decoders
+ * can map the 8-bit slices back to approximate 16-bit values:
+ *
+ *   <stream>.window: "H26XWIN1 <linear|gamma|log> <gamma> <slices>", then
+ *                    one line per slice "<n> <low> <high>"
+ */
+
+enum window_mapping {
+  WINDOW_LINEAR,
+  WINDOW_GAMMA,
+  WINDOW_LOG
+};
+
+typedef struct window_map {
+  enum window_mapping mapping;
+  float gamma;
+  uint16_t low;
+  uint16_t high;
+  int use_lut;          /* set by window_map_prepare */
+  uint32_t scale;       /* 16.16 fixed point factor of linear windows */
+  uint8_t lut[65536];
+} window_map;
+
+/* "linear", "gamma" or "log", -1 if unknown */
+static inline int window_mapping_from_name(const char *name)
+{
+  static const char *names[] = { "linear", "gamma", "log" };
+  int m;
+  for (m = 0; m < 3; ++m)
+    if (strcmp(name, names[m]) == 0)
+      return m;
+  return -1;
+}
+
+static inline const char *window_mapping_name(int mapping)
+{
+  return mapping == WINDOW_GAMMA ? "gamma" : mapping == WINDOW_LOG ? "log" : "linear";
+}
+
+/* 8-bit value of v under the window (the exact reference of the table) */
+static inline uint8_t window_value(const window_map *map, uint32_t v)
+{
+  const double range = map->high > map->low ? map->high - map->low : 1;
+  double t, out;
+  if (v <= map->low)
+    return 0;
+  if (v >= map->high)
+    return 255;
+  t = (v - map->low) / range;
+  if (map->mapping == WINDOW_GAMMA)
+    out = 255. * pow(t, 1. / (map->gamma > 0 ? map->gamma : 1.));
+  else if (map->mapping == WINDOW_LOG)
+    out = 255. * log1p(v - map->low) / log1p(range);
+  else
+    out = 255. * t;
+  return (uint8_t)(out + .5);
+}
+
+/* 16-bit value an 8-bit value stands for, the inverse of window_value */
+static inline uint16_t window_invert(const window_map *map, uint8_t v)
+{
+  const double range = map->high > map->low ? map->high - map->low : 0;
+  const double t = v / 255.;
+  double out;
+  if (map->mapping == WINDOW_GAMMA)
+    out = range * pow(t, map->gamma > 0 ? map->gamma : 1.);
+  else if (map->mapping == WINDOW_LOG)
+    out = expm1(t * log1p(range));
+  else
+    out = range * t;
+  out += map->low + .5;
+  return out > 65535. ? 65535 : (uint16_t)out;
+}
+
+/* call after changing mapping, gamma, low or high */
+static inline void window_map_prepare(window_map *map)
+{
+  const uint32_t range = map->high > map->low ? map->high - map->low : 1;
+  uint32_t v;
+
+  if (map->high <= map->low)
+    map->high = map->low + 1 < 65535 ? map->low + 1 : 65535;
+
+  map->use_lut = map->mapping != WINDOW_LINEAR || range < 256;
+  map->scale = (uint32_t)(((255u << 16) + range / 2) / range);
+  if (map->use_lut)
+    for (v = 0; v < 65536; ++v)
+      map->lut[v] = window_value(map, v);
+}
+
+static inline void window_map_init(window_map *map, enum window_mapping mapping, float gamma,
+                                   uint16_t low, uint16_t high)
+{
+  map->mapping = mapping;
+  map->gamma = gamma;
+  map->low = low;
+  map->high = high;
+  window_map_prepare(map);
+}
+
+/* converts one row of width 16-bit values */
+static inline void window_row(const window_map *map, const uint16_t *src, uint8_t *dst, int width)
+{
+  int x = 0;
+  if (map->use_lut) {
+    for (; x < width; ++x)
+      dst[x] = map->lut[src[x]];
+    return;
+  }
+#ifdef __SSE2__
+  {
+    const __m128i low = _mm_set1_epi16((short)map->low);
+    const __m128i range = _mm_set1_epi16((short)(map->high - map->low));
+    const __m128i scale = _mm_set1_epi16((short)map->scale);
+    for (; x + 16 <= width; x += 16) {
+      __m128i a = _mm_subs_epu16(_mm_loadu_si128((const __m128i *)(src + x)), low);
+      __m128i b = _mm_subs_epu16(_mm_loadu_si128((const __m128i *)(src + x + 8)), low);
+      /* min(v - low, range) without SSE4.1 */
+      a = _mm_sub_epi16(a, _mm_subs_epu16(a, range));
+      b = _mm_sub_epi16(b, _mm_subs_epu16(b, range));
+      /* (t * scale + 0x8000) >> 16: high half plus the top bit of the low half */
+      a = _mm_add_epi16(_mm_mulhi_epu16(a, scale), _mm_srli_epi16(_mm_mullo_epi16(a, scale), 15));
+      b = _mm_add_epi16(_mm_mulhi_epu16(b, scale), _mm_srli_epi16(_mm_mullo_epi16(b, scale), 15));
+      _mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(a, b));
+    }
+  }
+#endif
+  for (; x < width; ++x) {
+    const uint32_t range = map->high - map->low;
+    uint32_t t = src[x] > map->low ? src[x] - map->low : 0;
+    if (t > range)
+      t = range;
+    t = (t * map->scale + 0x8000) >> 16;
+    dst[x] = t > 255 ? 255 : (uint8_t)t;
+  }
+}
+
+/* converts a width x height plane, strides in elements */
+static inline void window_plane(const window_map *map, const uint16_t *src, int src_stride,
+                                uint8_t *dst, int dst_linesize, int width, int height)
+{
+  int y;
+  for (y = 0; y < height; ++y)
+    window_row(map, src + (size_t)y * src_stride, dst + (size_t)y * dst_linesize, width);
+}
+
+/* histograms for percentile windows: 65536 bins */
+static inline void window_histogram_add(uint64_t *hist, const uint16_t *src, int src_stride, int width, int height)
+{
+  int x, y;
+  for (y = 0; y < height; ++y) {
+    const uint16_t *row = src + (size_t)y * src_stride;
+    for (x = 0; x < width; ++x)
+      ++hist[row[x]];
+  }
+}
+
+/* smallest value with at least fraction (0..1) of the counts at or below it */
+static inline uint16_t window_histogram_percentile(const uint64_t *hist, double fraction)
+{
+  uint64_t total = 0, seen = 0, wanted;
+  uint32_t v;
+  for (v = 0; v < 65536; ++v)
+    total += hist[v];
+  wanted = (uint64_t)(fraction * total);
+  for (v = 0; v < 65536; ++v) {
+    seen += hist[v];
+    if (seen > wanted || (seen == total && seen))
+      return (uint16_t)v;
+  }
+  return 65535;
+}
+
+/* sets low/high to the lower/upper percentiles (e.g. 0.001 and 0.999) of hist */
+static inline void window_map_auto(window_map *map, const uint64_t *hist, double lower, double upper)
+{
+  map->low = window_histogram_percentile(hist, lower);
+  map->high = window_histogram_percentile(hist, upper);
+  window_map_prepare(map);
+}
+
+/* the sidecar, see above: call window_file_open, window_file_slice per slice, fclose */
+static inline FILE *window_file_open(const char *stream, int mapping, float gamma, int slices)
+{
+  char path[4096];
+  FILE *out;
+  snprintf(path, sizeof(path), "%s.window", stream);
+  out = fopen(path, "w");
+  if (out)
+    fprintf(out, "H26XWIN1 %s %g %d\n", window_mapping_name(mapping), gamma, slices);
+  return out;
+}
+
+static inline void window_file_slice(FILE *out, int slice, uint16_t low, uint16_t high)
+{
+  if (out)
+    fprintf(out, "%d %u %u\n", slice, low, high);
+}
+
+/*
+ * reads the sidecar of stream: mapping and gamma into map, the windows of
+ * up to max_slices slices into lows/highs; returns the slice count, -1 if
+ * there is no (valid) sidecar
+ */
+static inline int window_file_read(const char *stream, window_map *map, uint16_t *lows, uint16_t *highs,
+                                   int max_slices)
+{
+  char path[4096], mapping[16];
+  int slices = 0, s;
+  FILE *in;
+  snprintf(path, sizeof(path), "%s.window", stream);
+  in = fopen(path, "r");
+  if (!in)
+    return -1;
+  if (fscanf(in, "H26XWIN1 %15s %f %d", mapping, &map->gamma, &slices) != 3 ||
+      window_mapping_from_name(mapping) < 0) {
+    fclose(in);
+    return -1;
+  }
+  map->mapping = (enum window_mapping)window_mapping_from_name(mapping);
+  for (s = 0; s < slices; ++s) {
+    int n;
+    unsigned low, high;
+    if (fscanf(in, "%d %u %u", &n, &low, &high) != 3 || n != s) {
+      slices = -1;
+      break;
+    }
+    if (s < max_slices) {
+      lows[s] = (uint16_t)low;
+      highs[s] = (uint16_t)high;
+    }
+  }
+  fclose(in);
+  return slices;
+}
+
+#endif /* _WINDOW_H_ */